@@ -10,8 +10,17 @@
 #include <sys/stat.h>
 #include <limits.h>
 #include <signal.h>
-
-#include "ini_parse.h"
+#include <inttypes.h>
+
+#include "monitor.h"
+#include "control.h"
+#include "receive.h"
+#include "task.h"
+#include "pack.h"
+#include "restore.h"
+#include "config.h"
+#include "replicate.h"
+#include "log.h"
 
 #define LOCK_FILE "/var/run/backupd.pid"
 
@@ -21,7 +30,15 @@ static int fd;
 
 static void usage()
 {
-  fprintf(stderr, "usage: backupd <start | stop> <config file>\n");
+  fprintf(stderr, "usage: backupd <start | run> <config file>\n"
+		  "       backupd record <config file> <trace file>\n"
+		  "       backupd replay <config file> <trace file> [fast]\n"
+		  "       backupd <stop | reload | status | flush | upgrade>\n"
+		  "       backupd <pause | resume> <job>\n"
+		  "       backupd sync <path>\n"
+		  "       backupd receive <[host:]port> <directory>\n"
+		  "       backupd extract <destination> <directory> [path]\n"
+		  "       backupd restore <config file> <job>[@<snapshot>] <directory> [path]\n");
   exit(1);
 }
 
@@ -47,16 +64,143 @@ static pid_t get_daemon_pid()
   return (pid);
 }
 
-static void send_stop()
+static void send_signal(int signum, const char *cmd)
 {
   pid_t pid = get_daemon_pid();
   
   if (pid == -1) {
-    fprintf(stderr, "stop failed\n");
+    fprintf(stderr, "%s failed\n", cmd);
     return;
   }
   
-  kill(get_daemon_pid(), SIGTERM);
+  kill(pid, signum);
+}
+
+/* send a request over the control socket and exit with its outcome */
+static void control(const char *cmd, const char *param)
+{
+  char line[CONTROL_LINE];
+  char path[PATH_MAX];
+  int ret;
+
+  if (param && strcmp(cmd, "sync") == 0) {
+    // the daemon runs in /
+    if (!realpath(param, path)) {
+      perror(param);
+      exit(1);
+    }
+    param = path;
+  }
+
+  if (snprintf(line, sizeof(line), "%s%s%s", cmd, param ? " " : "",
+	       param ? param : "") >= (int)sizeof(line)) {
+    fprintf(stderr, "%s: too long\n", param);
+    exit(1);
+  }
+
+  if ((ret = control_request(CONTROL_SOCKET, line)) < 0) {
+    fprintf(stderr, "%s failed: %s: %s\n", cmd, CONTROL_SOCKET, strerror(errno));
+    exit(1);
+  }
+  exit(ret);
+}
+
+/* take tcp:// destinations into directory until killed */
+static void receive(const char *addr, const char *dir)
+{
+  char path[PATH_MAX];
+  int lfd;
+
+  if (!realpath(dir, path)) {
+    perror(dir);
+    exit(1);
+  }
+
+  log_open(1);
+  signal(SIGPIPE, SIG_IGN);
+
+  // for removals, like the daemon
+  if (task_start() < 0 || (lfd = receive_listen(addr)) < 0) {
+    exit(1);
+  }
+  log_msg(LOG_INFO, "receiving on %s into %s", addr, path);
+
+  receive_serve(lfd, path);
+  exit(1);
+}
+
+/* write the files packed in a destination (see pack.c) out to directory */
+static void extract(const char *dst, const char *dir, const char *sub)
+{
+  unsigned long files;
+  pack_st *p;
+  size_t len;
+  int ret;
+
+  log_open(1);
+  if (!(p = pack_open(dst, 0))) {
+    fprintf(stderr, "%s/%s: %s\n", dst, PACK_DIR, strerror(errno));
+    exit(1);
+  }
+
+  if (sub) {
+    while (*sub == '/') {
+      sub++;
+    }
+    // the pack's paths have no trailing slash either
+    if ((len = strlen(sub)) && sub[len - 1] == '/' && !(sub = strndup(sub, len - 1))) {
+      exit(1);
+    }
+    if (!*sub) {
+      sub = NULL;
+    }
+  }
+
+  ret = pack_extract(p, sub, dir, &files);
+  pack_close(p);
+  printf("%lu files extracted\n", files);
+  exit(ret < 0 ? 1 : 0);
+}
+
+/* copy a job's destination (or a snapshot of it) back out to directory */
+static void restore(const char *cfg_file, char *name, const char *dir, const char *rel)
+{
+  restore_stats_st st;
+  config_st *cfg;
+  char *snapshot;
+  job_st *job;
+  int ret;
+
+  log_open(1);
+  if ((snapshot = strchr(name, '@'))) {
+    *snapshot++ = '\0';
+  }
+  if (!(cfg = config_load(cfg_file))) {
+    exit(1);
+  }
+  if (!(job = job_find(cfg->jobs, name))) {
+    fprintf(stderr, "%s: no job %s\n", cfg_file, name);
+    exit(1);
+  }
+  replicate_cache(cfg->cache);
+
+  while (rel && *rel == '/') {
+    rel++;
+  }
+  if ((ret = restore_run(job, snapshot, rel ? rel : "", dir, 0, &st)) < 0 &&
+      !st.files && !st.dirs) {
+    exit(1);
+  }
+
+  printf("%lu files (%" PRIu64 " bytes) and %lu directories restored in %.2fs: %.1f MiB/s, "
+	 "%.0f files/s\n", st.files, st.bytes, st.dirs, st.seconds,
+	 st.seconds > 0 ? st.bytes / st.seconds / (1 << 20) : 0.0,
+	 st.seconds > 0 ? st.files / st.seconds : 0.0);
+  if (st.failed) {
+    printf("%lu failed\n", st.failed);
+  }
+  config_free(cfg);
+  exit(ret < 0 ? 1 : 0);
 }
 
 static void cleanup()
@@ -65,6 +209,7 @@ static void cleanup()
   fcntl(fd, F_SETLK, &file_lock);
   close(fd);
   remove(LOCK_FILE);
+  unlink(CONTROL_SOCKET);
 }
 
 
@@ -76,7 +221,21 @@ void sigterm_handler(int signum)
 }
 
 
-int is_daemon_running()
+void sighup_handler(int signum)
+{
+  // picked up by the monitor loop
+  monitor_request_reload();
+}
+
+
+/* is_daemon_running - take the pid file lock
+ *
+ * wait - IN - block until it is free (taking over from a daemon
+ *             that is about to exit)
+ *
+ * returns - 1 if another daemon holds it, 0 once it is ours
+ */
+int is_daemon_running(int wait)
 {
     char    buf[16];
 
@@ -89,7 +248,7 @@ int is_daemon_running()
       exit(1);
     }
     
-    if (fcntl(fd, F_SETLK, &file_lock) < 0) {
+    if (fcntl(fd, wait ? F_SETLKW : F_SETLK, &file_lock) < 0) {
       if (errno == EACCES || errno == EAGAIN) {
 	close(fd);
 	return (1);
@@ -112,200 +271,153 @@ int is_daemon_running()
     return (0);
 }
 
-void monitor_fs(char *cfg_file)
-{
-  int fd;
-  int wd;
-
-  struct timeval time;
-  fd_set descript = {0};
-  int ret;
-
-  ini_data_st *cfg;
-  char *ptr;
-  char watch_dir[PATH_MAX];
-  char backup_dir[PATH_MAX];
-  
-  if ((fd = inotify_init()) < 0) {
-    exit(1);
-  }
-
-  cfg = ini_init(cfg_file);
-  ptr = ini_get_data(cfg, "SOURCE DIR", "PATH");
-  if (!ptr) {
-    ini_free(cfg);
-    exit(1);
-  }
-
-  strcpy(watch_dir, ptr);
-
-  if ((wd = inotify_add_watch(fd, watch_dir, IN_DELETE | IN_MODIFY | IN_MOVE | IN_CREATE)) < 0) {
-    exit(1);
-  }
-
-  ptr = ini_get_data(cfg, "DESTINATION DIR", "PATH");
-  if (!watch_dir) {
-    ini_free(cfg);
-    exit(1);
-  }
-  
-  strcpy(backup_dir, ptr);
-
-  ini_free(cfg);
-  
-  while (1) {
-    
-    time.tv_sec = 1;
-    time.tv_usec = 0;
-    
-    FD_SET (fd, &descript);
-    
-    ret = select (fd + 1, &descript, NULL, NULL, &time);
-    if (ret < 0) {
-      exit(1);
-    } else if (!ret) {
-      // nothing happened, but we timed out in select
-      continue;
-    } else if (FD_ISSET (fd, &descript)) {
-      char buf[1024 * sizeof(struct inotify_event)];
-      int len, i = 0;
-      
-      len = read (fd, buf, 1024 * sizeof(struct inotify_event));
-      if (len < 0) {
-	if (errno == EINTR) {
-	  // syscall was interrupted, reissue call
-	  continue;
-	} else {
-	  // some other error
-	  exit(1);
-	} 
-      } else if (!len) {
-	// this shouldnt happen. if it does...blow up
-	exit(1);
-      }
-      
-      while (i < len) {
-	struct inotify_event *event;
-	
-	event = (struct inotify_event *) &buf[i];
-	
-	switch (event->mask) {
-	case IN_DELETE:
-	case IN_MOVED_FROM:
-	{
-	  char file_name[1024];
-	  snprintf(file_name, sizeof(file_name), "%s/%s", backup_dir, event->name);
-	  unlink(file_name);
-	  break;
-	}
-	    
-	case IN_CREATE:
-	case IN_MOVED_TO:
-	case IN_MODIFY:
-	{
-	  char in_file_name[1024];
-	  char out_file_name[1024];
-	  snprintf(in_file_name, sizeof(in_file_name), "%s/%s", watch_dir, event->name);
-	  snprintf(out_file_name, sizeof(out_file_name), "%s/%s", backup_dir, event->name);
-	  
-	  int in_fd = open(in_file_name, O_RDONLY);
-	  assert(in_fd >= 0);
-	  int out_fd = open(out_file_name, O_WRONLY | O_CREAT, S_IRWXU);
-	  
-	  assert(out_fd >= 0);
-	  
-	  char buf[8192];
-	  
-	  ssize_t result = read(in_fd, &buf[0], sizeof(buf));
-	  while (result) {
-	    assert(result > 0);
-	    assert(write(out_fd, &buf[0], result) == result);
-	    result = read(in_fd, &buf[0], sizeof(buf));
-	  }
-	  
-	  close(in_fd);
-	  close(out_fd);
-	  
-	  struct stat fst;
-	  stat(in_file_name,&fst);
-	  assert(chown(out_file_name,fst.st_uid,fst.st_gid) == 0);
-	  chmod(out_file_name,fst.st_mode);
-	  break;
-	}
-	default:
-	  //do something...
-	  break;
-	}
-	
-	i += sizeof(struct inotify_event) + event->len;
-      }
-    } 
-    
-  }
-  
-}
-
-
 int main(int argc, char* argv[])
 {
-  FILE *fp = NULL;
   pid_t pid = 0;
   pid_t sid = 0;
+  int foreground = 0;
+  char cfg_file[PATH_MAX];
+  struct sigaction sa;
+  handoff_st *h = NULL;
 
   if (argc < 2) {
     usage();
   }
 
   if (strcmp(argv[1], "stop") == 0) {
-    send_stop();
+    send_signal(SIGTERM, "stop");
+    exit(0);
+  } else if (strcmp(argv[1], "reload") == 0) {
+    send_signal(SIGHUP, "reload");
     exit(0);
-  } else if (strcmp(argv[1], "start") == 0) {
+  } else if (strcmp(argv[1], "status") == 0 || strcmp(argv[1], "flush") == 0 ||
+	     strcmp(argv[1], "upgrade") == 0) {
+    if (argc != 2) {
+      usage();
+    }
+    control(argv[1], NULL);
+  } else if (strcmp(argv[1], "pause") == 0 || strcmp(argv[1], "resume") == 0 ||
+	     strcmp(argv[1], "sync") == 0) {
     if (argc != 3) {
       usage();
     }
+    control(argv[1], argv[2]);
+  } else if (strcmp(argv[1], "start") == 0 || strcmp(argv[1], "run") == 0) {
+    if (argc != 3) {
+      usage();
+    }
+    foreground = (strcmp(argv[1], "run") == 0);
+  } else if (strcmp(argv[1], "record") == 0) {
+    // a run that also writes every event to a trace
+    if (argc != 4) {
+      usage();
+    }
+    if (monitor_record(argv[3]) < 0) {
+      perror(argv[3]);
+      exit(1);
+    }
+    foreground = 1;
+  } else if (strcmp(argv[1], "replay") == 0) {
+    // not the daemon, so no pid file: it can run next to one
+    if (argc < 4 || argc > 5 || (argc == 5 && strcmp(argv[4], "fast") != 0)) {
+      usage();
+    }
+    log_open(1);
+    monitor_replay(argv[2], argv[3], argc == 5);
+    exit(0);
+  } else if (strcmp(argv[1], "receive") == 0) {
+    // no pid file either, a receiver can run next to a daemon
+    if (argc != 4) {
+      usage();
+    }
+    receive(argv[2], argv[3]);
+  } else if (strcmp(argv[1], "extract") == 0) {
+    // only reads the destination, the daemon can keep running
+    if (argc < 4 || argc > 5) {
+      usage();
+    }
+    extract(argv[2], argv[3], argc == 5 ? argv[4] : NULL);
+  } else if (strcmp(argv[1], "restore") == 0) {
+    // reads the destination, writes elsewhere: no pid file either
+    if (argc < 5 || argc > 6) {
+      usage();
+    }
+    restore(argv[2], argv[3], argv[4], argc == 6 ? argv[5] : NULL);
+  } else if (strcmp(argv[1], "takeover") == 0) {
+    // run by "upgrade" in the daemon we replace, with its state on the
+    // given fd: it is already a daemon, so no fork
+    if (argc != 5) {
+      usage();
+    }
+    foreground = atoi(argv[4]);
+    log_open(foreground);
+    if (!(h = handoff_receive(atoi(argv[3]))) || handoff_ack(h) < 0) {
+      exit(1);
+    }
   } else {
     usage();
   }
 
-
-  if ((pid = fork()) < 0) {
-    perror("fork failed");
+  // we chdir to / below and reload the config later on, so hang on to
+  // an absolute path
+  if (!realpath(argv[2], cfg_file)) {
+    perror(argv[2]);
     exit(1);
   }
 
-  if (pid > 0) {
-    // parent process - kill to make child a daemon
-    exit(0);
-  }
+  if (!foreground && !h) {
+    if ((pid = fork()) < 0) {
+      perror("fork failed");
+      exit(1);
+    }
 
-  umask(0);
+    if (pid > 0) {
+      // parent process - kill to make child a daemon
+      exit(0);
+    }
 
-  if ((sid = setsid()) < 0) {
-    exit(1);
-  }
+    umask(0);
 
-  if (chdir("/") < 0) {
-    perror("chdir failed");
-    exit(1);
+    if ((sid = setsid()) < 0) {
+      exit(1);
+    }
+
+    if (chdir("/") < 0) {
+      perror("chdir failed");
+      exit(1);
+    }
   }
 
-  // check to see if we are already running
-  if (is_daemon_running()) {
+  // check to see if we are already running (the daemon we take over
+  // from lets go of the pid file as it exits)
+  if (is_daemon_running(h != NULL)) {
     fprintf(stderr, "backupd already running\n");
     exit(0);
   }
 
-  // set up out signal handler
+  // set up out signal handlers
   signal(SIGTERM, sigterm_handler);
+  signal(SIGINT, sigterm_handler);
+  // control clients can hang up before they are answered
+  signal(SIGPIPE, SIG_IGN);
+
+  // no SA_RESTART, the monitor loop needs select to be interrupted
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = sighup_handler;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGHUP, &sa, NULL);
+
+  log_open(foreground);
+
+  if (!foreground && !h) {
+    // by this point we will no longer log anything to stdout/stderr and we will not take in any
+    // user input, so close the respective FDs
+    close(STDIN_FILENO);
+    close(STDOUT_FILENO);
+    close(STDERR_FILENO);
+  }
 
-
-  // by this point we will no longer log anything to stdout/stderr and we will not take in any
-  // user input, so close the respective FDs
-  close(STDIN_FILENO);
-  close(STDOUT_FILENO);
-  close(STDERR_FILENO);
-
-  monitor_fs(argv[2]);
+  monitor_fs(cfg_file, foreground, h);
   
   return (0);
 }
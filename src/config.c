@@ -0,0 +1,354 @@
+/*
+ * config.c
+ *
+ * Loads the config file
+ * 
+ *
+ * Copyright (C) 2013  Bryant Moscon - bmoscon@gmail.com
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to 
+ * deal in the Software without restriction, including without limitation the 
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, 
+ *    this list of conditions and the following disclaimer in the documentation 
+ *    and/or other materials provided with the distribution, and in the same 
+ *    place and form as other copyright, license and disclaimer information.
+ *
+ * 3. The end-user documentation included with the redistribution, if any, must 
+ *    include the following acknowledgment: "This product includes software 
+ *    developed by Bryant Moscon (http://www.bryantmoscon.org/)", in the same 
+ *    place and form as other third-party acknowledgments. Alternately, this 
+ *    acknowledgment may appear in the software itself, in the same form and 
+ *    location as other such third-party acknowledgments.
+ *
+ * 4. Except as contained in this notice, the name of the author, Bryant Moscon,
+ *    shall not be used in advertising or otherwise to promote the sale, use or 
+ *    other dealings in this Software without prior written authorization from 
+ *    the author.
+ *
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL 
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN 
+ * THE SOFTWARE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+
+#include "config.h"
+#include "replicate.h"
+#include "scrub.h"
+#include "trash.h"
+#include "ini_parse.h"
+#include "log.h"
+
+
+static int get_str(ini_data_st *ini, char *prop, char **out)
+{
+  char *val = ini_get_data(ini, DAEMON_SECTION, prop);
+
+  if (val && !(*out = strdup(val))) {
+    return (-1);
+  }
+  return (0);
+}
+
+
+static int get_int(ini_data_st *ini, char *prop, int def, int min)
+{
+  char *val = ini_get_data(ini, DAEMON_SECTION, prop);
+  int ret;
+
+  if (!val) {
+    return (def);
+  }
+
+  ret = atoi(val);
+  if (ret < min) {
+    log_msg(LOG_WARNING, "%s must be at least %d", prop, min);
+    return (def);
+  }
+  return (ret);
+}
+
+
+/* a size, with an optional K, M or G suffix. 0 is allowed */
+static off_t get_size(ini_data_st *ini, char *prop, off_t def)
+{
+  char *val = ini_get_data(ini, DAEMON_SECTION, prop);
+  char *end;
+  long long ret;
+
+  if (!val) {
+    return (def);
+  }
+
+  ret = strtoll(val, &end, 10);
+  if (end == val) {
+    ret = -1;
+  }
+
+  switch (*end) {
+  case 'G': case 'g':
+    ret *= 1024;
+    /* fall through */
+  case 'M': case 'm':
+    ret *= 1024;
+    /* fall through */
+  case 'K': case 'k':
+    ret *= 1024;
+    end++;
+  }
+
+  if (ret < 0 || *end != '\0') {
+    log_msg(LOG_WARNING, "%s: bad size \"%s\"", prop, val);
+    return (def);
+  }
+  return (ret);
+}
+
+
+/* a duration in seconds, with an optional s, m, h or d suffix */
+static time_t get_time(ini_data_st *ini, char *prop, time_t def)
+{
+  char *val = ini_get_data(ini, DAEMON_SECTION, prop);
+  char *end;
+  long long ret;
+
+  if (!val) {
+    return (def);
+  }
+
+  ret = strtoll(val, &end, 10);
+  if (end == val) {
+    ret = -1;
+  }
+
+  switch (*end) {
+  case 'd': case 'D':
+    ret *= 24;
+    /* fall through */
+  case 'h': case 'H':
+    ret *= 60;
+    /* fall through */
+  case 'm': case 'M':
+    ret *= 60;
+    /* fall through */
+  case 's': case 'S':
+    end++;
+  }
+
+  if (ret < 0 || *end != '\0') {
+    log_msg(LOG_WARNING, "%s: bad time \"%s\"", prop, val);
+    return (def);
+  }
+  return (ret);
+}
+
+
+/* parse a CPU list like 0-7,16-23 into set */
+static int parse_cpus(const char *list, cpu_set_t *set)
+{
+  const char *p = list;
+  char *end;
+  long from, to;
+
+  CPU_ZERO(set);
+  while (*p && !isspace((unsigned char)*p)) {
+    from = to = strtol(p, &end, 10);
+    if (end == p) {
+      return (-1);
+    }
+    if (*end == '-') {
+      p = end + 1;
+      to = strtol(p, &end, 10);
+      if (end == p) {
+	return (-1);
+      }
+    }
+    if (from < 0 || to < from || to >= CPU_SETSIZE) {
+      return (-1);
+    }
+    for (; from <= to; from++) {
+      CPU_SET(from, set);
+    }
+
+    p = end;
+    if (*p == ',') {
+      ++p;
+    } else if (*p && !isspace((unsigned char)*p)) {
+      return (-1);
+    }
+  }
+  return (CPU_COUNT(set) ? 0 : -1);
+}
+
+
+/* get_cpus - where shard n runs, from SHARD_<n>: a CPU list, or
+ *            "node <n>" for the CPUs of a NUMA node. An empty set if
+ *            not given, or bad (logged)
+ */
+
+static void get_cpus(ini_data_st *ini, int n, cpu_set_t *set)
+{
+  char prop[32];
+  char path[64];
+  char list[1024];
+  char *val;
+  FILE *fp;
+
+  CPU_ZERO(set);
+  snprintf(prop, sizeof(prop), "SHARD_%d", n);
+  if (!(val = ini_get_data(ini, DAEMON_SECTION, prop))) {
+    return;
+  }
+
+  if (strncasecmp(val, "node", 4) == 0) {
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", atoi(val + 4));
+    if (!(fp = fopen(path, "r")) || !fgets(list, sizeof(list), fp) ||
+	parse_cpus(list, set) < 0) {
+      log_msg(LOG_WARNING, "%s: no NUMA %s, not pinned", prop, val);
+      CPU_ZERO(set);
+    }
+    if (fp) {
+      fclose(fp);
+    }
+  } else if (parse_cpus(val, set) < 0) {
+    log_msg(LOG_WARNING, "%s: bad CPU list \"%s\", not pinned", prop, val);
+    CPU_ZERO(set);
+  }
+}
+
+
+/* config_load - parse the config file into jobs and daemon settings
+ *
+ * file_name - IN - INI file
+ *
+ * returns - config_st - malloc'd config, to be freed with config_free,
+ *                       or NULL on error (logged)
+ *
+ *
+ * Daemon wide settings live in an optional [BACKUPD] section:
+ *
+ * [BACKUPD]
+ * JOURNAL=/var/lib/backupd/journal
+ * BACKEND=fanotify
+ * WORKERS=4
+ * SPLIT_SIZE=256M
+ * CACHE=dontneed
+ * SCRUB=/var/lib/backupd/scrub
+ * SCRUB_RATE=8M
+ * QUEUE_MEMORY=256M
+ * QUEUE_SPILL=/var/tmp
+ * SHARDS=2
+ * SHARD_0=node 0
+ * SHARD_1=8-15,24-31
+ * DELETE=trash
+ * TRASH_KEEP=1d
+ * TRASH_RATE=64M
+ *
+ * see job.c for the jobs themselves.
+ */
+
+config_st *config_load(const char *file_name)
+{
+  ini_data_st *ini;
+  config_st *cfg;
+  char *backend;
+  char *cache;
+  char *delete;
+  int i;
+
+  ini = ini_init(file_name);
+  if (!ini) {
+    log_msg(LOG_ERR, "could not parse %s", file_name);
+    return (NULL);
+  }
+
+  if (!(cfg = calloc(1, sizeof(config_st)))) {
+    ini_free(ini);
+    return (NULL);
+  }
+
+  backend = ini_get_data(ini, DAEMON_SECTION, "BACKEND");
+  cache = ini_get_data(ini, DAEMON_SECTION, "CACHE");
+  delete = ini_get_data(ini, DAEMON_SECTION, "DELETE");
+  if (!(cfg->jobs = job_load(ini)) ||
+      get_str(ini, "JOURNAL", &cfg->journal) != 0 || get_str(ini, "SCRUB", &cfg->scrub) != 0 ||
+      get_str(ini, "QUEUE_SPILL", &cfg->queue_spill) != 0 ||
+      (!cfg->queue_spill && !(cfg->queue_spill = strdup(DEFAULT_QUEUE_SPILL)))) {
+    config_free(cfg);
+    cfg = NULL;
+  } else {
+    cfg->fanotify = (backend && strcasecmp(backend, "fanotify") == 0);
+    if (backend && !cfg->fanotify && strcasecmp(backend, "inotify") != 0) {
+      log_msg(LOG_WARNING, "unknown BACKEND %s, using inotify", backend);
+    }
+    cfg->workers = get_int(ini, "WORKERS", DEFAULT_WORKERS, 1);
+    cfg->split_size = get_size(ini, "SPLIT_SIZE", DEFAULT_SPLIT_SIZE);
+    if ((cfg->scrub_rate = get_size(ini, "SCRUB_RATE", DEFAULT_SCRUB_RATE)) == 0) {
+      log_msg(LOG_WARNING, "SCRUB_RATE must be more than 0");
+      cfg->scrub_rate = DEFAULT_SCRUB_RATE;
+    }
+    cfg->queue_memory = get_size(ini, "QUEUE_MEMORY", DEFAULT_QUEUE_MEMORY);
+
+    cfg->shards = get_int(ini, "SHARDS", 1, 1);
+    if ((cfg->shard_cpus = calloc(cfg->shards, sizeof(cpu_set_t)))) {
+      for (i = 0; i < cfg->shards; i++) {
+	get_cpus(ini, i, &cfg->shard_cpus[i]);
+      }
+    }
+
+    cfg->trash = (delete && strcasecmp(delete, "trash") == 0);
+    if (delete && !cfg->trash && strcasecmp(delete, "unlink") != 0) {
+      log_msg(LOG_WARNING, "unknown DELETE %s, using unlink", delete);
+    }
+    cfg->trash_keep = get_time(ini, "TRASH_KEEP", 0);
+    if ((cfg->trash_rate = get_size(ini, "TRASH_RATE", DEFAULT_TRASH_RATE)) == 0) {
+      log_msg(LOG_WARNING, "TRASH_RATE must be more than 0");
+      cfg->trash_rate = DEFAULT_TRASH_RATE;
+    }
+
+    cfg->cache = CACHE_NORMAL;
+    if (cache && strcasecmp(cache, "dontneed") == 0) {
+      cfg->cache = CACHE_DONTNEED;
+    } else if (cache && strcasecmp(cache, "direct") == 0) {
+      cfg->cache = CACHE_DIRECT;
+    } else if (cache && strcasecmp(cache, "normal") != 0) {
+      log_msg(LOG_WARNING, "unknown CACHE %s, using normal", cache);
+    }
+  }
+
+  ini_free(ini);
+  return (cfg);
+}
+
+
+void config_free(config_st *cfg)
+{
+  if (!cfg) {
+    return;
+  }
+
+  job_free_list(cfg->jobs);
+  free(cfg->journal);
+  free(cfg->scrub);
+  free(cfg->queue_spill);
+  free(cfg->shard_cpus);
+  free(cfg);
+}
@@ -0,0 +1,90 @@
+/*
+ * config.h
+ *
+ * Configuration Definitions
+ * 
+ *
+ * Copyright (C) 2013  Bryant Moscon - bmoscon@gmail.com
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to 
+ * deal in the Software without restriction, including without limitation the 
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, 
+ *    this list of conditions and the following disclaimer in the documentation 
+ *    and/or other materials provided with the distribution, and in the same 
+ *    place and form as other copyright, license and disclaimer information.
+ *
+ * 3. The end-user documentation included with the redistribution, if any, must 
+ *    include the following acknowledgment: "This product includes software 
+ *    developed by Bryant Moscon (http://www.bryantmoscon.org/)", in the same 
+ *    place and form as other third-party acknowledgments. Alternately, this 
+ *    acknowledgment may appear in the software itself, in the same form and 
+ *    location as other such third-party acknowledgments.
+ *
+ * 4. Except as contained in this notice, the name of the author, Bryant Moscon,
+ *    shall not be used in advertising or otherwise to promote the sale, use or 
+ *    other dealings in this Software without prior written authorization from 
+ *    the author.
+ *
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL 
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN 
+ * THE SOFTWARE.
+ *
+ */
+
+#ifndef __CONFIG__
+#define __CONFIG__
+
+#include <time.h>
+#include <sched.h>
+#include <sys/types.h>
+
+#include "job.h"
+
+
+#define DAEMON_SECTION "BACKUPD"
+#define DEFAULT_WORKERS 4
+#define DEFAULT_SPLIT_SIZE (256 * 1024 * 1024)
+#define DEFAULT_QUEUE_MEMORY (256 * 1024 * 1024)
+#define DEFAULT_QUEUE_SPILL "/var/tmp"
+
+
+typedef struct config_st {
+  job_st *jobs;
+
+  // daemon wide settings, from the [BACKUPD] section. These are read
+  // at startup only, a reload does not change them
+  char *journal;      // JOURNAL - write-ahead journal directory, or NULL
+  int fanotify;       // BACKEND - fanotify instead of inotify
+  int workers;        // WORKERS - copy worker threads
+  off_t split_size;   // SPLIT_SIZE - copy files this big in parallel ranges
+  int cache;          // CACHE - page cache policy of copies, CACHE_*
+  char *scrub;        // SCRUB - scrub state directory, or NULL for no scrub
+  off_t scrub_rate;   // SCRUB_RATE - bytes per second the scrub reads
+  off_t queue_memory; // QUEUE_MEMORY - cap on the copy queue, 0 for none
+  char *queue_spill;  // QUEUE_SPILL - directory of its overflow file
+  int shards;         // SHARDS - event loops, each with its own workers
+  cpu_set_t *shard_cpus; // SHARD_<n> - CPUs shard n runs on, empty for any
+  int trash;          // DELETE - move deletions to the trash, see trash.c
+  time_t trash_keep;  // TRASH_KEEP - seconds they stay there, at least
+  off_t trash_rate;   // TRASH_RATE - bytes per second the trash is emptied at
+} config_st;
+
+
+config_st *config_load(const char *file_name);
+void config_free(config_st *cfg);
+
+
+#endif
@@ -0,0 +1,313 @@
+/*
+ * control.c
+ *
+ * Control Socket
+ * 
+ *
+ * Copyright (C) 2013  Bryant Moscon - bmoscon@gmail.com
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to 
+ * deal in the Software without restriction, including without limitation the 
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, 
+ *    this list of conditions and the following disclaimer in the documentation 
+ *    and/or other materials provided with the distribution, and in the same 
+ *    place and form as other copyright, license and disclaimer information.
+ *
+ * 3. The end-user documentation included with the redistribution, if any, must 
+ *    include the following acknowledgment: "This product includes software 
+ *    developed by Bryant Moscon (http://www.bryantmoscon.org/)", in the same 
+ *    place and form as other third-party acknowledgments. Alternately, this 
+ *    acknowledgment may appear in the software itself, in the same form and 
+ *    location as other such third-party acknowledgments.
+ *
+ * 4. Except as contained in this notice, the name of the author, Bryant Moscon,
+ *    shall not be used in advertising or otherwise to promote the sale, use or 
+ *    other dealings in this Software without prior written authorization from 
+ *    the author.
+ *
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL 
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN 
+ * THE SOFTWARE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "control.h"
+#include "log.h"
+
+
+/*
+ * The daemon listens on a unix socket, served from the monitor's
+ * event loop like the inotify fd. A client connects, sends one
+ * request line, and reads the reply until the daemon closes the
+ * connection. Replies are text, an error starts with "error:".
+ *
+ * Requests are read as they come in, so a slow client cannot hold up
+ * the loop, and replies are written with a send timeout for the same
+ * reason.
+ */
+
+
+#define SEND_TIMEOUT 1       // seconds
+
+
+static int make_addr(const char *path, struct sockaddr_un *addr)
+{
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr->sun_path)) {
+    errno = ENAMETOOLONG;
+    return (-1);
+  }
+  strcpy(addr->sun_path, path);
+  return (0);
+}
+
+
+/* control_open - listen on a unix socket at path, replacing any left
+ *                over from an earlier run
+ *
+ * returns - the control socket, NULL on error (logged)
+ */
+
+control_st *control_open(const char *path)
+{
+  struct sockaddr_un addr;
+  control_st *c;
+
+  if (!(c = calloc(1, sizeof(control_st))) || !(c->path = strdup(path))) {
+    free(c);
+    return (NULL);
+  }
+
+  if (make_addr(path, &addr) < 0 ||
+      (c->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0) {
+    goto fail;
+  }
+
+  // the pid file lock says no other daemon is using it
+  unlink(path);
+  if (bind(c->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+      chmod(path, S_IRUSR | S_IWUSR) < 0 || listen(c->fd, 16) < 0) {
+    close(c->fd);
+    goto fail;
+  }
+
+  return (c);
+
+ fail:
+  log_msg(LOG_WARNING, "control socket %s: %s", path, strerror(errno));
+  free(c->path);
+  free(c);
+  return (NULL);
+}
+
+
+/* control_adopt - serve a socket already listening at path, handed
+ *                 over by the daemon this one replaces
+ *
+ * returns - the control socket, NULL if out of memory
+ */
+
+control_st *control_adopt(const char *path, int fd)
+{
+  control_st *c;
+
+  if (!(c = calloc(1, sizeof(control_st))) || !(c->path = strdup(path))) {
+    free(c);
+    return (NULL);
+  }
+  c->fd = fd;
+  return (c);
+}
+
+
+static void conn_free(control_conn_st *conn)
+{
+  close(conn->fd);
+  free(conn);
+}
+
+
+void control_close(control_st *c)
+{
+  control_conn_st *conn;
+
+  if (!c) {
+    return;
+  }
+
+  while ((conn = c->conns)) {
+    c->conns = conn->next;
+    conn_free(conn);
+  }
+  close(c->fd);
+  unlink(c->path);
+  free(c->path);
+  free(c);
+}
+
+
+/* control_fds - add the socket and its connections to set
+ *
+ * returns - the highest fd in set
+ */
+
+int control_fds(control_st *c, fd_set *set, int max_fd)
+{
+  control_conn_st *conn;
+
+  FD_SET(c->fd, set);
+  if (c->fd > max_fd) {
+    max_fd = c->fd;
+  }
+
+  for (conn = c->conns; conn; conn = conn->next) {
+    FD_SET(conn->fd, set);
+    if (conn->fd > max_fd) {
+      max_fd = conn->fd;
+    }
+  }
+
+  return (max_fd);
+}
+
+
+static void accept_all(control_st *c)
+{
+  struct timeval timeout = {SEND_TIMEOUT, 0};
+  control_conn_st *conn;
+  int fd;
+
+  while ((fd = accept4(c->fd, NULL, NULL, SOCK_CLOEXEC)) >= 0) {
+    if (!(conn = calloc(1, sizeof(control_conn_st)))) {
+      close(fd);
+      continue;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    conn->fd = fd;
+    conn->next = c->conns;
+    c->conns = conn;
+  }
+}
+
+
+/* control_serve - accept new connections and read requests, handing
+ *                 each complete one to handler
+ */
+
+void control_serve(control_st *c, fd_set *set, control_fp handler, void *arg)
+{
+  control_conn_st **prev = &c->conns;
+  control_conn_st *conn;
+  ssize_t len;
+  char *end;
+
+  while ((conn = *prev)) {
+    if (!FD_ISSET(conn->fd, set)) {
+      prev = &conn->next;
+      continue;
+    }
+
+    len = read(conn->fd, conn->buf + conn->len, sizeof(conn->buf) - 1 - conn->len);
+    if (len < 0 && errno == EINTR) {
+      prev = &conn->next;
+      continue;
+    }
+    if (len > 0) {
+      conn->len += len;
+      conn->buf[conn->len] = '\0';
+      if (!(end = strchr(conn->buf, '\n')) && conn->len < sizeof(conn->buf) - 1) {
+	prev = &conn->next;
+	continue;
+      }
+      if (!end) {
+	dprintf(conn->fd, "error: request too long\n");
+      } else {
+	*end = '\0';
+	if (handler(arg, conn->fd, conn->buf)) {
+	  conn->fd = -1;
+	}
+      }
+    }
+
+    // answered, or gone
+    *prev = conn->next;
+    if (conn->fd >= 0) {
+      close(conn->fd);
+    }
+    free(conn);
+  }
+
+  if (FD_ISSET(c->fd, set)) {
+    accept_all(c);
+  }
+}
+
+
+/* control_request - send one request to the daemon and copy its reply
+ *                   to stdout
+ *
+ * returns - 0 on success, 1 if the daemon answered with an error, -1
+ *           if it could not be reached (errno set)
+ */
+
+int control_request(const char *path, const char *line)
+{
+  struct sockaddr_un addr;
+  char buf[4096];
+  int fd, ret = 0, first = 1;
+  ssize_t len;
+
+  if (make_addr(path, &addr) < 0 ||
+      (fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+    return (-1);
+  }
+
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+      dprintf(fd, "%s\n", line) < 0) {
+    close(fd);
+    return (-1);
+  }
+
+  while ((len = read(fd, buf, sizeof(buf))) != 0) {
+    if (len < 0) {
+      if (errno == EINTR) {
+	continue;
+      }
+      close(fd);
+      return (-1);
+    }
+    if (first && len >= 6 && strncmp(buf, "error:", 6) == 0) {
+      ret = 1;
+    }
+    first = 0;
+    fwrite(buf, 1, len, stdout);
+  }
+
+  close(fd);
+  return (ret);
+}
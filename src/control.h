@@ -0,0 +1,86 @@
+/*
+ * control.h
+ *
+ * Control Socket Definitions
+ * 
+ *
+ * Copyright (C) 2013  Bryant Moscon - bmoscon@gmail.com
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to 
+ * deal in the Software without restriction, including without limitation the 
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, 
+ *    this list of conditions and the following disclaimer in the documentation 
+ *    and/or other materials provided with the distribution, and in the same 
+ *    place and form as other copyright, license and disclaimer information.
+ *
+ * 3. The end-user documentation included with the redistribution, if any, must 
+ *    include the following acknowledgment: "This product includes software 
+ *    developed by Bryant Moscon (http://www.bryantmoscon.org/)", in the same 
+ *    place and form as other third-party acknowledgments. Alternately, this 
+ *    acknowledgment may appear in the software itself, in the same form and 
+ *    location as other such third-party acknowledgments.
+ *
+ * 4. Except as contained in this notice, the name of the author, Bryant Moscon,
+ *    shall not be used in advertising or otherwise to promote the sale, use or 
+ *    other dealings in this Software without prior written authorization from 
+ *    the author.
+ *
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL 
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN 
+ * THE SOFTWARE.
+ *
+ */
+
+#ifndef __CONTROL__
+#define __CONTROL__
+
+#include <sys/select.h>
+
+
+#define CONTROL_SOCKET "/var/run/backupd.sock"
+#define CONTROL_LINE 8192    // longest request
+
+
+typedef struct control_conn_st {
+  int fd;
+  char buf[CONTROL_LINE];
+  size_t len;
+
+  struct control_conn_st *next;
+} control_conn_st;
+
+
+typedef struct control_st {
+  int fd;                  // listening
+  char *path;
+  control_conn_st *conns;  // waiting for their request
+} control_st;
+
+
+/* handles a request, returns 1 if it kept fd (and will close it
+ * itself), 0 to have it closed once the handler returns */
+typedef int (*control_fp)(void *arg, int fd, char *line);
+
+
+control_st *control_open(const char *path);
+control_st *control_adopt(const char *path, int fd);
+void control_close(control_st *c);
+int control_fds(control_st *c, fd_set *set, int max_fd);
+void control_serve(control_st *c, fd_set *set, control_fp handler, void *arg);
+int control_request(const char *path, const char *line);
+
+
+#endif
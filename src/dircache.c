@@ -0,0 +1,338 @@
+/*
+ * dircache.c
+ *
+ * Per-thread LRU cache of open directory fds
+ * 
+ *
+ * Copyright (C) 2013  Bryant Moscon - bmoscon@gmail.com
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to 
+ * deal in the Software without restriction, including without limitation the 
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, 
+ *    this list of conditions and the following disclaimer in the documentation 
+ *    and/or other materials provided with the distribution, and in the same 
+ *    place and form as other copyright, license and disclaimer information.
+ *
+ * 3. The end-user documentation included with the redistribution, if any, must 
+ *    include the following acknowledgment: "This product includes software 
+ *    developed by Bryant Moscon (http://www.bryantmoscon.org/)", in the same 
+ *    place and form as other third-party acknowledgments. Alternately, this 
+ *    acknowledgment may appear in the software itself, in the same form and 
+ *    location as other such third-party acknowledgments.
+ *
+ * 4. Except as contained in this notice, the name of the author, Bryant Moscon,
+ *    shall not be used in advertising or otherwise to promote the sale, use or 
+ *    other dealings in this Software without prior written authorization from 
+ *    the author.
+ *
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL 
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN 
+ * THE SOFTWARE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "dircache.h"
+#include "hash_map.h"
+
+
+/*
+ * Every file operation used to build an absolute path and hand it to
+ * the kernel, which walked it from the root each time, and paths were
+ * limited to what fit in a PATH_MAX buffer. Instead we keep O_PATH fds
+ * of recently used directories (keyed by root + relative path) and use
+ * the *at() calls relative to them. A directory that is not cached is
+ * opened relative to its parent, which is looked up the same way, so
+ * only the first use of a directory costs a walk, and that one is a
+ * single component from the nearest cached ancestor.
+ *
+ * Each thread has a cache of its own (no locking, and an fd cannot be
+ * closed under another thread's feet). An fd stays valid until the
+ * same thread's next lookup, a caller that needs two directories at
+ * once must dup() the first.
+ *
+ * An fd follows its directory when it is renamed, so the cached paths
+ * go wrong when a directory is moved or removed. dir_invalidate() bumps
+ * a global generation, and each cache empties itself the next time it
+ * is used after that.
+ */
+
+
+typedef struct dir_entry_st {
+  char *key;           // root/rel
+  int fd;
+  struct dir_entry_st *prev;
+  struct dir_entry_st *next;
+} dir_entry_st;
+
+
+typedef struct dir_cache_st {
+  hash_map_st *map;    // key -> entry
+  dir_entry_st *head;  // most recently used
+  dir_entry_st *tail;
+  int size;
+  unsigned int gen;
+} dir_cache_st;
+
+
+static unsigned int generation = 0;
+static __thread dir_cache_st *cache = NULL;
+
+
+static void unlink_entry(dir_cache_st *c, dir_entry_st *e)
+{
+  if (e->prev) {
+    e->prev->next = e->next;
+  } else {
+    c->head = e->next;
+  }
+  if (e->next) {
+    e->next->prev = e->prev;
+  } else {
+    c->tail = e->prev;
+  }
+}
+
+
+static void push_front(dir_cache_st *c, dir_entry_st *e)
+{
+  e->prev = NULL;
+  e->next = c->head;
+  if (c->head) {
+    c->head->prev = e;
+  } else {
+    c->tail = e;
+  }
+  c->head = e;
+}
+
+
+static void drop(dir_cache_st *c, dir_entry_st *e)
+{
+  unlink_entry(c, e);
+  hash_map_remove(c->map, e->key);
+  close(e->fd);
+  free(e->key);
+  free(e);
+  --c->size;
+}
+
+
+static dir_cache_st *get_cache(void)
+{
+  dir_cache_st *c = cache;
+  unsigned int gen = __atomic_load_n(&generation, __ATOMIC_ACQUIRE);
+
+  if (!c) {
+    if (!(c = calloc(1, sizeof(dir_cache_st))) ||
+	!(c->map = hash_map_init(DIR_CACHE_SIZE * 2, hash_map_str_hash, hash_map_str_cmp))) {
+      free(c);
+      return (NULL);
+    }
+    c->gen = gen;
+    cache = c;
+  }
+
+  if (c->gen != gen) {
+    while (c->head) {
+      drop(c, c->head);
+    }
+    c->gen = gen;
+  }
+
+  return (c);
+}
+
+
+static int lookup(dir_cache_st *c, const char *root, const char *rel)
+{
+  size_t rlen = strlen(root);
+  size_t len = strlen(rel);
+  const char *slash;
+  dir_entry_st *e;
+  char *key;
+  int parent;
+  int fd;
+
+  if (!(key = malloc(rlen + len + 2))) {
+    return (-1);
+  }
+  memcpy(key, root, rlen);
+  key[rlen] = '/';
+  memcpy(key + rlen + 1, rel, len + 1);
+
+  if ((e = hash_map_get(c->map, key))) {
+    free(key);
+    unlink_entry(c, e);
+    push_front(c, e);
+    return (e->fd);
+  }
+
+  if (!len) {
+    fd = open(root, O_PATH | O_DIRECTORY | O_CLOEXEC);
+  } else {
+    char *dir = strndup(rel, (slash = strrchr(rel, '/')) ? (size_t)(slash - rel) : 0);
+
+    parent = dir ? lookup(c, root, dir) : -1;
+    free(dir);
+    fd = (parent < 0) ? -1 :
+      openat(parent, slash ? slash + 1 : rel, O_PATH | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+  }
+
+  if (fd < 0 || !(e = malloc(sizeof(dir_entry_st)))) {
+    if (fd >= 0) {
+      close(fd);
+    }
+    free(key);
+    return (-1);
+  }
+
+  e->key = key;
+  e->fd = fd;
+  if (hash_map_put(c->map, key, e) != 0) {
+    close(fd);
+    free(key);
+    free(e);
+    return (-1);
+  }
+  push_front(c, e);
+
+  if (++c->size > DIR_CACHE_SIZE) {
+    drop(c, c->tail);
+  }
+
+  return (fd);
+}
+
+
+/* dir_get - an fd for the directory root/rel, usable with the *at()
+ *           calls. Owned by the cache, do not close it
+ *
+ * returns - fd, or -1 with errno set
+ */
+
+int dir_get(const char *root, const char *rel)
+{
+  dir_cache_st *c = get_cache();
+
+  if (!c) {
+    errno = ENOMEM;
+    return (-1);
+  }
+  return (lookup(c, root, rel));
+}
+
+
+/* dir_open - the directory that root/rel is in, and the name of rel
+ *            in it, for the *at() calls. The root itself comes back
+ *            as "." in root
+ *
+ * base - OUT - points into rel (or at ".")
+ *
+ * returns - fd, or -1 with errno set
+ */
+
+int dir_open(const char *root, const char *rel, const char **base)
+{
+  const char *slash = strrchr(rel, '/');
+  char *dir;
+  int fd;
+
+  if (!*rel) {
+    *base = ".";
+    return (dir_get(root, ""));
+  }
+
+  if (!slash) {
+    *base = rel;
+    return (dir_get(root, ""));
+  }
+
+  if (!(dir = strndup(rel, slash - rel))) {
+    errno = ENOMEM;
+    return (-1);
+  }
+  fd = dir_get(root, dir);
+  free(dir);
+
+  *base = slash + 1;
+  return (fd);
+}
+
+
+/* dir_dup - like dir_open, but the fd is the caller's own (to close),
+ *           for when a second directory is needed at the same time
+ */
+
+int dir_dup(const char *root, const char *rel, const char **base)
+{
+  int fd = dir_open(root, rel, base);
+
+  return (fd < 0 ? -1 : fcntl(fd, F_DUPFD_CLOEXEC, 0));
+}
+
+
+/* dir_release - close this thread's cache, before the thread exits */
+void dir_release(void)
+{
+  dir_cache_st *c = cache;
+
+  if (!c) {
+    return;
+  }
+  while (c->head) {
+    drop(c, c->head);
+  }
+  hash_map_free(c->map);
+  free(c);
+  cache = NULL;
+}
+
+
+/* dir_forget - drop root/rel from this thread's cache, it was removed
+ *              by this thread (other threads never had it)
+ */
+
+void dir_forget(const char *root, const char *rel)
+{
+  dir_cache_st *c = cache;
+  dir_entry_st *e;
+  char *key;
+
+  if (!c || asprintf(&key, "%s/%s", root, rel) < 0) {
+    return;
+  }
+  if ((e = hash_map_get(c->map, key))) {
+    drop(c, e);
+  }
+  free(key);
+}
+
+
+/* dir_invalidate - a directory was renamed or removed somewhere, so no
+ *                  cached fd can be trusted to still have its path
+ */
+
+void dir_invalidate(void)
+{
+  __atomic_add_fetch(&generation, 1, __ATOMIC_RELEASE);
+}
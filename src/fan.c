@@ -0,0 +1,465 @@
+/*
+ * fan.c
+ *
+ * fanotify event backend - one mark per filesystem instead of a watch per directory
+ * 
+ *
+ * Copyright (C) 2013  Bryant Moscon - bmoscon@gmail.com
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to 
+ * deal in the Software without restriction, including without limitation the 
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, 
+ *    this list of conditions and the following disclaimer in the documentation 
+ *    and/or other materials provided with the distribution, and in the same 
+ *    place and form as other copyright, license and disclaimer information.
+ *
+ * 3. The end-user documentation included with the redistribution, if any, must 
+ *    include the following acknowledgment: "This product includes software 
+ *    developed by Bryant Moscon (http://www.bryantmoscon.org/)", in the same 
+ *    place and form as other third-party acknowledgments. Alternately, this 
+ *    acknowledgment may appear in the software itself, in the same form and 
+ *    location as other such third-party acknowledgments.
+ *
+ * 4. Except as contained in this notice, the name of the author, Bryant Moscon,
+ *    shall not be used in advertising or otherwise to promote the sale, use or 
+ *    other dealings in this Software without prior written authorization from 
+ *    the author.
+ *
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL 
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN 
+ * THE SOFTWARE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/fanotify.h>
+#include <sys/inotify.h>
+
+#include "fan.h"
+#include "log.h"
+
+
+/*
+ * With FAN_REPORT_DFID_NAME an event names the directory it happened in
+ * by file handle, plus the name of the entry. Handles are turned into
+ * paths with open_by_handle_at() and /proc/self/fd, and the result is
+ * cached. Removing or moving a directory changes the paths below it, so
+ * that empties the cache.
+ *
+ * Events are passed on with the inotify mask bits they correspond to,
+ * so the monitor handles both backends the same way. With FAN_RENAME
+ * (linux 5.17) a move arrives as one event naming both ends and is
+ * passed on as an IN_MOVED_FROM / IN_MOVED_TO pair with a made up
+ * cookie. Without it the two halves cannot be paired, and are handled
+ * as a delete and a create.
+ */
+
+
+#ifdef FAN_REPORT_DFID_NAME
+
+#define FAN_EVENTS (FAN_CREATE | FAN_DELETE | FAN_MODIFY | FAN_ATTRIB | FAN_ONDIR)
+#define FAN_MOVES (FAN_MOVED_FROM | FAN_MOVED_TO)
+
+
+static const struct {
+  uint64_t fan;
+  uint32_t in;
+} fan_bits[] = {
+  {FAN_CREATE, IN_CREATE},
+  {FAN_MODIFY, IN_MODIFY},
+  {FAN_ATTRIB, IN_ATTRIB},
+  {FAN_MOVED_FROM, IN_MOVED_FROM},
+  {FAN_MOVED_TO, IN_MOVED_TO},
+  {FAN_DELETE, IN_DELETE}
+};
+
+
+/* cache key - the filesystem id, then the handle */
+typedef struct fan_key_st {
+  size_t len;
+  unsigned char data[];
+} fan_key_st;
+
+
+static uint32_t key_hash(void *key)
+{
+  fan_key_st *k = (fan_key_st *)key;
+  uint32_t hash = 2166136261U;
+  size_t i;
+
+  for (i = 0; i < k->len; i++) {
+    hash ^= k->data[i];
+    hash *= 16777619U;
+  }
+  return (hash);
+}
+
+
+static int key_cmp(void *a, void *b)
+{
+  fan_key_st *x = (fan_key_st *)a;
+  fan_key_st *y = (fan_key_st *)b;
+
+  if (x->len != y->len) {
+    return (1);
+  }
+  return (memcmp(x->data, y->data, x->len));
+}
+
+
+static void free_entry(void *key, void *val, void *arg)
+{
+  hash_map_remove((hash_map_st *)arg, key);
+  free(key);
+  free(val);
+}
+
+
+static void flush_cache(fan_st *f)
+{
+  hash_map_foreach(f->cache, free_entry, f->cache);
+}
+
+
+fan_st *fan_init(void)
+{
+  int fd = fanotify_init(FAN_CLASS_NOTIF | FAN_CLOEXEC | FAN_REPORT_DFID_NAME,
+			 O_RDONLY | O_LARGEFILE);
+
+  return (fd < 0 ? NULL : fan_adopt(fd));
+}
+
+
+/* fan_adopt - fan_init, for an fd fanotify_init'd like it is there
+ *             (handed over by the daemon this one replaces). Its marks
+ *             are there already, fan_add adds them again all the same
+ *
+ * returns - the backend, NULL if out of memory (fd is closed)
+ */
+
+fan_st *fan_adopt(int fd)
+{
+  fan_st *f;
+
+  if (!(f = calloc(1, sizeof(fan_st)))) {
+    close(fd);
+    return (NULL);
+  }
+
+  f->rename = 1;
+  f->fd = fd;
+
+  if (!(f->cache = hash_map_init(4096, key_hash, key_cmp))) {
+    close(f->fd);
+    free(f);
+    return (NULL);
+  }
+
+  return (f);
+}
+
+
+void fan_free(fan_st *f)
+{
+  fan_mark_st *m;
+
+  if (!f) {
+    return;
+  }
+
+  while ((m = f->marks)) {
+    f->marks = m->next;
+    close(m->mount_fd);
+    free(m);
+  }
+
+  flush_cache(f);
+  hash_map_free(f->cache);
+  close(f->fd);
+  free(f);
+}
+
+
+static fan_mark_st *find_mark(fan_st *f, fsid_t *fsid)
+{
+  fan_mark_st *m;
+
+  for (m = f->marks; m; m = m->next) {
+    if (memcmp(&m->fsid, fsid, sizeof(fsid_t)) == 0) {
+      return (m);
+    }
+  }
+  return (NULL);
+}
+
+
+static int mark(fan_st *f, int fd)
+{
+  unsigned int flags = FAN_MARK_ADD | FAN_MARK_FILESYSTEM;
+
+#ifdef FAN_RENAME
+  if (f->rename) {
+    if (fanotify_mark(f->fd, flags, FAN_EVENTS | FAN_RENAME, fd, NULL) == 0) {
+      return (0);
+    }
+    if (errno != EINVAL) {
+      return (-1);
+    }
+    // FAN_RENAME came later than the rest, moves can not be paired
+    f->rename = 0;
+  }
+#endif
+
+  return (fanotify_mark(f->fd, flags, FAN_EVENTS | FAN_MOVES, fd, NULL));
+}
+
+
+/* fan_add - get events for the whole filesystem path is on
+ *
+ * returns - 0 on success, -1 on error (logged)
+ */
+
+int fan_add(fan_st *f, const char *path)
+{
+  struct statfs sfs;
+  fan_mark_st *m;
+  int fd;
+
+  if ((fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0 || fstatfs(fd, &sfs) < 0) {
+    log_msg(LOG_ERR, "%s: %s", path, strerror(errno));
+    if (fd >= 0) {
+      close(fd);
+    }
+    return (-1);
+  }
+
+  if (find_mark(f, &sfs.f_fsid)) {
+    // another job on the same filesystem
+    close(fd);
+    return (0);
+  }
+
+  if (mark(f, fd) < 0) {
+    log_msg(LOG_ERR, "fanotify_mark %s: %s", path, strerror(errno));
+    close(fd);
+    return (-1);
+  }
+
+  if (!(m = malloc(sizeof(fan_mark_st)))) {
+    close(fd);
+    return (-1);
+  }
+  m->fsid = sfs.f_fsid;
+  m->mount_fd = fd;
+  m->next = f->marks;
+  f->marks = m;
+
+  return (0);
+}
+
+
+/* resolve - the path of the directory an info record names, or NULL
+ *           if it is gone (or on a filesystem we did not mark)
+ */
+
+static const char *resolve(fan_st *f, struct fanotify_event_info_fid *fid)
+{
+  struct file_handle *h = (struct file_handle *)fid->handle;
+  size_t hlen = sizeof(struct file_handle) + h->handle_bytes;
+  char link[64];
+  char path[PATH_MAX];
+  fan_key_st *key;
+  fan_mark_st *m;
+  char *val;
+  ssize_t len;
+  int fd;
+
+  if (!(key = malloc(sizeof(fan_key_st) + sizeof(fid->fsid) + hlen))) {
+    return (NULL);
+  }
+  key->len = sizeof(fid->fsid) + hlen;
+  memcpy(key->data, &fid->fsid, sizeof(fid->fsid));
+  memcpy(key->data + sizeof(fid->fsid), h, hlen);
+
+  if ((val = hash_map_get(f->cache, key))) {
+    free(key);
+    return (val);
+  }
+
+  if (!(m = find_mark(f, (fsid_t *)&fid->fsid)) ||
+      (fd = open_by_handle_at(m->mount_fd, h, O_PATH | O_DIRECTORY)) < 0) {
+    free(key);
+    return (NULL);
+  }
+
+  snprintf(link, sizeof(link), "/proc/self/fd/%d", fd);
+  len = readlink(link, path, sizeof(path) - 1);
+  close(fd);
+  if (len <= 0 || len >= (ssize_t)sizeof(path) - 1) {
+    free(key);
+    return (NULL);
+  }
+  path[len] = '\0';
+
+  if (!(val = strdup(path)) || hash_map_put(f->cache, key, val) != 0) {
+    free(key);
+    free(val);
+    return (NULL);
+  }
+  return (val);
+}
+
+
+/* the name following the handle in an info record */
+static const char *fid_name(struct fanotify_event_info_fid *fid)
+{
+  struct file_handle *h = (struct file_handle *)fid->handle;
+
+  return ((const char *)h->f_handle + h->handle_bytes);
+}
+
+
+/* fan_read - read whatever events are waiting and pass them to fp
+ *
+ * returns - 0 on success, -1 on a read error
+ */
+
+int fan_read(fan_st *f, fan_event_fp fp, void *arg)
+{
+  char buf[64 * 1024] __attribute__((aligned(__alignof__(struct fanotify_event_metadata))));
+  struct fanotify_event_metadata *meta;
+  ssize_t len;
+
+  if ((len = read(f->fd, buf, sizeof(buf))) < 0) {
+    return (errno == EINTR || errno == EAGAIN ? 0 : -1);
+  }
+
+  for (meta = (struct fanotify_event_metadata *)buf; FAN_EVENT_OK(meta, len);
+       meta = FAN_EVENT_NEXT(meta, len)) {
+    struct fanotify_event_info_fid *dir = NULL, *from = NULL, *to = NULL;
+    const char *dir_path = NULL;
+    uint32_t is_dir = (meta->mask & FAN_ONDIR) ? IN_ISDIR : 0;
+    char *info = (char *)meta + meta->metadata_len;
+    size_t i;
+
+    if (meta->vers != FANOTIFY_METADATA_VERSION) {
+      log_msg(LOG_ERR, "fanotify: unexpected metadata version %d", meta->vers);
+      return (-1);
+    }
+
+    if (meta->mask & FAN_Q_OVERFLOW) {
+      fp(arg, NULL, NULL, IN_Q_OVERFLOW, 0);
+      continue;
+    }
+
+    while (info < (char *)meta + meta->event_len) {
+      struct fanotify_event_info_fid *fid = (struct fanotify_event_info_fid *)info;
+
+      switch (fid->hdr.info_type) {
+      case FAN_EVENT_INFO_TYPE_DFID_NAME:
+	dir = fid;
+	break;
+#ifdef FAN_RENAME
+      case FAN_EVENT_INFO_TYPE_OLD_DFID_NAME:
+	from = fid;
+	break;
+      case FAN_EVENT_INFO_TYPE_NEW_DFID_NAME:
+	to = fid;
+	break;
+#endif
+      }
+      if (!fid->hdr.len) {
+	break;
+      }
+      info += fid->hdr.len;
+    }
+
+#ifdef FAN_RENAME
+    if ((meta->mask & FAN_RENAME) && from && to) {
+      // cached paths stay put until the cache is emptied
+      const char *from_path = resolve(f, from);
+      const char *to_path = resolve(f, to);
+
+      // either end may be outside the jobs, the monitor sorts that out
+      if (!++f->cookie) {
+	++f->cookie;
+      }
+      if (from_path) {
+	fp(arg, from_path, fid_name(from), IN_MOVED_FROM | is_dir, f->cookie);
+      }
+      if (to_path) {
+	fp(arg, to_path, fid_name(to), IN_MOVED_TO | is_dir, f->cookie);
+      }
+    }
+#endif
+
+    if (dir && strcmp(fid_name(dir), ".") != 0 && (dir_path = resolve(f, dir))) {
+      for (i = 0; i < sizeof(fan_bits) / sizeof(fan_bits[0]); i++) {
+	if (meta->mask & fan_bits[i].fan) {
+	  fp(arg, dir_path, fid_name(dir), fan_bits[i].in | is_dir, 0);
+	}
+      }
+    }
+
+    // paths below a removed or moved directory are stale now
+    if (is_dir && (meta->mask & (FAN_DELETE | FAN_MOVED_FROM
+#ifdef FAN_RENAME
+				 | FAN_RENAME
+#endif
+				 ))) {
+      flush_cache(f);
+    }
+  }
+
+  return (0);
+}
+
+#else
+
+fan_st *fan_init(void)
+{
+  errno = ENOSYS;
+  return (NULL);
+}
+
+fan_st *fan_adopt(int fd)
+{
+  close(fd);
+  errno = ENOSYS;
+  return (NULL);
+}
+
+void fan_free(fan_st *f)
+{
+}
+
+int fan_add(fan_st *f, const char *path)
+{
+  return (-1);
+}
+
+int fan_read(fan_st *f, fan_event_fp fp, void *arg)
+{
+  return (-1);
+}
+
+#endif
@@ -0,0 +1,85 @@
+/*
+ * fan.h
+ *
+ * fanotify Event Backend Definitions
+ * 
+ *
+ * Copyright (C) 2013  Bryant Moscon - bmoscon@gmail.com
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to 
+ * deal in the Software without restriction, including without limitation the 
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, 
+ *    this list of conditions and the following disclaimer in the documentation 
+ *    and/or other materials provided with the distribution, and in the same 
+ *    place and form as other copyright, license and disclaimer information.
+ *
+ * 3. The end-user documentation included with the redistribution, if any, must 
+ *    include the following acknowledgment: "This product includes software 
+ *    developed by Bryant Moscon (http://www.bryantmoscon.org/)", in the same 
+ *    place and form as other third-party acknowledgments. Alternately, this 
+ *    acknowledgment may appear in the software itself, in the same form and 
+ *    location as other such third-party acknowledgments.
+ *
+ * 4. Except as contained in this notice, the name of the author, Bryant Moscon,
+ *    shall not be used in advertising or otherwise to promote the sale, use or 
+ *    other dealings in this Software without prior written authorization from 
+ *    the author.
+ *
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL 
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN 
+ * THE SOFTWARE.
+ *
+ */
+
+#ifndef __FAN__
+#define __FAN__
+
+#include <stdint.h>
+#include <sys/vfs.h>
+
+#include "hash_map.h"
+
+
+/* a filesystem with a mark on it */
+typedef struct fan_mark_st {
+  fsid_t fsid;
+  int mount_fd;        // any directory on it, for open_by_handle_at
+  struct fan_mark_st *next;
+} fan_mark_st;
+
+
+typedef struct fan_st {
+  int fd;
+  int rename;          // FAN_RENAME supported, moves come paired
+  uint32_t cookie;     // made up for paired moves
+  fan_mark_st *marks;
+  hash_map_st *cache;  // directory handle -> absolute path
+} fan_st;
+
+
+/* called for each event, with inotify IN_* mask bits */
+typedef void (*fan_event_fp)(void *arg, const char *dir, const char *name,
+			     uint32_t mask, uint32_t cookie);
+
+
+fan_st *fan_init(void);
+fan_st *fan_adopt(int fd);
+void fan_free(fan_st *f);
+int fan_add(fan_st *f, const char *path);
+int fan_read(fan_st *f, fan_event_fp fp, void *arg);
+
+
+#endif
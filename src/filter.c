@@ -0,0 +1,393 @@
+/*
+ * filter.c
+ *
+ * Include/exclude rules, compiled into a single trie of path components
+ * 
+ *
+ * Copyright (C) 2013  Bryant Moscon - bmoscon@gmail.com
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to 
+ * deal in the Software without restriction, including without limitation the 
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, 
+ *    this list of conditions and the following disclaimer in the documentation 
+ *    and/or other materials provided with the distribution, and in the same 
+ *    place and form as other copyright, license and disclaimer information.
+ *
+ * 3. The end-user documentation included with the redistribution, if any, must 
+ *    include the following acknowledgment: "This product includes software 
+ *    developed by Bryant Moscon (http://www.bryantmoscon.org/)", in the same 
+ *    place and form as other third-party acknowledgments. Alternately, this 
+ *    acknowledgment may appear in the software itself, in the same form and 
+ *    location as other such third-party acknowledgments.
+ *
+ * 4. Except as contained in this notice, the name of the author, Bryant Moscon,
+ *    shall not be used in advertising or otherwise to promote the sale, use or 
+ *    other dealings in this Software without prior written authorization from 
+ *    the author.
+ *
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL 
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN 
+ * THE SOFTWARE.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <fnmatch.h>
+#include <limits.h>
+
+#include "filter.h"
+
+
+/*
+ * Every rule is a glob such as "*.swp", ".git" or "build/tmp",
+ * split on '/' into components. All rules, include and exclude
+ * alike, are merged into one trie keyed by component, so matching a
+ * path is one walk down the trie, following every edge the current
+ * component matches (an NFA over path components), rather than one
+ * fnmatch per rule. Literal components are found with a binary
+ * search, only components with glob characters are matched with
+ * fnmatch. A rule without a '/' matches at any depth, as if its
+ * first component was "**".
+ *
+ * A rule that matches a directory matches everything below it too,
+ * so ".git" excludes ".git/objects/ab/cdef...".
+ */
+
+
+static filter_node_st *node_new(filter_st *f)
+{
+  filter_node_st *node;
+
+  node = calloc(1, sizeof(filter_node_st));
+  if (node) {
+    ++f->num_nodes;
+  }
+  return (node);
+}
+
+
+static void node_free(filter_node_st *node)
+{
+  int i;
+
+  if (!node) {
+    return;
+  }
+
+  for (i = 0; i < node->num_literal; ++i) {
+    free(node->literal[i].pattern);
+    node_free(node->literal[i].node);
+  }
+  for (i = 0; i < node->num_wild; ++i) {
+    free(node->wild[i].pattern);
+    node_free(node->wild[i].node);
+  }
+  node_free(node->star);
+  free(node->literal);
+  free(node->wild);
+  free(node);
+}
+
+
+void filter_free(filter_st *f)
+{
+  if (!f) {
+    return;
+  }
+
+  node_free(f->root);
+  free(f);
+}
+
+
+static filter_node_st *star_of(filter_st *f, filter_node_st *node)
+{
+  if (!node->star) {
+    if (!(node->star = node_new(f))) {
+      return (NULL);
+    }
+    node->star->globstar = 1;
+  }
+  return (node->star);
+}
+
+
+static filter_node_st *edge_to(filter_st *f, filter_edge_st **edges, int *num, const char *pattern)
+{
+  filter_edge_st *e;
+  int i;
+
+  for (i = 0; i < *num; ++i) {
+    if (strcmp((*edges)[i].pattern, pattern) == 0) {
+      return ((*edges)[i].node);
+    }
+  }
+
+  e = realloc(*edges, (*num + 1) * sizeof(filter_edge_st));
+  if (!e) {
+    return (NULL);
+  }
+  *edges = e;
+
+  e = &e[*num];
+  e->pattern = strdup(pattern);
+  e->node = node_new(f);
+  if (!e->pattern || !e->node) {
+    free(e->pattern);
+    free(e->node);
+    return (NULL);
+  }
+  ++*num;
+
+  return (e->node);
+}
+
+
+static int add_rule(filter_st *f, char *rule, int flag)
+{
+  filter_node_st *node = f->root;
+  size_t len = strlen(rule);
+  char *comp;
+  char *save;
+
+  while (len > 1 && rule[len - 1] == '/') {
+    rule[--len] = '\0';
+  }
+
+  if (!strchr(rule, '/')) {
+    // unanchored, matches at any depth
+    if (!(node = star_of(f, node))) {
+      return (-1);
+    }
+  }
+
+  for (comp = strtok_r(rule, "/", &save); comp; comp = strtok_r(NULL, "/", &save)) {
+    if (strcmp(comp, "**") == 0) {
+      node = star_of(f, node);
+    } else if (strpbrk(comp, "*?[")) {
+      node = edge_to(f, &node->wild, &node->num_wild, comp);
+    } else {
+      node = edge_to(f, &node->literal, &node->num_literal, comp);
+    }
+
+    if (!node) {
+      return (-1);
+    }
+  }
+
+  if (node == f->root) {
+    // "/" or an empty rule
+    return (0);
+  }
+
+  node->flags |= flag;
+  return (0);
+}
+
+
+static int edge_cmp(const void *a, const void *b)
+{
+  return (strcmp(((filter_edge_st *)a)->pattern, ((filter_edge_st *)b)->pattern));
+}
+
+
+static void node_sort(filter_node_st *node)
+{
+  int i;
+
+  qsort(node->literal, node->num_literal, sizeof(filter_edge_st), edge_cmp);
+
+  for (i = 0; i < node->num_literal; ++i) {
+    node_sort(node->literal[i].node);
+  }
+  for (i = 0; i < node->num_wild; ++i) {
+    node_sort(node->wild[i].node);
+  }
+  if (node->star) {
+    node_sort(node->star);
+  }
+}
+
+
+static int add_rules(filter_st *f, const char *list, int flag, int *count)
+{
+  char *copy;
+  char *rule;
+  char *save;
+  int ret = 0;
+
+  if (!list) {
+    return (0);
+  }
+
+  if (!(copy = strdup(list))) {
+    return (-1);
+  }
+
+  for (rule = strtok_r(copy, ",", &save); rule; rule = strtok_r(NULL, ",", &save)) {
+    if (add_rule(f, rule, flag) != 0) {
+      ret = -1;
+      break;
+    }
+    ++*count;
+  }
+
+  free(copy);
+  return (ret);
+}
+
+
+/* filter_compile - compile comma separated lists of include and
+ *                  exclude globs into one matcher
+ *
+ * include - IN - rules a file must match to be replicated, or NULL
+ * exclude - IN - rules that keep a file or directory out, or NULL
+ *
+ * returns - filter_st - compiled filter, to be freed with filter_free,
+ *                       or NULL when both lists are empty or on error
+ */
+
+filter_st *filter_compile(const char *include, const char *exclude)
+{
+  filter_st *f;
+
+  if (!include && !exclude) {
+    return (NULL);
+  }
+
+  f = calloc(1, sizeof(filter_st));
+  if (!f) {
+    return (NULL);
+  }
+
+  if (!(f->root = node_new(f)) ||
+      add_rules(f, include, FILTER_INCLUDE, &f->num_include) != 0 ||
+      add_rules(f, exclude, FILTER_EXCLUDE, &f->num_exclude) != 0) {
+    filter_free(f);
+    return (NULL);
+  }
+
+  node_sort(f->root);
+
+  return (f);
+}
+
+
+/* add a node, and the "**" nodes reachable from it without consuming
+ * a component, to the active set */
+static void activate(filter_node_st **set, int *n, filter_node_st *node)
+{
+  int i;
+
+  while (node) {
+    for (i = 0; i < *n; ++i) {
+      if (set[i] == node) {
+	return;
+      }
+    }
+    set[(*n)++] = node;
+    node = node->star;
+  }
+}
+
+
+/* filter_match - should path be replicated?
+ *
+ * f - IN - compiled filter, NULL matches everything
+ * path - IN - path relative to the job's source
+ * is_dir - IN - path is a directory. Directories are only checked
+ *               against exclude rules, include rules pick files
+ *
+ * returns - 1 if the path passes the filter, 0 if not
+ */
+
+int filter_match(filter_st *f, const char *path, int is_dir)
+{
+  char comp[NAME_MAX + 1];
+  const char *end;
+  int included = 0;
+  int n = 0;
+  int m;
+  int i, j;
+
+  if (!f) {
+    return (1);
+  }
+
+  {
+    filter_node_st *set[f->num_nodes];
+    filter_node_st *next[f->num_nodes];
+
+    activate(set, &n, f->root);
+
+    while (*path && n) {
+      size_t len;
+
+      end = strchr(path, '/');
+      len = end ? (size_t)(end - path) : strlen(path);
+      if (len > NAME_MAX) {
+	len = NAME_MAX;
+      }
+      memcpy(comp, path, len);
+      comp[len] = '\0';
+      path = end ? end + 1 : path + strlen(path);
+
+      if (!len) {
+	continue;
+      }
+
+      m = 0;
+      for (i = 0; i < n; ++i) {
+	filter_node_st *node = set[i];
+	filter_edge_st key = {comp, NULL};
+	filter_edge_st *e;
+
+	if (node->globstar) {
+	  activate(next, &m, node);
+	}
+
+	e = bsearch(&key, node->literal, node->num_literal, sizeof(filter_edge_st), edge_cmp);
+	if (e) {
+	  activate(next, &m, e->node);
+	}
+
+	for (j = 0; j < node->num_wild; ++j) {
+	  if (fnmatch(node->wild[j].pattern, comp, 0) == 0) {
+	    activate(next, &m, node->wild[j].node);
+	  }
+	}
+      }
+
+      for (i = 0; i < m; ++i) {
+	if (next[i]->flags & FILTER_EXCLUDE) {
+	  return (0);
+	}
+	if (next[i]->flags & FILTER_INCLUDE) {
+	  included = 1;
+	}
+	set[i] = next[i];
+      }
+      n = m;
+    }
+  }
+
+  if (is_dir || !f->num_include) {
+    return (1);
+  }
+
+  return (included);
+}
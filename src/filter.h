@@ -0,0 +1,86 @@
+/*
+ * filter.h
+ *
+ * Include/Exclude Filter Definitions
+ * 
+ *
+ * Copyright (C) 2013  Bryant Moscon - bmoscon@gmail.com
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to 
+ * deal in the Software without restriction, including without limitation the 
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, 
+ *    this list of conditions and the following disclaimer in the documentation 
+ *    and/or other materials provided with the distribution, and in the same 
+ *    place and form as other copyright, license and disclaimer information.
+ *
+ * 3. The end-user documentation included with the redistribution, if any, must 
+ *    include the following acknowledgment: "This product includes software 
+ *    developed by Bryant Moscon (http://www.bryantmoscon.org/)", in the same 
+ *    place and form as other third-party acknowledgments. Alternately, this 
+ *    acknowledgment may appear in the software itself, in the same form and 
+ *    location as other such third-party acknowledgments.
+ *
+ * 4. Except as contained in this notice, the name of the author, Bryant Moscon,
+ *    shall not be used in advertising or otherwise to promote the sale, use or 
+ *    other dealings in this Software without prior written authorization from 
+ *    the author.
+ *
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL 
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN 
+ * THE SOFTWARE.
+ *
+ */
+
+#ifndef __FILTER__
+#define __FILTER__
+
+
+typedef struct filter_edge_st {
+  char *pattern;
+  struct filter_node_st *node;
+} filter_edge_st;
+
+
+typedef struct filter_node_st {
+  int flags;                       // FILTER_INCLUDE / FILTER_EXCLUDE if a rule ends here
+  int globstar;                    // "**" - this node also matches any number of components
+
+  filter_edge_st *literal;         // sorted by pattern, searched with bsearch
+  int num_literal;
+  filter_edge_st *wild;            // components with glob characters, checked with fnmatch
+  int num_wild;
+  struct filter_node_st *star;     // a "**" component below this node
+} filter_node_st;
+
+
+typedef struct filter_st {
+  filter_node_st *root;
+  int num_nodes;
+  int num_include;
+  int num_exclude;
+} filter_st;
+
+
+#define FILTER_INCLUDE 1
+#define FILTER_EXCLUDE 2
+
+
+filter_st *filter_compile(const char *include, const char *exclude);
+void filter_free(filter_st *f);
+int filter_match(filter_st *f, const char *path, int is_dir);
+
+
+#endif
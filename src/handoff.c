@@ -0,0 +1,487 @@
+/*
+ * handoff.c
+ *
+ * Daemon Handoff
+ * 
+ *
+ * Copyright (C) 2013  Bryant Moscon - bmoscon@gmail.com
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to 
+ * deal in the Software without restriction, including without limitation the 
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, 
+ *    this list of conditions and the following disclaimer in the documentation 
+ *    and/or other materials provided with the distribution, and in the same 
+ *    place and form as other copyright, license and disclaimer information.
+ *
+ * 3. The end-user documentation included with the redistribution, if any, must 
+ *    include the following acknowledgment: "This product includes software 
+ *    developed by Bryant Moscon (http://www.bryantmoscon.org/)", in the same 
+ *    place and form as other third-party acknowledgments. Alternately, this 
+ *    acknowledgment may appear in the software itself, in the same form and 
+ *    location as other such third-party acknowledgments.
+ *
+ * 4. Except as contained in this notice, the name of the author, Bryant Moscon,
+ *    shall not be used in advertising or otherwise to promote the sale, use or 
+ *    other dealings in this Software without prior written authorization from 
+ *    the author.
+ *
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL 
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN 
+ * THE SOFTWARE.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "handoff.h"
+
+
+/*
+ * "backupd upgrade" replaces the running daemon with a freshly exec'd
+ * one without dropping its watches. The running daemon makes a unix
+ * socket pair and execs the binary it was started from as
+ *
+ *   backupd takeover <config file> 3 <foreground>
+ *
+ * with the other end as fd 3. Over it go, first, the event fd of each
+ * shard and the listening control socket, with SCM_RIGHTS, then a
+ * stream of records: the running jobs, the watch table of each shard,
+ * moves waiting for their other half, paused jobs and the ops not
+ * applied yet, up to HANDOFF_END. The new process reads it all, acks
+ * with a byte, and the old one exits. The kernel keeps queueing events
+ * on the fds meanwhile, the new process reads them from where the old
+ * one stopped.
+ */
+
+
+#define HANDOFF_ACK 'k'
+
+
+typedef struct handoff_hdr_st {
+  char magic[sizeof(HANDOFF_MAGIC) - 1];
+  uint32_t nshards;
+  uint32_t fanotify;
+  int32_t control;         // 1 if the control socket follows the shards' fds
+} handoff_hdr_st;
+
+
+/* handoff_spawn - start the new process, see above
+ *
+ * exe - IN - binary to exec
+ * cfg_file - IN - absolute path of the config file
+ * foreground - IN - it logs to stderr, not syslog
+ * pid - OUT - its pid
+ *
+ * returns - our end of the socket, -1 on error
+ */
+
+int handoff_spawn(const char *exe, const char *cfg_file, int foreground, pid_t *pid)
+{
+  char *argv[] = {"backupd", "takeover", (char *)cfg_file, "3", foreground ? "1" : "0", NULL};
+  long max = sysconf(_SC_OPEN_MAX);
+  int sv[2];
+  int fd;
+
+  if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0) {
+    return (-1);
+  }
+  if (max < 0 || max > 65536) {
+    max = 65536;
+  }
+
+  if ((*pid = fork()) < 0) {
+    close(sv[0]);
+    close(sv[1]);
+    return (-1);
+  }
+
+  if (!*pid) {
+    // only async-signal-safe calls until the exec, other threads may
+    // have held locks at the fork
+    if (sv[1] == 3 ? fcntl(3, F_SETFD, 0) < 0 : dup2(sv[1], 3) < 0) {
+      _exit(127);
+    }
+    for (fd = foreground ? 4 : 0; fd < max; fd++) {
+      if (fd != 3) {
+	close(fd);
+      }
+    }
+    execv(exe, argv);
+    _exit(127);
+  }
+
+  close(sv[1]);
+  return (sv[0]);
+}
+
+
+/* handoff_send_fds - pass the shards' event fds and the control socket
+ *                    (-1 for none), they stay open here too
+ *
+ * returns - 0 on success, -1 on error
+ */
+
+int handoff_send_fds(int sock, int nshards, int fanotify, const int *fds, int control_fd)
+{
+  int n = nshards + (control_fd >= 0);
+  handoff_hdr_st hdr;
+  struct msghdr msg;
+  struct cmsghdr *cmsg;
+  struct iovec iov;
+  char *buf;
+  int ret;
+
+  if (n > HANDOFF_FDS_MAX) {
+    errno = EMFILE;
+    return (-1);
+  }
+  if (!(buf = calloc(1, CMSG_SPACE(n * sizeof(int))))) {
+    return (-1);
+  }
+
+  memcpy(hdr.magic, HANDOFF_MAGIC, sizeof(hdr.magic));
+  hdr.nshards = nshards;
+  hdr.fanotify = fanotify;
+  hdr.control = (control_fd >= 0);
+
+  iov.iov_base = &hdr;
+  iov.iov_len = sizeof(hdr);
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = buf;
+  msg.msg_controllen = CMSG_SPACE(n * sizeof(int));
+
+  cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(n * sizeof(int));
+  memcpy(CMSG_DATA(cmsg), fds, nshards * sizeof(int));
+  if (control_fd >= 0) {
+    memcpy(CMSG_DATA(cmsg) + nshards * sizeof(int), &control_fd, sizeof(int));
+  }
+
+  ret = (sendmsg(sock, &msg, MSG_NOSIGNAL) == sizeof(hdr)) ? 0 : -1;
+  free(buf);
+  return (ret);
+}
+
+
+/* handoff_write - write a record with two strings (b may be NULL) */
+int handoff_write(FILE *fp, handoff_type type, int shard, uint32_t arg, uint32_t arg2,
+		  int is_dir, const char *a, const char *b)
+{
+  size_t alen = strlen(a) + 1;
+  size_t blen = b ? strlen(b) + 1 : 1;
+  handoff_rec_st rec;
+
+  if (alen + blen > HANDOFF_REC_MAX) {
+    errno = ENAMETOOLONG;
+    return (-1);
+  }
+
+  memset(&rec, 0, sizeof(rec));
+  rec.type = type;
+  rec.is_dir = is_dir;
+  rec.shard = shard;
+  rec.arg = arg;
+  rec.arg2 = arg2;
+  rec.len = alen + blen;
+
+  if (fwrite(&rec, sizeof(rec), 1, fp) != 1 || fwrite(a, alen, 1, fp) != 1 ||
+      fwrite(b ? b : "", blen, 1, fp) != 1) {
+    return (-1);
+  }
+  return (0);
+}
+
+
+/* handoff_write_op - write an op_encode'd op */
+int handoff_write_op(FILE *fp, int shard, const char *buf, size_t len)
+{
+  handoff_rec_st rec;
+
+  memset(&rec, 0, sizeof(rec));
+  rec.type = HANDOFF_OP;
+  rec.shard = shard;
+  rec.len = len;
+
+  if (len > HANDOFF_REC_MAX || fwrite(&rec, sizeof(rec), 1, fp) != 1 ||
+      fwrite(buf, len, 1, fp) != 1) {
+    return (-1);
+  }
+  return (0);
+}
+
+
+/* handoff_wait - wait for the new process to say it has everything
+ *
+ * returns - 0 once it has, -1 if it went away or took too long
+ */
+
+int handoff_wait(int sock)
+{
+  struct pollfd pfd = {sock, POLLIN, 0};
+  char c;
+  int ret;
+
+  while ((ret = poll(&pfd, 1, HANDOFF_TIMEOUT * 1000)) < 0 && errno == EINTR);
+  if (ret == 0) {
+    errno = ETIMEDOUT;
+    return (-1);
+  }
+  if (ret < 0 || read(sock, &c, 1) != 1 || c != HANDOFF_ACK) {
+    if (ret > 0) {
+      errno = EPIPE;
+    }
+    return (-1);
+  }
+  return (0);
+}
+
+
+/* read exactly len bytes */
+static int read_all(int fd, void *buf, size_t len)
+{
+  ssize_t n;
+
+  while (len) {
+    if ((n = read(fd, buf, len)) < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      if (!n) {
+	errno = EPIPE;
+      }
+      return (-1);
+    }
+    buf = (char *)buf + n;
+    len -= n;
+  }
+  return (0);
+}
+
+
+/* take the fds (and the start of the header) off the socket */
+static int receive_fds(handoff_st *h, handoff_hdr_st *hdr)
+{
+  char buf[CMSG_SPACE(HANDOFF_FDS_MAX * sizeof(int))];
+  struct cmsghdr *cmsg;
+  struct msghdr msg;
+  struct iovec iov;
+  ssize_t len;
+  int *fds = NULL;
+  int n = 0;
+  int i;
+
+  iov.iov_base = hdr;
+  iov.iov_len = sizeof(*hdr);
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = buf;
+  msg.msg_controllen = sizeof(buf);
+
+  while ((len = recvmsg(h->sock, &msg, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR);
+  if (len <= 0) {
+    if (!len) {
+      errno = EPIPE;
+    }
+    return (-1);
+  }
+
+  for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+      fds = (int *)CMSG_DATA(cmsg);
+      n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+      break;
+    }
+  }
+
+  // the rest of the header, if it came apart
+  if ((size_t)len < sizeof(*hdr) &&
+      read_all(h->sock, (char *)hdr + len, sizeof(*hdr) - len) < 0) {
+    goto fail;
+  }
+  if (memcmp(hdr->magic, HANDOFF_MAGIC, sizeof(hdr->magic)) != 0 ||
+      n != (int)(hdr->nshards + (hdr->control != 0)) || (msg.msg_flags & MSG_CTRUNC)) {
+    errno = EPROTO;
+    goto fail;
+  }
+
+  if (!(h->fds = malloc(hdr->nshards * sizeof(int)))) {
+    goto fail;
+  }
+  h->nshards = hdr->nshards;
+  h->fanotify = hdr->fanotify;
+  memcpy(h->fds, fds, h->nshards * sizeof(int));
+  h->control_fd = hdr->control ? fds[h->nshards] : -1;
+  return (0);
+
+ fail:
+  for (i = 0; i < n; i++) {
+    close(fds[i]);
+  }
+  return (-1);
+}
+
+
+/* handoff_receive - take everything the old process hands over, up to
+ *                   HANDOFF_END
+ *
+ * sock - IN - our end of the socket, taken over
+ *
+ * returns - what was handed over, NULL on error (errno set)
+ */
+
+handoff_st *handoff_receive(int sock)
+{
+  handoff_hdr_st hdr;
+  handoff_rec_st rec;
+  handoff_st *h;
+  size_t cap = 0;
+  char *data;
+  FILE *fp = NULL;
+  int fd;
+
+  if (!(h = calloc(1, sizeof(handoff_st)))) {
+    close(sock);
+    return (NULL);
+  }
+  h->sock = sock;
+  h->control_fd = -1;
+
+  if (receive_fds(h, &hdr) < 0 || (fd = dup(sock)) < 0) {
+    goto fail;
+  }
+  if (!(fp = fdopen(fd, "r"))) {
+    close(fd);
+    goto fail;
+  }
+
+  do {
+    if (fread(&rec, sizeof(rec), 1, fp) != 1 || rec.len > HANDOFF_REC_MAX ||
+	rec.type < HANDOFF_JOB || rec.type > HANDOFF_END || rec.shard >= h->nshards) {
+      errno = EPROTO;
+      goto fail;
+    }
+    if (h->len + sizeof(rec) + rec.len > cap) {
+      cap = cap ? cap * 2 : 65536;
+      while (h->len + sizeof(rec) + rec.len > cap) {
+	cap *= 2;
+      }
+      if (!(data = realloc(h->data, cap))) {
+	goto fail;
+      }
+      h->data = data;
+    }
+    memcpy(h->data + h->len, &rec, sizeof(rec));
+    if (rec.len && fread(h->data + h->len + sizeof(rec), rec.len, 1, fp) != 1) {
+      errno = EPROTO;
+      goto fail;
+    }
+    // strings: two, each NUL terminated
+    if (rec.type != HANDOFF_OP && rec.type != HANDOFF_END &&
+	(rec.len < 2 || h->data[h->len + sizeof(rec) + rec.len - 1] != '\0' ||
+	 !memchr(h->data + h->len + sizeof(rec), '\0', rec.len - 1))) {
+      errno = EPROTO;
+      goto fail;
+    }
+    h->len += sizeof(rec) + rec.len;
+  } while (rec.type != HANDOFF_END);
+
+  fclose(fp);
+  return (h);
+
+ fail:
+  if (fp) {
+    fclose(fp);
+  }
+  handoff_free(h);
+  return (NULL);
+}
+
+
+/* handoff_ack - tell the old process it can go */
+int handoff_ack(handoff_st *h)
+{
+  char c = HANDOFF_ACK;
+
+  return (send(h->sock, &c, 1, MSG_NOSIGNAL) == 1 ? 0 : -1);
+}
+
+
+/* handoff_next - the record at *pos, moving past it
+ *
+ * rec - OUT - the record
+ * a, b - OUT - its strings, or for HANDOFF_OP the op in a (rec->len
+ *              bytes) and b NULL
+ *
+ * returns - 1 for a record, 0 at HANDOFF_END
+ */
+
+int handoff_next(handoff_st *h, size_t *pos, handoff_rec_st *rec, const char **a,
+		 const char **b)
+{
+  if (*pos + sizeof(*rec) > h->len) {
+    return (0);
+  }
+  memcpy(rec, h->data + *pos, sizeof(*rec));
+  *a = h->data + *pos + sizeof(*rec);
+  *b = (rec->type == HANDOFF_OP) ? NULL : *a + strlen(*a) + 1;
+  *pos += sizeof(*rec) + rec->len;
+
+  return (rec->type != HANDOFF_END);
+}
+
+
+/* handoff_take_fd - the event fd of a shard, it is the caller's now */
+int handoff_take_fd(handoff_st *h, int shard)
+{
+  int fd = h->fds[shard];
+
+  h->fds[shard] = -1;
+  return (fd);
+}
+
+
+/* handoff_free - what was not taken is closed */
+void handoff_free(handoff_st *h)
+{
+  int i;
+
+  if (!h) {
+    return;
+  }
+  for (i = 0; h->fds && i < h->nshards; i++) {
+    if (h->fds[i] >= 0) {
+      close(h->fds[i]);
+    }
+  }
+  if (h->control_fd >= 0) {
+    close(h->control_fd);
+  }
+  close(h->sock);
+  free(h->fds);
+  free(h->data);
+  free(h);
+}
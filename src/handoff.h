@@ -0,0 +1,109 @@
+/*
+ * handoff.h
+ *
+ * Daemon Handoff Definitions
+ * 
+ *
+ * Copyright (C) 2013  Bryant Moscon - bmoscon@gmail.com
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to 
+ * deal in the Software without restriction, including without limitation the 
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, 
+ *    this list of conditions and the following disclaimer in the documentation 
+ *    and/or other materials provided with the distribution, and in the same 
+ *    place and form as other copyright, license and disclaimer information.
+ *
+ * 3. The end-user documentation included with the redistribution, if any, must 
+ *    include the following acknowledgment: "This product includes software 
+ *    developed by Bryant Moscon (http://www.bryantmoscon.org/)", in the same 
+ *    place and form as other third-party acknowledgments. Alternately, this 
+ *    acknowledgment may appear in the software itself, in the same form and 
+ *    location as other such third-party acknowledgments.
+ *
+ * 4. Except as contained in this notice, the name of the author, Bryant Moscon,
+ *    shall not be used in advertising or otherwise to promote the sale, use or 
+ *    other dealings in this Software without prior written authorization from 
+ *    the author.
+ *
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL 
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN 
+ * THE SOFTWARE.
+ *
+ */
+
+#ifndef __HANDOFF__
+#define __HANDOFF__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+
+#define HANDOFF_MAGIC   "BKDHND1\n"
+#define HANDOFF_TIMEOUT 30          // seconds the new process has to take it all
+#define HANDOFF_FDS_MAX 253         // SCM_MAX_FD, shards and the control socket
+#define HANDOFF_REC_MAX (1 << 20)
+
+
+typedef enum handoff_type {
+  HANDOFF_JOB = 1,     // a running job: name, source
+  HANDOFF_WATCH,       // arg is a wd of the shard's fd: job, path
+  HANDOFF_MOVE,        // an IN_MOVED_FROM, arg its cookie, arg2 ms left: job, path
+  HANDOFF_PAUSED,      // job
+  HANDOFF_OP,          // an op not applied yet, op_encode'd
+  HANDOFF_END
+} handoff_type;
+
+
+/* a record, followed by len bytes: two NUL terminated strings, or an op */
+typedef struct handoff_rec_st {
+  uint8_t type;
+  uint8_t is_dir;
+  uint16_t shard;
+  uint32_t arg;
+  uint32_t arg2;
+  uint32_t len;
+} handoff_rec_st;
+
+
+/* what a new process was handed */
+typedef struct handoff_st {
+  int sock;
+  int nshards;
+  int fanotify;
+  int *fds;                // event fd of each shard, -1 once taken
+  int control_fd;          // listening control socket, -1 for none
+  char *data;              // the records, up to HANDOFF_END
+  size_t len;
+} handoff_st;
+
+
+int handoff_spawn(const char *exe, const char *cfg_file, int foreground, pid_t *pid);
+int handoff_send_fds(int sock, int nshards, int fanotify, const int *fds, int control_fd);
+int handoff_write(FILE *fp, handoff_type type, int shard, uint32_t arg, uint32_t arg2,
+		  int is_dir, const char *a, const char *b);
+int handoff_write_op(FILE *fp, int shard, const char *buf, size_t len);
+int handoff_wait(int sock);
+
+handoff_st *handoff_receive(int sock);
+int handoff_ack(handoff_st *h);
+int handoff_next(handoff_st *h, size_t *pos, handoff_rec_st *rec, const char **a,
+		 const char **b);
+int handoff_take_fd(handoff_st *h, int shard);
+void handoff_free(handoff_st *h);
+
+
+#endif
@@ -0,0 +1,260 @@
+/*
+ * hash_map.c
+ *
+ * Hash Map Implementation
+ * 
+ *
+ * Copyright (C) 2013  Bryant Moscon - bmoscon@gmail.com
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to 
+ * deal in the Software without restriction, including without limitation the 
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, 
+ *    this list of conditions and the following disclaimer in the documentation 
+ *    and/or other materials provided with the distribution, and in the same 
+ *    place and form as other copyright, license and disclaimer information.
+ *
+ * 3. The end-user documentation included with the redistribution, if any, must 
+ *    include the following acknowledgment: "This product includes software 
+ *    developed by Bryant Moscon (http://www.bryantmoscon.org/)", in the same 
+ *    place and form as other third-party acknowledgments. Alternately, this 
+ *    acknowledgment may appear in the software itself, in the same form and 
+ *    location as other such third-party acknowledgments.
+ *
+ * 4. Except as contained in this notice, the name of the author, Bryant Moscon,
+ *    shall not be used in advertising or otherwise to promote the sale, use or 
+ *    other dealings in this Software without prior written authorization from 
+ *    the author.
+ *
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL 
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN 
+ * THE SOFTWARE.
+ *
+ */
+
+#include <assert.h>
+#include <string.h>
+
+#include "hash_map.h"
+
+
+/* grow the bucket array once the average chain is longer than this */
+#define MAX_LOAD 2
+
+
+hash_map_st* hash_map_init(size_t size, uint32_t (*hash_fp)(void *), int (*cmp_fp)(void *, void *))
+{
+  hash_map_st *ret = NULL;
+
+  assert(size > 0);
+
+  ret = (hash_map_st *)malloc(sizeof(hash_map_st));
+  if (!ret) {
+    return (NULL);
+  }
+
+  ret->entries = 0;
+  ret->len = size;
+  ret->hash_fp = hash_fp;
+  ret->cmp_fp = cmp_fp;
+  ret->array = calloc(size, sizeof(map_entry_st *));
+  if (!ret->array) {
+    free(ret);
+    return (NULL);
+  }
+
+  return (ret);
+}
+
+
+void hash_map_free(hash_map_st *map)
+{
+  map_entry_st *e;
+  size_t i;
+
+  if (!map) {
+    return;
+  }
+
+  for (i = 0; i < map->len; ++i) {
+    while ((e = map->array[i])) {
+      map->array[i] = e->next;
+      free(e);
+    }
+  }
+  free(map->array);
+  free(map);
+}
+
+
+static void hash_map_grow(hash_map_st *map)
+{
+  map_entry_st **array;
+  map_entry_st *e;
+  size_t len = map->len * 2;
+  size_t i;
+
+  array = calloc(len, sizeof(map_entry_st *));
+  if (!array) {
+    // keep the old array, chains just get longer
+    return;
+  }
+
+  for (i = 0; i < map->len; ++i) {
+    while ((e = map->array[i])) {
+      map->array[i] = e->next;
+      e->next = array[e->hash % len];
+      array[e->hash % len] = e;
+    }
+  }
+
+  free(map->array);
+  map->array = array;
+  map->len = len;
+}
+
+
+void *hash_map_get(hash_map_st *map, void *key)
+{
+  uint32_t hash;
+  map_entry_st *e;
+
+  hash = map->hash_fp(key);
+
+  for (e = map->array[hash % map->len]; e; e = e->next) {
+    if (e->hash == hash && map->cmp_fp(e->key, key) == 0) {
+      return (e->val);
+    }
+  }
+
+  return (NULL);
+}
+
+
+/* hash_map_put - insert or replace the value stored under key.
+ *                the map does not copy or own the key, it must
+ *                stay valid for as long as the entry exists
+ *
+ * returns - 0 on success, -1 on allocation failure
+ */
+
+int hash_map_put(hash_map_st *map, void *key, void *val)
+{
+  uint32_t hash;
+  map_entry_st *e;
+
+  hash = map->hash_fp(key);
+
+  for (e = map->array[hash % map->len]; e; e = e->next) {
+    if (e->hash == hash && map->cmp_fp(e->key, key) == 0) {
+      e->key = key;
+      e->val = val;
+      return (0);
+    }
+  }
+
+  if (map->entries >= map->len * MAX_LOAD) {
+    hash_map_grow(map);
+  }
+
+  e = malloc(sizeof(map_entry_st));
+  if (!e) {
+    return (-1);
+  }
+
+  e->hash = hash;
+  e->key = key;
+  e->val = val;
+  e->next = map->array[hash % map->len];
+  map->array[hash % map->len] = e;
+  ++map->entries;
+
+  return (0);
+}
+
+
+void *hash_map_remove(hash_map_st *map, void *key)
+{
+  uint32_t hash;
+  map_entry_st **prev;
+  map_entry_st *e;
+  void *val;
+
+  hash = map->hash_fp(key);
+
+  for (prev = &map->array[hash % map->len]; (e = *prev); prev = &e->next) {
+    if (e->hash == hash && map->cmp_fp(e->key, key) == 0) {
+      *prev = e->next;
+      val = e->val;
+      free(e);
+      --map->entries;
+      return (val);
+    }
+  }
+
+  return (NULL);
+}
+
+
+/* hash_map_foreach - call fp on every entry. fp may remove the
+ *                    entry it was handed, but no other
+ */
+
+void hash_map_foreach(hash_map_st *map, void (*fp)(void *key, void *val, void *arg), void *arg)
+{
+  map_entry_st *e, *next;
+  size_t i;
+
+  for (i = 0; i < map->len; ++i) {
+    for (e = map->array[i]; e; e = next) {
+      next = e->next;
+      fp(e->key, e->val, arg);
+    }
+  }
+}
+
+
+/* FNV-1a */
+uint32_t hash_map_str_hash(void *key)
+{
+  unsigned char *s = (unsigned char *)key;
+  uint32_t h = 2166136261u;
+
+  while (*s) {
+    h ^= *s++;
+    h *= 16777619u;
+  }
+  return (h);
+}
+
+int hash_map_str_cmp(void *a, void *b)
+{
+  return (strcmp((char *)a, (char *)b));
+}
+
+uint32_t hash_map_int_hash(void *key)
+{
+  uint64_t k = (uint64_t)(uintptr_t)key;
+
+  k ^= k >> 33;
+  k *= 0xff51afd7ed558ccdULL;
+  k ^= k >> 33;
+  return ((uint32_t)k);
+}
+
+int hash_map_int_cmp(void *a, void *b)
+{
+  return (a != b);
+}
@@ -0,0 +1,86 @@
+/*
+ * hash_map.h
+ *
+ * Hash Map Definitions
+ * 
+ *
+ * Copyright (C) 2013  Bryant Moscon - bmoscon@gmail.com
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to 
+ * deal in the Software without restriction, including without limitation the 
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, 
+ *    this list of conditions and the following disclaimer in the documentation 
+ *    and/or other materials provided with the distribution, and in the same 
+ *    place and form as other copyright, license and disclaimer information.
+ *
+ * 3. The end-user documentation included with the redistribution, if any, must 
+ *    include the following acknowledgment: "This product includes software 
+ *    developed by Bryant Moscon (http://www.bryantmoscon.org/)", in the same 
+ *    place and form as other third-party acknowledgments. Alternately, this 
+ *    acknowledgment may appear in the software itself, in the same form and 
+ *    location as other such third-party acknowledgments.
+ *
+ * 4. Except as contained in this notice, the name of the author, Bryant Moscon,
+ *    shall not be used in advertising or otherwise to promote the sale, use or 
+ *    other dealings in this Software without prior written authorization from 
+ *    the author.
+ *
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL 
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN 
+ * THE SOFTWARE.
+ *
+ */
+
+#ifndef __HASH_MAP__
+#define __HASH_MAP__
+
+#include <stdint.h>
+#include <stdlib.h>
+
+
+typedef struct map_entry_st {
+  uint32_t hash;
+  void *key;
+  void *val;
+  struct map_entry_st *next;
+} map_entry_st;
+
+
+typedef struct hash_map_st {
+  size_t entries;
+  size_t len;
+  uint32_t (*hash_fp)(void *);
+  int (*cmp_fp)(void *, void *);
+  map_entry_st **array;
+} hash_map_st;
+
+
+hash_map_st* hash_map_init(size_t size, uint32_t (*hash_fp)(void *), int (*cmp_fp)(void *, void *));
+void hash_map_free(hash_map_st *map);
+void *hash_map_get(hash_map_st *map, void *key);
+int hash_map_put(hash_map_st *map, void *key, void *val);
+void *hash_map_remove(hash_map_st *map, void *key);
+void hash_map_foreach(hash_map_st *map, void (*fp)(void *key, void *val, void *arg), void *arg);
+
+// helpers for the common key types
+uint32_t hash_map_str_hash(void *key);
+int hash_map_str_cmp(void *a, void *b);
+uint32_t hash_map_int_hash(void *key);
+int hash_map_int_cmp(void *a, void *b);
+
+
+
+#endif
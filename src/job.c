@@ -0,0 +1,474 @@
+/*
+ * job.c
+ *
+ * Replication jobs, loaded from the INI file
+ * 
+ *
+ * Copyright (C) 2013  Bryant Moscon - bmoscon@gmail.com
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to 
+ * deal in the Software without restriction, including without limitation the 
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, 
+ *    this list of conditions and the following disclaimer in the documentation 
+ *    and/or other materials provided with the distribution, and in the same 
+ *    place and form as other copyright, license and disclaimer information.
+ *
+ * 3. The end-user documentation included with the redistribution, if any, must 
+ *    include the following acknowledgment: "This product includes software 
+ *    developed by Bryant Moscon (http://www.bryantmoscon.org/)", in the same 
+ *    place and form as other third-party acknowledgments. Alternately, this 
+ *    acknowledgment may appear in the software itself, in the same form and 
+ *    location as other such third-party acknowledgments.
+ *
+ * 4. Except as contained in this notice, the name of the author, Bryant Moscon,
+ *    shall not be used in advertising or otherwise to promote the sale, use or 
+ *    other dealings in this Software without prior written authorization from 
+ *    the author.
+ *
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL 
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN 
+ * THE SOFTWARE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "job.h"
+#include "tail.h"
+#include "remote.h"
+#include "pack.h"
+#include "hash_map.h"
+#include "log.h"
+
+
+#define JOB_PREFIX "JOB "
+#define DEFAULT_JOB "default"
+
+
+static char *strip_slash(char *path)
+{
+  size_t len = strlen(path);
+
+  while (len > 1 && path[len - 1] == '/') {
+    path[--len] = '\0';
+  }
+  return (path);
+}
+
+
+static job_st *job_new(ini_data_st *cfg, char *sec, const char *name,
+		       const char *src, const char *dst)
+{
+  job_st *job;
+  char *include;
+  char *exclude;
+  char *priority;
+  char *tail;
+  char *snap;
+  char *shard;
+  char *pack;
+  char *end;
+
+  job = calloc(1, sizeof(job_st));
+  if (!job) {
+    return (NULL);
+  }
+
+  job->refs = 1;
+  job->name = strdup(name);
+  job->src = strdup(src);
+  job->dst = strdup(dst);
+  if (!job->name || !job->src || !job->dst) {
+    job_free(job);
+    return (NULL);
+  }
+
+  strip_slash(job->src);
+  strip_slash(job->dst);
+
+  if (remote_is_url(job->dst) && !(job->remote = remote_new(job))) {
+    job_free(job);
+    return (NULL);
+  }
+
+  include = ini_get_data(cfg, sec, "INCLUDE");
+  exclude = ini_get_data(cfg, sec, "EXCLUDE");
+  if ((include && !(job->include = strdup(include))) ||
+      (exclude && !(job->exclude = strdup(exclude)))) {
+    job_free(job);
+    return (NULL);
+  }
+
+  if (include || exclude) {
+    if (!(job->filter = filter_compile(include, exclude))) {
+      job_free(job);
+      return (NULL);
+    }
+  }
+
+  // tailed files only need the include side of a filter
+  if ((tail = ini_get_data(cfg, sec, "TAIL"))) {
+    if (!(job->tail = strdup(tail)) ||
+	!(job->tail_filter = filter_compile(tail, NULL)) ||
+	!(job->tails = tail_init())) {
+      job_free(job);
+      return (NULL);
+    }
+  }
+
+  job->priority = DEFAULT_PRIORITY;
+  if ((priority = ini_get_data(cfg, sec, "PRIORITY"))) {
+    job->priority = atoi(priority);
+    if (job->priority < 1 || job->priority > MAX_PRIORITY) {
+      log_msg(LOG_WARNING, "job %s: PRIORITY must be 1 to %d", name, MAX_PRIORITY);
+      job->priority = DEFAULT_PRIORITY;
+    }
+  }
+
+  if ((snap = ini_get_data(cfg, sec, "SNAPSHOT"))) {
+    if (strcasecmp(snap, "hourly") == 0) {
+      job->snap_every = 3600;
+    } else if (strcasecmp(snap, "daily") == 0) {
+      job->snap_every = 86400;
+    } else {
+      log_msg(LOG_WARNING, "job %s: SNAPSHOT must be hourly or daily", name);
+    }
+  }
+
+  // placed by config_load, once the number of shards is known
+  job->shard = -1;
+  if ((shard = ini_get_data(cfg, sec, "SHARD"))) {
+    job->shard = atoi(shard);
+    if (job->shard < 0) {
+      log_msg(LOG_WARNING, "job %s: SHARD must be at least 0", name);
+      job->shard = -1;
+    }
+  }
+
+  job->snap_keep = DEFAULT_SNAPSHOT_KEEP;
+  if ((snap = ini_get_data(cfg, sec, "SNAPSHOT_KEEP"))) {
+    job->snap_keep = atoi(snap);
+    if (job->snap_keep < 1) {
+      log_msg(LOG_WARNING, "job %s: SNAPSHOT_KEEP must be at least 1", name);
+      job->snap_keep = DEFAULT_SNAPSHOT_KEEP;
+    }
+  }
+
+  if ((pack = ini_get_data(cfg, sec, "PACK"))) {
+    job->pack_size = strtol(pack, &end, 10);
+    if (*end == 'K' || *end == 'k') {
+      job->pack_size *= 1024;
+      end++;
+    }
+    if (end == pack || *end || job->pack_size < 1 || job->pack_size > PACK_MAX) {
+      log_msg(LOG_WARNING, "job %s: PACK must be a size of 1 to %dK", name, PACK_MAX / 1024);
+      job->pack_size = 0;
+    }
+  }
+
+  // all work on the destination tree in place
+  if (job->remote && (job->tail || job->snap_every || job->pack_size)) {
+    log_msg(LOG_WARNING, "job %s: TAIL, SNAPSHOT and PACK are not supported on a remote "
+	    "DESTINATION", name);
+    tail_free(job->tails);
+    job->tails = NULL;
+    job->snap_every = 0;
+    job->pack_size = 0;
+  }
+
+  // a snapshot links files, packed ones would be left out
+  if (job->pack_size && job->snap_every) {
+    log_msg(LOG_WARNING, "job %s: PACK and SNAPSHOT do not go together, files are not "
+	    "packed", name);
+    job->pack_size = 0;
+  }
+
+  return (job);
+}
+
+
+void job_free(job_st *job)
+{
+  if (!job) {
+    return;
+  }
+
+  remote_free(job->remote);
+  free(job->name);
+  free(job->src);
+  free(job->dst);
+  free(job->include);
+  free(job->exclude);
+  filter_free(job->filter);
+  free(job->tail);
+  filter_free(job->tail_filter);
+  tail_free(job->tails);
+  pack_close(job->pack);
+  free(job);
+}
+
+
+void job_free_list(job_st *list)
+{
+  job_st *next;
+
+  while (list) {
+    next = list->next;
+    job_release(list);
+    list = next;
+  }
+}
+
+
+void job_hold(job_st *job)
+{
+  __atomic_add_fetch(&job->refs, 1, __ATOMIC_RELAXED);
+}
+
+
+void job_release(job_st *job)
+{
+  if (__atomic_sub_fetch(&job->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+    job_free(job);
+  }
+}
+
+
+/* tell background work still holding the job to give up */
+void job_set_stopped(job_st *job)
+{
+  __atomic_store_n(&job->stopped, 1, __ATOMIC_RELEASE);
+}
+
+
+int job_is_stopped(job_st *job)
+{
+  return (__atomic_load_n(&job->stopped, __ATOMIC_ACQUIRE));
+}
+
+
+job_st *job_find(job_st *list, const char *name)
+{
+  while (list && strcmp(list->name, name) != 0) {
+    list = list->next;
+  }
+  return (list);
+}
+
+
+/* job_place - put every job of list on one of shards shards: the one
+ *             its SHARD names, or else one picked by its name, so it
+ *             stays put across reloads
+ */
+
+void job_place(job_st *list, int shards)
+{
+  job_st *job;
+
+  for (job = list; job; job = job->next) {
+    if (job->shard < 0) {
+      job->shard = hash_map_str_hash(job->name) % shards;
+    } else if (job->shard >= shards) {
+      log_msg(LOG_WARNING, "job %s: no shard %d, using shard %d", job->name, job->shard,
+	      job->shard % shards);
+      job->shard %= shards;
+    }
+  }
+}
+
+
+static int same_str(const char *a, const char *b)
+{
+  if (!a || !b) {
+    return (a == b);
+  }
+  return (strcmp(a, b) == 0);
+}
+
+
+/* job_same_tree - do two jobs replicate the same files from the same
+ *                 source to the same destination, the same way? If
+ *                 so, a running job can keep its watches across a
+ *                 config reload. A job that moves to another shard
+ *                 is restarted there
+ */
+
+int job_same_tree(job_st *a, job_st *b)
+{
+  return (strcmp(a->src, b->src) == 0 && strcmp(a->dst, b->dst) == 0 &&
+	  a->shard == b->shard && a->pack_size == b->pack_size &&
+	  same_str(a->include, b->include) && same_str(a->exclude, b->exclude) &&
+	  same_str(a->tail, b->tail));
+}
+
+
+/* job_retune - take over the settings of cfg (the same job, freshly
+ *              loaded) that can change while the job keeps running
+ */
+
+void job_retune(job_st *job, job_st *cfg)
+{
+  job->priority = cfg->priority;
+
+  if (job->snap_every != cfg->snap_every) {
+    job->snap_every = cfg->snap_every;
+    job->snap_next = 0;
+  }
+  job->snap_keep = cfg->snap_keep;
+}
+
+
+/* job_load - build the list of jobs described by a parsed INI file
+ *
+ * cfg - IN - parsed config
+ *
+ * returns - job_st - head of a malloc'd list of jobs, to be freed
+ *                    with job_free_list, or NULL on error
+ *
+ *
+ * Every [JOB <name>] section is one job, with SOURCE and
+ * DESTINATION properties. The original [SOURCE DIR] and
+ * [DESTINATION DIR] sections are still honored and become
+ * the job named "default".
+ *
+ * INCLUDE and EXCLUDE are optional, comma separated lists of globs
+ * (see filter.c). When INCLUDE is given only matching files are
+ * replicated, anything matching EXCLUDE never is.
+ *
+ * TAIL is a list of globs, like INCLUDE, for files that are only ever
+ * appended to (logs). Changes to those copy only the new bytes, see
+ * tail.c.
+ *
+ * PRIORITY (1 to 10, default 5) weighs the job's copies against
+ * those of other jobs, higher goes first.
+ *
+ * SNAPSHOT (hourly or daily) takes hard link snapshots of the
+ * destination, of which the newest SNAPSHOT_KEEP (default 24) are
+ * kept, see snapshot.c.
+ *
+ * A DESTINATION of tcp://host:port replicates to "backupd receive"
+ * on that host, into a directory named after the job, see remote.c.
+ * TAIL, SNAPSHOT and PACK do not apply to those.
+ *
+ * PACK (a size, up to 1024K) packs files up to that size into segment
+ * files instead of copying each to a file of its own, see pack.c. It
+ * cannot be combined with SNAPSHOT.
+ *
+ * SHARD picks the event loop (and copy workers) the job runs on, see
+ * SHARDS in config.c. Jobs without one are spread by their name.
+ *
+ * PRIORITY and the SNAPSHOT settings can be changed with a reload
+ * without restarting the job.
+ *
+ * example:
+ *
+ * [JOB home]
+ * SOURCE=/home/user
+ * DESTINATION=/mnt/backup/home
+ * EXCLUDE=*.swp,*.tmp,.git,.cache
+ * TAIL=*.log
+ * PRIORITY=8
+ * SNAPSHOT=daily
+ * SNAPSHOT_KEEP=14
+ *
+ */
+
+job_st *job_load(ini_data_st *cfg)
+{
+  job_st *head = NULL;
+  job_st **tail = &head;
+  job_st *job;
+  ini_section_st *sec;
+  char *src;
+  char *dst;
+
+  src = ini_get_data(cfg, "SOURCE DIR", "PATH");
+  dst = ini_get_data(cfg, "DESTINATION DIR", "PATH");
+  if (src || dst) {
+    if (!src || !dst) {
+      log_msg(LOG_ERR, "SOURCE DIR and DESTINATION DIR must both have a PATH");
+      return (NULL);
+    }
+
+    if (!(job = job_new(cfg, "SOURCE DIR", DEFAULT_JOB, src, dst))) {
+      log_msg(LOG_ERR, "%d - malloc failed", __LINE__);
+      return (NULL);
+    }
+    *tail = job;
+    tail = &job->next;
+  }
+
+  for (sec = cfg->head; sec; sec = sec->next) {
+    char *name;
+
+    if (!sec->name || strncmp(sec->name, JOB_PREFIX, strlen(JOB_PREFIX)) != 0) {
+      continue;
+    }
+
+    name = sec->name + strlen(JOB_PREFIX);
+    src = ini_get_data(cfg, sec->name, "SOURCE");
+    dst = ini_get_data(cfg, sec->name, "DESTINATION");
+
+    if (!*name || !src || !dst) {
+      log_msg(LOG_ERR, "[%s] needs a name, SOURCE and DESTINATION", sec->name);
+      goto error;
+    }
+
+    if (job_find(head, name)) {
+      log_msg(LOG_ERR, "job %s defined twice", name);
+      goto error;
+    }
+
+    if (!(job = job_new(cfg, sec->name, name, src, dst))) {
+      log_msg(LOG_ERR, "%d - malloc failed", __LINE__);
+      goto error;
+    }
+    *tail = job;
+    tail = &job->next;
+  }
+
+  if (!head) {
+    log_msg(LOG_ERR, "no jobs configured");
+  }
+
+  return (head);
+
+error:
+  job_free_list(head);
+  return (NULL);
+}
+
+
+/* job_path - build the absolute path of rel under root
+ *
+ * returns - 0 on success, -1 if the path did not fit in buf
+ */
+
+int job_path(const char *root, const char *rel, char *buf, size_t len)
+{
+  int ret;
+
+  if (*rel) {
+    ret = snprintf(buf, len, "%s/%s", root, rel);
+  } else {
+    ret = snprintf(buf, len, "%s", root);
+  }
+
+  return ((ret < 0 || (size_t)ret >= len) ? -1 : 0);
+}
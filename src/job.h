@@ -0,0 +1,108 @@
+/*
+ * job.h
+ *
+ * Replication Job Definitions
+ * 
+ *
+ * Copyright (C) 2013  Bryant Moscon - bmoscon@gmail.com
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to 
+ * deal in the Software without restriction, including without limitation the 
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, 
+ *    this list of conditions and the following disclaimer in the documentation 
+ *    and/or other materials provided with the distribution, and in the same 
+ *    place and form as other copyright, license and disclaimer information.
+ *
+ * 3. The end-user documentation included with the redistribution, if any, must 
+ *    include the following acknowledgment: "This product includes software 
+ *    developed by Bryant Moscon (http://www.bryantmoscon.org/)", in the same 
+ *    place and form as other third-party acknowledgments. Alternately, this 
+ *    acknowledgment may appear in the software itself, in the same form and 
+ *    location as other such third-party acknowledgments.
+ *
+ * 4. Except as contained in this notice, the name of the author, Bryant Moscon,
+ *    shall not be used in advertising or otherwise to promote the sale, use or 
+ *    other dealings in this Software without prior written authorization from 
+ *    the author.
+ *
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL 
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN 
+ * THE SOFTWARE.
+ *
+ */
+
+#ifndef __JOB__
+#define __JOB__
+
+#include <stddef.h>
+#include <time.h>
+#include <sys/types.h>
+
+#include "ini_parse.h"
+#include "filter.h"
+
+
+#define DEFAULT_PRIORITY 5
+#define MAX_PRIORITY 10
+#define DEFAULT_SNAPSHOT_KEEP 24
+
+typedef struct job_st {
+  char *name;
+  char *src;
+  char *dst;
+
+  char *include;       // raw INCLUDE / EXCLUDE rules, as configured
+  char *exclude;
+  filter_st *filter;   // ... and compiled
+  char *tail;          // TAIL rules, files that only ever grow
+  filter_st *tail_filter;
+  struct tail_table_st *tails;  // what was replicated of them, see tail.c
+  int priority;        // PRIORITY, 1 (lowest) to 10, see sched.c
+  int shard;           // SHARD, event loop and copy workers it runs on
+
+  int snap_every;      // SNAPSHOT interval in seconds, 0 for none
+  int snap_keep;       // SNAPSHOT_KEEP
+  time_t snap_next;    // when the next one is due
+  int snap_running;    // one is being built, see snapshot.c
+
+  off_t pack_size;     // PACK, files up to this size are packed, 0 for none
+  struct pack_st *pack;  // ... into this, opened on first use, see pack.c
+
+  struct remote_st *remote;  // DESTINATION is tcp://host:port, see remote.c
+  int paused;          // changes are held back, see monitor.c
+  int refs;            // background tasks hold a reference
+  int stopped;         // set once the job is no longer running
+
+  struct job_st *next;
+} job_st;
+
+
+job_st *job_load(ini_data_st *cfg);
+void job_free(job_st *job);
+void job_free_list(job_st *list);
+void job_hold(job_st *job);
+void job_release(job_st *job);
+void job_set_stopped(job_st *job);
+int job_is_stopped(job_st *job);
+job_st *job_find(job_st *list, const char *name);
+int job_same_tree(job_st *a, job_st *b);
+void job_retune(job_st *job, job_st *cfg);
+void job_place(job_st *list, int shards);
+
+int job_path(const char *root, const char *rel, char *buf, size_t len);
+
+
+#endif
@@ -0,0 +1,537 @@
+/*
+ * journal.c
+ *
+ * Write-ahead journal of accepted replication operations
+ * 
+ *
+ * Copyright (C) 2013  Bryant Moscon - bmoscon@gmail.com
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to 
+ * deal in the Software without restriction, including without limitation the 
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, 
+ *    this list of conditions and the following disclaimer in the documentation 
+ *    and/or other materials provided with the distribution, and in the same 
+ *    place and form as other copyright, license and disclaimer information.
+ *
+ * 3. The end-user documentation included with the redistribution, if any, must 
+ *    include the following acknowledgment: "This product includes software 
+ *    developed by Bryant Moscon (http://www.bryantmoscon.org/)", in the same 
+ *    place and form as other third-party acknowledgments. Alternately, this 
+ *    acknowledgment may appear in the software itself, in the same form and 
+ *    location as other such third-party acknowledgments.
+ *
+ * 4. Except as contained in this notice, the name of the author, Bryant Moscon,
+ *    shall not be used in advertising or otherwise to promote the sale, use or 
+ *    other dealings in this Software without prior written authorization from 
+ *    the author.
+ *
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL 
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN 
+ * THE SOFTWARE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "journal.h"
+#include "hash_map.h"
+#include "log.h"
+
+
+/*
+ * Every op the monitor accepts is appended here before it is applied,
+ * and a done record is appended once it has been. Appends only copy
+ * into a memory buffer; journal_sync() writes the buffer out with a
+ * single write() and fdatasync(), so one inotify read's worth of ops
+ * costs one sync (group commit). Ops are only applied after the sync
+ * that covers them.
+ *
+ * The journal is a series of segment files, journal.<n>. A new one is
+ * started once the current one passes SEG_MAX bytes, and an older
+ * segment is deleted as soon as every op in it is done, which keeps
+ * the journal about as small as the backlog of pending work. An op is
+ * counted live in the current segment when it is appended, so it may
+ * be done before the sync that writes it.
+ *
+ * At startup the segments are replayed and every op without a done
+ * record is handed back to be applied again. All ops are idempotent,
+ * so applying one twice is harmless.
+ *
+ * Record format, native byte order:
+ *
+ * uint32_t length of the body
+ * uint32_t checksum of the body
+ * uint8_t  REC_OP or REC_DONE
+ * uint64_t sequence number
+ * encoded op (REC_OP only, see op.c)
+ *
+ * A torn or corrupt record ends the replay of its segment.
+ */
+
+
+#define SEG_MAX (4 * 1024 * 1024)
+
+#define REC_OP 1
+#define REC_DONE 2
+
+#define REC_HDR (2 * sizeof(uint32_t))
+#define BODY_HDR (1 + sizeof(uint64_t))
+
+
+static journal_st *journal = NULL;
+
+
+static uint32_t checksum(const char *buf, size_t len)
+{
+  uint32_t h = 2166136261u;
+
+  while (len--) {
+    h ^= (unsigned char)*buf++;
+    h *= 16777619u;
+  }
+  return (h);
+}
+
+
+static int seg_name(journal_st *j, uint32_t no, char *buf, size_t len)
+{
+  return (snprintf(buf, len, "%s/journal.%08u", j->dir, no) >= (int)len ? -1 : 0);
+}
+
+
+static int seg_open(journal_st *j, uint32_t no, uint64_t first)
+{
+  journal_seg_st *seg;
+  journal_seg_st **tail;
+  char name[PATH_MAX];
+  int fd;
+
+  if (seg_name(j, no, name, sizeof(name)) < 0 ||
+      (fd = open(name, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, S_IRUSR | S_IWUSR)) < 0) {
+    return (-1);
+  }
+
+  if (!(seg = calloc(1, sizeof(journal_seg_st)))) {
+    close(fd);
+    return (-1);
+  }
+  seg->no = no;
+  seg->first = first;
+
+  for (tail = &j->segs; *tail; tail = &(*tail)->next);
+  *tail = seg;
+  j->last = seg;
+
+  if (j->fd >= 0) {
+    close(j->fd);
+  }
+  j->fd = fd;
+  j->size = 0;
+
+  return (0);
+}
+
+
+/* reserve room for one record in the buffer, lock held */
+static char *rec_alloc(journal_st *j, size_t body)
+{
+  size_t need = j->len + REC_HDR + body;
+  char *buf;
+
+  if (need > j->cap) {
+    size_t cap = j->cap ? j->cap : 65536;
+
+    while (cap < need) {
+      cap *= 2;
+    }
+    if (!(buf = realloc(j->buf, cap))) {
+      return (NULL);
+    }
+    j->buf = buf;
+    j->cap = cap;
+  }
+
+  buf = j->buf + j->len;
+  j->len = need;
+  return (buf);
+}
+
+
+static void rec_seal(char *rec, size_t body, uint8_t kind, uint64_t seq)
+{
+  uint32_t len = body;
+  uint32_t sum;
+
+  rec[REC_HDR] = kind;
+  memcpy(rec + REC_HDR + 1, &seq, sizeof(seq));
+  sum = checksum(rec + REC_HDR, body);
+  memcpy(rec, &len, sizeof(len));
+  memcpy(rec + sizeof(len), &sum, sizeof(sum));
+}
+
+
+/* journal_append - give op a sequence number and journal it. It is
+ *                  durable after the next journal_sync()
+ */
+
+void journal_append(op_st *op)
+{
+  journal_st *j = journal;
+  size_t olen;
+  char *rec;
+
+  if (!j) {
+    return;
+  }
+
+  // applied all the same, it is just not recovered after a crash
+  if (!(olen = op_encode(op, NULL, 0))) {
+    log_msg(LOG_WARNING, "journal: %s: %s, op not journaled", op->job->name, strerror(errno));
+    return;
+  }
+
+  pthread_mutex_lock(&j->lock);
+  if ((rec = rec_alloc(j, BODY_HDR + olen))) {
+    op->seq = ++j->seq;
+    op_encode(op, rec + REC_HDR + BODY_HDR, olen);
+    rec_seal(rec, BODY_HDR + olen, REC_OP, op->seq);
+    ++j->last->live;
+  } else {
+    log_msg(LOG_ERR, "journal: out of memory, op not journaled");
+  }
+  pthread_mutex_unlock(&j->lock);
+}
+
+
+/* journal_done - op seq has been applied */
+void journal_done(uint64_t seq)
+{
+  journal_st *j = journal;
+  journal_seg_st *seg, *owner = NULL;
+  char *rec;
+
+  if (!j || !seq) {
+    return;
+  }
+
+  pthread_mutex_lock(&j->lock);
+  if ((rec = rec_alloc(j, BODY_HDR))) {
+    rec_seal(rec, BODY_HDR, REC_DONE, seq);
+  }
+
+  for (seg = j->segs; seg && seg->first <= seq; seg = seg->next) {
+    owner = seg;
+  }
+  if (owner && owner->live) {
+    --owner->live;
+  }
+  pthread_mutex_unlock(&j->lock);
+}
+
+
+/* delete the oldest segments, up to the first one with anything live
+ * or the current one, lock held. A later segment with nothing live of
+ * its own can still hold the DONE records of ops in an earlier live
+ * one, so it has to stay until that one goes
+ */
+static void checkpoint(journal_st *j)
+{
+  journal_seg_st *seg;
+  char name[PATH_MAX];
+
+  while ((seg = j->segs) && seg->next && !seg->live) {
+    if (seg_name(j, seg->no, name, sizeof(name)) == 0) {
+      unlink(name);
+    }
+    j->segs = seg->next;
+    free(seg);
+  }
+}
+
+
+/* journal_sync - write out everything appended so far and wait for it
+ *                to be on disk. The shards' threads take turns, so
+ *                records reach the file in order and a later sync
+ *                also covers what an earlier one was writing
+ *
+ * returns - 0 on success, -1 on error (logged)
+ */
+
+int journal_sync(void)
+{
+  journal_st *j = journal;
+  size_t len;
+  char *buf;
+  ssize_t n;
+  size_t off = 0;
+  int fd;
+  int ret = 0;
+
+  if (!j) {
+    return (0);
+  }
+
+  pthread_mutex_lock(&j->sync_lock);
+  pthread_mutex_lock(&j->lock);
+  buf = j->buf;
+  len = j->len;
+  fd = j->fd;
+  j->buf = NULL;
+  j->len = j->cap = 0;
+
+  // the buffer is the last of this segment. The next one starts here,
+  // not after the write, so every op appended from now on is counted
+  // in the segment its done record looks for
+  if (j->size + (off_t)len >= SEG_MAX) {
+    j->fd = -1;
+    if (seg_open(j, j->last->no + 1, j->seq + 1) < 0) {
+      log_msg(LOG_ERR, "journal: cannot start a new segment: %s", strerror(errno));
+      j->fd = fd;
+    }
+  }
+  pthread_mutex_unlock(&j->lock);
+
+  while (off < len) {
+    if ((n = write(fd, buf + off, len - off)) < 0) {
+      if (errno == EINTR) {
+	continue;
+      }
+      log_msg(LOG_ERR, "journal write: %s", strerror(errno));
+      ret = -1;
+      break;
+    }
+    off += n;
+  }
+
+  if (len && fdatasync(fd) < 0) {
+    log_msg(LOG_ERR, "journal sync: %s", strerror(errno));
+    ret = -1;
+  }
+  free(buf);
+
+  pthread_mutex_lock(&j->lock);
+  if (fd != j->fd) {
+    close(fd);
+  } else {
+    j->size += off;
+  }
+
+  checkpoint(j);
+  pthread_mutex_unlock(&j->lock);
+  pthread_mutex_unlock(&j->sync_lock);
+
+  return (ret);
+}
+
+
+static int uint_cmp(const void *a, const void *b)
+{
+  uint32_t x = *(const uint32_t *)a;
+  uint32_t y = *(const uint32_t *)b;
+
+  return (x < y ? -1 : x > y);
+}
+
+
+static int op_cmp(const void *a, const void *b)
+{
+  uint64_t x = (*(op_st * const *)a)->seq;
+  uint64_t y = (*(op_st * const *)b)->seq;
+
+  return (x < y ? -1 : x > y);
+}
+
+
+/* replay one segment into the map of unfinished ops */
+static void replay_seg(journal_st *j, uint32_t no, hash_map_st *pending, job_st *jobs)
+{
+  char name[PATH_MAX];
+  struct stat st;
+  char *buf;
+  size_t off = 0;
+  int fd;
+
+  if (seg_name(j, no, name, sizeof(name)) < 0 || (fd = open(name, O_RDONLY)) < 0) {
+    return;
+  }
+
+  if (fstat(fd, &st) < 0 || !(buf = malloc(st.st_size + 1))) {
+    close(fd);
+    return;
+  }
+
+  if (read(fd, buf, st.st_size) != st.st_size) {
+    st.st_size = 0;
+  }
+  close(fd);
+
+  while (off + REC_HDR + BODY_HDR <= (size_t)st.st_size) {
+    uint32_t len, sum;
+    uint64_t seq;
+    char *body;
+    op_st *op;
+
+    memcpy(&len, buf + off, sizeof(len));
+    memcpy(&sum, buf + off + sizeof(len), sizeof(sum));
+    body = buf + off + REC_HDR;
+
+    if (len < BODY_HDR || off + REC_HDR + len > (size_t)st.st_size ||
+	checksum(body, len) != sum) {
+      log_msg(LOG_WARNING, "journal: %s is truncated at %zu", name, off);
+      break;
+    }
+    off += REC_HDR + len;
+
+    memcpy(&seq, body + 1, sizeof(seq));
+    if (seq > j->seq) {
+      j->seq = seq;
+    }
+
+    if (body[0] == REC_OP) {
+      if ((op = op_decode(body + BODY_HDR, len - BODY_HDR, jobs))) {
+	op->seq = seq;
+	if (hash_map_put(pending, (void *)(uintptr_t)seq, op) != 0) {
+	  op_free(op);
+	}
+      }
+    } else if (body[0] == REC_DONE) {
+      op_free(hash_map_remove(pending, (void *)(uintptr_t)seq));
+    }
+  }
+
+  free(buf);
+}
+
+
+static void collect(void *key, void *val, void *arg)
+{
+  op_st ***next = (op_st ***)arg;
+
+  *(*next)++ = (op_st *)val;
+}
+
+
+/* journal_open - open the journal in dir, creating it if needed, and
+ *                replay whatever a previous run left unfinished
+ *
+ * dir - IN - journal directory
+ * jobs - IN - running jobs, ops of jobs that no longer exist are dropped
+ *
+ * returns - op_st - list of unfinished ops in their original order.
+ *                   They have no sequence number yet and are to be
+ *                   journal_append()ed and applied like new ops. The
+ *                   old segments go away on the first journal_sync()
+ */
+
+op_st *journal_open(const char *dir, job_st *jobs)
+{
+  journal_st *j;
+  hash_map_st *pending;
+  journal_seg_st **tail;
+  uint32_t *nos = NULL;
+  size_t num = 0;
+  op_st *head = NULL;
+  op_st **ops = NULL;
+  DIR *d;
+  struct dirent *ent;
+  size_t i;
+
+  if (mkdir(dir, S_IRWXU) < 0 && errno != EEXIST) {
+    log_msg(LOG_ERR, "journal: mkdir %s: %s", dir, strerror(errno));
+    return (NULL);
+  }
+
+  if (!(j = calloc(1, sizeof(journal_st))) || !(j->dir = strdup(dir))) {
+    free(j);
+    return (NULL);
+  }
+  j->fd = -1;
+  pthread_mutex_init(&j->lock, NULL);
+  pthread_mutex_init(&j->sync_lock, NULL);
+
+  if (!(pending = hash_map_init(1024, hash_map_int_hash, hash_map_int_cmp))) {
+    free(j->dir);
+    free(j);
+    return (NULL);
+  }
+
+  if ((d = opendir(dir))) {
+    while ((ent = readdir(d))) {
+      unsigned int no;
+      uint32_t *n;
+
+      if (sscanf(ent->d_name, "journal.%u", &no) != 1) {
+	continue;
+      }
+      if (!(n = realloc(nos, (num + 1) * sizeof(uint32_t)))) {
+	break;
+      }
+      nos = n;
+      nos[num++] = no;
+    }
+    closedir(d);
+  }
+
+  qsort(nos, num, sizeof(uint32_t), uint_cmp);
+
+  for (i = 0, tail = &j->segs; i < num; ++i) {
+    journal_seg_st *seg = calloc(1, sizeof(journal_seg_st));
+
+    replay_seg(j, nos[i], pending, jobs);
+
+    // old segments stay until the first sync has re-journaled their ops
+    if (seg) {
+      seg->no = nos[i];
+      *tail = seg;
+      tail = &seg->next;
+    }
+  }
+
+  if (seg_open(j, num ? nos[num - 1] + 1 : 0, j->seq + 1) < 0) {
+    log_msg(LOG_ERR, "journal: cannot create a segment in %s: %s", dir, strerror(errno));
+  } else {
+    journal = j;
+  }
+
+  if (pending->entries && (ops = malloc(pending->entries * sizeof(op_st *)))) {
+    op_st **next = ops;
+    size_t n = pending->entries;
+
+    hash_map_foreach(pending, collect, &next);
+    qsort(ops, n, sizeof(op_st *), op_cmp);
+
+    for (i = n; i > 0; --i) {
+      ops[i - 1]->seq = 0;
+      ops[i - 1]->next = head;
+      head = ops[i - 1];
+    }
+    log_msg(LOG_INFO, "journal: replaying %zu unfinished operation(s)", n);
+    free(ops);
+  }
+
+  hash_map_free(pending);
+  free(nos);
+
+  return (head);
+}
@@ -0,0 +1,89 @@
+/*
+ * journal.h
+ *
+ * Write-Ahead Journal Definitions
+ * 
+ *
+ * Copyright (C) 2013  Bryant Moscon - bmoscon@gmail.com
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to 
+ * deal in the Software without restriction, including without limitation the 
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, 
+ *    this list of conditions and the following disclaimer in the documentation 
+ *    and/or other materials provided with the distribution, and in the same 
+ *    place and form as other copyright, license and disclaimer information.
+ *
+ * 3. The end-user documentation included with the redistribution, if any, must 
+ *    include the following acknowledgment: "This product includes software 
+ *    developed by Bryant Moscon (http://www.bryantmoscon.org/)", in the same 
+ *    place and form as other third-party acknowledgments. Alternately, this 
+ *    acknowledgment may appear in the software itself, in the same form and 
+ *    location as other such third-party acknowledgments.
+ *
+ * 4. Except as contained in this notice, the name of the author, Bryant Moscon,
+ *    shall not be used in advertising or otherwise to promote the sale, use or 
+ *    other dealings in this Software without prior written authorization from 
+ *    the author.
+ *
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL 
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN 
+ * THE SOFTWARE.
+ *
+ */
+
+#ifndef __JOURNAL__
+#define __JOURNAL__
+
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#include "op.h"
+
+
+typedef struct journal_seg_st {
+  uint32_t no;
+  uint64_t first;    // first sequence number written to this segment
+  uint64_t live;     // ops in this segment not yet done
+
+  struct journal_seg_st *next;
+} journal_seg_st;
+
+
+typedef struct journal_st {
+  char *dir;
+  int fd;                  // current (last) segment
+  off_t size;
+  journal_seg_st *segs;    // oldest first
+  journal_seg_st *last;    // the current one, new ops are counted in it
+
+  uint64_t seq;            // last sequence number handed out
+  char *buf;               // records not written yet
+  size_t len;
+  size_t cap;
+
+  pthread_mutex_t lock;
+  pthread_mutex_t sync_lock;  // one journal_sync at a time, shards share it
+} journal_st;
+
+
+op_st *journal_open(const char *dir, job_st *jobs);
+void journal_append(op_st *op);
+void journal_done(uint64_t seq);
+int journal_sync(void);
+
+
+#endif
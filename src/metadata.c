@@ -0,0 +1,232 @@
+/*
+ * metadata.c
+ *
+ * Replicates file metadata - owner, mode, extended attributes and times
+ * 
+ *
+ * Copyright (C) 2013  Bryant Moscon - bmoscon@gmail.com
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to 
+ * deal in the Software without restriction, including without limitation the 
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, 
+ *    this list of conditions and the following disclaimer in the documentation 
+ *    and/or other materials provided with the distribution, and in the same 
+ *    place and form as other copyright, license and disclaimer information.
+ *
+ * 3. The end-user documentation included with the redistribution, if any, must 
+ *    include the following acknowledgment: "This product includes software 
+ *    developed by Bryant Moscon (http://www.bryantmoscon.org/)", in the same 
+ *    place and form as other third-party acknowledgments. Alternately, this 
+ *    acknowledgment may appear in the software itself, in the same form and 
+ *    location as other such third-party acknowledgments.
+ *
+ * 4. Except as contained in this notice, the name of the author, Bryant Moscon,
+ *    shall not be used in advertising or otherwise to promote the sale, use or 
+ *    other dealings in this Software without prior written authorization from 
+ *    the author.
+ *
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL 
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN 
+ * THE SOFTWARE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/xattr.h>
+
+#include "metadata.h"
+#include "log.h"
+
+
+/* the NUL separated list of extended attribute names of fd, malloc'd */
+static ssize_t list_xattrs(int fd, char **names)
+{
+  ssize_t len;
+
+  *names = NULL;
+  while ((len = flistxattr(fd, NULL, 0)) > 0) {
+    if (!(*names = malloc(len))) {
+      return (-1);
+    }
+    if ((len = flistxattr(fd, *names, len)) >= 0) {
+      return (len);
+    }
+    free(*names);
+    *names = NULL;
+    if (errno != ERANGE) {
+      break;
+    }
+    // grew in between, try again
+  }
+
+  return (len);
+}
+
+
+static int has_name(const char *names, ssize_t len, const char *name)
+{
+  const char *p;
+
+  for (p = names; p < names + len; p += strlen(p) + 1) {
+    if (strcmp(p, name) == 0) {
+      return (1);
+    }
+  }
+  return (0);
+}
+
+
+static void copy_xattrs(int out_fd, int in_fd, const char *name, int prune)
+{
+  char *in_names, *out_names, *p;
+  ssize_t in_len, out_len, vlen;
+  char *val = NULL;
+  size_t cap = 0;
+
+  if ((in_len = list_xattrs(in_fd, &in_names)) < 0) {
+    return;
+  }
+
+  for (p = in_names; p < in_names + in_len; p += strlen(p) + 1) {
+    if ((vlen = fgetxattr(in_fd, p, NULL, 0)) < 0) {
+      continue;
+    }
+    if ((size_t)vlen > cap) {
+      char *grown = realloc(val, vlen);
+
+      if (!grown) {
+	continue;
+      }
+      val = grown;
+      cap = vlen;
+    }
+    if ((vlen = fgetxattr(in_fd, p, val, cap)) < 0) {
+      continue;
+    }
+    if (fsetxattr(out_fd, p, val, vlen, 0) < 0 && errno != ENOTSUP) {
+      log_msg(LOG_WARNING, "setxattr %s %s: %s", name, p, strerror(errno));
+    }
+  }
+
+  if (prune && (out_len = list_xattrs(out_fd, &out_names)) > 0) {
+    for (p = out_names; p < out_names + out_len; p += strlen(p) + 1) {
+      if (!has_name(in_names, in_len, p)) {
+	fremovexattr(out_fd, p);
+      }
+    }
+    free(out_names);
+  }
+
+  free(val);
+  free(in_names);
+}
+
+
+/* meta_copy - give out_fd the metadata of the source
+ *
+ * out_fd - IN - destination file or directory
+ * in_fd - IN - the source, for its extended attributes (-1 to skip them)
+ * st - IN - the source's stat
+ * name - IN - destination name, for messages
+ * what - IN - META_* flags
+ *
+ * returns - 0 on success, -1 if anything could not be applied (logged)
+ */
+
+int meta_copy(int out_fd, int in_fd, struct stat *st, const char *name, int what)
+{
+  int ret = 0;
+
+  // chown clears set-id bits, so it goes before chmod. Setting an ACL
+  // changes the mode too
+  if ((what & META_OWNER) && fchown(out_fd, st->st_uid, st->st_gid) != 0) {
+    log_msg(LOG_WARNING, "chown %s: %s", name, strerror(errno));
+    ret = -1;
+  }
+
+  if ((what & META_XATTR) && in_fd >= 0) {
+    copy_xattrs(out_fd, in_fd, name, what & META_PRUNE);
+  }
+
+  if ((what & META_MODE) && fchmod(out_fd, st->st_mode & 07777) != 0) {
+    log_msg(LOG_WARNING, "chmod %s: %s", name, strerror(errno));
+    ret = -1;
+  }
+
+  // last, as nothing else may touch them afterwards
+  if (what & META_TIMES) {
+    struct timespec times[2] = {st->st_atim, st->st_mtim};
+
+    if (futimens(out_fd, times) != 0) {
+      log_msg(LOG_WARNING, "utimensat %s: %s", name, strerror(errno));
+      ret = -1;
+    }
+  }
+
+  return (ret);
+}
+
+
+/* meta_sync - bring the metadata of out_dir/out_base in line with
+ *             in_dir/in_base, without touching any data. Symbolic
+ *             links are not followed
+ *
+ * name - IN - for messages
+ *
+ * returns - 0 on success, -1 on error
+ */
+
+int meta_sync(int in_dir, const char *in_base, int out_dir, const char *out_base,
+	      const char *name)
+{
+  struct stat st;
+  int in_fd, out_fd;
+  int ret;
+
+  if (fstatat(in_dir, in_base, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+    return (-1);
+  }
+
+  if (S_ISLNK(st.st_mode)) {
+    struct timespec times[2] = {st.st_atim, st.st_mtim};
+
+    if (fchownat(out_dir, out_base, st.st_uid, st.st_gid, AT_SYMLINK_NOFOLLOW) < 0 ||
+	utimensat(out_dir, out_base, times, AT_SYMLINK_NOFOLLOW) < 0) {
+      return (-1);
+    }
+    return (0);
+  }
+
+  // O_NONBLOCK so a FIFO does not hang us
+  if ((in_fd = openat(in_dir, in_base, O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC)) < 0) {
+    return (-1);
+  }
+  if ((out_fd = openat(out_dir, out_base, O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC)) < 0) {
+    close(in_fd);
+    return (-1);
+  }
+
+  ret = meta_copy(out_fd, in_fd, &st, name, META_ALL | META_PRUNE);
+
+  close(in_fd);
+  close(out_fd);
+  return (ret);
+}
@@ -0,0 +1,1904 @@
+/*
+ * monitor.c
+ *
+ * Watches the source trees and replicates changes as they happen
+ * 
+ *
+ * Copyright (C) 2013  Bryant Moscon - bmoscon@gmail.com
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to 
+ * deal in the Software without restriction, including without limitation the 
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, 
+ *    this list of conditions and the following disclaimer in the documentation 
+ *    and/or other materials provided with the distribution, and in the same 
+ *    place and form as other copyright, license and disclaimer information.
+ *
+ * 3. The end-user documentation included with the redistribution, if any, must 
+ *    include the following acknowledgment: "This product includes software 
+ *    developed by Bryant Moscon (http://www.bryantmoscon.org/)", in the same 
+ *    place and form as other third-party acknowledgments. Alternately, this 
+ *    acknowledgment may appear in the software itself, in the same form and 
+ *    location as other such third-party acknowledgments.
+ *
+ * 4. Except as contained in this notice, the name of the author, Bryant Moscon,
+ *    shall not be used in advertising or otherwise to promote the sale, use or 
+ *    other dealings in this Software without prior written authorization from 
+ *    the author.
+ *
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL 
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN 
+ * THE SOFTWARE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <signal.h>
+#include <libgen.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <inttypes.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/select.h>
+#include <sys/inotify.h>
+
+#include "monitor.h"
+#include "replicate.h"
+#include "journal.h"
+#include "config.h"
+#include "task.h"
+#include "sched.h"
+#include "fan.h"
+#include "snapshot.h"
+#include "dircache.h"
+#include "trace.h"
+#include "control.h"
+#include "scrub.h"
+#include "remote.h"
+#include "trash.h"
+#include "pack.h"
+#include "log.h"
+
+
+#define WATCH_MASK (IN_DELETE | IN_MODIFY | IN_MOVE | IN_CREATE | IN_ATTRIB)
+#define CFG_MASK (IN_CLOSE_WRITE | IN_MOVED_TO)
+
+// how long an IN_MOVED_FROM waits for a matching IN_MOVED_TO before it
+// is taken as a move out of the watched tree
+#define MOVE_WINDOW_MS 50
+
+
+static volatile sig_atomic_t reload_requested = 0;
+static trace_st *recording = NULL;   // backupd record
+static pthread_mutex_t record_lock = PTHREAD_MUTEX_INITIALIZER;  // shared by the shards
+
+
+/* called from the SIGHUP handler */
+void monitor_request_reload(void)
+{
+  reload_requested = 1;
+}
+
+
+/* load_jobs - the jobs of the config file, placed on the shards we
+ *             run (SHARDS only takes effect on a restart)
+ */
+
+static job_st *load_jobs(monitor_st *mon)
+{
+  config_st *cfg;
+  job_st *jobs;
+
+  if (!(cfg = config_load(mon->cfg_file))) {
+    return (NULL);
+  }
+
+  jobs = cfg->jobs;
+  cfg->jobs = NULL;
+  config_free(cfg);
+  job_place(jobs, mon->nshards);
+
+  return (jobs);
+}
+
+
+/* emit - accept an op: journal it and queue it to be applied once the
+ *        current batch of events has been journaled
+ */
+
+static void emit(shard_st *sh, op_type type, job_st *job, const char *path,
+		 const char *path2, int is_dir)
+{
+  op_st *op;
+
+  if (!(op = op_new(type, job, path, path2, is_dir))) {
+    log_msg(LOG_ERR, "%s: out of memory, change not replicated", path);
+    return;
+  }
+
+  journal_append(op);
+  *sh->batch_tail = op;
+  sh->batch_tail = &op->next;
+}
+
+
+static void remove_tree(shard_st *sh, job_st *job, const char *rel)
+{
+  char *staging = replicate_staging_name(rel);
+
+  if (staging) {
+    emit(sh, OP_REMOVE_TREE, job, rel, staging, 1);
+    free(staging);
+  }
+}
+
+
+/* flush_batch - make the batch durable with a single journal sync,
+ *               then apply it in order. File copies go to the
+ *               scheduler, everything else is quick and done here,
+ *               after bringing any queued copies it affects in line.
+ *               Ops of paused jobs are held back
+ */
+
+static void flush_batch(shard_st *sh)
+{
+  op_st *op;
+
+  journal_sync();
+
+  while ((op = sh->batch)) {
+    sh->batch = op->next;
+    op->next = NULL;
+
+    if (op->job->paused) {
+      // journaled, applied when the job is resumed
+      *sh->held_tail = op;
+      sh->held_tail = &op->next;
+      continue;
+    }
+
+    switch (op->type) {
+    case OP_COPY:
+      sched_submit(op);
+      continue;
+
+    case OP_UNLINK:
+    case OP_REMOVE_TREE:
+      sched_cancel(op->job, op->path);
+      break;
+
+    case OP_RENAME:
+      sched_rename(op->job, op->path, op->path2);
+      break;
+
+    default:
+      break;
+    }
+
+    op_apply(op);
+    op_free(op);
+  }
+  sh->batch_tail = &sh->batch;
+
+  if (recording) {
+    pthread_mutex_lock(&record_lock);
+    if (recording) {
+      trace_flush(recording);
+    }
+    pthread_mutex_unlock(&record_lock);
+  }
+}
+
+
+/* scan_found - something in a directory changed while the job's tree
+ *              was being walked, before that directory was watched.
+ *              Called with the walk's lock held, from its threads
+ *              (while this thread waits for them)
+ */
+
+static void scan_found(void *arg, job_st *job, const char *rel, int is_dir)
+{
+  emit((shard_st *)arg, is_dir ? OP_POPULATE : OP_COPY, job, rel, NULL, is_dir);
+}
+
+
+static void job_start(shard_st *sh, job_st *job)
+{
+  watch_scan_st scan;
+
+  if (sh->fan) {
+    if (fan_add(sh->fan, job->src) < 0) {
+      log_msg(LOG_ERR, "job %s: cannot watch %s", job->name, job->src);
+      return;
+    }
+  } else {
+    memset(&scan, 0, sizeof(scan));
+    clock_gettime(CLOCK_REALTIME, &scan.since);
+    // file times are only as fine as the kernel's tick
+    --scan.since.tv_sec;
+    scan.found = scan_found;
+    scan.arg = sh;
+
+    if (watch_add_tree(sh->watches, job, "", &scan) < 0) {
+      log_msg(LOG_ERR, "job %s: cannot watch %s", job->name, job->src);
+      return;
+    }
+    log_msg(LOG_INFO, "job %s: %lu directories watched in %.2fs", job->name, scan.dirs,
+	    scan.seconds);
+  }
+  if (sh->mon->nshards > 1) {
+    log_msg(LOG_INFO, "job %s: %s -> %s, shard %d", job->name, job->src, job->dst, sh->no);
+  } else {
+    log_msg(LOG_INFO, "job %s: %s -> %s", job->name, job->src, job->dst);
+  }
+}
+
+
+static void move_free(move_st *m)
+{
+  free(m->path);
+  free(m);
+}
+
+
+/* take_held - take the held ops of job out of the held list, in
+ *             order, onto *tail (or drop them, if tail is NULL)
+ *
+ * returns - how many there were
+ */
+
+static unsigned long take_held(shard_st *sh, job_st *job, op_st ***tail)
+{
+  op_st **prev = &sh->held;
+  unsigned long n = 0;
+  op_st *op;
+
+  while ((op = *prev)) {
+    if (op->job != job) {
+      prev = &op->next;
+      continue;
+    }
+
+    *prev = op->next;
+    op->next = NULL;
+    if (tail) {
+      **tail = op;
+      *tail = &op->next;
+    } else {
+      // the job is stopped, this only marks it done
+      op_apply(op);
+      op_free(op);
+    }
+    ++n;
+  }
+  sh->held_tail = prev;
+
+  return (n);
+}
+
+
+static void job_stop(shard_st *sh, job_st *job)
+{
+  move_st **prev = &sh->moves;
+  move_st *m;
+
+  job_set_stopped(job);
+  if (sh->watches) {
+    watch_remove_job(sh->watches, job);
+  }
+  take_held(sh, job, NULL);
+
+  while ((m = *prev)) {
+    if (m->job == job) {
+      *prev = m->next;
+      move_free(m);
+    } else {
+      prev = &m->next;
+    }
+  }
+
+  log_msg(LOG_INFO, "job %s stopped", job->name);
+}
+
+
+static shard_st *shard_of(monitor_st *mon, job_st *job)
+{
+  return (&mon->shards[job->shard]);
+}
+
+
+static void lock_all(monitor_st *mon)
+{
+  int i;
+
+  for (i = 0; i < mon->nshards; i++) {
+    pthread_mutex_lock(&mon->shards[i].lock);
+  }
+}
+
+
+/* unlock_all - let the shards go again, once whatever was accepted
+ *              for them meanwhile is applied
+ */
+
+static void unlock_all(monitor_st *mon)
+{
+  int i;
+
+  for (i = 0; i < mon->nshards; i++) {
+    flush_batch(&mon->shards[i]);
+    pthread_mutex_unlock(&mon->shards[i].lock);
+  }
+}
+
+
+/* monitor_reload - re-read the config file and bring the running
+ *                  jobs in line with it. Jobs whose source and
+ *                  destination did not change keep their watches,
+ *                  only new, removed and changed jobs are touched.
+ *                  A config that fails to parse is ignored and the
+ *                  old jobs keep running. The shards are stopped
+ *                  meanwhile.
+ */
+
+static void monitor_reload(monitor_st *mon)
+{
+  job_st *cfg_jobs;
+  job_st *old_jobs;
+  job_st *running = NULL;
+  job_st **tail = &running;
+  job_st *job, *next, *old, **prev;
+
+  if (!(cfg_jobs = load_jobs(mon))) {
+    log_msg(LOG_ERR, "reload failed, keeping the current config");
+    return;
+  }
+  lock_all(mon);
+
+  // stop everything that was removed or points somewhere else first,
+  // a changed job may reuse directories (and so watches) of its old self
+  for (job = mon->jobs; job; job = job->next) {
+    next = job_find(cfg_jobs, job->name);
+    if (!next || !job_same_tree(job, next)) {
+      job_stop(shard_of(mon, job), job);
+    }
+  }
+
+  old_jobs = mon->jobs;
+  for (job = cfg_jobs; job; job = next) {
+    next = job->next;
+    job->next = NULL;
+
+    for (prev = &old_jobs; (old = *prev); prev = &old->next) {
+      if (strcmp(old->name, job->name) == 0) {
+	break;
+      }
+    }
+
+    if (old && job_same_tree(old, job)) {
+      // same tree, keep the running job (and its watches) but pick
+      // up anything that can change under it
+      *prev = old->next;
+      old->next = NULL;
+      job_retune(old, job);
+      job_release(job);
+      job = old;
+    } else {
+      job_start(shard_of(mon, job), job);
+    }
+
+    *tail = job;
+    tail = &job->next;
+  }
+
+  // whatever is left was stopped above
+  job_free_list(old_jobs);
+
+  mon->jobs = running;
+  unlock_all(mon);
+
+  scrub_jobs(mon->jobs);
+  trash_jobs(mon->jobs);
+  log_msg(LOG_INFO, "config reloaded");
+}
+
+
+static void move_from(shard_st *sh, job_st *job, char *rel, uint32_t cookie, int is_dir)
+{
+  move_st **tail = &sh->moves;
+  move_st *m;
+
+  if (!(m = malloc(sizeof(move_st)))) {
+    if (is_dir) {
+      remove_tree(sh, job, rel);
+    } else {
+      emit(sh, OP_UNLINK, job, rel, NULL, 0);
+    }
+    free(rel);
+    return;
+  }
+
+  m->cookie = cookie;
+  m->job = job;
+  m->path = rel;
+  m->is_dir = is_dir;
+  m->next = NULL;
+
+  clock_gettime(CLOCK_MONOTONIC, &m->deadline);
+  m->deadline.tv_nsec += MOVE_WINDOW_MS * 1000000L;
+  if (m->deadline.tv_nsec >= 1000000000L) {
+    m->deadline.tv_sec += 1;
+    m->deadline.tv_nsec -= 1000000000L;
+  }
+
+  while (*tail) {
+    tail = &(*tail)->next;
+  }
+  *tail = m;
+}
+
+
+static move_st *move_take(shard_st *sh, uint32_t cookie)
+{
+  move_st **prev;
+  move_st *m;
+
+  for (prev = &sh->moves; (m = *prev); prev = &m->next) {
+    if (m->cookie == cookie) {
+      *prev = m->next;
+      return (m);
+    }
+  }
+
+  return (NULL);
+}
+
+
+/* moves_expire - moves that were not paired within the window left
+ *                the watched tree (or the filter), so remove the
+ *                destination copy
+ */
+
+static void moves_expire(shard_st *sh)
+{
+  struct timespec now;
+  move_st *m;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  while ((m = sh->moves)) {
+    if (m->deadline.tv_sec > now.tv_sec ||
+	(m->deadline.tv_sec == now.tv_sec && m->deadline.tv_nsec > now.tv_nsec)) {
+      // the list is in arrival order, so nothing after this expired either
+      break;
+    }
+
+    sh->moves = m->next;
+    if (m->is_dir) {
+      if (sh->watches) {
+	watch_remove_tree(sh->watches, m->job, m->path);
+      }
+      remove_tree(sh, m->job, m->path);
+    } else {
+      emit(sh, OP_UNLINK, m->job, m->path, NULL, 0);
+    }
+    move_free(m);
+  }
+}
+
+
+/* time left until the oldest pending move expires */
+static void moves_timeout(shard_st *sh, struct timeval *time)
+{
+  struct timespec now;
+  long usec;
+
+  if (!sh->moves) {
+    return;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  usec = (sh->moves->deadline.tv_sec - now.tv_sec) * 1000000L +
+    (sh->moves->deadline.tv_nsec - now.tv_nsec) / 1000L;
+  if (usec < 0) {
+    usec = 0;
+  }
+
+  time->tv_sec = usec / 1000000L;
+  time->tv_usec = usec % 1000000L;
+}
+
+
+/* a directory showed up that we know nothing about: watch it and
+ * copy it over */
+static void new_dir(shard_st *sh, job_st *job, const char *rel)
+{
+  if (sh->watches) {
+    watch_add_tree(sh->watches, job, rel, NULL);
+  }
+  // files may have been created before the watch was in place
+  emit(sh, OP_POPULATE, job, rel, NULL, 1);
+}
+
+
+static void move_to(shard_st *sh, job_st *job, const char *rel, uint32_t cookie, int is_dir)
+{
+  move_st *m = cookie ? move_take(sh, cookie) : NULL;
+
+  if (!m) {
+    // moved in from outside the watched tree
+    if (is_dir) {
+      new_dir(sh, job, rel);
+    } else {
+      emit(sh, OP_COPY, job, rel, NULL, 0);
+    }
+    return;
+  }
+
+  if (m->job == job) {
+    if (is_dir && sh->watches) {
+      watch_rename_tree(sh->watches, job, m->path, rel);
+    }
+    emit(sh, OP_RENAME, job, m->path, rel, is_dir);
+  } else if (is_dir) {
+    // moved between two jobs
+    if (sh->watches) {
+      watch_remove_tree(sh->watches, m->job, m->path);
+    }
+    remove_tree(sh, m->job, m->path);
+    new_dir(sh, job, rel);
+  } else {
+    emit(sh, OP_UNLINK, m->job, m->path, NULL, 0);
+    emit(sh, OP_COPY, job, rel, NULL, 0);
+  }
+
+  move_free(m);
+}
+
+
+/* record - write an event to the trace, with what a replay needs to
+ *          make the same change: the size the file grew (or shrank)
+ *          to, or its new mode
+ */
+
+static void record(job_st *job, const char *rel, uint32_t mask, uint32_t cookie)
+{
+  const char *base;
+  struct stat st;
+  uint64_t arg = 0;
+  int dir;
+
+  if ((mask & (IN_CREATE | IN_MODIFY | IN_MOVED_TO | IN_ATTRIB)) &&
+      (dir = dir_open(job->src, rel, &base)) >= 0 &&
+      fstatat(dir, base, &st, AT_SYMLINK_NOFOLLOW) == 0) {
+    arg = (mask & IN_ATTRIB) ? (uint64_t)st.st_mode : (uint64_t)st.st_size;
+  }
+
+  pthread_mutex_lock(&record_lock);
+  if (recording && trace_event(recording, job->name, rel, mask, cookie, arg) < 0) {
+    log_msg(LOG_ERR, "trace: %s, recording stopped", strerror(errno));
+    trace_close(recording);
+    recording = NULL;
+  }
+  pthread_mutex_unlock(&record_lock);
+}
+
+
+/* handle_change - turn one change to job->src/rel into ops. Both
+ *                 backends end up here, with inotify mask bits
+ *
+ * rel - IN - malloc'd, taken over
+ */
+
+static void handle_change(shard_st *sh, job_st *job, char *rel, uint32_t mask,
+			  uint32_t cookie)
+{
+  int is_dir = (mask & IN_ISDIR) != 0;
+
+  if (recording) {
+    record(job, rel, mask, cookie);
+  }
+
+  if (!filter_match(job->filter, rel, is_dir)) {
+    free(rel);
+    return;
+  }
+
+  // directory fds cached under the old path no longer match it
+  if (is_dir && (mask & (IN_DELETE | IN_MOVED_FROM))) {
+    dir_invalidate();
+  }
+
+  switch (mask & ~IN_ISDIR) {
+  case IN_DELETE:
+    if (is_dir) {
+      remove_tree(sh, job, rel);
+    } else {
+      emit(sh, OP_UNLINK, job, rel, NULL, 0);
+    }
+    break;
+
+  case IN_MOVED_FROM:
+    // held back until we know where it went
+    move_from(sh, job, rel, cookie, is_dir);
+    return;
+
+  case IN_MOVED_TO:
+    move_to(sh, job, rel, cookie, is_dir);
+    break;
+
+  case IN_CREATE:
+    if (is_dir) {
+      new_dir(sh, job, rel);
+    } else {
+      emit(sh, OP_COPY, job, rel, NULL, 0);
+    }
+    break;
+
+  case IN_MODIFY:
+    emit(sh, OP_COPY, job, rel, NULL, 0);
+    break;
+
+  case IN_ATTRIB:
+    emit(sh, OP_META, job, rel, NULL, is_dir);
+    break;
+
+  default:
+    //do something...
+    break;
+  }
+
+  free(rel);
+}
+
+
+static void handle_event(shard_st *sh, struct inotify_event *event)
+{
+  watch_st *w;
+  char *rel;
+
+  if (event->mask & IN_Q_OVERFLOW) {
+    log_msg(LOG_WARNING, "inotify queue overflow, events were lost");
+    return;
+  }
+
+  if (!(w = watch_get(sh->watches, event->wd))) {
+    return;
+  }
+
+  if (event->mask & IN_IGNORED) {
+    watch_forget(sh->watches, event->wd);
+    return;
+  }
+
+  if (!event->len) {
+    return;
+  }
+
+  if (!(rel = watch_path(sh->watches, w, event->name))) {
+    return;
+  }
+
+  handle_change(sh, w->job, rel, event->mask, event->cookie);
+}
+
+
+/* fan_event - an event from the fanotify backend. It covers whole
+ *             filesystems, so first find the job (if any) that dir
+ *             belongs to. The job list only changes while every
+ *             shard is locked
+ */
+
+static void fan_event(void *arg, const char *dir, const char *name, uint32_t mask,
+		      uint32_t cookie)
+{
+  shard_st *sh = (shard_st *)arg;
+  job_st *job;
+  char *rel;
+
+  if (mask & IN_Q_OVERFLOW) {
+    log_msg(LOG_WARNING, "fanotify queue overflow, events were lost");
+    return;
+  }
+
+  // marks are per filesystem, so other shards' jobs show up here too
+  for (job = sh->mon->jobs; job; job = job->next) {
+    if (job->shard == sh->no && !job_is_stopped(job) && path_in_tree(dir, job->src)) {
+      break;
+    }
+  }
+  if (!job) {
+    return;
+  }
+
+  dir += strlen(job->src);
+  if (*dir == '/') {
+    ++dir;
+  }
+
+  if ((rel = path_join(dir, name))) {
+    handle_change(sh, job, rel, mask, cookie);
+  }
+}
+
+
+/* drain the config directory's inotify fd, looking for our file */
+static void check_cfg_events(monitor_st *mon)
+{
+  char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  struct inotify_event *event;
+  ssize_t len;
+  int i;
+
+  while ((len = read(mon->cfg_fd, buf, sizeof(buf))) > 0) {
+    for (i = 0; i < len; i += sizeof(struct inotify_event) + event->len) {
+      event = (struct inotify_event *) &buf[i];
+
+      if (event->len && strcmp(event->name, mon->cfg_name) == 0) {
+	reload_requested = 1;
+      }
+    }
+  }
+}
+
+
+/*
+ * Requests on the control socket (see control.c):
+ *
+ *   status        queue depths, copies in flight and lag, per job
+ *   pause <job>   hold the job's changes back (journaled) until
+ *   resume <job>  it is resumed
+ *   flush         answer once everything accepted so far is copied
+ *                 and on disk
+ *   sync <path>   copy path, a file or a whole directory, again
+ *
+ * They are served on the main thread, which locks a job's shard to
+ * reach into it.
+ */
+
+
+typedef struct flush_st {
+  int fd;                  // to answer on
+  job_st **jobs;           // to syncfs the destinations of, held
+  int n;
+  unsigned long held;      // not flushed, their jobs are paused
+} flush_st;
+
+
+static unsigned long count_held(shard_st *sh, job_st *job)
+{
+  unsigned long n = 0;
+  op_st *op;
+
+  for (op = sh->held; op; op = op->next) {
+    if (!job || op->job == job) {
+      ++n;
+    }
+  }
+  return (n);
+}
+
+
+static void ctl_status(monitor_st *mon, int fd)
+{
+  sched_stats_st stats[NUM_CLASSES];
+  sched_job_stats_st js;
+  scrub_stats_st ss;
+  trash_stats_st ts;
+  pack_stats_st ps;
+  remote_stats_st rs;
+  sched_queue_stats_st qs;
+  size_t running = 0;
+  size_t watches, paths;
+  unsigned long held;
+  shard_st *sh;
+  job_st *job;
+  int i, n, cpus;
+
+  sched_stats(stats);
+  for (job = mon->jobs; job; job = job->next) {
+    sched_job_stats(job, &js);
+    running += js.running;
+  }
+
+  dprintf(fd, "copies queued: %zu small, %zu medium, %zu large\n", stats[CLASS_SMALL].queued,
+	  stats[CLASS_MEDIUM].queued, stats[CLASS_LARGE].queued);
+  dprintf(fd, "copies in flight: %zu\n", running);
+  dprintf(fd, "tasks pending: %u\n", task_pending());
+
+  sched_queue_stats(&qs);
+  dprintf(fd, "copy queue memory: %zu bytes", qs.mem);
+  if (qs.limit) {
+    dprintf(fd, " of %zu, %zu copies spilled (%" PRIu64 " bytes)", qs.limit, qs.spilled,
+	    qs.spill_bytes);
+  }
+  dprintf(fd, "\n");
+
+  scrub_stats(&ss);
+  if (ss.enabled) {
+    dprintf(fd, "scrub: %lu passes, %s%s%s%" PRIu64 " files compared (%" PRIu64
+	    " from cached checksums), %" PRIu64 " bytes read, %" PRIu64 " mismatches, %" PRIu64
+	    " repairs queued\n", ss.passes, ss.job[0] ? "at job " : "", ss.job,
+	    ss.job[0] ? ", " : "", ss.files, ss.cached, ss.bytes, ss.mismatches, ss.repairs);
+  }
+
+  trash_stats(&ts);
+  if (ts.enabled) {
+    dprintf(fd, "trash: kept %lds, %" PRIu64 " deletions moved there, %" PRIu64 " entries (%"
+	    PRIu64 " bytes) purged\n", (long)ts.keep, ts.moved, ts.purged, ts.bytes);
+  }
+
+  watches = paths = 0;
+  for (i = 0; i < mon->nshards; i++) {
+    sh = &mon->shards[i];
+    if (sh->watches) {
+      pthread_mutex_lock(&sh->lock);
+      watches += sh->watches->map->entries;
+      paths += pathtree_memory(sh->watches->paths);
+      pthread_mutex_unlock(&sh->lock);
+    }
+  }
+  if (watches) {
+    dprintf(fd, "watches: %zu directories, %zu bytes of paths\n", watches, paths);
+  }
+
+  for (i = 0; i < mon->nshards && mon->nshards > 1; i++) {
+    n = 0;
+    for (job = mon->jobs; job; job = job->next) {
+      n += (job->shard == i);
+    }
+    if ((cpus = CPU_COUNT(&mon->shards[i].cpus))) {
+      dprintf(fd, "shard %d: %d jobs, on %d CPUs\n", i, n, cpus);
+    } else {
+      dprintf(fd, "shard %d: %d jobs, not pinned\n", i, n);
+    }
+  }
+
+  for (job = mon->jobs; job; job = job->next) {
+    sh = shard_of(mon, job);
+    sched_job_stats(job, &js);
+    pthread_mutex_lock(&sh->lock);
+    held = count_held(sh, job);
+    pthread_mutex_unlock(&sh->lock);
+    dprintf(fd, "job %s: %s, %zu queued, %zu copying, %lu held, lag %.2fs\n", job->name,
+	    job->paused ? "paused" : "running", js.queued, js.running, held, js.lag_us / 1e6);
+    if (job->remote) {
+      remote_stats(job->remote, &rs);
+      dprintf(fd, "job %s: %s %s, %zu unacknowledged, %" PRIu64 " bytes in flight, %zu to "
+	      "resend\n", job->name, rs.connected ? "connected to" : "reconnecting to",
+	      job->dst, rs.unacked, rs.in_flight, rs.retry);
+    }
+    if (job->pack_size) {
+      pack_stats(job, &ps);
+      dprintf(fd, "job %s: %" PRIu64 " files packed (%" PRIu64 " bytes) in %d segments, %"
+	      PRIu64 " bytes to reclaim, %" PRIu64 " moved by compaction\n", job->name, ps.files,
+	      ps.live, ps.segments, ps.dead, ps.compacted);
+    }
+  }
+}
+
+
+static void ctl_pause(monitor_st *mon, int fd, const char *name, int pause)
+{
+  job_st *job = job_find(mon->jobs, name);
+  op_st *held = NULL;
+  op_st **tail = &held;
+  unsigned long n;
+  shard_st *sh;
+
+  if (!job) {
+    dprintf(fd, "error: no job %s\n", name);
+    return;
+  }
+
+  // its shard looks at paused as it applies each batch
+  sh = shard_of(mon, job);
+  pthread_mutex_lock(&sh->lock);
+
+  if (pause) {
+    job->paused = 1;
+    pthread_mutex_unlock(&sh->lock);
+    log_msg(LOG_INFO, "job %s paused", job->name);
+    dprintf(fd, "ok: job %s paused\n", job->name);
+    return;
+  }
+
+  // what was held goes ahead of anything in the current batch
+  job->paused = 0;
+  n = take_held(sh, job, &tail);
+  if (held) {
+    *tail = sh->batch;
+    if (!sh->batch) {
+      sh->batch_tail = tail;
+    }
+    sh->batch = held;
+  }
+  flush_batch(sh);
+  pthread_mutex_unlock(&sh->lock);
+
+  log_msg(LOG_INFO, "job %s resumed, %lu held changes applied", job->name, n);
+  dprintf(fd, "ok: job %s resumed, %lu held changes applied\n", job->name, n);
+}
+
+
+static void flush_free(flush_st *f)
+{
+  while (f->n--) {
+    job_release(f->jobs[f->n]);
+  }
+  free(f->jobs);
+  free(f);
+}
+
+
+static void *flush_main(void *arg)
+{
+  flush_st *f = (flush_st *)arg;
+  int fd, i, err = 0;
+  const char *failed = NULL;
+  job_st *job;
+
+  sched_barrier();
+  task_barrier();
+  // the files of trees populated meanwhile were queued as copies
+  sched_barrier();
+
+  for (i = 0; i < f->n; i++) {
+    job = f->jobs[i];
+    fd = -1;
+    // a remote destination is synced by its receiver, once it has
+    // applied everything sent so far
+    if (job->remote ? remote_sync(job->remote) < 0 :
+	(fd = open(job->dst, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0 || syncfs(fd) < 0) {
+      log_msg(LOG_WARNING, "flush %s: %s", job->dst, strerror(errno));
+      if (!failed) {
+	failed = job->dst;
+	err = errno;
+      }
+    }
+    if (fd >= 0) {
+      close(fd);
+    }
+  }
+
+  if (failed) {
+    dprintf(f->fd, "error: %s: %s\n", failed, strerror(err));
+  } else if (f->held) {
+    dprintf(f->fd, "ok: flushed, %lu changes held by paused jobs\n", f->held);
+  } else {
+    dprintf(f->fd, "ok: flushed\n");
+  }
+
+  close(f->fd);
+  flush_free(f);
+
+  return (NULL);
+}
+
+
+/* ctl_flush - wait for the copies on a thread of its own, so the
+ *             event loop goes on meanwhile
+ *
+ * returns - 1 if the thread took fd, 0 if it was answered here
+ */
+
+static int ctl_flush(monitor_st *mon, int fd)
+{
+  flush_st *f;
+  pthread_t tid;
+  job_st *job;
+  int n = 0;
+  int i;
+
+  for (job = mon->jobs; job; job = job->next) {
+    ++n;
+  }
+
+  if (!(f = calloc(1, sizeof(flush_st))) || !(f->jobs = calloc(n + 1, sizeof(job_st *)))) {
+    free(f);
+    dprintf(fd, "error: out of memory\n");
+    return (0);
+  }
+  f->fd = fd;
+  for (i = 0; i < mon->nshards; i++) {
+    pthread_mutex_lock(&mon->shards[i].lock);
+    f->held += count_held(&mon->shards[i], NULL);
+    pthread_mutex_unlock(&mon->shards[i].lock);
+  }
+
+  // a reload may stop them meanwhile
+  for (job = mon->jobs; job; job = job->next) {
+    job_hold(job);
+    f->jobs[f->n++] = job;
+  }
+
+  if (pthread_create(&tid, NULL, flush_main, f) != 0) {
+    flush_free(f);
+    dprintf(fd, "error: %s\n", strerror(errno));
+    return (0);
+  }
+  pthread_detach(tid);
+
+  return (1);
+}
+
+
+static void ctl_sync(monitor_st *mon, int fd, const char *path)
+{
+  struct stat st;
+  const char *rel;
+  shard_st *sh;
+  job_st *job;
+  int is_dir;
+
+  for (job = mon->jobs; job; job = job->next) {
+    if (path_in_tree(path, job->src)) {
+      break;
+    }
+  }
+  if (!job) {
+    dprintf(fd, "error: %s is not in any job\n", path);
+    return;
+  }
+
+  rel = path + strlen(job->src);
+  if (*rel == '/') {
+    ++rel;
+  }
+
+  if (lstat(path, &st) < 0) {
+    dprintf(fd, "error: %s: %s\n", path, strerror(errno));
+    return;
+  }
+  if (!S_ISDIR(st.st_mode) && !S_ISREG(st.st_mode)) {
+    dprintf(fd, "error: %s is not a file or directory\n", path);
+    return;
+  }
+  is_dir = S_ISDIR(st.st_mode);
+
+  if (*rel && !filter_match(job->filter, rel, is_dir)) {
+    dprintf(fd, "error: %s is excluded from job %s\n", path, job->name);
+    return;
+  }
+
+  sh = shard_of(mon, job);
+  pthread_mutex_lock(&sh->lock);
+  emit(sh, is_dir ? OP_POPULATE : OP_COPY, job, rel, NULL, is_dir);
+  flush_batch(sh);
+  pthread_mutex_unlock(&sh->lock);
+
+  dprintf(fd, "ok: %s queued for job %s%s\n", path, job->name,
+	  job->paused ? " (paused)" : "");
+}
+
+
+/*
+ * An upgrade (see handoff.c) stops the shards, lets the task thread
+ * and the running copies finish and takes the queued copies out of the
+ * scheduler, then hands the shards' fds and everything the new process
+ * needs to carry on over to it. With a journal, the ops not applied
+ * yet are left to its replay in the new process instead of being sent.
+ * If anything fails on the way the new process is killed and this one
+ * carries on.
+ */
+
+
+typedef struct send_arg_st {
+  FILE *fp;
+  watch_table_st *wt;
+  int shard;
+  int err;
+} send_arg_st;
+
+
+static void send_watch(void *key, void *val, void *arg)
+{
+  send_arg_st *a = (send_arg_st *)arg;
+  watch_st *w = (watch_st *)val;
+  char *path;
+
+  // a directory replaced by another has no path, its events are stale
+  if (a->err || !(path = watch_path(a->wt, w, NULL))) {
+    return;
+  }
+  a->err = handoff_write(a->fp, HANDOFF_WATCH, a->shard, w->wd, 0, 1, w->job->name, path);
+  free(path);
+}
+
+
+static int send_op(FILE *fp, op_st *op)
+{
+  size_t len = op_encode(op, NULL, 0);
+  char *buf;
+  int ret;
+
+  // not one the new process could be given, so no handoff
+  if (!len) {
+    log_msg(LOG_ERR, "upgrade: job %s: an op cannot be handed over: %s", op->job->name,
+	    strerror(errno));
+    return (-1);
+  }
+  if (!(buf = malloc(len))) {
+    return (-1);
+  }
+  op_encode(op, buf, len);
+  ret = handoff_write_op(fp, op->job->shard, buf, len);
+  free(buf);
+  return (ret);
+}
+
+
+/* send_state - write the records of a handoff, shards locked */
+static int send_state(monitor_st *mon, FILE *fp, op_st *queued)
+{
+  struct timespec now;
+  send_arg_st arg;
+  shard_st *sh;
+  job_st *job;
+  move_st *m;
+  op_st *op;
+  long ms;
+  int i, err = 0;
+
+  // jobs first, the new process decides what to adopt from them
+  for (job = mon->jobs; job && !err; job = job->next) {
+    err = handoff_write(fp, HANDOFF_JOB, job->shard, 0, 0, 1, job->name, job->src);
+  }
+  for (job = mon->jobs; job && !err; job = job->next) {
+    if (job->paused) {
+      err = handoff_write(fp, HANDOFF_PAUSED, job->shard, 0, 0, 0, job->name, NULL);
+    }
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  for (i = 0; i < mon->nshards && !err; i++) {
+    sh = &mon->shards[i];
+    if (sh->watches) {
+      arg.fp = fp;
+      arg.wt = sh->watches;
+      arg.shard = i;
+      arg.err = 0;
+      hash_map_foreach(sh->watches->map, send_watch, &arg);
+      err = arg.err;
+    }
+    for (m = sh->moves; m && !err; m = m->next) {
+      ms = (m->deadline.tv_sec - now.tv_sec) * 1000 +
+	(m->deadline.tv_nsec - now.tv_nsec) / 1000000;
+      err = handoff_write(fp, HANDOFF_MOVE, i, m->cookie, ms > 0 ? ms : 0, m->is_dir,
+			  m->job->name, m->path);
+    }
+    for (op = sh->held; op && !err && !mon->journaled; op = op->next) {
+      err = send_op(fp, op);
+    }
+  }
+  for (op = queued; op && !err && !mon->journaled; op = op->next) {
+    err = send_op(fp, op);
+  }
+
+  if (!err) {
+    err = handoff_write(fp, HANDOFF_END, 0, 0, 0, 0, "", NULL);
+  }
+  return (err || fflush(fp) != 0 ? -1 : 0);
+}
+
+
+static void ctl_upgrade(monitor_st *mon, int fd)
+{
+  int fds[mon->nshards];
+  op_st *queued, *op;
+  FILE *fp = NULL;
+  job_st *job;
+  int sock, dfd, i;
+  pid_t pid;
+
+  if (recording) {
+    dprintf(fd, "error: not while recording a trace\n");
+    return;
+  }
+  if (!mon->exe || (sock = handoff_spawn(mon->exe, mon->cfg_file, mon->foreground, &pid)) < 0) {
+    dprintf(fd, "error: cannot start %s: %s\n", mon->exe ? mon->exe : "backupd",
+	    mon->exe ? strerror(errno) : "unknown binary");
+    return;
+  }
+  log_msg(LOG_INFO, "upgrade: handing over to %s, pid %d", mon->exe, (int)pid);
+
+  // from here on events wait in the fds
+  lock_all(mon);
+  for (i = 0; i < mon->nshards; i++) {
+    flush_batch(&mon->shards[i]);
+    fds[i] = mon->shards[i].fd;
+  }
+  task_drain();
+  queued = sched_stop();
+  for (job = mon->jobs; job; job = job->next) {
+    if (job->remote && remote_sync(job->remote) < 0) {
+      log_msg(LOG_WARNING, "upgrade: job %s: %s not synced: %s", job->name, job->dst,
+	      strerror(errno));
+    }
+  }
+  journal_sync();
+
+  if (handoff_send_fds(sock, mon->nshards, mon->shards[0].fan != NULL, fds,
+		       mon->control ? mon->control->fd : -1) == 0 &&
+      (dfd = dup(sock)) >= 0 && !(fp = fdopen(dfd, "w"))) {
+    close(dfd);
+  }
+  if (fp && send_state(mon, fp, queued) == 0 && handoff_wait(sock) == 0) {
+    // the new process waits for the pid file lock, which goes with us
+    log_msg(LOG_INFO, "upgrade: handed over to pid %d", (int)pid);
+    dprintf(fd, "ok: handed over to pid %d\n", (int)pid);
+    _exit(0);
+  }
+
+  log_msg(LOG_ERR, "upgrade: handoff to pid %d failed: %s", (int)pid, strerror(errno));
+  dprintf(fd, "error: handoff to pid %d failed: %s\n", (int)pid, strerror(errno));
+  kill(pid, SIGKILL);
+  waitpid(pid, NULL, 0);
+  if (fp) {
+    fclose(fp);
+  }
+  close(sock);
+
+  sched_restart();
+  while ((op = queued)) {
+    queued = op->next;
+    op->next = NULL;
+    sched_submit(op);
+  }
+  unlock_all(mon);
+}
+
+
+/* control_cmd - a request from the control socket, see above */
+static int control_cmd(void *arg, int fd, char *line)
+{
+  monitor_st *mon = (monitor_st *)arg;
+  char *param = strchr(line, ' ');
+
+  if (param) {
+    *param++ = '\0';
+  }
+
+  if (strcmp(line, "status") == 0 && !param) {
+    ctl_status(mon, fd);
+  } else if ((strcmp(line, "pause") == 0 || strcmp(line, "resume") == 0) && param) {
+    ctl_pause(mon, fd, param, line[0] == 'p');
+  } else if (strcmp(line, "flush") == 0 && !param) {
+    return (ctl_flush(mon, fd));
+  } else if (strcmp(line, "sync") == 0 && param && param[0] == '/') {
+    ctl_sync(mon, fd, param);
+  } else if (strcmp(line, "upgrade") == 0 && !param) {
+    ctl_upgrade(mon, fd);
+  } else {
+    dprintf(fd, "error: bad request\n");
+  }
+
+  return (0);
+}
+
+
+/*
+ * Jobs are placed on shards (SHARDS in [BACKUPD], job_place), each an
+ * event loop on a thread of its own with its own inotify (or fanotify)
+ * fd, watch table, pending moves and batch, and its own copy workers
+ * (see sched.c), optionally pinned to a set of CPUs. A shard's thread
+ * holds its lock while it handles what it read. The main thread keeps
+ * the config file, the control socket and snapshots, and takes the
+ * lock of a shard to reach into it. What the shards still share is
+ * the journal, the task thread and the scrub.
+ */
+
+
+/* shard_init - open the event fd of a shard, or take over fd (-1 for
+ *              none) handed over by the daemon this one replaces
+ *
+ * returns - 0 on success, -1 on error (logged)
+ */
+
+static int shard_init(monitor_st *mon, int no, int fanotify, const cpu_set_t *cpus, int fd)
+{
+  shard_st *sh = &mon->shards[no];
+
+  sh->mon = mon;
+  sh->no = no;
+  sh->batch_tail = &sh->batch;
+  sh->held_tail = &sh->held;
+  pthread_mutex_init(&sh->lock, NULL);
+  if (cpus) {
+    sh->cpus = *cpus;
+  }
+
+  if (fanotify) {
+    if ((sh->fan = (fd >= 0) ? fan_adopt(fd) : fan_init())) {
+      sh->fd = sh->fan->fd;
+    } else {
+      log_msg(LOG_WARNING, "fanotify: %s, using inotify", strerror(errno));
+    }
+    fd = -1;
+  }
+
+  if (!sh->fan) {
+    if ((sh->fd = (fd >= 0) ? fd : inotify_init()) < 0) {
+      log_msg(LOG_ERR, "inotify: %s", strerror(errno));
+      return (-1);
+    }
+
+    if (!(sh->watches = watch_init(sh->fd, WATCH_MASK))) {
+      return (-1);
+    }
+  }
+
+  return (0);
+}
+
+
+/* read_events - handle whatever is waiting on the shard's fd, lock
+ *               held
+ *
+ * returns - 0 on success, -1 if the fd failed
+ */
+
+static int read_events(shard_st *sh)
+{
+  char buf[1024 * sizeof(struct inotify_event)]
+    __attribute__((aligned(__alignof__(struct inotify_event))));
+  struct inotify_event *event;
+  int len, i = 0;
+
+  if (sh->fan) {
+    return (fan_read(sh->fan, fan_event, sh));
+  }
+
+  len = read (sh->fd, buf, sizeof(buf));
+  if (len < 0) {
+    // interrupted, reissued on the next time around
+    return (errno == EINTR ? 0 : -1);
+  } else if (!len) {
+    // this shouldnt happen. if it does...blow up
+    return (-1);
+  }
+
+  while (i < len) {
+    event = (struct inotify_event *) &buf[i];
+    handle_event(sh, event);
+
+    i += sizeof(struct inotify_event) + event->len;
+  }
+
+  return (0);
+}
+
+
+static void *shard_main(void *arg)
+{
+  shard_st *sh = (shard_st *)arg;
+  struct timeval time;
+  fd_set descript;
+  int ret;
+
+  while (1) {
+    time.tv_sec = 1;
+    time.tv_usec = 0;
+    pthread_mutex_lock(&sh->lock);
+    moves_timeout(sh, &time);
+    pthread_mutex_unlock(&sh->lock);
+
+    FD_ZERO(&descript);
+    FD_SET (sh->fd, &descript);
+
+    ret = select (sh->fd + 1, &descript, NULL, NULL, &time);
+    if (ret < 0 && errno != EINTR) {
+      log_msg(LOG_ERR, "shard %d: %s", sh->no, strerror(errno));
+      exit(1);
+    }
+
+    pthread_mutex_lock(&sh->lock);
+    if (ret > 0 && read_events(sh) < 0) {
+      log_msg(LOG_ERR, "shard %d: cannot read events: %s", sh->no, strerror(errno));
+      exit(1);
+    }
+    moves_expire(sh);
+    flush_batch(sh);
+    pthread_mutex_unlock(&sh->lock);
+  }
+
+  return (NULL);
+}
+
+
+/* shard_run - start the event loop thread of a shard, on its CPUs */
+static int shard_run(shard_st *sh)
+{
+  pthread_attr_t attr;
+  int ret;
+
+  pthread_attr_init(&attr);
+  if (CPU_COUNT(&sh->cpus) &&
+      pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), &sh->cpus) != 0) {
+    log_msg(LOG_WARNING, "shard %d: cannot pin the event loop", sh->no);
+  }
+  ret = pthread_create(&sh->tid, &attr, shard_main, sh);
+  pthread_attr_destroy(&attr);
+
+  return (ret == 0 ? 0 : -1);
+}
+
+
+/* handed_over - can job keep the watches it had in the daemon we
+ *               replace? Only on the same shard, whose fd we took, and
+ *               for the same source. The job records come first
+ */
+
+static int handed_over(handoff_st *h, job_st *job, const int *taken)
+{
+  handoff_rec_st rec;
+  const char *a, *b;
+  size_t pos = 0;
+
+  while (handoff_next(h, &pos, &rec, &a, &b) && rec.type == HANDOFF_JOB) {
+    if (strcmp(a, job->name) == 0) {
+      return (rec.shard == job->shard && taken[job->shard] && strcmp(b, job->src) == 0);
+    }
+  }
+  return (0);
+}
+
+
+static job_st *find_adopted(job_st **adopted, int n, const char *name)
+{
+  while (n--) {
+    if (strcmp(adopted[n]->name, name) == 0) {
+      return (adopted[n]);
+    }
+  }
+  return (NULL);
+}
+
+
+/* take_over - carry on from what the daemon we replace handed over:
+ *             jobs that can keep their watches take them (and their
+ *             pending moves), the others are started afresh once the
+ *             watches they had are gone. Ops it did not get to apply
+ *             go in the batches, paused jobs stay paused
+ */
+
+static void take_over(monitor_st *mon, handoff_st *h, const int *taken)
+{
+  unsigned long watches = 0, ops = 0;
+  struct timespec now;
+  handoff_rec_st rec;
+  const char *a, *b;
+  job_st **adopted;
+  size_t pos = 0;
+  move_st **tail;
+  shard_st *sh;
+  job_st *job;
+  move_st *m;
+  op_st *op;
+  int n = 0;
+
+  for (job = mon->jobs; job; job = job->next) {
+    ++n;
+  }
+  if (!(adopted = calloc(n + 1, sizeof(job_st *)))) {
+    exit(1);
+  }
+  n = 0;
+  for (job = mon->jobs; job; job = job->next) {
+    if (!shard_of(mon, job)->fan && handed_over(h, job, taken)) {
+      adopted[n++] = job;
+    }
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  while (handoff_next(h, &pos, &rec, &a, &b)) {
+    switch (rec.type) {
+    case HANDOFF_PAUSED:
+      if ((job = job_find(mon->jobs, a))) {
+	job->paused = 1;
+      }
+      break;
+
+    case HANDOFF_OP:
+      if ((op = op_decode(a, rec.len, mon->jobs))) {
+	sh = shard_of(mon, op->job);
+	*sh->batch_tail = op;
+	sh->batch_tail = &op->next;
+	++ops;
+      }
+      break;
+
+    case HANDOFF_WATCH:
+      if ((job = find_adopted(adopted, n, a)) && rec.shard == job->shard) {
+	watches += (watch_adopt(shard_of(mon, job)->watches, job, b, rec.arg) == 0);
+      } else if (rec.shard < mon->nshards && taken[rec.shard]) {
+	inotify_rm_watch(mon->shards[rec.shard].fd, rec.arg);
+      }
+      break;
+
+    case HANDOFF_MOVE:
+      if (!(job = find_adopted(adopted, n, a)) || !(m = calloc(1, sizeof(move_st))) ||
+	  !(m->path = strdup(b))) {
+	free(job ? m : NULL);
+	break;
+      }
+      m->cookie = rec.arg;
+      m->job = job;
+      m->is_dir = rec.is_dir;
+      m->deadline = now;
+      m->deadline.tv_sec += rec.arg2 / 1000;
+      m->deadline.tv_nsec += (rec.arg2 % 1000) * 1000000L;
+      if (m->deadline.tv_nsec >= 1000000000L) {
+	m->deadline.tv_sec += 1;
+	m->deadline.tv_nsec -= 1000000000L;
+      }
+      for (tail = &shard_of(mon, job)->moves; *tail; tail = &(*tail)->next);
+      *tail = m;
+      break;
+
+    default:
+      break;
+    }
+  }
+
+  // the rest walk their trees, as on any start
+  for (job = mon->jobs; job; job = job->next) {
+    if (find_adopted(adopted, n, job->name)) {
+      log_msg(LOG_INFO, "job %s: %s -> %s, watches handed over", job->name, job->src,
+	      job->dst);
+    } else {
+      job_start(shard_of(mon, job), job);
+    }
+  }
+  log_msg(LOG_INFO, "upgrade: took over %d jobs, %lu watches and %lu changes not applied yet",
+	  n, watches, ops);
+  free(adopted);
+}
+
+
+void monitor_fs(const char *cfg_file, int foreground, handoff_st *h)
+{
+  monitor_st mon = {0};
+  struct timeval time;
+  fd_set descript;
+  config_st *cfg;
+  char *cfg_copy;
+  job_st *job;
+  shard_st *sh;
+  op_st *op, *replay = NULL;
+  int *taken;
+  int ret;
+  int i;
+
+  mon.cfg_file = cfg_file;
+  mon.foreground = foreground;
+  // for an upgrade, whatever is at this path by then is run
+  mon.exe = realpath("/proc/self/exe", NULL);
+
+  if (!(cfg = config_load(cfg_file))) {
+    exit(1);
+  }
+  mon.jobs = cfg->jobs;
+  cfg->jobs = NULL;
+
+  mon.nshards = cfg->shards;
+  job_place(mon.jobs, mon.nshards);
+  if (!(mon.shards = calloc(mon.nshards, sizeof(shard_st))) ||
+      !(taken = calloc(mon.nshards, sizeof(int)))) {
+    exit(1);
+  }
+  for (i = 0; i < mon.nshards; i++) {
+    // a handed over fd is only any use with the same backend
+    taken[i] = (h && i < h->nshards && h->fanotify == cfg->fanotify);
+    if (shard_init(&mon, i, cfg->fanotify, cfg->shard_cpus ? &cfg->shard_cpus[i] : NULL,
+		   taken[i] ? handoff_take_fd(h, i) : -1) < 0) {
+      exit(1);
+    }
+  }
+  mon.journaled = (cfg->journal != NULL);
+
+  if (task_start() < 0) {
+    exit(1);
+  }
+
+  if (sched_start(mon.nshards, cfg->workers, cfg->split_size, cfg->shard_cpus) < 0) {
+    exit(1);
+  }
+  replicate_cache(cfg->cache);
+  sched_limit(cfg->queue_memory, cfg->queue_spill);
+
+  if (cfg->journal) {
+    replay = journal_open(cfg->journal, mon.jobs);
+  }
+
+
+  // whatever a previous run accepted but did not get to apply, ahead
+  // of anything the walks below find
+  while ((op = replay)) {
+    replay = op->next;
+    op->next = NULL;
+    journal_append(op);
+    sh = shard_of(&mon, op->job);
+    *sh->batch_tail = op;
+    sh->batch_tail = &op->next;
+  }
+
+  if (h) {
+    take_over(&mon, h, taken);
+  } else {
+    for (job = mon.jobs; job; job = job->next) {
+      job_start(shard_of(&mon, job), job);
+    }
+  }
+  for (i = 0; i < mon.nshards; i++) {
+    flush_batch(&mon.shards[i]);
+  }
+  free(taken);
+
+  if (cfg->scrub) {
+    scrub_start(cfg->scrub, cfg->scrub_rate, mon.jobs);
+  }
+  if (cfg->trash) {
+    trash_start(cfg->trash_keep, cfg->trash_rate, mon.jobs);
+  }
+  config_free(cfg);
+
+  // watch the directory rather than the file, editors usually
+  // replace the file instead of writing it in place
+  cfg_copy = strdup(cfg_file);
+  mon.cfg_name = strdup(basename(cfg_copy));
+  strcpy(cfg_copy, cfg_file);
+  if ((mon.cfg_fd = inotify_init1(IN_NONBLOCK)) < 0 ||
+      inotify_add_watch(mon.cfg_fd, dirname(cfg_copy), CFG_MASK) < 0) {
+    log_msg(LOG_WARNING, "not watching %s for changes, use SIGHUP to reload", cfg_file);
+  }
+  free(cfg_copy);
+
+  // the socket clients of the old daemon were connecting to, if handed over
+  if (h && h->control_fd >= 0 && (mon.control = control_adopt(CONTROL_SOCKET, h->control_fd))) {
+    h->control_fd = -1;
+  } else {
+    mon.control = control_open(CONTROL_SOCKET);
+  }
+  handoff_free(h);
+
+  for (i = 0; i < mon.nshards; i++) {
+    if (shard_run(&mon.shards[i]) < 0) {
+      exit(1);
+    }
+  }
+
+  while (1) {
+    int max_fd = -1;
+
+    if (reload_requested) {
+      reload_requested = 0;
+      monitor_reload(&mon);
+    }
+
+    time.tv_sec = 1;
+    time.tv_usec = 0;
+
+    FD_ZERO(&descript);
+    if (mon.cfg_fd >= 0) {
+      FD_SET (mon.cfg_fd, &descript);
+      max_fd = mon.cfg_fd;
+    }
+    if (mon.control) {
+      max_fd = control_fds(mon.control, &descript, max_fd);
+    }
+
+    ret = select (max_fd + 1, &descript, NULL, NULL, &time);
+    if (ret < 0) {
+      if (errno == EINTR) {
+	// most likely SIGHUP, go around and reload
+	continue;
+      }
+      exit(1);
+    } else if (!ret) {
+      // nothing happened, but we timed out in select
+      snapshot_tick(mon.jobs);
+      continue;
+    }
+
+    if (mon.cfg_fd >= 0 && FD_ISSET (mon.cfg_fd, &descript)) {
+      check_cfg_events(&mon);
+    }
+
+    if (mon.control) {
+      control_serve(mon.control, &descript, control_cmd, &mon);
+    }
+
+    snapshot_tick(mon.jobs);
+  }
+}
+
+
+/* monitor_record - also write every event to trace_file, for
+ *                  monitor_replay. Called before monitor_fs
+ *
+ * returns - 0 on success, -1 with errno set
+ */
+
+int monitor_record(const char *trace_file)
+{
+  return ((recording = trace_create(trace_file)) ? 0 : -1);
+}
+
+
+static uint64_t now_us(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+}
+
+
+/* is dir empty, or missing? */
+static int scratch(const char *dir)
+{
+  struct dirent *ent;
+  DIR *d;
+  int empty = 1;
+
+  if (!(d = opendir(dir))) {
+    return (errno == ENOENT);
+  }
+  while (empty && (ent = readdir(d))) {
+    empty = (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0);
+  }
+  closedir(d);
+  return (empty);
+}
+
+
+/* monitor_replay - feed a trace through the replication pipeline. The
+ *                  config's jobs (matched by name) must point at empty
+ *                  scratch trees: each change is made to the job's
+ *                  source before its event is handled, in the batches
+ *                  they were read in. Reports how long it all took,
+ *                  once every copy is done
+ *
+ * fast - IN - as fast as possible, instead of at the traced times
+ */
+
+void monitor_replay(const char *cfg_file, const char *trace_file, int fast)
+{
+  static const char *names[NUM_CLASSES] = {"small", "medium", "large"};
+  sched_stats_st stats[NUM_CLASSES];
+  uint64_t events = 0, unknown = 0, failed = 0;
+  uint64_t start, at;
+  monitor_st mon = {0};
+  shard_st shard = {0};
+  shard_st *sh = &shard;
+  trace_rec_st rec;
+  config_st *cfg;
+  trace_st *t;
+  job_st *job;
+  double secs;
+  char *rel;
+  int ret;
+  int c;
+
+  // one shard, handled on this thread, that watches nothing
+  mon.cfg_file = cfg_file;
+  mon.shards = sh;
+  mon.nshards = 1;
+  sh->mon = &mon;
+  sh->fd = -1;
+  sh->batch_tail = &sh->batch;
+  sh->held_tail = &sh->held;
+
+  if (!(cfg = config_load(cfg_file))) {
+    exit(1);
+  }
+  mon.jobs = cfg->jobs;
+  cfg->jobs = NULL;
+  job_place(mon.jobs, 1);
+
+  // a replay writes, truncates and deletes below SOURCE, so a config
+  // pointing at real trees (the one the trace was recorded with) would
+  // destroy them
+  for (job = mon.jobs; job; job = job->next) {
+    if (!scratch(job->src) || (!remote_is_url(job->dst) && !scratch(job->dst))) {
+      log_msg(LOG_ERR, "replay: job %s: %s and %s are not empty, a replay needs empty "
+	      "scratch trees", job->name, job->src, job->dst);
+      exit(1);
+    }
+  }
+
+  if (!(t = trace_open(trace_file))) {
+    log_msg(LOG_ERR, "%s: %s", trace_file, strerror(errno));
+    exit(1);
+  }
+
+  // no journal, nothing of a replay is to be recovered
+  if (task_start() < 0 || sched_start(1, cfg->workers, cfg->split_size, NULL) < 0) {
+    exit(1);
+  }
+  replicate_cache(cfg->cache);
+  sched_limit(cfg->queue_memory, cfg->queue_spill);
+  config_free(cfg);
+
+  start = now_us();
+  while ((ret = trace_next(t, &rec)) > 0) {
+    if (!fast && (at = start + rec.time_us) > now_us()) {
+      usleep(at - now_us());
+    }
+
+    if (rec.type == TRACE_FLUSH) {
+      moves_expire(sh);
+      flush_batch(sh);
+      continue;
+    }
+
+    for (job = mon.jobs; job && strcmp(job->name, rec.job) != 0; job = job->next);
+    if (!job) {
+      unknown++;
+      continue;
+    }
+
+    if (trace_apply(t, job, &rec) < 0) {
+      failed++;
+    }
+    if ((rel = strdup(rec.path))) {
+      handle_change(sh, job, rel, rec.mask, rec.cookie);
+    }
+    events++;
+  }
+
+  if (ret < 0) {
+    log_msg(LOG_ERR, "%s: corrupt after %llu events", trace_file, (unsigned long long)events);
+  }
+
+  // whatever was moved out at the end
+  memset(&rec, 0, sizeof(rec));
+  trace_apply(t, NULL, &rec);
+  usleep(MOVE_WINDOW_MS * 1000);
+  moves_expire(sh);
+  flush_batch(sh);
+
+  task_drain();
+  sched_drain();
+  task_drain();
+  // what the populated trees queued
+  sched_drain();
+  secs = (now_us() - start) / 1e6;
+
+  log_msg(LOG_INFO, "replay: %llu events in %.2fs (%.0f/s), %llu for unknown jobs, "
+	  "%llu changes could not be made", (unsigned long long)events, secs,
+	  secs > 0 ? events / secs : 0.0, (unsigned long long)unknown,
+	  (unsigned long long)failed);
+
+  sched_stats(stats);
+  for (c = 0; c < NUM_CLASSES; c++) {
+    if (stats[c].done) {
+      log_msg(LOG_INFO, "replay: %s copies %llu, lag mean %.1fms max %.1fms", names[c],
+	      (unsigned long long)stats[c].done,
+	      stats[c].lag_total_us / (double)stats[c].done / 1000.0,
+	      stats[c].lag_max_us / 1000.0);
+    }
+  }
+
+  trace_close(t);
+}
@@ -0,0 +1,121 @@
+/*
+ * monitor.h
+ *
+ * Filesystem Monitor Definitions
+ * 
+ *
+ * Copyright (C) 2013  Bryant Moscon - bmoscon@gmail.com
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to 
+ * deal in the Software without restriction, including without limitation the 
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, 
+ *    this list of conditions and the following disclaimer in the documentation 
+ *    and/or other materials provided with the distribution, and in the same 
+ *    place and form as other copyright, license and disclaimer information.
+ *
+ * 3. The end-user documentation included with the redistribution, if any, must 
+ *    include the following acknowledgment: "This product includes software 
+ *    developed by Bryant Moscon (http://www.bryantmoscon.org/)", in the same 
+ *    place and form as other third-party acknowledgments. Alternately, this 
+ *    acknowledgment may appear in the software itself, in the same form and 
+ *    location as other such third-party acknowledgments.
+ *
+ * 4. Except as contained in this notice, the name of the author, Bryant Moscon,
+ *    shall not be used in advertising or otherwise to promote the sale, use or 
+ *    other dealings in this Software without prior written authorization from 
+ *    the author.
+ *
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL 
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN 
+ * THE SOFTWARE.
+ *
+ */
+
+#ifndef __MONITOR__
+#define __MONITOR__
+
+#include <stdint.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "job.h"
+#include "watch.h"
+#include "op.h"
+#include "fan.h"
+#include "control.h"
+#include "handoff.h"
+
+
+/* an IN_MOVED_FROM waiting for its IN_MOVED_TO */
+typedef struct move_st {
+  uint32_t cookie;
+  job_st *job;
+  char *path;
+  int is_dir;
+  struct timespec deadline;
+
+  struct move_st *next;
+} move_st;
+
+
+struct monitor_st;
+
+
+/* an event loop, for the jobs placed on it (see job_place) */
+typedef struct shard_st {
+  struct monitor_st *mon;
+  int no;
+  pthread_t tid;
+  pthread_mutex_t lock;    // held while it handles events, and by the
+			   // main thread to reach into it
+  cpu_set_t cpus;          // to run on, empty for anywhere
+
+  int fd;                  // inotify (or fanotify) fd for its job trees
+  watch_table_st *watches; // inotify only
+  fan_st *fan;             // fanotify only
+  move_st *moves;          // oldest first
+
+  op_st *batch;            // ops accepted from the current read
+  op_st **batch_tail;
+  op_st *held;             // journaled ops of paused jobs, in order
+  op_st **held_tail;
+} shard_st;
+
+
+typedef struct monitor_st {
+  const char *cfg_file;
+  const char *cfg_name;    // basename of cfg_file
+  int cfg_fd;              // inotify fd for the config file's directory
+  int foreground;          // logging to stderr
+  int journaled;           // JOURNAL is set
+  char *exe;               // the binary we were started from, for upgrades
+
+  job_st *jobs;            // only changed with every shard locked
+  shard_st *shards;
+  int nshards;
+
+  control_st *control;     // NULL if it could not be opened
+} monitor_st;
+
+
+void monitor_fs(const char *cfg_file, int foreground, handoff_st *h);
+int monitor_record(const char *trace_file);
+void monitor_replay(const char *cfg_file, const char *trace_file, int fast);
+void monitor_request_reload(void);
+
+
+#endif
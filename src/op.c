@@ -0,0 +1,278 @@
+/*
+ * op.c
+ *
+ * Replication operations - what an event turns into
+ * 
+ *
+ * Copyright (C) 2013  Bryant Moscon - bmoscon@gmail.com
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to 
+ * deal in the Software without restriction, including without limitation the 
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, 
+ *    this list of conditions and the following disclaimer in the documentation 
+ *    and/or other materials provided with the distribution, and in the same 
+ *    place and form as other copyright, license and disclaimer information.
+ *
+ * 3. The end-user documentation included with the redistribution, if any, must 
+ *    include the following acknowledgment: "This product includes software 
+ *    developed by Bryant Moscon (http://www.bryantmoscon.org/)", in the same 
+ *    place and form as other third-party acknowledgments. Alternately, this 
+ *    acknowledgment may appear in the software itself, in the same form and 
+ *    location as other such third-party acknowledgments.
+ *
+ * 4. Except as contained in this notice, the name of the author, Bryant Moscon,
+ *    shall not be used in advertising or otherwise to promote the sale, use or 
+ *    other dealings in this Software without prior written authorization from 
+ *    the author.
+ *
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL 
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN 
+ * THE SOFTWARE.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "op.h"
+#include "replicate.h"
+#include "journal.h"
+#include "task.h"
+#include "tail.h"
+#include "dircache.h"
+#include "remote.h"
+
+
+op_st *op_new(op_type type, job_st *job, const char *path, const char *path2, int is_dir)
+{
+  op_st *op;
+
+  if (!(op = calloc(1, sizeof(op_st)))) {
+    return (NULL);
+  }
+
+  op->type = type;
+  op->is_dir = is_dir;
+  op->job = job;
+  job_hold(job);
+
+  op->path = strdup(path);
+  if (!op->path || (path2 && !(op->path2 = strdup(path2)))) {
+    op_free(op);
+    return (NULL);
+  }
+
+  return (op);
+}
+
+
+void op_free(op_st *op)
+{
+  if (!op) {
+    return;
+  }
+
+  job_release(op->job);
+  free(op->path);
+  free(op->path2);
+  free(op);
+}
+
+
+/* op_apply - carry out an operation. It is marked done in the journal
+ *            once complete, which for whole subtree operations is
+ *            when their background task finishes. The op itself is
+ *            not freed
+ */
+
+void op_apply(op_st *op)
+{
+  job_st *job = op->job;
+
+  if (job_is_stopped(job)) {
+    journal_done(op->seq);
+    return;
+  }
+
+  if (job->remote) {
+    // the source's cached directory fds are just as stale
+    if (op->is_dir && (op->type == OP_RENAME || op->type == OP_REMOVE_TREE)) {
+      dir_invalidate();
+    }
+    remote_apply(job->remote, op);
+    return;
+  }
+
+  switch (op->type) {
+  case OP_COPY:
+    if (tail_wanted(job, op->path)) {
+      tail_copy(job, op->path);
+    } else {
+      replicate_copy(job, op->path);
+    }
+    break;
+
+  case OP_UNLINK:
+    tail_forget(job, op->path, 0);
+    replicate_unlink(job, op->path);
+    break;
+
+  case OP_REMOVE_TREE:
+    tail_forget(job, op->path, 1);
+    replicate_remove_tree(job, op->path, op->path2, op->seq);
+    // done once the background removal finishes
+    return;
+
+  case OP_RENAME:
+    // a renamed file is tailed again from a full copy
+    tail_forget(job, op->path, op->is_dir);
+    tail_forget(job, op->path2, op->is_dir);
+    if (op->is_dir) {
+      dir_invalidate();
+    }
+    if (replicate_rename(job, op->path, op->path2) == 0 || errno != ENOENT) {
+      break;
+    }
+
+    // the old copy is not there (never replicated, or filtered), so
+    // copy the new name instead
+    if (!op->is_dir) {
+      replicate_copy(job, op->path2);
+      break;
+    }
+    if (replicate_mkdir(job, op->path2) == 0) {
+      task_populate(job, op->path2, op->seq);
+      return;
+    }
+    break;
+
+  case OP_META:
+    replicate_meta(job, op->path);
+    break;
+
+  case OP_POPULATE:
+    if (replicate_mkdir(job, op->path) == 0) {
+      task_populate(job, op->path, op->seq);
+      return;
+    }
+    break;
+  }
+
+  journal_done(op->seq);
+}
+
+
+/*
+ * Encoded form, used by the journal:
+ *
+ * uint8_t  type
+ * uint8_t  is_dir
+ * uint16_t length of the job name
+ * uint16_t length of path
+ * uint16_t length of path2 (0 if none)
+ * job name, path, path2 - not NUL terminated
+ */
+
+#define OP_HDR 8
+
+
+/* op_encode - the encoded form of op, into buf if it fits
+ *
+ * returns - the length of the encoded form, 0 (ENAMETOOLONG) if a name
+ *           or path is too long for it
+ */
+
+size_t op_encode(op_st *op, char *buf, size_t len)
+{
+  size_t jl = strlen(op->job->name);
+  size_t pl = strlen(op->path);
+  size_t p2l = op->path2 ? strlen(op->path2) : 0;
+  uint16_t jlen = jl, plen = pl, p2len = p2l;
+  size_t need = OP_HDR + jl + pl + p2l;
+
+  if (jl > UINT16_MAX || pl > UINT16_MAX || p2l > UINT16_MAX) {
+    errno = ENAMETOOLONG;
+    return (0);
+  }
+  if (need > len) {
+    return (need);
+  }
+
+  buf[0] = (char)op->type;
+  buf[1] = (char)op->is_dir;
+  memcpy(&buf[2], &jlen, sizeof(jlen));
+  memcpy(&buf[4], &plen, sizeof(plen));
+  memcpy(&buf[6], &p2len, sizeof(p2len));
+  buf += OP_HDR;
+  memcpy(buf, op->job->name, jlen);
+  memcpy(buf + jlen, op->path, plen);
+  memcpy(buf + jlen + plen, op->path2, p2len);
+
+  return (need);
+}
+
+
+/* op_decode - rebuild an op from its encoded form
+ *
+ * jobs - IN - running jobs, the op is matched to one by name
+ *
+ * returns - op_st - the op, or NULL if it is malformed or its job
+ *                   no longer exists
+ */
+
+op_st *op_decode(const char *buf, size_t len, job_st *jobs)
+{
+  const char *hdr = buf;
+  uint16_t jlen, plen, p2len;
+  char name[UINT16_MAX + 1];
+  char *path = NULL;
+  char *path2 = NULL;
+  job_st *job;
+  op_st *op = NULL;
+
+  if (len < OP_HDR) {
+    return (NULL);
+  }
+
+  memcpy(&jlen, &buf[2], sizeof(jlen));
+  memcpy(&plen, &buf[4], sizeof(plen));
+  memcpy(&p2len, &buf[6], sizeof(p2len));
+  if (len != (size_t)OP_HDR + jlen + plen + p2len ||
+      buf[0] < OP_COPY || buf[0] > OP_META) {
+    return (NULL);
+  }
+  buf += OP_HDR;
+
+  memcpy(name, buf, jlen);
+  name[jlen] = '\0';
+  if (!(job = job_find(jobs, name))) {
+    return (NULL);
+  }
+
+  path = strndup(buf + jlen, plen);
+  if (p2len) {
+    path2 = strndup(buf + jlen + plen, p2len);
+  }
+
+  if (path && (path2 || !p2len)) {
+    op = op_new((op_type)hdr[0], job, path, path2, hdr[1]);
+  }
+
+  free(path);
+  free(path2);
+  return (op);
+}
@@ -0,0 +1,86 @@
+/*
+ * op.h
+ *
+ * Replication Operation Definitions
+ * 
+ *
+ * Copyright (C) 2013  Bryant Moscon - bmoscon@gmail.com
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to 
+ * deal in the Software without restriction, including without limitation the 
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, 
+ *    this list of conditions and the following disclaimer in the documentation 
+ *    and/or other materials provided with the distribution, and in the same 
+ *    place and form as other copyright, license and disclaimer information.
+ *
+ * 3. The end-user documentation included with the redistribution, if any, must 
+ *    include the following acknowledgment: "This product includes software 
+ *    developed by Bryant Moscon (http://www.bryantmoscon.org/)", in the same 
+ *    place and form as other third-party acknowledgments. Alternately, this 
+ *    acknowledgment may appear in the software itself, in the same form and 
+ *    location as other such third-party acknowledgments.
+ *
+ * 4. Except as contained in this notice, the name of the author, Bryant Moscon,
+ *    shall not be used in advertising or otherwise to promote the sale, use or 
+ *    other dealings in this Software without prior written authorization from 
+ *    the author.
+ *
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL 
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN 
+ * THE SOFTWARE.
+ *
+ */
+
+#ifndef __OP__
+#define __OP__
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "job.h"
+
+
+typedef enum op_type {
+  OP_COPY = 1,       // copy path
+  OP_UNLINK,         // remove file path
+  OP_REMOVE_TREE,    // remove directory path, staged under path2 first
+  OP_RENAME,         // rename path to path2
+  OP_POPULATE,       // create directory path and copy everything below it
+  OP_META            // apply the owner, mode, xattrs and times of path
+} op_type;
+
+
+typedef struct op_st {
+  uint64_t seq;      // journal sequence number, 0 if not journaled
+  op_type type;
+  int is_dir;
+  job_st *job;
+  char *path;
+  char *path2;
+
+  struct op_st *next;
+} op_st;
+
+
+op_st *op_new(op_type type, job_st *job, const char *path, const char *path2, int is_dir);
+void op_free(op_st *op);
+void op_apply(op_st *op);
+
+size_t op_encode(op_st *op, char *buf, size_t len);
+op_st *op_decode(const char *buf, size_t len, job_st *jobs);
+
+
+#endif
@@ -0,0 +1,1557 @@
+/*
+ * pack.c
+ *
+ * Small File Pack
+ * 
+ *
+ * Copyright (C) 2013  Bryant Moscon - bmoscon@gmail.com
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to 
+ * deal in the Software without restriction, including without limitation the 
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, 
+ *    this list of conditions and the following disclaimer in the documentation 
+ *    and/or other materials provided with the distribution, and in the same 
+ *    place and form as other copyright, license and disclaimer information.
+ *
+ * 3. The end-user documentation included with the redistribution, if any, must 
+ *    include the following acknowledgment: "This product includes software 
+ *    developed by Bryant Moscon (http://www.bryantmoscon.org/)", in the same 
+ *    place and form as other third-party acknowledgments. Alternately, this 
+ *    acknowledgment may appear in the software itself, in the same form and 
+ *    location as other such third-party acknowledgments.
+ *
+ * 4. Except as contained in this notice, the name of the author, Bryant Moscon,
+ *    shall not be used in advertising or otherwise to promote the sale, use or 
+ *    other dealings in this Software without prior written authorization from 
+ *    the author.
+ *
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL 
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN 
+ * THE SOFTWARE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "pack.h"
+#include "hash_map.h"
+#include "pathtree.h"
+#include "dircache.h"
+#include "watch.h"
+#include "idle.h"
+#include "log.h"
+
+
+/*
+ * With PACK=<size> in a job, files of up to that size do not get an
+ * inode of their own in the destination. Their contents are appended
+ * to a segment file and an index says where they went:
+ *
+ *   <DESTINATION>/.backupd/pack/<n>.seg   contents, back to back
+ *   <DESTINATION>/.backupd/pack/index     path -> segment, offset,
+ *                                         length, mode, owner, mtime
+ *
+ * so a copy is a pwrite() and a write() to files that are already
+ * open, instead of open/create/write/close/chown/chmod/utimes of a new
+ * file. Directories are still made in the destination. A segment is
+ * appended to until it passes PACK_SEGMENT bytes, then a new one is
+ * started.
+ *
+ * The index is a log: every change to a packed file (copied again,
+ * new metadata, renamed, deleted) appends a record, and the records
+ * are replayed into a hash map when the pack is opened. In memory the
+ * paths are nodes of a path tree (see pathtree.c), which key the map;
+ * a directory is in the tree only while something below it is packed. The contents
+ * a copy replaces stay in their segment as garbage. Once more than
+ * half of a segment that is no longer appended to is garbage, a
+ * thread at idle I/O priority moves what is still live to the current
+ * segment and deletes it (compaction). The index is rewritten from the
+ * map when it has more than twice as many records as there are files.
+ *
+ * Packed files keep their mode, owner and modification time, not their
+ * extended attributes. "backupd extract" writes them back out.
+ *
+ * Index record format, native byte order:
+ *
+ * uint32_t length of the body
+ * uint32_t checksum of the body
+ * pack_rec_st, then the path
+ *
+ * A torn or corrupt record ends the replay, and is cut off.
+ */
+
+
+#define PACK_SEGMENT (64 * 1024 * 1024)
+#define PACK_INDEX   "index"
+#define PACK_TICK    60           // seconds between looks for garbage
+#define PACK_BATCH   256          // files moved per turn of the lock
+#define INDEX_SLACK  4096         // records the index may have over twice the files
+
+#define REC_PUT 1
+#define REC_DEL 2
+
+#define REC_HDR (2 * sizeof(uint32_t))
+
+
+typedef struct pack_rec_st {
+  uint8_t type;            // REC_PUT or REC_DEL
+  uint8_t pad[3];
+  uint32_t seg;
+  uint64_t off;
+  uint32_t len;
+  uint32_t mode;
+  uint32_t uid;
+  uint32_t gid;
+  int64_t mtime;           // nanoseconds
+} pack_rec_st;
+
+
+typedef struct pack_ent_st {
+  uint32_t node;           // its path in the pack's tree, the map key
+  pack_rec_st rec;         // REC_PUT, where it is
+} pack_ent_st;
+
+
+typedef struct pack_seg_st {
+  uint32_t no;
+  int fd;
+  off_t size;
+  off_t live;              // of size, still in use
+} pack_seg_st;
+
+
+struct pack_st {
+  char *dst;
+  int writable;
+  int dir;                 // PACK_DIR
+  pthread_mutex_t lock;    // everything below
+
+  hash_map_st *ents;       // node -> pack_ent_st
+  pathtree_st *paths;      // of the packed files
+  uint32_t root;
+  pack_seg_st *segs;       // by number, the last one is appended to
+  int nsegs;
+
+  int index;               // appended to
+  uint64_t records;        // in it
+  char *buf;               // records not written yet
+  size_t len;
+  size_t cap;
+  uint64_t compacted;
+
+  int refs;                // jobs, and compaction while it runs
+  struct pack_st *next;    // open for writing, see packs
+};
+
+
+// packs open for writing, one per destination
+static struct {
+  pthread_mutex_t lock;
+  pthread_once_t once;
+  pack_st *list;
+} packs = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_ONCE_INIT, NULL};
+
+
+static uint32_t checksum(const char *buf, size_t len)
+{
+  uint32_t h = 2166136261u;
+
+  while (len--) {
+    h ^= (unsigned char)*buf++;
+    h *= 16777619u;
+  }
+  return (h);
+}
+
+
+static void seg_name(uint32_t no, char *buf, size_t len)
+{
+  snprintf(buf, len, "%08u.seg", no);
+}
+
+
+static pack_seg_st *seg_find(pack_st *p, uint32_t no)
+{
+  int lo = 0, hi = p->nsegs - 1, mid;
+
+  while (lo <= hi) {
+    mid = (lo + hi) / 2;
+    if (p->segs[mid].no == no) {
+      return (&p->segs[mid]);
+    }
+    if (p->segs[mid].no < no) {
+      lo = mid + 1;
+    } else {
+      hi = mid - 1;
+    }
+  }
+  return (NULL);
+}
+
+
+/* seg_add - open segment no (higher than any so far), lock held.
+ *           Moves p->segs
+ */
+
+static pack_seg_st *seg_add(pack_st *p, uint32_t no, int create)
+{
+  pack_seg_st *segs;
+  char name[32];
+  struct stat st;
+  int fd;
+
+  seg_name(no, name, sizeof(name));
+  if ((fd = openat(p->dir, name, (p->writable ? O_RDWR : O_RDONLY) | O_CLOEXEC |
+		   (create ? O_CREAT | O_EXCL : 0), S_IRUSR | S_IWUSR)) < 0) {
+    return (NULL);
+  }
+  if (fstat(fd, &st) < 0 ||
+      !(segs = realloc(p->segs, (p->nsegs + 1) * sizeof(pack_seg_st)))) {
+    close(fd);
+    return (NULL);
+  }
+
+  p->segs = segs;
+  segs[p->nsegs].no = no;
+  segs[p->nsegs].fd = fd;
+  segs[p->nsegs].size = st.st_size;
+  segs[p->nsegs].live = 0;
+  return (&segs[p->nsegs++]);
+}
+
+
+/* the segment to append to, a new one once the last is full; lock held */
+static pack_seg_st *seg_current(pack_st *p)
+{
+  pack_seg_st *last = p->nsegs ? &p->segs[p->nsegs - 1] : NULL;
+
+  if (last && last->size < PACK_SEGMENT) {
+    return (last);
+  }
+  return (seg_add(p, last ? last->no + 1 : 0, 1));
+}
+
+
+/* ent_find - the entry of packed file rel, NULL if there is none. Lock
+ *            held
+ */
+
+static pack_ent_st *ent_find(pack_st *p, const char *rel)
+{
+  uint32_t node = pathtree_find(p->paths, p->root, rel);
+
+  return (node ? hash_map_get(p->ents, (void *)(uintptr_t)node) : NULL);
+}
+
+
+/* the path of e, to be freed. Lock held */
+static char *ent_path(pack_st *p, pack_ent_st *e)
+{
+  return (pathtree_path(p->paths, p->root, e->node, NULL));
+}
+
+
+/* ent_set - rel is now where rec says, lock held */
+static pack_ent_st *ent_set(pack_st *p, const char *rel, const pack_rec_st *rec)
+{
+  pack_ent_st *e = ent_find(p, rel);
+  pack_seg_st *seg;
+
+  if (e) {
+    if ((seg = seg_find(p, e->rec.seg))) {
+      seg->live -= e->rec.len;
+    }
+  } else {
+    if (!(e = calloc(1, sizeof(pack_ent_st))) ||
+	!(e->node = pathtree_get(p->paths, p->root, rel)) ||
+	hash_map_put(p->ents, (void *)(uintptr_t)e->node, e) != 0) {
+      if (e) {
+	pathtree_put(p->paths, e->node);
+      }
+      free(e);
+      return (NULL);
+    }
+  }
+
+  e->rec = *rec;
+  e->rec.type = REC_PUT;
+  if ((seg = seg_find(p, rec->seg))) {
+    seg->live += rec->len;
+  }
+  return (e);
+}
+
+
+/* ent_drop - forget e, its contents are garbage now. Lock held */
+static void ent_drop(pack_st *p, pack_ent_st *e)
+{
+  pack_seg_st *seg;
+
+  if ((seg = seg_find(p, e->rec.seg))) {
+    seg->live -= e->rec.len;
+  }
+  hash_map_remove(p->ents, (void *)(uintptr_t)e->node);
+  pathtree_put(p->paths, e->node);
+  free(e);
+}
+
+
+/* rec_add - queue an index record, lock held */
+static int rec_add(pack_st *p, const pack_rec_st *rec, const char *rel)
+{
+  uint32_t plen = strlen(rel);
+  uint32_t body = sizeof(pack_rec_st) + plen;
+  size_t need = p->len + REC_HDR + body;
+  uint32_t sum;
+  char *b;
+
+  if (need > p->cap) {
+    size_t cap = p->cap ? p->cap : 65536;
+
+    while (cap < need) {
+      cap *= 2;
+    }
+    if (!(b = realloc(p->buf, cap))) {
+      return (-1);
+    }
+    p->buf = b;
+    p->cap = cap;
+  }
+
+  b = p->buf + p->len;
+  memcpy(b + REC_HDR, rec, sizeof(pack_rec_st));
+  memcpy(b + REC_HDR + sizeof(pack_rec_st), rel, plen);
+  sum = checksum(b + REC_HDR, body);
+  memcpy(b, &body, sizeof(body));
+  memcpy(b + sizeof(body), &sum, sizeof(sum));
+
+  p->len = need;
+  p->records++;
+  return (0);
+}
+
+
+/* rec_flush - write the queued records to the index, lock held. On
+ *             error the index is cut back to where it was, a torn
+ *             record would make the next open drop every later one
+ *
+ * returns - 0 on success, -1 on error (logged)
+ */
+
+static int rec_flush(pack_st *p)
+{
+  size_t off = 0;
+  off_t size;
+  ssize_t n;
+
+  if (!p->len) {
+    return (0);
+  }
+  if ((size = lseek(p->index, 0, SEEK_END)) < 0) {
+    log_msg(LOG_ERR, "pack %s: index: %s", p->dst, strerror(errno));
+    p->len = 0;
+    return (-1);
+  }
+
+  while (off < p->len) {
+    if ((n = write(p->index, p->buf + off, p->len - off)) <= 0) {
+      if (n < 0 && errno == EINTR) {
+	continue;
+      }
+      log_msg(LOG_ERR, "pack %s: index write: %s", p->dst, n < 0 ? strerror(errno) : "short write");
+      if (ftruncate(p->index, size) < 0) {
+	log_msg(LOG_ERR, "pack %s: index truncate: %s", p->dst, strerror(errno));
+      }
+      p->len = 0;
+      errno = n < 0 ? errno : EIO;
+      return (-1);
+    }
+    off += n;
+  }
+  p->len = 0;
+  return (0);
+}
+
+
+static void rec_meta(pack_rec_st *rec, struct stat *st)
+{
+  rec->mode = st->st_mode;
+  rec->uid = st->st_uid;
+  rec->gid = st->st_gid;
+  rec->mtime = (int64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+}
+
+
+static int by_name(const struct dirent **a, const struct dirent **b)
+{
+  return (strcmp((*a)->d_name, (*b)->d_name));
+}
+
+
+/* load_segs - open the segments there are, in order */
+static int load_segs(pack_st *p)
+{
+  struct dirent **list;
+  unsigned int no;
+  int n, i, end;
+  int ret = 0;
+
+  if ((n = scandirat(p->dir, ".", &list, NULL, by_name)) < 0) {
+    return (-1);
+  }
+
+  for (i = 0; i < n; i++) {
+    end = 0;
+    // zero padded, so in name order is in number order
+    if (sscanf(list[i]->d_name, "%8u.seg%n", &no, &end) == 1 && end &&
+	!list[i]->d_name[end] && ret == 0 && !seg_add(p, no, 0)) {
+      ret = -1;
+    }
+    free(list[i]);
+  }
+  free(list);
+
+  return (ret);
+}
+
+
+typedef struct check_arg_st {
+  pack_st *p;
+  unsigned long dropped;
+} check_arg_st;
+
+
+/* check_ent - drop an entry whose contents never made it to its segment */
+static void check_ent(void *key, void *val, void *arg)
+{
+  check_arg_st *a = arg;
+  pack_ent_st *e = val;
+  pack_seg_st *seg = seg_find(a->p, e->rec.seg);
+
+  if (!seg || e->rec.off + e->rec.len > (uint64_t)seg->size) {
+    ent_drop(a->p, e);
+    a->dropped++;
+  }
+}
+
+
+/* load_index - replay the index into the map */
+static int load_index(pack_st *p)
+{
+  check_arg_st arg = {p, 0};
+  pack_ent_st *e;
+  pack_rec_st rec;
+  uint32_t hdr[2];
+  off_t good = 0;
+  struct stat st;
+  char *body = NULL;
+  size_t cap = 0;
+  FILE *fp;
+  int fd;
+  int ret = 0;
+
+  if ((p->index = openat(p->dir, PACK_INDEX, p->writable ?
+			 O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC : O_RDONLY | O_CLOEXEC,
+			 S_IRUSR | S_IWUSR)) < 0) {
+    // nothing was packed yet
+    return ((errno == ENOENT && !p->writable) ? 0 : -1);
+  }
+  if ((fd = dup(p->index)) < 0 || !(fp = fdopen(fd, "r"))) {
+    if (fd >= 0) {
+      close(fd);
+    }
+    return (-1);
+  }
+
+  while (fread(hdr, sizeof(hdr), 1, fp) == 1) {
+    if (hdr[0] < sizeof(pack_rec_st) || hdr[0] > sizeof(pack_rec_st) + PATH_MAX) {
+      break;
+    }
+    if (hdr[0] + 1 > cap) {
+      char *b;
+
+      if (!(b = realloc(body, hdr[0] + 1))) {
+	ret = -1;
+	break;
+      }
+      body = b;
+      cap = hdr[0] + 1;
+    }
+    if (fread(body, hdr[0], 1, fp) != 1 || checksum(body, hdr[0]) != hdr[1]) {
+      break;
+    }
+    body[hdr[0]] = '\0';
+    memcpy(&rec, body, sizeof(rec));
+
+    if (rec.type == REC_PUT) {
+      if (!ent_set(p, body + sizeof(rec), &rec)) {
+	ret = -1;
+	break;
+      }
+    } else if ((e = ent_find(p, body + sizeof(rec)))) {
+      ent_drop(p, e);
+    }
+    good += REC_HDR + hdr[0];
+    p->records++;
+  }
+  free(body);
+  fclose(fp);
+
+  if (ret == 0 && fstat(p->index, &st) == 0 && good < st.st_size) {
+    log_msg(LOG_WARNING, "pack %s: index damaged after %lld bytes, the rest is dropped",
+	    p->dst, (long long)good);
+    if (p->writable && ftruncate(p->index, good) < 0) {
+      ret = -1;
+    }
+  }
+
+  // crashed between writing the index and the segment
+  hash_map_foreach(p->ents, check_ent, &arg);
+  if (arg.dropped) {
+    log_msg(LOG_WARNING, "pack %s: %lu files not found in their segments, dropped", p->dst,
+	    arg.dropped);
+  }
+
+  return (ret);
+}
+
+
+static void free_ent(void *key, void *val, void *arg)
+{
+  free(val);
+}
+
+
+static void pack_free(pack_st *p)
+{
+  int i;
+
+  for (i = 0; i < p->nsegs; i++) {
+    close(p->segs[i].fd);
+  }
+  free(p->segs);
+  if (p->ents) {
+    hash_map_foreach(p->ents, free_ent, NULL);
+    hash_map_free(p->ents);
+  }
+  pathtree_free(p->paths);
+  if (p->index >= 0) {
+    close(p->index);
+  }
+  if (p->dir >= 0) {
+    close(p->dir);
+  }
+  pthread_mutex_destroy(&p->lock);
+  free(p->buf);
+  free(p->dst);
+  free(p);
+}
+
+
+static void *pack_main(void *arg);
+
+
+static void start_compaction(void)
+{
+  pthread_t tid;
+
+  if (pthread_create(&tid, NULL, pack_main, NULL) != 0) {
+    log_msg(LOG_ERR, "pack: cannot start compaction: %s", strerror(errno));
+    return;
+  }
+  pthread_detach(tid);
+}
+
+
+/* pack_open - open the pack of a destination, and read its index
+ *
+ * dst    - IN - destination directory
+ * create - IN - to copy into: make it if it is not there, and let the
+ *               compaction thread look after it. Without, it is only
+ *               read from (see pack_extract)
+ *
+ * returns - the pack, to be closed with pack_close, or NULL with errno
+ *           set
+ */
+
+pack_st *pack_open(const char *dst, int create)
+{
+  char path[PATH_MAX];
+  char *slash;
+  pack_st *p;
+
+  if (job_path(dst, PACK_DIR, path, sizeof(path)) < 0) {
+    errno = ENAMETOOLONG;
+    return (NULL);
+  }
+
+  if (create) {
+    pthread_mutex_lock(&packs.lock);
+    // jobs (a restarted one and its old self) share it
+    for (p = packs.list; p; p = p->next) {
+      if (strcmp(p->dst, dst) == 0) {
+	p->refs++;
+	pthread_mutex_unlock(&packs.lock);
+	return (p);
+      }
+    }
+
+    // .backupd, then .backupd/pack
+    slash = strrchr(path, '/');
+    *slash = '\0';
+    mkdir(path, S_IRWXU);
+    *slash = '/';
+    mkdir(path, S_IRWXU);
+  }
+
+  if (!(p = calloc(1, sizeof(pack_st)))) {
+    if (create) {
+      pthread_mutex_unlock(&packs.lock);
+    }
+    return (NULL);
+  }
+  p->writable = create;
+  p->refs = 1;
+  p->dir = p->index = -1;
+  pthread_mutex_init(&p->lock, NULL);
+
+  if (!(p->dst = strdup(dst)) ||
+      !(p->ents = hash_map_init(1024, hash_map_int_hash, hash_map_int_cmp)) ||
+      !(p->paths = pathtree_init()) || !(p->root = pathtree_root(p->paths)) ||
+      (p->dir = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0 ||
+      load_segs(p) < 0 || load_index(p) < 0) {
+    int err = errno;
+
+    pack_free(p);
+    if (create) {
+      pthread_mutex_unlock(&packs.lock);
+    }
+    errno = err;
+    return (NULL);
+  }
+
+  if (create) {
+    p->next = packs.list;
+    packs.list = p;
+    pthread_mutex_unlock(&packs.lock);
+    pthread_once(&packs.once, start_compaction);
+  }
+  return (p);
+}
+
+
+/* pack_close - let go of a pack, it is closed once nobody uses it */
+void pack_close(pack_st *p)
+{
+  pack_st **prev;
+  int last;
+
+  if (!p) {
+    return;
+  }
+
+  pthread_mutex_lock(&packs.lock);
+  if ((last = (--p->refs == 0))) {
+    for (prev = &packs.list; *prev; prev = &(*prev)->next) {
+      if (*prev == p) {
+	*prev = p->next;
+	break;
+      }
+    }
+  }
+  pthread_mutex_unlock(&packs.lock);
+
+  if (last) {
+    pack_free(p);
+  }
+}
+
+
+/* pack_get - the pack of a job with PACK, opened on first use
+ *
+ * returns - NULL if the job does not pack its files (or its pack
+ *           cannot be opened, it then copies them as files)
+ */
+
+pack_st *pack_get(job_st *job)
+{
+  static pthread_mutex_t open_lock = PTHREAD_MUTEX_INITIALIZER;
+  pack_st *p;
+
+  if (!job->pack_size) {
+    return (NULL);
+  }
+  if ((p = __atomic_load_n(&job->pack, __ATOMIC_ACQUIRE))) {
+    return (p);
+  }
+
+  pthread_mutex_lock(&open_lock);
+  if (!(p = job->pack) && job->pack_size) {
+    if (!(p = pack_open(job->dst, 1))) {
+      log_msg(LOG_ERR, "job %s: cannot open %s/%s: %s, copying files instead", job->name,
+	      job->dst, PACK_DIR, strerror(errno));
+      job->pack_size = 0;
+    }
+    __atomic_store_n(&job->pack, p, __ATOMIC_RELEASE);
+  }
+  pthread_mutex_unlock(&open_lock);
+
+  return (p);
+}
+
+
+/* put - append the contents of rel to the current segment, and log
+ *       where they went. Lock held
+ *
+ * rec   - IN/OUT - metadata in, location out
+ * fresh - OUT - rel was not packed before
+ *
+ * returns - 0 on success, -1 on error
+ */
+
+static int put(pack_st *p, const char *rel, const char *data, size_t len, pack_rec_st *rec,
+	       int *fresh)
+{
+  pack_seg_st *seg;
+  size_t off = 0;
+  ssize_t n;
+
+  if (!(seg = seg_current(p))) {
+    return (-1);
+  }
+
+  while (off < len) {
+    if ((n = pwrite(seg->fd, data + off, len - off, seg->size + off)) < 0) {
+      if (errno == EINTR) {
+	continue;
+      }
+      return (-1);
+    }
+    off += n;
+  }
+
+  rec->type = REC_PUT;
+  rec->seg = seg->no;
+  rec->off = seg->size;
+  rec->len = len;
+  seg->size += len;
+
+  if (fresh) {
+    *fresh = !ent_find(p, rel);
+  }
+  if (rec_add(p, rec, rel) < 0 || !ent_set(p, rel, rec)) {
+    return (-1);
+  }
+  return (0);
+}
+
+
+/* pack_copy - copy job->src/rel into the job's pack, if it is small
+ *             enough
+ *
+ * returns - 0 if it was packed, -1 on error (logged), 1 if it is to
+ *           be copied as a file (no PACK, too big, not a file)
+ */
+
+int pack_copy(job_st *job, const char *rel)
+{
+  pack_rec_st rec = {0}, old = {0};
+  pack_ent_st *e;
+  const char *base;
+  struct stat st;
+  pack_st *p;
+  size_t len = 0;
+  ssize_t n = 0;
+  char *buf;
+  int fresh = 0;
+  int dir, fd;
+  int ret;
+
+  if (!(p = pack_get(job))) {
+    return (1);
+  }
+
+  // if it cannot be read, the copy says why
+  if ((dir = dir_open(job->src, rel, &base)) < 0 ||
+      (fd = openat(dir, base, O_RDONLY | O_NOFOLLOW | O_CLOEXEC)) < 0) {
+    return (1);
+  }
+  if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size > job->pack_size ||
+      !(buf = malloc(job->pack_size + 1))) {
+    close(fd);
+    return (1);
+  }
+
+  // up to one byte more than fits, to tell it grew too big
+  while (len <= (size_t)job->pack_size &&
+	 (n = read(fd, buf + len, job->pack_size + 1 - len)) != 0) {
+    if (n < 0) {
+      if (errno == EINTR) {
+	continue;
+      }
+      break;
+    }
+    len += n;
+  }
+  if (n < 0 || len > (size_t)job->pack_size || fstat(fd, &st) < 0) {
+    close(fd);
+    free(buf);
+    return (1);
+  }
+  close(fd);
+
+  rec_meta(&rec, &st);
+  pthread_mutex_lock(&p->lock);
+  if ((e = ent_find(p, rel))) {
+    old = e->rec;
+  }
+  if ((ret = put(p, rel, buf, len, &rec, &fresh)) < 0) {
+    log_msg(LOG_WARNING, "pack %s/%s: %s", job->dst, rel, strerror(errno));
+  }
+  if (rec_flush(p) < 0 && ret == 0) {
+    // not in the index: a new file is copied as a file instead (and
+    // any copy of it as one kept), a packed one keeps what it had
+    if (e) {
+      ent_set(p, rel, &old);
+      ret = -1;
+    } else {
+      if ((e = ent_find(p, rel))) {
+	ent_drop(p, e);
+      }
+      ret = 1;
+    }
+  }
+  pthread_mutex_unlock(&p->lock);
+  free(buf);
+
+  // it was copied as a file before
+  if (ret == 0 && fresh && (dir = dir_open(job->dst, rel, &base)) >= 0) {
+    unlinkat(dir, base, 0);
+  }
+
+  return (ret);
+}
+
+
+typedef struct below_arg_st {
+  pack_st *p;
+  uint32_t top;
+  pack_ent_st **list;
+  size_t n;
+  size_t cap;
+} below_arg_st;
+
+
+static void below_ent(void *key, void *val, void *arg)
+{
+  below_arg_st *a = arg;
+  pack_ent_st *e = val;
+  pack_ent_st **list;
+
+  if (e->node == a->top || !pathtree_below(a->p->paths, e->node, a->top)) {
+    return;
+  }
+  if (a->n == a->cap) {
+    if (!(list = realloc(a->list, (a->cap ? a->cap * 2 : 64) * sizeof(pack_ent_st *)))) {
+      return;
+    }
+    a->list = list;
+    a->cap = a->cap ? a->cap * 2 : 64;
+  }
+  a->list[a->n++] = val;
+}
+
+
+/* below - the packed files below directory rel, lock held
+ *
+ * returns - malloc'd list (NULL for none), n is set to its length
+ */
+
+static pack_ent_st **below(pack_st *p, const char *rel, size_t *n)
+{
+  below_arg_st a = {p, pathtree_find(p->paths, p->root, rel), NULL, 0, 0};
+
+  // most directories have nothing packed below them, so are not in the tree
+  if (!a.top) {
+    *n = 0;
+    return (NULL);
+  }
+
+  hash_map_foreach(p->ents, below_ent, &a);
+  *n = a.n;
+  return (a.list);
+}
+
+
+/* pack_forget - rel was removed from the source, and with tree set
+ *               everything below it
+ *
+ * returns - 0 if rel itself was a packed file, -1 if not
+ */
+
+int pack_forget(job_st *job, const char *rel, int tree)
+{
+  pack_rec_st rec = {REC_DEL};
+  pack_ent_st **list;
+  pack_ent_st *e;
+  char *path;
+  pack_st *p;
+  size_t n = 0, i;
+  int ret = -1;
+
+  if (!(p = pack_get(job))) {
+    return (-1);
+  }
+
+  pthread_mutex_lock(&p->lock);
+  if ((e = ent_find(p, rel))) {
+    rec_add(p, &rec, rel);
+    ent_drop(p, e);
+    ret = 0;
+  }
+
+  if (tree && (list = below(p, rel, &n))) {
+    for (i = 0; i < n; i++) {
+      if ((path = ent_path(p, list[i]))) {
+	rec_add(p, &rec, path);
+	free(path);
+      }
+      ent_drop(p, list[i]);
+    }
+    free(list);
+  }
+  rec_flush(p);
+  pthread_mutex_unlock(&p->lock);
+
+  return (ret);
+}
+
+
+/* move - packed file e, at from, is now called to. Lock held */
+static void move(pack_st *p, pack_ent_st *e, const char *from, const char *to)
+{
+  pack_rec_st del = {REC_DEL};
+  pack_rec_st rec = e->rec;
+
+  rec_add(p, &del, from);
+  ent_drop(p, e);
+  rec_add(p, &rec, to);
+  ent_set(p, to, &rec);
+}
+
+
+/* pack_rename - from was renamed to in the source: a packed file, or a
+ *               directory with packed files below it
+ *
+ * returns - 0 if from itself was a packed file, -1 if not
+ */
+
+int pack_rename(job_st *job, const char *from, const char *to)
+{
+  pack_rec_st del = {REC_DEL};
+  size_t flen = strlen(from);
+  pack_ent_st **list;
+  pack_ent_st *e;
+  pack_st *p;
+  size_t n = 0, i;
+  char *name, *old;
+  int ret = -1;
+
+  if (!(p = pack_get(job))) {
+    return (-1);
+  }
+
+  pthread_mutex_lock(&p->lock);
+  // what was there is replaced
+  if ((e = ent_find(p, to))) {
+    rec_add(p, &del, to);
+    ent_drop(p, e);
+  }
+
+  if ((e = ent_find(p, from))) {
+    move(p, e, from, to);
+    ret = 0;
+  } else if ((list = below(p, from, &n))) {
+    for (i = 0; i < n; i++) {
+      if ((old = ent_path(p, list[i])) && (name = path_join(to, old + flen + 1))) {
+	move(p, list[i], old, name);
+	free(name);
+      }
+      free(old);
+    }
+    free(list);
+  }
+  rec_flush(p);
+  pthread_mutex_unlock(&p->lock);
+
+  return (ret);
+}
+
+
+/* pack_meta - take over a metadata change of job->src/rel, if it is a
+ *             packed file
+ *
+ * returns - 0 on success, -1 with errno ENOENT if rel is not packed
+ */
+
+int pack_meta(job_st *job, const char *rel)
+{
+  const char *base;
+  pack_ent_st *e;
+  pack_rec_st rec;
+  struct stat st;
+  pack_st *p;
+  int dir;
+  int ret = -1;
+
+  if (!(p = pack_get(job))) {
+    errno = ENOENT;
+    return (-1);
+  }
+
+  pthread_mutex_lock(&p->lock);
+  e = ent_find(p, rel);
+  pthread_mutex_unlock(&p->lock);
+  if (!e) {
+    errno = ENOENT;
+    return (-1);
+  }
+
+  if ((dir = dir_open(job->src, rel, &base)) < 0 ||
+      fstatat(dir, base, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+    // gone, or going
+    return (0);
+  }
+
+  pthread_mutex_lock(&p->lock);
+  if ((e = ent_find(p, rel))) {
+    rec = e->rec;
+    rec_meta(&rec, &st);
+    if ((ret = rec_add(p, &rec, rel)) == 0 && (ret = rec_flush(p)) == 0) {
+      e->rec = rec;
+    }
+  }
+  pthread_mutex_unlock(&p->lock);
+
+  return (ret);
+}
+
+
+/* pack_stat - what is known of packed file rel: mode, owner, size and
+ *             modification time
+ *
+ * returns - 0 on success, -1 with errno ENOENT if it is not packed
+ */
+
+int pack_stat(pack_st *p, const char *rel, struct stat *st)
+{
+  pack_ent_st *e;
+  int ret = -1;
+
+  pthread_mutex_lock(&p->lock);
+  if ((e = ent_find(p, rel))) {
+    memset(st, 0, sizeof(struct stat));
+    st->st_mode = e->rec.mode;
+    st->st_uid = e->rec.uid;
+    st->st_gid = e->rec.gid;
+    st->st_nlink = 1;
+    st->st_size = e->rec.len;
+    st->st_mtim.tv_sec = e->rec.mtime / 1000000000;
+    st->st_mtim.tv_nsec = e->rec.mtime % 1000000000;
+    ret = 0;
+  }
+  pthread_mutex_unlock(&p->lock);
+
+  if (ret < 0) {
+    errno = ENOENT;
+  }
+  return (ret);
+}
+
+
+/* read e's contents into buf, lock held */
+static ssize_t read_ent(pack_st *p, pack_ent_st *e, void *buf, size_t len)
+{
+  pack_seg_st *seg;
+  ssize_t n;
+
+  if (!(seg = seg_find(p, e->rec.seg))) {
+    errno = EIO;
+    return (-1);
+  }
+  if (len > e->rec.len) {
+    len = e->rec.len;
+  }
+  while ((n = pread(seg->fd, buf, len, e->rec.off)) < 0 && errno == EINTR);
+  return (n);
+}
+
+
+/* pack_read - read (up to len bytes of) packed file rel
+ *
+ * returns - the number of bytes read, -1 on error (ENOENT if it is
+ *           not packed)
+ */
+
+ssize_t pack_read(pack_st *p, const char *rel, void *buf, size_t len)
+{
+  pack_ent_st *e;
+  ssize_t n = -1;
+
+  pthread_mutex_lock(&p->lock);
+  if ((e = ent_find(p, rel))) {
+    n = read_ent(p, e, buf, len);
+  } else {
+    errno = ENOENT;
+  }
+  pthread_mutex_unlock(&p->lock);
+
+  return (n);
+}
+
+
+typedef struct in_seg_arg_st {
+  uint32_t no;
+  uint32_t *list;          // nodes
+  size_t n;
+  size_t cap;
+} in_seg_arg_st;
+
+
+static void in_seg(void *key, void *val, void *arg)
+{
+  in_seg_arg_st *a = arg;
+  uint32_t *list;
+
+  if (((pack_ent_st *)val)->rec.seg != a->no) {
+    return;
+  }
+  if (a->n == a->cap) {
+    if (!(list = realloc(a->list, (a->cap ? a->cap * 2 : 64) * sizeof(uint32_t)))) {
+      return;
+    }
+    a->list = list;
+    a->cap = a->cap ? a->cap * 2 : 64;
+  }
+  a->list[a->n++] = ((pack_ent_st *)val)->node;
+}
+
+
+/* compact_seg - move what is still live in segment no to the current
+ *               one, PACK_BATCH files at a time, then delete it
+ *
+ * returns - 0 once it is gone, -1 if not
+ */
+
+static int compact_seg(pack_st *p, uint32_t no)
+{
+  in_seg_arg_st a = {no, NULL, 0, 0};
+  pack_seg_st *seg;
+  pack_ent_st *e;
+  pack_rec_st rec;
+  char name[32];
+  char *rel = NULL;
+  char *buf;
+  size_t i;
+  ssize_t n;
+  int ret = 0;
+
+  if (!(buf = malloc(PACK_MAX))) {
+    return (-1);
+  }
+
+  pthread_mutex_lock(&p->lock);
+  hash_map_foreach(p->ents, in_seg, &a);
+  pthread_mutex_unlock(&p->lock);
+
+  for (i = 0; i < a.n; i++) {
+    if (i % PACK_BATCH == 0) {
+      if (i) {
+	rec_flush(p);
+	pthread_mutex_unlock(&p->lock);
+      }
+      pthread_mutex_lock(&p->lock);
+    }
+
+    // copied again or gone in the meantime (a node of a file that
+    // went can be another one's by now, which is moved just the same)
+    if (ret < 0 || !(e = hash_map_get(p->ents, (void *)(uintptr_t)a.list[i])) ||
+	e->rec.seg != no) {
+      continue;
+    }
+    rec = e->rec;
+    if (!(rel = ent_path(p, e))) {
+      ret = -1;
+    } else if ((n = read_ent(p, e, buf, PACK_MAX)) != (ssize_t)rec.len) {
+      errno = (n < 0) ? errno : EIO;
+      ret = -1;
+    } else if (put(p, rel, buf, n, &rec, NULL) < 0) {
+      ret = -1;
+    }
+    if (ret < 0) {
+      log_msg(LOG_WARNING, "pack %s: cannot move %s: %s", p->dst, rel ? rel : "a file",
+	      strerror(errno));
+      free(rel);
+      continue;
+    }
+    free(rel);
+    p->compacted += n;
+  }
+  if (a.n) {
+    rec_flush(p);
+    pthread_mutex_unlock(&p->lock);
+  }
+
+  free(a.list);
+  free(buf);
+
+  pthread_mutex_lock(&p->lock);
+  if (ret == 0 && (seg = seg_find(p, no)) && seg->live == 0) {
+    // the new places have to last before the old ones go
+    fdatasync(p->segs[p->nsegs - 1].fd);
+    fdatasync(p->index);
+
+    seg_name(no, name, sizeof(name));
+    if (unlinkat(p->dir, name, 0) < 0) {
+      log_msg(LOG_WARNING, "pack %s: cannot remove %s: %s", p->dst, name, strerror(errno));
+      ret = -1;
+    } else {
+      close(seg->fd);
+      memmove(seg, seg + 1, (p->nsegs - (seg - p->segs) - 1) * sizeof(pack_seg_st));
+      p->nsegs--;
+    }
+  } else {
+    ret = -1;
+  }
+  pthread_mutex_unlock(&p->lock);
+
+  return (ret);
+}
+
+
+typedef struct rewrite_arg_st {
+  pack_st *p;
+  int failed;
+} rewrite_arg_st;
+
+
+static void rewrite_ent(void *key, void *val, void *arg)
+{
+  rewrite_arg_st *a = arg;
+  pack_ent_st *e = val;
+  char *rel;
+
+  if (a->failed || !(rel = ent_path(a->p, e))) {
+    a->failed = 1;
+    return;
+  }
+  if (rec_add(a->p, &e->rec, rel) < 0 || (a->p->len >= (1 << 20) && rec_flush(a->p) < 0)) {
+    a->failed = 1;
+  }
+  free(rel);
+}
+
+
+/* rewrite - write a new index, from the map. Lock held */
+static int rewrite(pack_st *p)
+{
+  rewrite_arg_st a = {p, 0};
+  uint64_t records = p->records;
+  int old = p->index;
+  int fd;
+
+  if ((fd = openat(p->dir, PACK_INDEX ".new", O_WRONLY | O_CREAT | O_TRUNC | O_APPEND |
+		   O_CLOEXEC, S_IRUSR | S_IWUSR)) < 0) {
+    return (-1);
+  }
+
+  p->index = fd;
+  p->records = 0;
+  hash_map_foreach(p->ents, rewrite_ent, &a);
+  if (a.failed || rec_flush(p) < 0 || fdatasync(fd) < 0 ||
+      renameat(p->dir, PACK_INDEX ".new", p->dir, PACK_INDEX) < 0) {
+    log_msg(LOG_WARNING, "pack %s: cannot rewrite the index: %s", p->dst, strerror(errno));
+    p->len = 0;
+    p->index = old;
+    p->records = records;
+    close(fd);
+    unlinkat(p->dir, PACK_INDEX ".new", 0);
+    return (-1);
+  }
+
+  close(old);
+  return (0);
+}
+
+
+/* pack_compact - reclaim the space of what was replaced or deleted:
+ *                every segment (but the current one) that is more
+ *                than half garbage is moved out of the way, and the
+ *                index is rewritten if it grew too long
+ *
+ * returns - 0 on success, -1 on error (logged)
+ */
+
+int pack_compact(pack_st *p)
+{
+  uint32_t no = 0;
+  int i, found;
+  int ret = 0;
+
+  do {
+    found = 0;
+    pthread_mutex_lock(&p->lock);
+    for (i = 0; i + 1 < p->nsegs; i++) {
+      if (p->segs[i].live * 2 < p->segs[i].size || !p->segs[i].live) {
+	no = p->segs[i].no;
+	found = 1;
+	break;
+      }
+    }
+    pthread_mutex_unlock(&p->lock);
+  } while (found && (ret = compact_seg(p, no)) == 0);
+
+  pthread_mutex_lock(&p->lock);
+  if (p->records > 2 * p->ents->entries + INDEX_SLACK && rewrite(p) < 0) {
+    ret = -1;
+  }
+  pthread_mutex_unlock(&p->lock);
+
+  return (ret);
+}
+
+
+static void *pack_main(void *arg)
+{
+  pack_st **list;
+  pack_st *p;
+  int n, i;
+
+  idle_thread();
+
+  while (1) {
+    sleep(PACK_TICK);
+
+    pthread_mutex_lock(&packs.lock);
+    for (n = 0, p = packs.list; p; p = p->next) {
+      n++;
+    }
+    if ((list = malloc((n + 1) * sizeof(pack_st *)))) {
+      for (i = 0, p = packs.list; p; p = p->next) {
+	p->refs++;
+	list[i++] = p;
+      }
+    } else {
+      n = 0;
+    }
+    pthread_mutex_unlock(&packs.lock);
+
+    for (i = 0; i < n; i++) {
+      pack_compact(list[i]);
+      pack_close(list[i]);
+    }
+    free(list);
+  }
+
+  return (NULL);
+}
+
+
+typedef struct extract_item_st {
+  char *rel;
+  pack_ent_st *e;
+} extract_item_st;
+
+
+typedef struct extract_arg_st {
+  pack_st *p;
+  uint32_t top;            // of sub
+  extract_item_st *list;
+  size_t n;
+  size_t cap;
+} extract_arg_st;
+
+
+static void extract_ent(void *key, void *val, void *arg)
+{
+  extract_arg_st *a = arg;
+  pack_ent_st *e = val;
+  extract_item_st *list;
+
+  if (!pathtree_below(a->p->paths, e->node, a->top)) {
+    return;
+  }
+  if (a->n == a->cap) {
+    if (!(list = realloc(a->list, (a->cap ? a->cap * 2 : 1024) * sizeof(extract_item_st)))) {
+      return;
+    }
+    a->list = list;
+    a->cap = a->cap ? a->cap * 2 : 1024;
+  }
+  if ((a->list[a->n].rel = ent_path(a->p, e))) {
+    a->list[a->n++].e = e;
+  }
+}
+
+
+static int by_rel(const void *a, const void *b)
+{
+  return (strcmp(((extract_item_st *)a)->rel, ((extract_item_st *)b)->rel));
+}
+
+
+/* make the directories above target/rel that are missing */
+static int make_parents(const char *target, const char *rel)
+{
+  char path[PATH_MAX];
+  char *s;
+
+  if (job_path(target, rel, path, sizeof(path)) < 0) {
+    errno = ENAMETOOLONG;
+    return (-1);
+  }
+
+  for (s = path + strlen(target) + 1; (s = strchr(s, '/')); s++) {
+    *s = '\0';
+    if (mkdir(path, S_IRWXU | S_IRWXG | S_IRWXO) < 0 && errno != EEXIST) {
+      return (-1);
+    }
+    *s = '/';
+  }
+  return (0);
+}
+
+
+/* write packed file e out to target/rel, lock held */
+static int extract_one(pack_st *p, pack_ent_st *e, const char *rel, const char *target,
+		       char *buf)
+{
+  char path[PATH_MAX];
+  struct timespec times[2];
+  ssize_t n;
+  int fd;
+  int ret = 0;
+
+  if ((n = read_ent(p, e, buf, PACK_MAX)) != (ssize_t)e->rec.len) {
+    errno = (n < 0) ? errno : EIO;
+    return (-1);
+  }
+  if (make_parents(target, rel) < 0 || job_path(target, rel, path, sizeof(path)) < 0 ||
+      (fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC,
+		 S_IRUSR | S_IWUSR)) < 0) {
+    return (-1);
+  }
+
+  if (write(fd, buf, n) != n) {
+    ret = -1;
+  }
+  if (geteuid() == 0 && fchown(fd, e->rec.uid, e->rec.gid) < 0) {
+    ret = -1;
+  }
+  times[0].tv_sec = 0;
+  times[0].tv_nsec = UTIME_OMIT;
+  times[1].tv_sec = e->rec.mtime / 1000000000;
+  times[1].tv_nsec = e->rec.mtime % 1000000000;
+  if (fchmod(fd, e->rec.mode & 07777) < 0 || futimens(fd, times) < 0) {
+    ret = -1;
+  }
+  if (close(fd) < 0) {
+    ret = -1;
+  }
+  return (ret);
+}
+
+
+/* pack_extract - write packed files back out as files, with their
+ *                mode, owner (when run as root) and modification time
+ *
+ * sub    - IN - only those at or below this path, NULL for all
+ * target - IN - directory they go to, at the same path below it
+ * files  - OUT - how many were written
+ *
+ * returns - 0 on success, -1 if any could not be written (logged)
+ */
+
+int pack_extract(pack_st *p, const char *sub, const char *target, unsigned long *files)
+{
+  extract_arg_st a = {p, 0, NULL, 0, 0};
+  char *buf;
+  size_t i;
+  int ret = 0;
+
+  *files = 0;
+  if ((mkdir(target, S_IRWXU | S_IRWXG | S_IRWXO) < 0 && errno != EEXIST) ||
+      !(buf = malloc(PACK_MAX))) {
+    log_msg(LOG_ERR, "extract %s: %s", target, strerror(errno));
+    return (-1);
+  }
+
+  pthread_mutex_lock(&p->lock);
+  // nothing is packed at or below a sub that is not in the tree
+  if ((a.top = sub ? pathtree_find(p->paths, p->root, sub) : p->root)) {
+    hash_map_foreach(p->ents, extract_ent, &a);
+  }
+  // parents first, and the same order every time
+  qsort(a.list, a.n, sizeof(extract_item_st), by_rel);
+
+  for (i = 0; i < a.n; i++) {
+    if (extract_one(p, a.list[i].e, a.list[i].rel, target, buf) < 0) {
+      log_msg(LOG_WARNING, "extract %s/%s: %s", target, a.list[i].rel, strerror(errno));
+      ret = -1;
+    } else {
+      (*files)++;
+    }
+    free(a.list[i].rel);
+  }
+  pthread_mutex_unlock(&p->lock);
+
+  free(a.list);
+  free(buf);
+  return (ret);
+}
+
+
+/* pack_stats - copy out how much of a job's pack is in use */
+void pack_stats(job_st *job, pack_stats_st *st)
+{
+  pack_st *p = __atomic_load_n(&job->pack, __ATOMIC_ACQUIRE);
+  int i;
+
+  memset(st, 0, sizeof(pack_stats_st));
+  if (!p) {
+    return;
+  }
+
+  pthread_mutex_lock(&p->lock);
+  st->files = p->ents->entries;
+  for (i = 0; i < p->nsegs; i++) {
+    st->live += p->segs[i].live;
+    st->dead += p->segs[i].size - p->segs[i].live;
+  }
+  st->segments = p->nsegs;
+  st->compacted = p->compacted;
+  pthread_mutex_unlock(&p->lock);
+}
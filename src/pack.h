@@ -0,0 +1,87 @@
+/*
+ * pack.h
+ *
+ * Small File Pack Definitions
+ * 
+ *
+ * Copyright (C) 2013  Bryant Moscon - bmoscon@gmail.com
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to 
+ * deal in the Software without restriction, including without limitation the 
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, 
+ *    this list of conditions and the following disclaimer in the documentation 
+ *    and/or other materials provided with the distribution, and in the same 
+ *    place and form as other copyright, license and disclaimer information.
+ *
+ * 3. The end-user documentation included with the redistribution, if any, must 
+ *    include the following acknowledgment: "This product includes software 
+ *    developed by Bryant Moscon (http://www.bryantmoscon.org/)", in the same 
+ *    place and form as other third-party acknowledgments. Alternately, this 
+ *    acknowledgment may appear in the software itself, in the same form and 
+ *    location as other such third-party acknowledgments.
+ *
+ * 4. Except as contained in this notice, the name of the author, Bryant Moscon,
+ *    shall not be used in advertising or otherwise to promote the sale, use or 
+ *    other dealings in this Software without prior written authorization from 
+ *    the author.
+ *
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL 
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN 
+ * THE SOFTWARE.
+ *
+ */
+
+#ifndef __PACK__
+#define __PACK__
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "job.h"
+
+
+#define PACK_DIR ".backupd/pack"
+#define PACK_MAX (1024 * 1024)    // the largest PACK a job can have
+
+
+typedef struct pack_st pack_st;
+
+
+typedef struct pack_stats_st {
+  uint64_t files;          // packed
+  uint64_t live;           // bytes of them
+  uint64_t dead;           // bytes superseded, until compacted away
+  int segments;
+  uint64_t compacted;      // bytes moved by compaction, since it was opened
+} pack_stats_st;
+
+
+pack_st *pack_open(const char *dst, int create);
+void pack_close(pack_st *p);
+pack_st *pack_get(job_st *job);
+int pack_copy(job_st *job, const char *rel);
+int pack_forget(job_st *job, const char *rel, int tree);
+int pack_rename(job_st *job, const char *from, const char *to);
+int pack_meta(job_st *job, const char *rel);
+int pack_stat(pack_st *p, const char *rel, struct stat *st);
+ssize_t pack_read(pack_st *p, const char *rel, void *buf, size_t len);
+int pack_compact(pack_st *p);
+int pack_extract(pack_st *p, const char *sub, const char *target, unsigned long *files);
+void pack_stats(job_st *job, pack_stats_st *st);
+
+
+#endif
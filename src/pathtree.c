@@ -0,0 +1,737 @@
+/*
+ * pathtree.c
+ *
+ * Interned Path Tree
+ * 
+ *
+ * Copyright (C) 2013  Bryant Moscon - bmoscon@gmail.com
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to 
+ * deal in the Software without restriction, including without limitation the 
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, 
+ *    this list of conditions and the following disclaimer in the documentation 
+ *    and/or other materials provided with the distribution, and in the same 
+ *    place and form as other copyright, license and disclaimer information.
+ *
+ * 3. The end-user documentation included with the redistribution, if any, must 
+ *    include the following acknowledgment: "This product includes software 
+ *    developed by Bryant Moscon (http://www.bryantmoscon.org/)", in the same 
+ *    place and form as other third-party acknowledgments. Alternately, this 
+ *    acknowledgment may appear in the software itself, in the same form and 
+ *    location as other such third-party acknowledgments.
+ *
+ * 4. Except as contained in this notice, the name of the author, Bryant Moscon,
+ *    shall not be used in advertising or otherwise to promote the sale, use or 
+ *    other dealings in this Software without prior written authorization from 
+ *    the author.
+ *
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL 
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN 
+ * THE SOFTWARE.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "pathtree.h"
+#include "hash_map.h"
+
+
+/*
+ * A path is stored as a chain of nodes, one per component, each with
+ * its parent's id and the id of its name. Names are interned: every
+ * distinct component is kept once, in one text arena, however many
+ * directories it appears in. Node and name fields live in flat
+ * arrays indexed by id, so a node costs a few words and a path is
+ * rebuilt by walking its parents.
+ *
+ * A node is referenced by its holders and by each of its children,
+ * and freed (with its name's reference) when the last one goes. Ids
+ * of freed nodes and names are reused.
+ *
+ * Children are found through an open addressed table keyed by
+ * (parent, name), names through another keyed by their hash, both
+ * with linear probing and holding only ids. Roots are nodes with no
+ * parent, a tree can hold any number of them.
+ *
+ * Nothing here locks, callers do.
+ */
+
+
+#define TABLE_MIN  64
+#define TEXT_MIN   4096
+#define TEXT_SLACK 65536     // dead text bytes tolerated before compacting
+
+
+struct pathtree_st {
+  // nodes, by id
+  uint32_t *parent;        // PATHTREE_NONE for roots and detached nodes
+  uint32_t *name;          // 0 for roots
+  uint32_t *refs;          // holders and children, 0 when free
+  uint32_t nodes;          // ids used so far
+  uint32_t node_size;
+  uint32_t node_free;      // free list, linked through parent
+  uint32_t live;
+
+  // interned names, by id
+  uint32_t *name_off;      // in text
+  uint32_t *name_hash;
+  uint32_t *name_refs;     // nodes with the name, 0 when free
+  uint32_t names;
+  uint32_t name_size;
+  uint32_t name_free;      // free list, linked through name_off
+
+  char *text;              // the names, NUL terminated, back to back
+  size_t text_len;
+  size_t text_size;
+  size_t text_dead;        // bytes of freed names
+
+  // open addressed tables of ids, 0 for an empty slot
+  uint32_t *kids;          // nodes with a parent, by (parent, name)
+  uint32_t kids_size;      // a power of 2
+  uint32_t kids_used;
+  uint32_t *index;         // names, by hash
+  uint32_t index_size;
+  uint32_t index_used;
+};
+
+
+typedef uint32_t (*slot_hash_fp)(pathtree_st *t, uint32_t id);
+
+
+static uint32_t text_hash(const char *s, size_t len)
+{
+  uint32_t h = 2166136261u;
+
+  while (len--) {
+    h ^= (unsigned char)*s++;
+    h *= 16777619u;
+  }
+  return (h);
+}
+
+
+static uint32_t kid_hash(uint32_t parent, uint32_t name)
+{
+  return (hash_map_int_hash((void *)(uintptr_t)(((uint64_t)parent << 32) | name)));
+}
+
+
+static uint32_t kid_slot_hash(pathtree_st *t, uint32_t id)
+{
+  return (kid_hash(t->parent[id], t->name[id]));
+}
+
+
+static uint32_t name_slot_hash(pathtree_st *t, uint32_t id)
+{
+  return (t->name_hash[id]);
+}
+
+
+/* grow an array of ids to hold size of them */
+static int grow(uint32_t **array, uint32_t size)
+{
+  uint32_t *a = realloc(*array, size * sizeof(uint32_t));
+
+  if (!a) {
+    return (-1);
+  }
+  *array = a;
+  return (0);
+}
+
+
+static void slot_insert(pathtree_st *t, uint32_t *table, uint32_t size, slot_hash_fp hash,
+			uint32_t id)
+{
+  uint32_t i = hash(t, id) & (size - 1);
+
+  while (table[i]) {
+    i = (i + 1) & (size - 1);
+  }
+  table[i] = id;
+}
+
+
+/* empty slot i, moving back later entries that would no longer be found */
+static void slot_delete(pathtree_st *t, uint32_t *table, uint32_t size, slot_hash_fp hash,
+			uint32_t i)
+{
+  uint32_t mask = size - 1;
+  uint32_t j = i;
+  uint32_t k;
+
+  while (1) {
+    j = (j + 1) & mask;
+    if (!table[j]) {
+      break;
+    }
+    k = hash(t, table[j]) & mask;
+    // the entry at j stays if its home slot lies cyclically in (i, j]
+    if ((i < j) ? (k <= i || k > j) : (k <= i && k > j)) {
+      table[i] = table[j];
+      i = j;
+    }
+  }
+  table[i] = 0;
+}
+
+
+static void slot_remove(pathtree_st *t, uint32_t *table, uint32_t size, slot_hash_fp hash,
+			uint32_t id)
+{
+  uint32_t i = hash(t, id) & (size - 1);
+
+  while (table[i] && table[i] != id) {
+    i = (i + 1) & (size - 1);
+  }
+  if (table[i]) {
+    slot_delete(t, table, size, hash, i);
+  }
+}
+
+
+/* make room in a table for one more entry, keeping it at most 3/4 full */
+static int table_reserve(pathtree_st *t, uint32_t **table, uint32_t *size, uint32_t used,
+			 slot_hash_fp hash)
+{
+  uint32_t *old = *table;
+  uint32_t old_size = *size;
+  uint32_t new_size = old_size ? old_size : TABLE_MIN;
+  uint32_t *array;
+  uint32_t i;
+
+  while ((uint64_t)(used + 1) * 4 > (uint64_t)new_size * 3) {
+    new_size *= 2;
+  }
+  if (new_size == old_size) {
+    return (0);
+  }
+
+  if (!(array = calloc(new_size, sizeof(uint32_t)))) {
+    return (-1);
+  }
+  for (i = 0; i < old_size; i++) {
+    if (old[i]) {
+      slot_insert(t, array, new_size, hash, old[i]);
+    }
+  }
+  free(old);
+  *table = array;
+  *size = new_size;
+  return (0);
+}
+
+
+/* copy the live names into a fresh arena, dropping freed ones */
+static void text_compact(pathtree_st *t)
+{
+  size_t size = t->text_len - t->text_dead;
+  char *text;
+  size_t len = 1;
+  size_t l;
+  uint32_t i;
+
+  size = size < TEXT_MIN ? TEXT_MIN : size * 2;
+  if (!(text = malloc(size))) {
+    return;
+  }
+  // offset 0 stays the empty name
+  text[0] = '\0';
+  for (i = 1; i < t->names; i++) {
+    if (t->name_refs[i]) {
+      l = strlen(t->text + t->name_off[i]) + 1;
+      memcpy(text + len, t->text + t->name_off[i], l);
+      t->name_off[i] = len;
+      len += l;
+    }
+  }
+  free(t->text);
+  t->text = text;
+  t->text_len = len;
+  t->text_size = size;
+  t->text_dead = 0;
+}
+
+
+static uint32_t name_find(pathtree_st *t, const char *s, size_t len, uint32_t h)
+{
+  uint32_t i = h & (t->index_size - 1);
+  uint32_t id;
+
+  while ((id = t->index[i])) {
+    if (t->name_hash[id] == h && strncmp(t->text + t->name_off[id], s, len) == 0 &&
+	t->text[t->name_off[id] + len] == '\0') {
+      return (id);
+    }
+    i = (i + 1) & (t->index_size - 1);
+  }
+  return (0);
+}
+
+
+/* the id of name s (len bytes), interned if it was not, with a reference */
+static uint32_t name_get(pathtree_st *t, const char *s, size_t len)
+{
+  uint32_t h = text_hash(s, len);
+  uint32_t id;
+  char *text;
+  size_t size;
+
+  if ((id = name_find(t, s, len, h))) {
+    ++t->name_refs[id];
+    return (id);
+  }
+
+  if (t->text_dead > TEXT_SLACK && t->text_dead * 2 > t->text_len) {
+    text_compact(t);
+  }
+  if (t->text_len + len + 1 > t->text_size) {
+    for (size = t->text_size * 2; size < t->text_len + len + 1; size *= 2);
+    if (size > UINT32_MAX || !(text = realloc(t->text, size))) {
+      errno = ENOMEM;
+      return (0);
+    }
+    t->text = text;
+    t->text_size = size;
+  }
+
+  if (table_reserve(t, &t->index, &t->index_size, t->index_used, name_slot_hash) < 0) {
+    return (0);
+  }
+  if (t->name_free) {
+    id = t->name_free;
+    t->name_free = t->name_off[id];
+  } else {
+    if (t->names == t->name_size &&
+	(grow(&t->name_off, t->name_size * 2) < 0 || grow(&t->name_hash, t->name_size * 2) < 0 ||
+	 grow(&t->name_refs, t->name_size * 2) < 0)) {
+      return (0);
+    }
+    if (t->names == t->name_size) {
+      t->name_size *= 2;
+    }
+    id = t->names++;
+  }
+
+  memcpy(t->text + t->text_len, s, len);
+  t->text[t->text_len + len] = '\0';
+  t->name_off[id] = t->text_len;
+  t->text_len += len + 1;
+  t->name_hash[id] = h;
+  t->name_refs[id] = 1;
+  slot_insert(t, t->index, t->index_size, name_slot_hash, id);
+  ++t->index_used;
+
+  return (id);
+}
+
+
+static void name_put(pathtree_st *t, uint32_t id)
+{
+  if (!id || --t->name_refs[id]) {
+    return;
+  }
+  slot_remove(t, t->index, t->index_size, name_slot_hash, id);
+  --t->index_used;
+  t->text_dead += strlen(t->text + t->name_off[id]) + 1;
+  t->name_off[id] = t->name_free;
+  t->name_free = id;
+}
+
+
+static uint32_t kid_find(pathtree_st *t, uint32_t parent, uint32_t name)
+{
+  uint32_t i = kid_hash(parent, name) & (t->kids_size - 1);
+  uint32_t id;
+
+  while ((id = t->kids[i])) {
+    if (t->parent[id] == parent && t->name[id] == name) {
+      return (id);
+    }
+    i = (i + 1) & (t->kids_size - 1);
+  }
+  return (0);
+}
+
+
+/* a new node, with no references yet. name's reference is taken over */
+static uint32_t node_new(pathtree_st *t, uint32_t parent, uint32_t name)
+{
+  uint32_t id;
+
+  if (parent && table_reserve(t, &t->kids, &t->kids_size, t->kids_used, kid_slot_hash) < 0) {
+    return (0);
+  }
+  if (t->node_free) {
+    id = t->node_free;
+    t->node_free = t->parent[id];
+  } else {
+    if (t->nodes == t->node_size &&
+	(grow(&t->parent, t->node_size * 2) < 0 || grow(&t->name, t->node_size * 2) < 0 ||
+	 grow(&t->refs, t->node_size * 2) < 0)) {
+      return (0);
+    }
+    if (t->nodes == t->node_size) {
+      t->node_size *= 2;
+    }
+    id = t->nodes++;
+  }
+
+  t->parent[id] = parent;
+  t->name[id] = name;
+  t->refs[id] = 0;
+  ++t->live;
+  if (parent) {
+    ++t->refs[parent];
+    slot_insert(t, t->kids, t->kids_size, kid_slot_hash, id);
+    ++t->kids_used;
+  }
+  return (id);
+}
+
+
+/* take node out of its parent, it keeps its name */
+static void node_detach(pathtree_st *t, uint32_t node)
+{
+  slot_remove(t, t->kids, t->kids_size, kid_slot_hash, node);
+  --t->kids_used;
+  t->parent[node] = PATHTREE_NONE;
+}
+
+
+/* free node, and any parents that were only held by it, if unreferenced */
+static void node_drop(pathtree_st *t, uint32_t node)
+{
+  uint32_t parent;
+
+  while (node && !t->refs[node]) {
+    parent = t->parent[node];
+    if (parent) {
+      node_detach(t, node);
+    }
+    name_put(t, t->name[node]);
+    t->parent[node] = t->node_free;
+    t->node_free = node;
+    --t->live;
+
+    if (!parent || --t->refs[parent]) {
+      break;
+    }
+    node = parent;
+  }
+}
+
+
+/* the node of the first len bytes of rel below base, added if create */
+static uint32_t lookup(pathtree_st *t, uint32_t base, const char *rel, size_t len, int create)
+{
+  const char *end = rel + len;
+  const char *slash;
+  uint32_t node = base;
+  uint32_t added = 0;
+  uint32_t name;
+  uint32_t kid;
+  size_t l;
+
+  while (rel < end) {
+    if (!(slash = memchr(rel, '/', end - rel))) {
+      slash = end;
+    }
+    if ((l = slash - rel)) {
+      name = name_find(t, rel, l, text_hash(rel, l));
+      if (!(kid = name ? kid_find(t, node, name) : 0)) {
+	if (!create) {
+	  return (0);
+	}
+	if (!(name = name_get(t, rel, l)) || !(kid = node_new(t, node, name))) {
+	  name_put(t, name);
+	  // undo what was added for this lookup
+	  node_drop(t, added ? node : 0);
+	  errno = ENOMEM;
+	  return (0);
+	}
+	added = 1;
+      }
+      node = kid;
+    }
+    rel = slash + 1;
+  }
+  return (node);
+}
+
+
+/* pathtree_init - an empty tree
+ *
+ * returns - the tree, or NULL if out of memory
+ */
+
+pathtree_st *pathtree_init(void)
+{
+  pathtree_st *t = calloc(1, sizeof(pathtree_st));
+
+  if (!t) {
+    return (NULL);
+  }
+  t->node_size = t->name_size = TABLE_MIN;
+  t->text_size = TEXT_MIN;
+  if (!(t->parent = calloc(t->node_size, sizeof(uint32_t))) ||
+      !(t->name = calloc(t->node_size, sizeof(uint32_t))) ||
+      !(t->refs = calloc(t->node_size, sizeof(uint32_t))) ||
+      !(t->name_off = calloc(t->name_size, sizeof(uint32_t))) ||
+      !(t->name_hash = calloc(t->name_size, sizeof(uint32_t))) ||
+      !(t->name_refs = calloc(t->name_size, sizeof(uint32_t))) ||
+      !(t->text = calloc(1, t->text_size)) ||
+      table_reserve(t, &t->kids, &t->kids_size, 0, kid_slot_hash) < 0 ||
+      table_reserve(t, &t->index, &t->index_size, 0, name_slot_hash) < 0) {
+    pathtree_free(t);
+    return (NULL);
+  }
+  // id 0 is PATHTREE_NONE, name 0 is the empty name of roots
+  t->nodes = t->names = 1;
+  t->text_len = 1;
+
+  return (t);
+}
+
+
+void pathtree_free(pathtree_st *t)
+{
+  if (!t) {
+    return;
+  }
+  free(t->parent);
+  free(t->name);
+  free(t->refs);
+  free(t->name_off);
+  free(t->name_hash);
+  free(t->name_refs);
+  free(t->text);
+  free(t->kids);
+  free(t->index);
+  free(t);
+}
+
+
+/* pathtree_root - a new root, for paths relative to something else than
+ *                 the existing ones
+ *
+ * returns - the root with one reference, or PATHTREE_NONE if out of memory
+ */
+
+uint32_t pathtree_root(pathtree_st *t)
+{
+  uint32_t root = node_new(t, PATHTREE_NONE, 0);
+
+  if (root) {
+    t->refs[root] = 1;
+  }
+  return (root);
+}
+
+
+/* pathtree_get - the node of a path, added if it is not there yet
+ *
+ * t - IN - tree
+ * base - IN - node rel is relative to
+ * rel - IN - path, "" for base itself
+ *
+ * returns - the node, with a reference to drop with pathtree_put, or
+ *           PATHTREE_NONE if out of memory
+ */
+
+uint32_t pathtree_get(pathtree_st *t, uint32_t base, const char *rel)
+{
+  uint32_t node = lookup(t, base, rel, strlen(rel), 1);
+
+  if (node) {
+    ++t->refs[node];
+  }
+  return (node);
+}
+
+
+/* pathtree_find - pathtree_get, without adding anything or taking a
+ *                 reference
+ *
+ * returns - the node, or PATHTREE_NONE if rel is not in the tree
+ */
+
+uint32_t pathtree_find(pathtree_st *t, uint32_t base, const char *rel)
+{
+  return (lookup(t, base, rel, strlen(rel), 0));
+}
+
+
+/* pathtree_put - drop a reference to node, freeing it (and parents only
+ *                kept for it) with the last one
+ */
+
+void pathtree_put(pathtree_st *t, uint32_t node)
+{
+  if (node && t->refs[node] && --t->refs[node] == 0) {
+    node_drop(t, node);
+  }
+}
+
+
+/* pathtree_move - rename node, and so everything below it. Its id and
+ *                 those below stay the same
+ *
+ * t - IN - tree
+ * node - IN - node to move
+ * base - IN - node rel is relative to
+ * rel - IN - its new path
+ *
+ * returns - 0 on success, -1 if out of memory or rel is node itself or
+ *           below it (EINVAL). A node already at rel is detached: it
+ *           keeps its holders, but has no path any more
+ */
+
+int pathtree_move(pathtree_st *t, uint32_t node, uint32_t base, const char *rel)
+{
+  const char *slash = strrchr(rel, '/');
+  const char *base_name = slash ? slash + 1 : rel;
+  uint32_t parent, old_parent, old, name;
+
+  if (!*base_name || !node) {
+    errno = EINVAL;
+    return (-1);
+  }
+  if (!(parent = lookup(t, base, rel, slash ? slash - rel : 0, 1))) {
+    return (-1);
+  }
+  ++t->refs[parent];
+  if (pathtree_below(t, parent, node)) {
+    pathtree_put(t, parent);
+    errno = EINVAL;
+    return (-1);
+  }
+  if (!(name = name_get(t, base_name, strlen(base_name))) ||
+      table_reserve(t, &t->kids, &t->kids_size, t->kids_used, kid_slot_hash) < 0) {
+    name_put(t, name);
+    pathtree_put(t, parent);
+    return (-1);
+  }
+
+  if ((old = kid_find(t, parent, name)) == node) {
+    name_put(t, name);
+    pathtree_put(t, parent);
+    return (0);
+  }
+  if (old) {
+    node_detach(t, old);
+    --t->refs[parent];
+  }
+
+  old_parent = t->parent[node];
+  if (old_parent) {
+    node_detach(t, node);
+  }
+  name_put(t, t->name[node]);
+  t->parent[node] = parent;
+  t->name[node] = name;
+  slot_insert(t, t->kids, t->kids_size, kid_slot_hash, node);
+  ++t->kids_used;
+  // the new parent keeps the reference taken above, for its child
+  if (old_parent && --t->refs[old_parent] == 0) {
+    node_drop(t, old_parent);
+  }
+  if (old && !t->refs[old]) {
+    node_drop(t, old);
+  }
+
+  return (0);
+}
+
+
+/* is node top itself, or below it? */
+int pathtree_below(pathtree_st *t, uint32_t node, uint32_t top)
+{
+  while (node && node != top) {
+    node = t->parent[node];
+  }
+  return (node && node == top);
+}
+
+
+/* pathtree_path - the path of a node
+ *
+ * t - IN - tree
+ * base - IN - node the path is to be relative to
+ * node - IN - node whose path is wanted
+ * name - IN - appended as one more component, NULL for none
+ *
+ * returns - the path, to be freed, or NULL if node is not below base
+ *           (ENOENT) or out of memory
+ */
+
+char *pathtree_path(pathtree_st *t, uint32_t base, uint32_t node, const char *name)
+{
+  size_t nlen = name ? strlen(name) : 0;
+  size_t len = nlen;
+  size_t l;
+  uint32_t n;
+  char *path;
+  char *p;
+
+  if (name && !*name) {
+    name = NULL;
+  }
+  for (n = node; n != base; n = t->parent[n]) {
+    if (!n) {
+      errno = ENOENT;
+      return (NULL);
+    }
+    len += strlen(t->text + t->name_off[t->name[n]]) + 1;
+  }
+  if (!name && len) {
+    // no separator after the last component
+    --len;
+  }
+
+  if (!(path = malloc(len + 1))) {
+    return (NULL);
+  }
+  p = path + len;
+  *p = '\0';
+  if (name) {
+    p -= nlen;
+    memcpy(p, name, nlen);
+  }
+  for (n = node; n != base; n = t->parent[n]) {
+    if (p != path + len) {
+      *--p = '/';
+    }
+    l = strlen(t->text + t->name_off[t->name[n]]);
+    p -= l;
+    memcpy(p, t->text + t->name_off[t->name[n]], l);
+  }
+
+  return (path);
+}
+
+
+/* pathtree_memory - bytes held by the tree */
+size_t pathtree_memory(pathtree_st *t)
+{
+  return (sizeof(pathtree_st) + (size_t)t->node_size * 3 * sizeof(uint32_t) +
+	  (size_t)t->name_size * 3 * sizeof(uint32_t) + t->text_size +
+	  ((size_t)t->kids_size + t->index_size) * sizeof(uint32_t));
+}
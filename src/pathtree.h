@@ -0,0 +1,72 @@
+/*
+ * pathtree.h
+ *
+ * Interned Path Tree Definitions
+ * 
+ *
+ * Copyright (C) 2013  Bryant Moscon - bmoscon@gmail.com
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to 
+ * deal in the Software without restriction, including without limitation the 
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, 
+ *    this list of conditions and the following disclaimer in the documentation 
+ *    and/or other materials provided with the distribution, and in the same 
+ *    place and form as other copyright, license and disclaimer information.
+ *
+ * 3. The end-user documentation included with the redistribution, if any, must 
+ *    include the following acknowledgment: "This product includes software 
+ *    developed by Bryant Moscon (http://www.bryantmoscon.org/)", in the same 
+ *    place and form as other third-party acknowledgments. Alternately, this 
+ *    acknowledgment may appear in the software itself, in the same form and 
+ *    location as other such third-party acknowledgments.
+ *
+ * 4. Except as contained in this notice, the name of the author, Bryant Moscon,
+ *    shall not be used in advertising or otherwise to promote the sale, use or 
+ *    other dealings in this Software without prior written authorization from 
+ *    the author.
+ *
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL 
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN 
+ * THE SOFTWARE.
+ *
+ */
+
+#ifndef __PATHTREE__
+#define __PATHTREE__
+
+#include <stdint.h>
+#include <stddef.h>
+
+
+#define PATHTREE_NONE 0    // no node, node ids start at 1
+
+
+typedef struct pathtree_st pathtree_st;
+
+
+pathtree_st *pathtree_init(void);
+void pathtree_free(pathtree_st *t);
+uint32_t pathtree_root(pathtree_st *t);
+uint32_t pathtree_get(pathtree_st *t, uint32_t base, const char *rel);
+uint32_t pathtree_find(pathtree_st *t, uint32_t base, const char *rel);
+void pathtree_put(pathtree_st *t, uint32_t node);
+int pathtree_move(pathtree_st *t, uint32_t node, uint32_t base, const char *rel);
+int pathtree_below(pathtree_st *t, uint32_t node, uint32_t top);
+char *pathtree_path(pathtree_st *t, uint32_t base, uint32_t node, const char *name);
+size_t pathtree_memory(pathtree_st *t);
+
+
+#endif
@@ -0,0 +1,745 @@
+/*
+ * receive.c
+ *
+ * Remote Receiver
+ * 
+ *
+ * Copyright (C) 2013  Bryant Moscon - bmoscon@gmail.com
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to 
+ * deal in the Software without restriction, including without limitation the 
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, 
+ *    this list of conditions and the following disclaimer in the documentation 
+ *    and/or other materials provided with the distribution, and in the same 
+ *    place and form as other copyright, license and disclaimer information.
+ *
+ * 3. The end-user documentation included with the redistribution, if any, must 
+ *    include the following acknowledgment: "This product includes software 
+ *    developed by Bryant Moscon (http://www.bryantmoscon.org/)", in the same 
+ *    place and form as other third-party acknowledgments. Alternately, this 
+ *    acknowledgment may appear in the software itself, in the same form and 
+ *    location as other such third-party acknowledgments.
+ *
+ * 4. Except as contained in this notice, the name of the author, Bryant Moscon,
+ *    shall not be used in advertising or otherwise to promote the sale, use or 
+ *    other dealings in this Software without prior written authorization from 
+ *    the author.
+ *
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL 
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN 
+ * THE SOFTWARE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "receive.h"
+#include "remote.h"
+#include "replicate.h"
+#include "metadata.h"
+#include "dircache.h"
+#include "log.h"
+
+
+/*
+ * "backupd receive" takes the frames of remote.c, one thread per
+ * connection, and applies them to <directory>/<job name> with the
+ * same replicate_* calls the daemon uses on a local destination.
+ *
+ * Frames are read in large chunks and applied in order. Ops are
+ * acknowledged in batches: whenever the input runs dry, or after
+ * ACK_MAX of them. Every ACK also says how much data was taken in,
+ * which opens the sender's window.
+ */
+
+
+#define RECV_BUF (1024 * 1024)     // read at most this much at once
+#define ACK_MAX 4096
+#define ACK_ENTRY 12               // u64 id, u32 errno
+
+#define COPIES_SIZE 256
+
+
+/* a copy between its OPEN and CLOSE */
+typedef struct recv_copy_st {
+  uint64_t id;
+  char *rel;
+  int err;                 // the copy failed, 0 if still good
+  copy_st c;
+} recv_copy_st;
+
+
+typedef struct conn_st {
+  int fd;
+  char *dir;               // what receive_serve was given
+  job_st job;              // the sender's job: no source, dst only
+
+  char *in;                // read buffer, in_len bytes read
+  size_t in_len;
+  char *acks;              // FRAME_ACK being built
+  uint32_t n_acks;
+  uint64_t consumed;       // data taken in on this connection
+  uint64_t reported;       // ... as of the last ACK
+
+  hash_map_st *copies;     // id -> recv_copy_st
+} conn_st;
+
+
+/* receive_listen - listen for senders on addr, "[host:]port"
+ *
+ * returns - the listening socket, -1 on error (logged)
+ */
+
+int receive_listen(const char *addr)
+{
+  struct addrinfo hints;
+  struct addrinfo *res, *ai;
+  char *host = NULL;
+  const char *port = addr;
+  const char *colon = strrchr(addr, ':');
+  int one = 1;
+  int fd = -1;
+  int ret;
+
+  if (colon) {
+    port = colon + 1;
+    if (*addr == '[' && colon > addr + 1 && colon[-1] == ']') {
+      host = strndup(addr + 1, colon - addr - 2);
+    } else {
+      host = strndup(addr, colon - addr);
+    }
+    if (!host) {
+      return (-1);
+    }
+  }
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE;
+  if ((ret = getaddrinfo(host && *host ? host : NULL, port, &hints, &res)) != 0) {
+    log_msg(LOG_ERR, "%s: %s", addr, gai_strerror(ret));
+    free(host);
+    return (-1);
+  }
+  free(host);
+
+  for (ai = res; ai; ai = ai->ai_next) {
+    if ((fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol)) < 0) {
+      continue;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(fd, 16) == 0) {
+      break;
+    }
+    close(fd);
+    fd = -1;
+  }
+  freeaddrinfo(res);
+
+  if (fd < 0) {
+    log_msg(LOG_ERR, "listen %s: %s", addr, strerror(errno));
+  }
+  return (fd);
+}
+
+
+static uint32_t copy_hash(void *key)
+{
+  uint64_t id = ((recv_copy_st *)key)->id;
+
+  return ((uint32_t)(id ^ (id >> 32)));
+}
+
+
+static int copy_cmp(void *a, void *b)
+{
+  return (((recv_copy_st *)a)->id != ((recv_copy_st *)b)->id);
+}
+
+
+/* path_ok - a relative path that stays below the job's directory: not
+ *           absolute, and no empty, "." or ".." components
+ */
+
+static int path_ok(const char *path)
+{
+  const char *p = path;
+  size_t len;
+
+  if (!*p) {
+    return (0);
+  }
+
+  for (;;) {
+    len = strcspn(p, "/");
+    if (len == 0 || (len == 1 && p[0] == '.') || (len == 2 && p[0] == '.' && p[1] == '.')) {
+      return (0);
+    }
+    if (!p[len]) {
+      return (1);
+    }
+    p += len + 1;
+  }
+}
+
+
+/* get_path - copy the path at the end of a payload, NUL terminated
+ *
+ * returns - 0 on success, -1 if it is not a path we take
+ */
+
+static int get_path(const char *p, size_t len, char *buf)
+{
+  if (len == 0 || len >= PATH_MAX || memchr(p, '\0', len)) {
+    return (-1);
+  }
+  memcpy(buf, p, len);
+  buf[len] = '\0';
+  return (path_ok(buf) ? 0 : -1);
+}
+
+
+/* get_meta - the mode, owner and (if times) times at p into st */
+static const char *get_meta(const char *p, struct stat *st, int times)
+{
+  uint64_t ns;
+
+  memset(st, 0, sizeof(*st));
+  st->st_mode = remote_get32(p);
+  st->st_uid = remote_get32(p + 4);
+  st->st_gid = remote_get32(p + 8);
+  p += 12;
+
+  if (times) {
+    ns = remote_get64(p);
+    st->st_atim.tv_sec = ns / 1000000000ULL;
+    st->st_atim.tv_nsec = ns % 1000000000ULL;
+    ns = remote_get64(p + 8);
+    st->st_mtim.tv_sec = ns / 1000000000ULL;
+    st->st_mtim.tv_nsec = ns % 1000000000ULL;
+    p += 16;
+  }
+
+  return (p);
+}
+
+
+/* send_acks - report what was applied and taken in since the last */
+static int send_acks(conn_st *conn)
+{
+  char hdr[FRAME_HDR];
+  size_t len = 12 + (size_t)conn->n_acks * ACK_ENTRY;
+
+  remote_put64(conn->acks, conn->consumed);
+  remote_put32(conn->acks + 8, conn->n_acks);
+  remote_frame(hdr, FRAME_ACK, 0, len);
+
+  conn->n_acks = 0;
+  conn->reported = conn->consumed;
+  return (remote_write(conn->fd, hdr, conn->acks, len, NULL, 0));
+}
+
+
+static int ack(conn_st *conn, uint64_t id, int err)
+{
+  char *p = conn->acks + 12 + (size_t)conn->n_acks * ACK_ENTRY;
+
+  p = remote_put64(p, id);
+  remote_put32(p, err);
+
+  if (++conn->n_acks == ACK_MAX) {
+    return (send_acks(conn));
+  }
+  return (0);
+}
+
+
+/* hello - check the first frame, and set up the job it names */
+static int hello(conn_st *conn, const char *p, size_t len)
+{
+  char name[NAME_MAX + 1];
+
+  if (len < 4 || remote_get32(p) != REMOTE_VERSION) {
+    log_msg(LOG_WARNING, "receive: protocol version %u, expected %d",
+	    len < 4 ? 0 : remote_get32(p), REMOTE_VERSION);
+    return (-1);
+  }
+
+  // the job name is one directory under ours
+  if (len - 4 > NAME_MAX || get_path(p + 4, len - 4, name) < 0 || strchr(name, '/')) {
+    log_msg(LOG_WARNING, "receive: bad job name");
+    return (-1);
+  }
+
+  if (!(conn->job.name = strdup(name)) ||
+      asprintf(&conn->job.dst, "%s/%s", conn->dir, name) < 0) {
+    conn->job.dst = NULL;
+    return (-1);
+  }
+
+  if (mkdir(conn->job.dst, S_IRWXU) < 0 && errno != EEXIST) {
+    log_msg(LOG_WARNING, "receive: mkdir %s: %s", conn->job.dst, strerror(errno));
+    return (-1);
+  }
+
+  return (0);
+}
+
+
+static recv_copy_st *find_copy(conn_st *conn, uint64_t id)
+{
+  recv_copy_st key;
+
+  key.id = id;
+  return (hash_map_get(conn->copies, &key));
+}
+
+
+/* end_copy - publish (or drop, if failed) a copy and forget it */
+static int end_copy(conn_st *conn, recv_copy_st *rc, int failed)
+{
+  int err = rc->err;
+
+  hash_map_remove(conn->copies, rc);
+  if (!err) {
+    rc->c.failed = failed;
+    if (replicate_publish(&rc->c) < 0 && !failed) {
+      err = EIO;
+    }
+  }
+
+  free(rc->rel);
+  free(rc);
+  return (err);
+}
+
+
+static void open_copy(conn_st *conn, uint64_t id, const char *p, size_t len)
+{
+  recv_copy_st *rc;
+
+  if (len < 20 || find_copy(conn, id) || !(rc = calloc(1, sizeof(recv_copy_st)))) {
+    ack(conn, id, EPROTO);
+    return;
+  }
+
+  rc->id = id;
+  rc->c.in_fd = -1;
+  get_meta(p, &rc->c.st, 0);
+  rc->c.st.st_size = remote_get64(p + 12);
+  if (!(rc->rel = malloc(PATH_MAX)) || get_path(p + 20, len - 20, rc->rel) < 0 ||
+      hash_map_put(conn->copies, rc, rc) != 0) {
+    free(rc->rel);
+    free(rc);
+    ack(conn, id, EPROTO);
+    return;
+  }
+
+  // a failed copy still takes its DATA frames, and is answered at
+  // its CLOSE
+  if (replicate_create(&conn->job, rc->rel, &rc->c) < 0) {
+    rc->err = errno ? errno : EIO;
+  }
+}
+
+
+static void write_data(conn_st *conn, uint64_t id, const char *p, size_t len)
+{
+  recv_copy_st *rc = find_copy(conn, id);
+  off_t off;
+  ssize_t ret;
+
+  if (len < 8) {
+    return;
+  }
+  conn->consumed += len - 8;
+
+  if (!rc || rc->err) {
+    return;
+  }
+
+  off = remote_get64(p);
+  for (p += 8, len -= 8; len > 0; p += ret, len -= ret, off += ret) {
+    if ((ret = pwrite(rc->c.out_fd, p, len, off)) < 0) {
+      if (errno == EINTR) {
+	ret = 0;
+	continue;
+      }
+      log_msg(LOG_WARNING, "write %s/%s: %s", conn->job.dst, rc->rel, strerror(errno));
+      rc->err = errno;
+      rc->c.failed = 1;
+      replicate_publish(&rc->c);
+      return;
+    }
+  }
+}
+
+
+static void close_copy(conn_st *conn, uint64_t id, const char *p, size_t len)
+{
+  recv_copy_st *rc = find_copy(conn, id);
+
+  if (!rc || len < 28) {
+    ack(conn, id, EPROTO);
+    return;
+  }
+
+  get_meta(p, &rc->c.st, 1);
+  ack(conn, id, end_copy(conn, rc, 0));
+}
+
+
+static int apply_mkdir(conn_st *conn, const char *p, size_t len)
+{
+  char path[PATH_MAX];
+  struct stat st;
+  const char *base;
+  int dir;
+  int fd;
+
+  if (len < 12 || get_path(p + 12, len - 12, path) < 0) {
+    return (EPROTO);
+  }
+  get_meta(p, &st, 0);
+
+  if (replicate_mkdir(&conn->job, path) < 0) {
+    return (errno ? errno : EIO);
+  }
+  if ((dir = dir_open(conn->job.dst, path, &base)) >= 0 &&
+      (fd = openat(dir, base, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)) >= 0) {
+    meta_copy(fd, -1, &st, path, META_OWNER | META_MODE);
+    close(fd);
+  }
+  return (0);
+}
+
+
+static int apply_meta(conn_st *conn, const char *p, size_t len)
+{
+  char path[PATH_MAX];
+  struct stat st;
+  struct stat now;
+  const char *base;
+  int dir;
+  int fd;
+  int ret;
+
+  if (len < 28 || get_path(p + 28, len - 28, path) < 0) {
+    return (EPROTO);
+  }
+  get_meta(p, &st, 1);
+
+  if ((dir = dir_open(conn->job.dst, path, &base)) < 0 ||
+      fstatat(dir, base, &now, AT_SYMLINK_NOFOLLOW) < 0) {
+    return (errno);
+  }
+
+  if (S_ISLNK(now.st_mode)) {
+    struct timespec times[2] = {st.st_atim, st.st_mtim};
+
+    if (fchownat(dir, base, st.st_uid, st.st_gid, AT_SYMLINK_NOFOLLOW) < 0 ||
+	utimensat(dir, base, times, AT_SYMLINK_NOFOLLOW) < 0) {
+      return (errno);
+    }
+    return (0);
+  }
+
+  // O_NONBLOCK so a FIFO does not hang us
+  if ((fd = openat(dir, base, O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC)) < 0) {
+    return (errno);
+  }
+  ret = meta_copy(fd, -1, &st, path, META_OWNER | META_MODE | META_TIMES);
+  close(fd);
+
+  return (ret < 0 ? EPERM : 0);
+}
+
+
+static int apply_rename(conn_st *conn, const char *p, size_t len)
+{
+  char from[PATH_MAX];
+  char to[PATH_MAX];
+  uint32_t is_dir;
+  uint32_t flen;
+
+  if (len < 8) {
+    return (EPROTO);
+  }
+  is_dir = remote_get32(p);
+  flen = remote_get32(p + 4);
+  if (flen > len - 8 || get_path(p + 8, flen, from) < 0 ||
+      get_path(p + 8 + flen, len - 8 - flen, to) < 0) {
+    return (EPROTO);
+  }
+
+  if (is_dir) {
+    dir_invalidate();
+  }
+  errno = 0;
+  if (replicate_rename(&conn->job, from, to) < 0) {
+    return (errno ? errno : EIO);
+  }
+  return (0);
+}
+
+
+static int apply_rmtree(conn_st *conn, const char *p, size_t len)
+{
+  char path[PATH_MAX];
+  char *staging;
+
+  if (get_path(p, len, path) < 0) {
+    return (EPROTO);
+  }
+  if (!(staging = replicate_staging_name(path))) {
+    return (ENOMEM);
+  }
+
+  // removed in the background
+  replicate_remove_tree(&conn->job, path, staging, 0);
+  free(staging);
+  return (0);
+}
+
+
+static int apply_sync(conn_st *conn)
+{
+  int fd;
+  int err = 0;
+
+  if ((fd = open(conn->job.dst, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0 || syncfs(fd) < 0) {
+    err = errno;
+    log_msg(LOG_WARNING, "sync %s: %s", conn->job.dst, strerror(errno));
+  }
+  if (fd >= 0) {
+    close(fd);
+  }
+  return (err);
+}
+
+
+/* apply - carry out one frame
+ *
+ * returns - 0 on success, -1 if the connection is to be dropped
+ */
+
+static int apply(conn_st *conn, int type, uint64_t id, const char *p, size_t len)
+{
+  char path[PATH_MAX];
+
+  switch (type) {
+  case FRAME_OPEN:
+    open_copy(conn, id, p, len);
+    return (0);
+
+  case FRAME_DATA:
+    write_data(conn, id, p, len);
+    return (0);
+
+  case FRAME_CLOSE:
+    close_copy(conn, id, p, len);
+    return (0);
+
+  case FRAME_ABORT:
+    if (find_copy(conn, id)) {
+      end_copy(conn, find_copy(conn, id), 1);
+    }
+    return (ack(conn, id, ENOENT));
+
+  case FRAME_MKDIR:
+    return (ack(conn, id, apply_mkdir(conn, p, len)));
+
+  case FRAME_UNLINK:
+    if (get_path(p, len, path) < 0) {
+      return (ack(conn, id, EPROTO));
+    }
+    errno = 0;
+    return (ack(conn, id, replicate_unlink(&conn->job, path) < 0 ? errno : 0));
+
+  case FRAME_RMTREE:
+    return (ack(conn, id, apply_rmtree(conn, p, len)));
+
+  case FRAME_RENAME:
+    return (ack(conn, id, apply_rename(conn, p, len)));
+
+  case FRAME_META:
+    return (ack(conn, id, apply_meta(conn, p, len)));
+
+  case FRAME_SYNC:
+    return (ack(conn, id, apply_sync(conn)));
+  }
+
+  log_msg(LOG_WARNING, "receive: job %s: unknown frame %d", conn->job.name, type);
+  return (-1);
+}
+
+
+static void drop_copy(void *key, void *val, void *arg)
+{
+  recv_copy_st *rc = (recv_copy_st *)val;
+
+  (void)key;
+  (void)arg;
+  if (!rc->err) {
+    rc->c.failed = 1;
+    replicate_publish(&rc->c);
+  }
+  free(rc->rel);
+  free(rc);
+}
+
+
+static void conn_free(conn_st *conn)
+{
+  if (conn->copies) {
+    // copies cut off by the connection are sent again in full
+    hash_map_foreach(conn->copies, drop_copy, NULL);
+    hash_map_free(conn->copies);
+  }
+  close(conn->fd);
+  free(conn->dir);
+  free(conn->job.name);
+  free(conn->job.dst);
+  free(conn->in);
+  free(conn->acks);
+  free(conn);
+}
+
+
+/* conn_main - apply what one sender sends, until it goes away */
+static void *conn_main(void *arg)
+{
+  conn_st *conn = (conn_st *)arg;
+  struct pollfd pfd = {conn->fd, POLLIN, 0};
+  size_t cap = FRAME_HDR + FRAME_MAX + RECV_BUF;
+  size_t off;
+  size_t len;
+  ssize_t ret;
+  char *frame;
+
+  if (!(conn->in = malloc(cap)) ||
+      !(conn->acks = malloc(12 + ACK_MAX * ACK_ENTRY)) ||
+      !(conn->copies = hash_map_init(COPIES_SIZE, copy_hash, copy_cmp))) {
+    log_msg(LOG_ERR, "%d - malloc failed", __LINE__);
+    goto out;
+  }
+
+  for (;;) {
+    // about to wait for more, so let the sender know where we are
+    if ((conn->n_acks || conn->consumed != conn->reported) &&
+	poll(&pfd, 1, 0) == 0 && send_acks(conn) < 0) {
+      break;
+    }
+
+    if ((ret = read(conn->fd, conn->in + conn->in_len, cap - conn->in_len)) <= 0) {
+      if (ret < 0 && errno == EINTR) {
+	continue;
+      }
+      break;
+    }
+    conn->in_len += ret;
+
+    for (off = 0; conn->in_len - off >= FRAME_HDR; off += FRAME_HDR + len) {
+      frame = conn->in + off;
+      if ((len = remote_get32(frame)) > FRAME_MAX) {
+	log_msg(LOG_WARNING, "receive: frame of %zu bytes", len);
+	goto out;
+      }
+      if (conn->in_len - off < FRAME_HDR + len) {
+	break;
+      }
+
+      if (!conn->job.dst) {
+	if (frame[4] != FRAME_HELLO || hello(conn, frame + FRAME_HDR, len) < 0) {
+	  goto out;
+	}
+	log_msg(LOG_INFO, "receive: job %s connected", conn->job.name);
+	continue;
+      }
+      if (apply(conn, frame[4], remote_get64(frame + 8), frame + FRAME_HDR, len) < 0) {
+	goto out;
+      }
+    }
+
+    memmove(conn->in, conn->in + off, conn->in_len - off);
+    conn->in_len -= off;
+  }
+
+  if (conn->job.name) {
+    log_msg(LOG_INFO, "receive: job %s disconnected", conn->job.name);
+  }
+
+ out:
+  conn_free(conn);
+  dir_release();
+  return (NULL);
+}
+
+
+/* receive_serve - take connections on fd, each on a thread of its
+ *                 own, for jobs under dir. Only returns on error
+ */
+
+void receive_serve(int fd, const char *dir)
+{
+  conn_st *conn;
+  pthread_t tid;
+  int one = 1;
+  int cfd;
+
+  for (;;) {
+    if ((cfd = accept4(fd, NULL, NULL, SOCK_CLOEXEC)) < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) {
+	continue;
+      }
+      if (errno == EMFILE || errno == ENFILE) {
+	sleep(1);
+	continue;
+      }
+      log_msg(LOG_ERR, "accept: %s", strerror(errno));
+      return;
+    }
+    setsockopt(cfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    if (!(conn = calloc(1, sizeof(conn_st))) || !(conn->dir = strdup(dir))) {
+      free(conn);
+      close(cfd);
+      continue;
+    }
+    conn->fd = cfd;
+
+    if (pthread_create(&tid, NULL, conn_main, conn) != 0) {
+      log_msg(LOG_WARNING, "pthread_create: %s", strerror(errno));
+      conn_free(conn);
+      continue;
+    }
+    pthread_detach(tid);
+  }
+}
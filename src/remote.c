@@ -0,0 +1,1142 @@
+/*
+ * remote.c
+ *
+ * Streaming Remote Destination
+ * 
+ *
+ * Copyright (C) 2013  Bryant Moscon - bmoscon@gmail.com
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to 
+ * deal in the Software without restriction, including without limitation the 
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, 
+ *    this list of conditions and the following disclaimer in the documentation 
+ *    and/or other materials provided with the distribution, and in the same 
+ *    place and form as other copyright, license and disclaimer information.
+ *
+ * 3. The end-user documentation included with the redistribution, if any, must 
+ *    include the following acknowledgment: "This product includes software 
+ *    developed by Bryant Moscon (http://www.bryantmoscon.org/)", in the same 
+ *    place and form as other third-party acknowledgments. Alternately, this 
+ *    acknowledgment may appear in the software itself, in the same form and 
+ *    location as other such third-party acknowledgments.
+ *
+ * 4. Except as contained in this notice, the name of the author, Bryant Moscon,
+ *    shall not be used in advertising or otherwise to promote the sale, use or 
+ *    other dealings in this Software without prior written authorization from 
+ *    the author.
+ *
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL 
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN 
+ * THE SOFTWARE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <endian.h>
+#include <netdb.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "remote.h"
+#include "dircache.h"
+#include "journal.h"
+#include "task.h"
+#include "log.h"
+
+
+/*
+ * A job whose DESTINATION is tcp://host:port replicates to a
+ * "backupd receive" over one connection of its own. Ops become
+ * frames, sent by whichever thread applies them: the event loop, the
+ * copy workers, the task thread. Many copies are in flight at once,
+ * their OPEN, DATA and CLOSE frames interleaved, and nothing waits
+ * for a reply. The receiver applies the frames in order and sends
+ * back acknowledgements in batches, and an op is marked done in the
+ * journal once acknowledged.
+ *
+ * Backpressure: the receiver also reports how much data it has taken
+ * in, and a copy waits before sending more while REMOTE_WINDOW bytes
+ * are in flight.
+ *
+ * When the connection drops the reader thread reconnects, backing
+ * off, and every op not acknowledged is sent again (a copy from the
+ * start) by the resend thread, oldest first. Ops that come in while
+ * disconnected are queued behind them.
+ */
+
+
+#define BACKOFF_MIN 1        // seconds between connection attempts
+#define BACKOFF_MAX 30
+
+#define SYNC_WAIT 30          // seconds remote_sync waits for a connection
+
+#define PENDING_SIZE 1024
+
+
+char *remote_put32(char *p, uint32_t v)
+{
+  v = htobe32(v);
+  memcpy(p, &v, sizeof(v));
+  return (p + sizeof(v));
+}
+
+
+char *remote_put64(char *p, uint64_t v)
+{
+  v = htobe64(v);
+  memcpy(p, &v, sizeof(v));
+  return (p + sizeof(v));
+}
+
+
+uint32_t remote_get32(const char *p)
+{
+  uint32_t v;
+
+  memcpy(&v, p, sizeof(v));
+  return (be32toh(v));
+}
+
+
+uint64_t remote_get64(const char *p)
+{
+  uint64_t v;
+
+  memcpy(&v, p, sizeof(v));
+  return (be64toh(v));
+}
+
+
+/* remote_frame - fill in a frame header */
+void remote_frame(char *hdr, frame_type type, uint64_t id, size_t len)
+{
+  char *p = remote_put32(hdr, len);
+
+  *p++ = type;
+  *p++ = 0;
+  *p++ = 0;
+  *p++ = 0;
+  remote_put64(p, id);
+}
+
+
+/* remote_write - write a frame header and its payload, which may come
+ *                in two parts (data can be NULL)
+ *
+ * returns - 0 on success, -1 on error
+ */
+
+int remote_write(int fd, const char *hdr, const char *payload, size_t len, const char *data,
+		 size_t dlen)
+{
+  struct iovec iov[3] = {
+    {(void *)hdr, FRAME_HDR},
+    {(void *)payload, len},
+    {(void *)data, dlen}
+  };
+  struct msghdr msg;
+  struct iovec *v = iov;
+  int n = 3;
+  ssize_t ret;
+
+  while (n > 0) {
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = v;
+    msg.msg_iovlen = n;
+    // a connection closed by the other side is an error, not SIGPIPE
+    if ((ret = sendmsg(fd, &msg, MSG_NOSIGNAL)) < 0) {
+      if (errno == EINTR) {
+	continue;
+      }
+      return (-1);
+    }
+
+    while (n > 0 && (size_t)ret >= v->iov_len) {
+      ret -= v->iov_len;
+      ++v;
+      --n;
+    }
+    if (n > 0) {
+      v->iov_base = (char *)v->iov_base + ret;
+      v->iov_len -= ret;
+    }
+  }
+
+  return (0);
+}
+
+
+/* remote_read - read exactly len bytes
+ *
+ * returns - 0 on success, -1 on error or end of file
+ */
+
+int remote_read(int fd, char *buf, size_t len)
+{
+  ssize_t ret;
+
+  while (len > 0) {
+    if ((ret = read(fd, buf, len)) <= 0) {
+      if (ret < 0 && errno == EINTR) {
+	continue;
+      }
+      if (ret == 0) {
+	errno = ECONNRESET;
+      }
+      return (-1);
+    }
+    buf += ret;
+    len -= ret;
+  }
+
+  return (0);
+}
+
+
+int remote_is_url(const char *dst)
+{
+  return (strncmp(dst, REMOTE_PREFIX, strlen(REMOTE_PREFIX)) == 0);
+}
+
+
+static uint32_t entry_hash(void *key)
+{
+  uint64_t id = ((remote_entry_st *)key)->id;
+
+  return ((uint32_t)(id ^ (id >> 32)));
+}
+
+
+static int entry_cmp(void *a, void *b)
+{
+  return (((remote_entry_st *)a)->id != ((remote_entry_st *)b)->id);
+}
+
+
+static remote_entry_st *entry_new(frame_type type, const char *path, const char *path2,
+				  int is_dir, uint64_t seq)
+{
+  remote_entry_st *e;
+
+  if (!(e = calloc(1, sizeof(remote_entry_st)))) {
+    return (NULL);
+  }
+
+  e->type = type;
+  e->is_dir = is_dir;
+  e->seq = seq;
+  if ((path && !(e->path = strdup(path))) || (path2 && !(e->path2 = strdup(path2)))) {
+    free(e->path);
+    free(e);
+    return (NULL);
+  }
+
+  return (e);
+}
+
+
+static void entry_free(remote_entry_st *e)
+{
+  free(e->path);
+  free(e->path2);
+  free(e);
+}
+
+
+/* parse_url - split tcp://host:port, host may be [an IPv6 address] */
+static int parse_url(remote_st *r, const char *url)
+{
+  const char *host = url + strlen(REMOTE_PREFIX);
+  const char *end;
+  const char *port;
+
+  if (*host == '[') {
+    ++host;
+    if (!(end = strchr(host, ']')) || end[1] != ':') {
+      return (-1);
+    }
+    port = end + 2;
+  } else {
+    if (!(end = strrchr(host, ':'))) {
+      return (-1);
+    }
+    port = end + 1;
+  }
+
+  if (end == host || !*port || strchr(port, '/') ||
+      !(r->host = strndup(host, end - host)) || !(r->port = strdup(port))) {
+    return (-1);
+  }
+  return (0);
+}
+
+
+/* remote_new - set up replication of job to the receiver named by
+ *              its destination. Nothing connects until the first op
+ *              is sent
+ *
+ * returns - NULL on error (logged)
+ */
+
+remote_st *remote_new(job_st *job)
+{
+  remote_st *r;
+
+  if (!(r = calloc(1, sizeof(remote_st)))) {
+    log_msg(LOG_ERR, "%d - malloc failed", __LINE__);
+    return (NULL);
+  }
+
+  r->job = job;
+  r->fd = -1;
+  r->next_id = 1;
+  r->retry_tail = &r->retry;
+
+  if (parse_url(r, job->dst) < 0) {
+    log_msg(LOG_ERR, "job %s: DESTINATION must be %shost:port", job->name, REMOTE_PREFIX);
+    goto fail;
+  }
+  if (!(r->pending = hash_map_init(PENDING_SIZE, entry_hash, entry_cmp))) {
+    log_msg(LOG_ERR, "%d - malloc failed", __LINE__);
+    goto fail;
+  }
+
+  pthread_mutex_init(&r->lock, NULL);
+  pthread_cond_init(&r->cond, NULL);
+  pthread_mutex_init(&r->send_lock, NULL);
+  return (r);
+
+ fail:
+  free(r->host);
+  free(r->port);
+  free(r);
+  return (NULL);
+}
+
+
+static void free_entry(void *key, void *val, void *arg)
+{
+  (void)key;
+  (void)arg;
+  entry_free((remote_entry_st *)val);
+}
+
+
+/* remote_free - disconnect, and drop whatever was not acknowledged.
+ *               It is still in the journal, and sent again on the
+ *               next start
+ */
+
+void remote_free(remote_st *r)
+{
+  remote_entry_st *e;
+
+  if (!r) {
+    return;
+  }
+
+  pthread_mutex_lock(&r->lock);
+  r->closing = 1;
+  if (r->fd >= 0) {
+    shutdown(r->fd, SHUT_RDWR);
+  }
+  pthread_cond_broadcast(&r->cond);
+  pthread_mutex_unlock(&r->lock);
+
+  if (r->started) {
+    pthread_join(r->reader, NULL);
+    pthread_join(r->resender, NULL);
+  }
+
+  hash_map_foreach(r->pending, free_entry, NULL);
+  hash_map_free(r->pending);
+  while ((e = r->retry)) {
+    r->retry = e->next;
+    entry_free(e);
+  }
+
+  pthread_mutex_destroy(&r->lock);
+  pthread_cond_destroy(&r->cond);
+  pthread_mutex_destroy(&r->send_lock);
+  free(r->host);
+  free(r->port);
+  free(r);
+}
+
+
+/* queue an entry to send once connected, caller holds the lock */
+static void queue_retry(remote_st *r, remote_entry_st *e)
+{
+  e->next = NULL;
+  *r->retry_tail = e;
+  r->retry_tail = &e->next;
+  pthread_cond_broadcast(&r->cond);
+}
+
+
+typedef struct collect_st {
+  remote_entry_st **entries;
+  size_t n;
+} collect_st;
+
+
+static void collect(void *key, void *val, void *arg)
+{
+  collect_st *c = (collect_st *)arg;
+
+  (void)key;
+  c->entries[c->n++] = (remote_entry_st *)val;
+}
+
+
+static int id_cmp(const void *a, const void *b)
+{
+  uint64_t x = (*(remote_entry_st **)a)->id;
+  uint64_t y = (*(remote_entry_st **)b)->id;
+
+  return ((x > y) - (x < y));
+}
+
+
+/* conn_down - the connection fd failed: everything sent on it and not
+ *             acknowledged goes back in front of the retry list, in
+ *             the order it was sent. Caller holds the lock
+ */
+
+static void conn_down(remote_st *r, int fd)
+{
+  remote_entry_st *head = NULL;
+  remote_entry_st **tail = &head;
+  remote_entry_st *e;
+  collect_st c;
+  size_t i;
+
+  if (r->fd != fd || fd < 0) {
+    return;
+  }
+  shutdown(fd, SHUT_RDWR);
+  r->fd = -1;
+
+  c.n = 0;
+  if (r->pending->entries &&
+      (c.entries = malloc(r->pending->entries * sizeof(remote_entry_st *)))) {
+    hash_map_foreach(r->pending, collect, &c);
+    qsort(c.entries, c.n, sizeof(remote_entry_st *), id_cmp);
+
+    for (i = 0; i < c.n; i++) {
+      e = c.entries[i];
+      hash_map_remove(r->pending, e);
+      if (e->waiting) {
+	// remote_sync tries again itself
+	e->err = ECONNRESET;
+	e->done = 1;
+	continue;
+      }
+      *tail = e;
+      tail = &e->next;
+    }
+    free(c.entries);
+  }
+
+  if (head) {
+    *tail = r->retry;
+    if (!r->retry) {
+      r->retry_tail = tail;
+    }
+    r->retry = head;
+  }
+
+  pthread_cond_broadcast(&r->cond);
+}
+
+
+/* send_frame - send a frame on connection gen. Takes the send lock,
+ *              the state lock must not be held
+ *
+ * returns - 0 on success, -1 if the connection is (now) down, in
+ *           which case the op was queued to be sent again
+ */
+
+static int send_frame(remote_st *r, unsigned int gen, frame_type type, uint64_t id,
+		      const char *payload, size_t len, const char *data, size_t dlen)
+{
+  char hdr[FRAME_HDR];
+  int fd;
+  int ret = 0;
+
+  remote_frame(hdr, type, id, len + dlen);
+
+  // the reader closes a failed connection only under the send lock,
+  // so fd stays valid while it is held
+  pthread_mutex_lock(&r->send_lock);
+  pthread_mutex_lock(&r->lock);
+  fd = (r->gen == gen) ? r->fd : -1;
+  pthread_mutex_unlock(&r->lock);
+
+  if (fd < 0 || remote_write(fd, hdr, payload, len, data, dlen) < 0) {
+    pthread_mutex_lock(&r->lock);
+    conn_down(r, fd);
+    pthread_mutex_unlock(&r->lock);
+    ret = -1;
+  }
+  pthread_mutex_unlock(&r->send_lock);
+
+  return (ret);
+}
+
+
+/* dial - connect to the receiver and introduce the job
+ *
+ * returns - the connection, -1 on error
+ */
+
+static int dial(remote_st *r)
+{
+  struct addrinfo hints;
+  struct addrinfo *res, *ai;
+  char hello[4 + PATH_MAX];
+  char hdr[FRAME_HDR];
+  size_t len = strlen(r->job->name);
+  int one = 1;
+  int fd = -1;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  if (len > PATH_MAX || getaddrinfo(r->host, r->port, &hints, &res) != 0) {
+    errno = EHOSTUNREACH;
+    return (-1);
+  }
+
+  for (ai = res; ai; ai = ai->ai_next) {
+    if ((fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol)) < 0) {
+      continue;
+    }
+    if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+      break;
+    }
+    close(fd);
+    fd = -1;
+  }
+  freeaddrinfo(res);
+
+  if (fd < 0) {
+    return (-1);
+  }
+
+  // acknowledgements and small ops should not wait on Nagle
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+  remote_put32(hello, REMOTE_VERSION);
+  memcpy(hello + 4, r->job->name, len);
+  remote_frame(hdr, FRAME_HELLO, 0, 4 + len);
+  if (remote_write(fd, hdr, hello, 4 + len, NULL, 0) < 0) {
+    close(fd);
+    return (-1);
+  }
+
+  return (fd);
+}
+
+
+/* finish - op id was acknowledged with err, caller holds the lock */
+static void finish(remote_st *r, uint64_t id, int err)
+{
+  remote_entry_st key;
+  remote_entry_st *e;
+  char *path;
+
+  key.id = id;
+  if (!(e = hash_map_remove(r->pending, &key))) {
+    return;
+  }
+
+  if (e->waiting) {
+    e->err = err;
+    e->done = 1;
+    return;
+  }
+
+  // the old copy is not there (never replicated, or filtered), so
+  // copy the new name instead
+  if (e->type == FRAME_RENAME && err == ENOENT) {
+    path = e->path;
+    e->path = e->path2;
+    e->path2 = NULL;
+    free(path);
+    e->type = e->is_dir ? FRAME_MKDIR : FRAME_OPEN;
+    e->populate = e->is_dir;
+    r->requeued++;
+    queue_retry(r, e);
+    return;
+  }
+
+  if (err && !(err == ENOENT && (e->type == FRAME_UNLINK || e->type == FRAME_RMTREE ||
+				 e->type == FRAME_META || e->type == FRAME_OPEN))) {
+    log_msg(LOG_WARNING, "job %s: %s: %s on %s:%s", r->job->name, e->path, strerror(err),
+	    r->host, r->port);
+  }
+
+  journal_done(e->seq);
+  entry_free(e);
+}
+
+
+/* take in an ACK frame, caller holds the lock */
+static void acked(remote_st *r, const char *buf, size_t len)
+{
+  uint32_t n;
+
+  if (len < 12) {
+    return;
+  }
+
+  r->consumed = remote_get64(buf);
+  n = remote_get32(buf + 8);
+  buf += 12;
+  len -= 12;
+
+  for (; n > 0 && len >= 12; --n, buf += 12, len -= 12) {
+    finish(r, remote_get64(buf), (int)remote_get32(buf + 8));
+  }
+
+  pthread_cond_broadcast(&r->cond);
+}
+
+
+/* reader_main - connect, and read acknowledgements until the
+ *               connection fails, then connect again
+ */
+
+static void *reader_main(void *arg)
+{
+  remote_st *r = (remote_st *)arg;
+  struct timespec until;
+  char hdr[FRAME_HDR];
+  char *buf;
+  size_t len;
+  int backoff = BACKOFF_MIN;
+  int logged = 0;
+  int fd;
+
+  if (!(buf = malloc(FRAME_MAX))) {
+    log_msg(LOG_ERR, "%d - malloc failed", __LINE__);
+    return (NULL);
+  }
+
+  pthread_mutex_lock(&r->lock);
+  while (!r->closing) {
+    if (r->fd < 0) {
+      pthread_mutex_unlock(&r->lock);
+      fd = dial(r);
+      pthread_mutex_lock(&r->lock);
+
+      if (fd < 0) {
+	if (!logged) {
+	  log_msg(LOG_WARNING, "job %s: connect %s:%s: %s, retrying", r->job->name, r->host,
+		  r->port, strerror(errno));
+	  logged = 1;
+	}
+	clock_gettime(CLOCK_REALTIME, &until);
+	until.tv_sec += backoff;
+	if (!r->closing) {
+	  pthread_cond_timedwait(&r->cond, &r->lock, &until);
+	}
+	backoff = (backoff * 2 > BACKOFF_MAX) ? BACKOFF_MAX : backoff * 2;
+	continue;
+      }
+      if (r->closing) {
+	close(fd);
+	break;
+      }
+
+      r->fd = fd;
+      r->gen++;
+      r->sent = r->consumed = 0;
+      backoff = BACKOFF_MIN;
+      logged = 0;
+      log_msg(LOG_INFO, "job %s: connected to %s:%s", r->job->name, r->host, r->port);
+      pthread_cond_broadcast(&r->cond);
+    }
+
+    fd = r->fd;
+    pthread_mutex_unlock(&r->lock);
+
+    len = 0;
+    if (remote_read(fd, hdr, FRAME_HDR) < 0 || (len = remote_get32(hdr)) > FRAME_MAX ||
+	hdr[4] != FRAME_ACK || remote_read(fd, buf, len) < 0) {
+      if (len > FRAME_MAX || hdr[4] != FRAME_ACK) {
+	errno = EPROTO;
+      }
+      pthread_mutex_lock(&r->lock);
+      if (!r->closing) {
+	log_msg(LOG_WARNING, "job %s: connection to %s:%s lost: %s", r->job->name, r->host,
+		r->port, strerror(errno));
+      }
+      conn_down(r, fd);
+      pthread_mutex_unlock(&r->lock);
+
+      pthread_mutex_lock(&r->send_lock);
+      close(fd);
+      pthread_mutex_unlock(&r->send_lock);
+
+      pthread_mutex_lock(&r->lock);
+      continue;
+    }
+
+    pthread_mutex_lock(&r->lock);
+    acked(r, buf, len);
+  }
+  pthread_mutex_unlock(&r->lock);
+
+  free(buf);
+  return (NULL);
+}
+
+
+/* resender_main - send the retry list whenever connected */
+static void *resender_main(void *arg)
+{
+  remote_st *r = (remote_st *)arg;
+  remote_entry_st *e;
+
+  pthread_mutex_lock(&r->lock);
+  while (!r->closing) {
+    if (r->fd < 0 || !r->retry) {
+      pthread_cond_wait(&r->cond, &r->lock);
+      continue;
+    }
+
+    e = r->retry;
+    if (!(r->retry = e->next)) {
+      r->retry_tail = &r->retry;
+    }
+    r->resending = 1;
+    pthread_mutex_unlock(&r->lock);
+
+    if (e->type == FRAME_OPEN) {
+      remote_copy(r, e->path, e->seq);
+    } else if (e->type == FRAME_MKDIR && e->populate) {
+      if (remote_send(r, FRAME_MKDIR, e->path, NULL, 1, 0) == 0) {
+	task_populate(r->job, e->path, e->seq);
+      } else {
+	journal_done(e->seq);
+      }
+    } else {
+      remote_send(r, e->type, e->path, e->path2, e->is_dir, e->seq);
+    }
+    entry_free(e);
+
+    pthread_mutex_lock(&r->lock);
+    r->resending = 0;
+    pthread_cond_broadcast(&r->cond);
+  }
+  pthread_mutex_unlock(&r->lock);
+
+  dir_release();
+  return (NULL);
+}
+
+
+/* start the threads on first use, caller holds the lock */
+static void start(remote_st *r)
+{
+  if (r->started) {
+    return;
+  }
+
+  if (pthread_create(&r->reader, NULL, reader_main, r) != 0) {
+    log_msg(LOG_ERR, "job %s: pthread_create: %s", r->job->name, strerror(errno));
+    return;
+  }
+  if (pthread_create(&r->resender, NULL, resender_main, r) != 0) {
+    log_msg(LOG_ERR, "job %s: pthread_create: %s", r->job->name, strerror(errno));
+    r->closing = 1;
+    pthread_cond_broadcast(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+    pthread_join(r->reader, NULL);
+    pthread_mutex_lock(&r->lock);
+    r->closing = 0;
+    return;
+  }
+  r->started = 1;
+}
+
+
+/* track - hand e an id and put it in the pending map, or queue it
+ *         if not connected. Caller holds the lock
+ *
+ * returns - 1 if e is to be sent now on connection *gen, 0 if it was
+ *           queued
+ */
+
+static int track(remote_st *r, remote_entry_st *e, unsigned int *gen)
+{
+  start(r);
+
+  if (r->fd < 0 || !r->started) {
+    queue_retry(r, e);
+    return (0);
+  }
+
+  e->id = r->next_id++;
+  if (hash_map_put(r->pending, e, e) != 0) {
+    queue_retry(r, e);
+    return (0);
+  }
+  *gen = r->gen;
+  return (1);
+}
+
+
+/* src_stat - stat job->src/rel, symbolic links not followed */
+static int src_stat(remote_st *r, const char *rel, struct stat *st)
+{
+  const char *base;
+  int dir;
+
+  if ((dir = dir_open(r->job->src, rel, &base)) < 0 ||
+      fstatat(dir, base, st, AT_SYMLINK_NOFOLLOW) < 0) {
+    return (-1);
+  }
+  return (0);
+}
+
+
+static char *put_meta(char *p, struct stat *st, int times)
+{
+  p = remote_put32(p, st->st_mode);
+  p = remote_put32(p, st->st_uid);
+  p = remote_put32(p, st->st_gid);
+  if (times) {
+    p = remote_put64(p, st->st_atim.tv_sec * 1000000000ULL + st->st_atim.tv_nsec);
+    p = remote_put64(p, st->st_mtim.tv_sec * 1000000000ULL + st->st_mtim.tv_nsec);
+  }
+  return (p);
+}
+
+
+/* remote_copy - copy job->src/rel to the receiver: OPEN, DATA frames
+ *               as the window allows, then CLOSE with the metadata
+ *
+ * seq - IN - journal sequence number, done once acknowledged
+ *
+ * returns - 0 if the copy was sent (or queued to be), -1 on error
+ */
+
+int remote_copy(remote_st *r, const char *rel, uint64_t seq)
+{
+  remote_entry_st *e;
+  struct stat st;
+  const char *base;
+  unsigned int gen;
+  uint64_t id;
+  size_t plen = strlen(rel);
+  ssize_t len;
+  off_t off = 0;
+  char *buf;
+  char *p;
+  int dir;
+  int in;
+
+  if ((dir = dir_open(r->job->src, rel, &base)) < 0 ||
+      (in = openat(dir, base, O_RDONLY | O_CLOEXEC)) < 0) {
+    journal_done(seq);
+    return (-1);
+  }
+  if (fstat(in, &st) < 0 || !S_ISREG(st.st_mode) || plen > PATH_MAX) {
+    close(in);
+    journal_done(seq);
+    return (-1);
+  }
+
+  if (!(buf = malloc(FRAME_MAX)) || !(e = entry_new(FRAME_OPEN, rel, NULL, 0, seq))) {
+    log_msg(LOG_ERR, "%d - malloc failed", __LINE__);
+    free(buf);
+    close(in);
+    journal_done(seq);
+    return (-1);
+  }
+
+  pthread_mutex_lock(&r->lock);
+  if (!track(r, e, &gen)) {
+    pthread_mutex_unlock(&r->lock);
+    free(buf);
+    close(in);
+    return (0);
+  }
+  id = e->id;
+  pthread_mutex_unlock(&r->lock);
+
+  p = put_meta(buf, &st, 0);
+  p = remote_put64(p, st.st_size);
+  memcpy(p, rel, plen);
+  if (send_frame(r, gen, FRAME_OPEN, id, buf, p + plen - buf, NULL, 0) < 0) {
+    goto out;
+  }
+
+  for (;;) {
+    if ((len = pread(in, buf + 8, REMOTE_CHUNK, off)) < 0 && errno == EINTR) {
+      continue;
+    }
+
+    pthread_mutex_lock(&r->lock);
+    while (!r->closing && r->gen == gen && r->fd >= 0 &&
+	   r->sent - r->consumed >= REMOTE_WINDOW) {
+      pthread_cond_wait(&r->cond, &r->lock);
+    }
+    if (r->closing || r->gen != gen || r->fd < 0) {
+      // sent again from the start
+      pthread_mutex_unlock(&r->lock);
+      break;
+    }
+    if (len > 0) {
+      r->sent += len;
+    }
+    pthread_mutex_unlock(&r->lock);
+
+    if (len < 0) {
+      log_msg(LOG_WARNING, "read %s/%s: %s", r->job->src, rel, strerror(errno));
+      send_frame(r, gen, FRAME_ABORT, id, NULL, 0, NULL, 0);
+      break;
+    }
+
+    if (len == 0) {
+      // what was copied, not what was there when it was opened
+      fstat(in, &st);
+      p = put_meta(buf, &st, 1);
+      send_frame(r, gen, FRAME_CLOSE, id, buf, p - buf, NULL, 0);
+      break;
+    }
+
+    remote_put64(buf, off);
+    if (send_frame(r, gen, FRAME_DATA, id, buf, 8 + len, NULL, 0) < 0) {
+      break;
+    }
+    off += len;
+  }
+
+ out:
+  free(buf);
+  close(in);
+  return (0);
+}
+
+
+/* remote_send - send an op that carries no data
+ *
+ * type - IN - FRAME_MKDIR, FRAME_UNLINK, FRAME_RMTREE, FRAME_RENAME
+ *             (path to path2) or FRAME_META
+ * seq  - IN - journal sequence number, done once acknowledged
+ *
+ * returns - 0 if it was sent (or queued to be), -1 on error
+ */
+
+int remote_send(remote_st *r, frame_type type, const char *path, const char *path2,
+		int is_dir, uint64_t seq)
+{
+  char buf[32 + 2 * PATH_MAX];
+  remote_entry_st *e;
+  struct stat st;
+  unsigned int gen;
+  uint64_t id;
+  size_t plen = strlen(path);
+  size_t plen2 = path2 ? strlen(path2) : 0;
+  char *p = buf;
+
+  if (plen > PATH_MAX || plen2 > PATH_MAX) {
+    journal_done(seq);
+    return (-1);
+  }
+
+  if (type == FRAME_MKDIR || type == FRAME_META) {
+    if (src_stat(r, path, &st) < 0) {
+      // gone again, a later event says so
+      journal_done(seq);
+      return (-1);
+    }
+    p = put_meta(p, &st, type == FRAME_META);
+  } else if (type == FRAME_RENAME) {
+    p = remote_put32(p, is_dir);
+    p = remote_put32(p, plen);
+  }
+  memcpy(p, path, plen);
+  p += plen;
+  if (path2) {
+    memcpy(p, path2, plen2);
+    p += plen2;
+  }
+
+  if (!(e = entry_new(type, path, path2, is_dir, seq))) {
+    log_msg(LOG_ERR, "%d - malloc failed", __LINE__);
+    journal_done(seq);
+    return (-1);
+  }
+
+  pthread_mutex_lock(&r->lock);
+  if (!track(r, e, &gen)) {
+    pthread_mutex_unlock(&r->lock);
+    return (0);
+  }
+  id = e->id;
+  pthread_mutex_unlock(&r->lock);
+
+  send_frame(r, gen, type, id, buf, p - buf, NULL, 0);
+  return (0);
+}
+
+
+/* remote_sync - wait until everything sent so far has been applied
+ *               by the receiver, and its filesystem synced
+ *
+ * returns - 0 on success, -1 on error (errno set, ENOTCONN if the
+ *           receiver could not be reached for SYNC_WAIT seconds)
+ */
+
+int remote_sync(remote_st *r)
+{
+  remote_entry_st *e;
+  struct timespec until;
+  unsigned long requeued;
+  unsigned int gen;
+  int err;
+
+  if (!(e = entry_new(FRAME_SYNC, "", NULL, 0, 0))) {
+    errno = ENOMEM;
+    return (-1);
+  }
+  e->waiting = 1;
+
+  pthread_mutex_lock(&r->lock);
+  start(r);
+  for (;;) {
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_sec += SYNC_WAIT;
+
+    // ops waiting to be sent again go first
+    while (!r->closing && (r->fd < 0 || r->retry || r->resending)) {
+      if (r->fd >= 0) {
+	pthread_cond_wait(&r->cond, &r->lock);
+      } else if (pthread_cond_timedwait(&r->cond, &r->lock, &until) == ETIMEDOUT) {
+	break;
+      }
+    }
+    if (r->closing) {
+      err = ECANCELED;
+      break;
+    }
+    if (r->fd < 0) {
+      err = ENOTCONN;
+      break;
+    }
+    if (r->retry || r->resending) {
+      continue;
+    }
+
+    e->id = r->next_id++;
+    e->done = 0;
+    requeued = r->requeued;
+    if (hash_map_put(r->pending, e, e) != 0) {
+      err = ENOMEM;
+      break;
+    }
+    gen = r->gen;
+    pthread_mutex_unlock(&r->lock);
+
+    send_frame(r, gen, FRAME_SYNC, e->id, NULL, 0, NULL, 0);
+
+    pthread_mutex_lock(&r->lock);
+    while (!e->done && !r->closing) {
+      pthread_cond_wait(&r->cond, &r->lock);
+    }
+    if (!e->done) {
+      hash_map_remove(r->pending, e);
+      err = ECANCELED;
+      break;
+    }
+    if ((err = e->err) != ECONNRESET && (err || r->requeued == requeued)) {
+      break;
+    }
+    // the connection went, or an acknowledgement turned into an op
+    // to send (a rename of something not there), which the next
+    // round waits for
+  }
+  pthread_mutex_unlock(&r->lock);
+
+  entry_free(e);
+  errno = err;
+  return (err ? -1 : 0);
+}
+
+
+/* remote_apply - carry out op on the receiver, see op_apply */
+void remote_apply(remote_st *r, op_st *op)
+{
+  switch (op->type) {
+  case OP_COPY:
+    remote_copy(r, op->path, op->seq);
+    break;
+
+  case OP_UNLINK:
+    remote_send(r, FRAME_UNLINK, op->path, NULL, 0, op->seq);
+    break;
+
+  case OP_REMOVE_TREE:
+    remote_send(r, FRAME_RMTREE, op->path, NULL, 1, op->seq);
+    break;
+
+  case OP_RENAME:
+    remote_send(r, FRAME_RENAME, op->path, op->path2, op->is_dir, op->seq);
+    break;
+
+  case OP_META:
+    remote_send(r, FRAME_META, op->path, NULL, op->is_dir, op->seq);
+    break;
+
+  case OP_POPULATE:
+    if (remote_send(r, FRAME_MKDIR, op->path, NULL, 1, 0) == 0) {
+      task_populate(r->job, op->path, op->seq);
+    } else {
+      journal_done(op->seq);
+    }
+    break;
+  }
+}
+
+
+void remote_stats(remote_st *r, remote_stats_st *st)
+{
+  remote_entry_st *e;
+
+  pthread_mutex_lock(&r->lock);
+  st->connected = (r->fd >= 0);
+  st->unacked = r->pending->entries;
+  st->in_flight = r->sent > r->consumed ? r->sent - r->consumed : 0;
+  for (st->retry = 0, e = r->retry; e; e = e->next) {
+    st->retry++;
+  }
+  pthread_mutex_unlock(&r->lock);
+}
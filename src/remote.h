@@ -0,0 +1,165 @@
+/*
+ * remote.h
+ *
+ * Remote (TCP) Destination Definitions
+ * 
+ *
+ * Copyright (C) 2013  Bryant Moscon - bmoscon@gmail.com
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to 
+ * deal in the Software without restriction, including without limitation the 
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, 
+ *    this list of conditions and the following disclaimer in the documentation 
+ *    and/or other materials provided with the distribution, and in the same 
+ *    place and form as other copyright, license and disclaimer information.
+ *
+ * 3. The end-user documentation included with the redistribution, if any, must 
+ *    include the following acknowledgment: "This product includes software 
+ *    developed by Bryant Moscon (http://www.bryantmoscon.org/)", in the same 
+ *    place and form as other third-party acknowledgments. Alternately, this 
+ *    acknowledgment may appear in the software itself, in the same form and 
+ *    location as other such third-party acknowledgments.
+ *
+ * 4. Except as contained in this notice, the name of the author, Bryant Moscon,
+ *    shall not be used in advertising or otherwise to promote the sale, use or 
+ *    other dealings in this Software without prior written authorization from 
+ *    the author.
+ *
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL 
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN 
+ * THE SOFTWARE.
+ *
+ */
+
+#ifndef __REMOTE__
+#define __REMOTE__
+
+#include <stdint.h>
+#include <limits.h>
+#include <pthread.h>
+
+#include "hash_map.h"
+#include "op.h"
+#include "job.h"
+
+
+#define REMOTE_PREFIX  "tcp://"
+#define REMOTE_VERSION 1
+
+#define REMOTE_CHUNK   (256 * 1024)         // data per DATA frame
+#define REMOTE_WINDOW  (32 * 1024 * 1024)   // data sent and not yet taken in
+
+
+/*
+ * Frames: a header of u32 payload length, u8 type, 3 bytes of zero
+ * and u64 op id, then the payload. Numbers are big endian, paths are
+ * relative to the job's directory on the receiver, and not
+ * terminated: a path runs to the end of the payload.
+ */
+
+#define FRAME_HDR 16
+#define FRAME_MAX (REMOTE_CHUNK + 2 * PATH_MAX + 64)
+
+typedef enum frame_type {
+  FRAME_HELLO = 1,   // u32 version, job name
+  FRAME_MKDIR,       // u32 mode, uid, gid, path
+  FRAME_OPEN,        // u32 mode, uid, gid, u64 size, path: a copy starts
+  FRAME_DATA,        // u64 offset, data
+  FRAME_CLOSE,       // u32 mode, uid, gid, u64 atime, mtime (ns): publish it
+  FRAME_ABORT,       // the source went away, drop the copy
+  FRAME_UNLINK,      // path
+  FRAME_RMTREE,      // path
+  FRAME_RENAME,      // u32 is_dir, u32 length of the first path, from, to
+  FRAME_META,        // u32 mode, uid, gid, u64 atime, mtime (ns), path
+  FRAME_SYNC,        // syncfs the job's directory
+  FRAME_ACK          // receiver: u64 data taken in, u32 count, then count
+		     // times u64 id and u32 errno (0 for done)
+} frame_type;
+
+
+/* an op sent, or waiting to be, and not acknowledged yet */
+typedef struct remote_entry_st {
+  uint64_t id;
+  frame_type type;         // FRAME_OPEN for a copy
+  char *path;
+  char *path2;
+  int is_dir;
+  int populate;            // FRAME_MKDIR: copy everything below it too
+  uint64_t seq;            // journal, marked done once acknowledged
+  int waiting;             // remote_sync waits on it, and frees it
+  int done;
+  int err;
+
+  struct remote_entry_st *next;   // in the retry list
+} remote_entry_st;
+
+
+typedef struct remote_st {
+  job_st *job;             // owns this, not held
+  char *host;
+  char *port;
+
+  pthread_mutex_t lock;
+  pthread_cond_t cond;     // connected, acknowledged, window opened, closing
+  pthread_mutex_t send_lock;  // one frame at a time. Taken before lock,
+			      // never while holding it
+  int fd;                  // -1 while not connected
+  unsigned int gen;        // connections made
+  int started;             // the threads run
+  int closing;
+  int resending;           // the resend thread is sending an entry
+  unsigned long requeued;  // acknowledgements that became ops to send
+  uint64_t next_id;
+  uint64_t sent;           // data bytes sent on this connection
+  uint64_t consumed;       // ... and taken in by the receiver
+  hash_map_st *pending;    // id -> remote_entry_st, sent
+  remote_entry_st *retry;  // to (re)send once connected, oldest first
+  remote_entry_st **retry_tail;
+
+  pthread_t reader;        // acknowledgements, reconnects
+  pthread_t resender;      // the retry list
+} remote_st;
+
+
+typedef struct remote_stats_st {
+  int connected;
+  size_t unacked;          // ops sent and not acknowledged
+  uint64_t in_flight;      // data bytes sent and not taken in
+  size_t retry;            // ops waiting to be sent again
+} remote_stats_st;
+
+
+int remote_is_url(const char *dst);
+remote_st *remote_new(job_st *job);
+void remote_free(remote_st *r);
+void remote_apply(remote_st *r, op_st *op);
+int remote_copy(remote_st *r, const char *rel, uint64_t seq);
+int remote_send(remote_st *r, frame_type type, const char *path, const char *path2,
+		int is_dir, uint64_t seq);
+int remote_sync(remote_st *r);
+void remote_stats(remote_st *r, remote_stats_st *st);
+
+char *remote_put32(char *p, uint32_t v);
+char *remote_put64(char *p, uint64_t v);
+uint32_t remote_get32(const char *p);
+uint64_t remote_get64(const char *p);
+void remote_frame(char *hdr, frame_type type, uint64_t id, size_t len);
+int remote_read(int fd, char *buf, size_t len);
+int remote_write(int fd, const char *hdr, const char *payload, size_t len, const char *data,
+		 size_t dlen);
+
+
+#endif
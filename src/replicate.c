@@ -0,0 +1,866 @@
+/*
+ * replicate.c
+ *
+ * Applies source changes to the destination
+ * 
+ *
+ * Copyright (C) 2013  Bryant Moscon - bmoscon@gmail.com
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to 
+ * deal in the Software without restriction, including without limitation the 
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, 
+ *    this list of conditions and the following disclaimer in the documentation 
+ *    and/or other materials provided with the distribution, and in the same 
+ *    place and form as other copyright, license and disclaimer information.
+ *
+ * 3. The end-user documentation included with the redistribution, if any, must 
+ *    include the following acknowledgment: "This product includes software 
+ *    developed by Bryant Moscon (http://www.bryantmoscon.org/)", in the same 
+ *    place and form as other third-party acknowledgments. Alternately, this 
+ *    acknowledgment may appear in the software itself, in the same form and 
+ *    location as other such third-party acknowledgments.
+ *
+ * 4. Except as contained in this notice, the name of the author, Bryant Moscon,
+ *    shall not be used in advertising or otherwise to promote the sale, use or 
+ *    other dealings in this Software without prior written authorization from 
+ *    the author.
+ *
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL 
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN 
+ * THE SOFTWARE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "replicate.h"
+#include "remote.h"
+#include "dircache.h"
+#include "metadata.h"
+#include "task.h"
+#include "journal.h"
+#include "trash.h"
+#include "pack.h"
+#include "log.h"
+
+
+/*
+ * Copying through the page cache pushes out everything else that is
+ * cached, so big copies can be told not to keep what they copied
+ * (CACHE_DONTNEED): the destination is written back a window at a
+ * time behind the copy, and the window before it (already on its way
+ * to disk) is dropped from the cache, for the source too (whoever
+ * wrote it is done with it). CACHE_DIRECT instead reads and writes
+ * with O_DIRECT through aligned buffers, kept in a pool, and only the
+ * unaligned start and end of a range go through the cache. Files
+ * smaller than CACHE_MIN_SIZE are always copied the normal way.
+ */
+
+
+#define CACHE_WINDOW (8 * 1024 * 1024)
+#define DIRECT_ALIGN 4096
+#define DIRECT_BUF   (1024 * 1024)
+#define POOL_MAX     16
+
+
+static int policy = CACHE_NORMAL;
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static void *pool[POOL_MAX];
+static int pooled = 0;
+
+
+/* replicate_cache - set the page cache policy of copies, CACHE_* */
+void replicate_cache(int cache)
+{
+  policy = cache;
+}
+
+
+/* an aligned buffer of DIRECT_BUF bytes */
+static void *buf_get(void)
+{
+  void *buf = NULL;
+
+  pthread_mutex_lock(&pool_lock);
+  if (pooled) {
+    buf = pool[--pooled];
+  }
+  pthread_mutex_unlock(&pool_lock);
+
+  if (!buf && posix_memalign(&buf, DIRECT_ALIGN, DIRECT_BUF) != 0) {
+    return (NULL);
+  }
+  return (buf);
+}
+
+
+static void buf_put(void *buf)
+{
+  pthread_mutex_lock(&pool_lock);
+  if (pooled < POOL_MAX) {
+    pool[pooled++] = buf;
+    buf = NULL;
+  }
+  pthread_mutex_unlock(&pool_lock);
+
+  free(buf);
+}
+
+
+/* open the O_DIRECT twins of a copy's fds */
+static int open_direct(copy_st *c)
+{
+  char name[64];
+
+  snprintf(name, sizeof(name), "/proc/self/fd/%d", c->in_fd);
+  if ((c->in_direct = open(name, O_RDONLY | O_DIRECT | O_CLOEXEC)) < 0) {
+    return (-1);
+  }
+
+  snprintf(name, sizeof(name), "/proc/self/fd/%d", c->out_fd);
+  if ((c->out_direct = open(name, O_WRONLY | O_DIRECT | O_CLOEXEC)) < 0) {
+    close(c->in_direct);
+    c->in_direct = -1;
+    return (-1);
+  }
+
+  return (0);
+}
+
+
+/* make_parents - create any missing destination directories above rel */
+static int make_parents(job_st *job, const char *rel)
+{
+  char *copy = strdup(rel);
+  char *slash;
+  int ret = 0;
+
+  if (!copy) {
+    return (-1);
+  }
+
+  for (slash = strchr(copy, '/'); slash; slash = strchr(slash + 1, '/')) {
+    *slash = '\0';
+    if (replicate_mkdir(job, copy) < 0) {
+      ret = -1;
+      break;
+    }
+    *slash = '/';
+  }
+
+  free(copy);
+  return (ret);
+}
+
+
+/* open_temp - create a temporary file in dir. The copy is written
+ *             there and renamed over the old one once complete, so a
+ *             half written file is never visible and two copies of
+ *             the same file cannot interleave
+ */
+
+static int open_temp(int dir, char *temp, size_t len)
+{
+  static unsigned int seq = 0;
+  int tries;
+  int fd;
+
+  for (tries = 0; tries < 100; tries++) {
+    snprintf(temp, len, ".backupd.%lx.%x", (long)getpid(),
+	     __atomic_fetch_add(&seq, 1, __ATOMIC_RELAXED));
+    if ((fd = openat(dir, temp, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600)) >= 0 ||
+	errno != EEXIST) {
+      return (fd);
+    }
+  }
+
+  return (-1);
+}
+
+
+/* replicate_create - open a temporary file in the destination for a
+ *                    copy of rel, the destination half of
+ *                    replicate_open. Also used by the receiver, which
+ *                    has no source file
+ *
+ * c - IN/OUT - c->st describes the source, the rest is filled in
+ *
+ * returns - 0 on success, -1 on error (logged)
+ */
+
+int replicate_create(job_st *job, const char *rel, copy_st *c)
+{
+  c->job = job;
+  c->rel = rel;
+  c->out_fd = c->out_dir = -1;
+  c->in_direct = c->out_direct = -1;
+  c->failed = 0;
+  c->cache = CACHE_NORMAL;
+
+  c->out_dir = dir_dup(job->dst, rel, &c->out_base);
+  if (c->out_dir < 0 && errno == ENOENT && make_parents(job, rel) == 0) {
+    c->out_dir = dir_dup(job->dst, rel, &c->out_base);
+  }
+  if (c->out_dir < 0 ||
+      (c->out_fd = open_temp(c->out_dir, c->temp_name, sizeof(c->temp_name))) < 0) {
+    log_msg(LOG_WARNING, "open %s/%s: %s", job->dst, rel, strerror(errno));
+    if (c->out_dir >= 0) {
+      close(c->out_dir);
+    }
+    return (-1);
+  }
+
+  // a source with holes is copied without them, see copy_span
+  c->sparse = (c->in_fd >= 0 && (off_t)c->st.st_blocks * 512 < c->st.st_size);
+
+  // reserve the space up front, keeps large copies from fragmenting
+  // (and is needed before ranges are written out of order)
+  if (c->st.st_size > 0 && !c->sparse) {
+    fallocate(c->out_fd, FALLOC_FL_KEEP_SIZE, 0, c->st.st_size);
+  }
+
+  return (0);
+}
+
+
+/* replicate_open - start a copy of job->src/rel: open it and a
+ *                  temporary file to copy it to
+ *
+ * c - OUT - copy state, passed to replicate_range and
+ *           replicate_publish. It points into rel, which must stay
+ *           around until then
+ *
+ * returns - 0 on success, -1 on error (logged, unless the file is
+ *           already gone again - a later event will tell us)
+ */
+
+int replicate_open(job_st *job, const char *rel, copy_st *c)
+{
+  const char *base;
+  int dir;
+
+  c->in_fd = -1;
+
+  if ((dir = dir_open(job->src, rel, &base)) < 0 ||
+      (c->in_fd = openat(dir, base, O_RDONLY | O_CLOEXEC)) < 0) {
+    if (errno != ENOENT) {
+      log_msg(LOG_WARNING, "open %s/%s: %s", job->src, rel, strerror(errno));
+    }
+    return (-1);
+  }
+
+  if (fstat(c->in_fd, &c->st) < 0 || !S_ISREG(c->st.st_mode) ||
+      replicate_create(job, rel, c) < 0) {
+    close(c->in_fd);
+    return (-1);
+  }
+
+  c->cache = (c->st.st_size >= CACHE_MIN_SIZE) ? policy : CACHE_NORMAL;
+  if (c->cache != CACHE_NORMAL) {
+    posix_fadvise(c->in_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  }
+  // not every filesystem takes O_DIRECT (tmpfs)
+  if (c->cache == CACHE_DIRECT && open_direct(c) < 0) {
+    c->cache = CACHE_DONTNEED;
+  }
+
+  return (0);
+}
+
+
+/* copy len bytes at off with read/write, for when copy_file_range
+ * cannot be used between the two filesystems
+ */
+
+static ssize_t copy_slow(copy_st *c, off_t off, size_t len)
+{
+  char buf[65536];
+  ssize_t result;
+
+  if (len > sizeof(buf)) {
+    len = sizeof(buf);
+  }
+
+  if ((result = pread(c->in_fd, buf, len, off)) > 0 &&
+      pwrite(c->out_fd, buf, result, off) != result) {
+    return (-1);
+  }
+  return (result);
+}
+
+
+/* copy_bytes - copy from off up to end (-1 for the end of the file)
+ *
+ * returns - bytes copied (fewer at the end of the file), -1 on error
+ *           (logged, and the copy is marked failed)
+ */
+
+static off_t copy_bytes(copy_st *c, off_t off, off_t end)
+{
+  off_t start = off;
+  int slow = 0;
+  ssize_t result;
+
+  while (end < 0 || off < end) {
+    size_t want = (end < 0 || end - off > (1 << 30)) ? (1 << 30) : (size_t)(end - off);
+
+    if (!slow) {
+      loff_t in_off = off;
+      loff_t out_off = off;
+
+      result = copy_file_range(c->in_fd, &in_off, c->out_fd, &out_off, want, 0);
+      if (result < 0 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL ||
+			 errno == EOPNOTSUPP)) {
+	slow = 1;
+	continue;
+      }
+    } else {
+      result = copy_slow(c, off, want);
+    }
+
+    if (result == 0) {
+      break;
+    }
+    if (result < 0) {
+      if (errno == EINTR) {
+	continue;
+      }
+      log_msg(LOG_WARNING, "copy %s: %s", c->rel, strerror(errno));
+      __atomic_store_n(&c->failed, 1, __ATOMIC_RELAXED);
+      return (-1);
+    }
+    off += result;
+  }
+
+  return (off - start);
+}
+
+
+/* copy_span - copy_bytes, but only the data of a sparse source: its
+ *             holes are skipped, and stay holes in the copy
+ *
+ * returns - bytes gone past, holes included (fewer at the end of the
+ *           file), -1 on error
+ */
+
+static off_t copy_span(copy_st *c, off_t off, off_t end)
+{
+  off_t start = off;
+  off_t data, hole, n;
+  struct stat st;
+
+  if (!c->sparse) {
+    return (copy_bytes(c, off, end));
+  }
+
+  while (end < 0 || off < end) {
+    if ((data = lseek(c->in_fd, off, SEEK_DATA)) < 0) {
+      if (errno != ENXIO) {
+	// no SEEK_DATA here
+	return ((n = copy_bytes(c, off, end)) < 0 ? -1 : off - start + n);
+      }
+      // a hole up to the end of the file
+      if (fstat(c->in_fd, &st) == 0 && st.st_size > off) {
+	off = (end >= 0 && end < st.st_size) ? end : st.st_size;
+      }
+      break;
+    }
+    if (end >= 0 && data >= end) {
+      off = end;
+      break;
+    }
+    if ((hole = lseek(c->in_fd, data, SEEK_HOLE)) < 0 || (end >= 0 && hole > end)) {
+      hole = end;
+    }
+
+    if ((n = copy_bytes(c, data, hole)) < 0) {
+      return (-1);
+    }
+    off = data + n;
+    if (hole >= 0 && n < hole - data) {
+      // shrank
+      break;
+    }
+  }
+
+  return (off - start);
+}
+
+
+/* write back len bytes at off of the copy, and drop them (on both
+ * sides) from the page cache */
+static void drop(copy_st *c, off_t off, off_t len)
+{
+  sync_file_range(c->out_fd, off, len, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+		  SYNC_FILE_RANGE_WAIT_AFTER);
+  posix_fadvise(c->out_fd, off, len, POSIX_FADV_DONTNEED);
+  posix_fadvise(c->in_fd, off, len, POSIX_FADV_DONTNEED);
+}
+
+
+/* copy_direct - copy_span with O_DIRECT, unaligned ends go through
+ *               the cache
+ */
+
+static off_t copy_direct(copy_st *c, off_t off, off_t end)
+{
+  off_t start = off;
+  ssize_t result;
+  char *buf;
+
+  if (off % DIRECT_ALIGN) {
+    off_t head = off - off % DIRECT_ALIGN + DIRECT_ALIGN;
+
+    if (end >= 0 && head > end) {
+      head = end;
+    }
+    if ((result = copy_span(c, off, head)) < 0) {
+      return (-1);
+    }
+    off += result;
+    if (off < head) {
+      return (off - start);
+    }
+  }
+
+  if (!(buf = buf_get())) {
+    return ((result = copy_span(c, off, end)) < 0 ? -1 : off + result - start);
+  }
+
+  while (end < 0 || off < end) {
+    size_t want = (end >= 0 && end - off < DIRECT_BUF) ? (size_t)(end - off) : DIRECT_BUF;
+
+    if (want % DIRECT_ALIGN) {
+      if ((result = copy_span(c, off, end)) < 0) {
+	buf_put(buf);
+	return (-1);
+      }
+      off += result;
+      break;
+    }
+
+    if ((result = pread(c->in_direct, buf, want, off)) == 0) {
+      break;
+    }
+    if (result > 0 && result % DIRECT_ALIGN) {
+      // the end of the file, not a whole block
+      if (pwrite(c->out_fd, buf, result, off) != result) {
+	result = -1;
+      } else {
+	off += result;
+	break;
+      }
+    } else if (result > 0 && pwrite(c->out_direct, buf, result, off) != result) {
+      result = -1;
+    }
+
+    if (result < 0) {
+      if (errno == EINTR) {
+	continue;
+      }
+      log_msg(LOG_WARNING, "copy %s: %s", c->rel, strerror(errno));
+      __atomic_store_n(&c->failed, 1, __ATOMIC_RELAXED);
+      buf_put(buf);
+      return (-1);
+    }
+    off += result;
+  }
+
+  buf_put(buf);
+  return (off - start);
+}
+
+
+/* replicate_range - copy the bytes from off up to off + len (or to
+ *                   the end of the file, if len is 0). Ranges of one
+ *                   copy can be done by several threads at once
+ *
+ * returns - 0 on success, -1 on error (logged, and the copy is
+ *           marked failed)
+ */
+
+int replicate_range(copy_st *c, off_t off, off_t len)
+{
+  off_t end = len ? off + len : -1;
+  off_t prev_off = 0;
+  off_t prev_len = 0;
+  off_t result;
+
+  if (c->cache == CACHE_NORMAL) {
+    return (copy_span(c, off, end) < 0 ? -1 : 0);
+  }
+
+  if (c->cache == CACHE_DIRECT) {
+    // the unaligned ends were cached
+    if ((result = copy_direct(c, off, end)) > 0) {
+      drop(c, off, result);
+    }
+    return (result < 0 ? -1 : 0);
+  }
+
+  while (end < 0 || off < end) {
+    off_t want = (end >= 0 && end - off < CACHE_WINDOW) ? end - off : CACHE_WINDOW;
+
+    if ((result = copy_span(c, off, off + want)) < 0) {
+      return (-1);
+    }
+
+    // start writing this window back, and drop the one before,
+    // which has had the time to get to disk
+    if (result) {
+      sync_file_range(c->out_fd, off, result, SYNC_FILE_RANGE_WRITE);
+    }
+    if (prev_len) {
+      drop(c, prev_off, prev_len);
+    }
+    prev_off = off;
+    prev_len = result;
+
+    off += result;
+    if (result < want) {
+      break;
+    }
+  }
+
+  if (prev_len) {
+    drop(c, prev_off, prev_len);
+  }
+  return (0);
+}
+
+
+/* replicate_publish - finish a copy. If every range went well the
+ *                     temporary file gets the source's metadata
+ *                     (as it is now) and is renamed over the old
+ *                     copy, if not it is removed
+ *
+ * returns - 0 on success, -1 on error
+ */
+
+int replicate_publish(copy_st *c)
+{
+  int ret = c->failed ? -1 : 0;
+
+  if (ret == 0) {
+    // the receiver has no source, c->st came with the copy
+    if (c->in_fd >= 0) {
+      fstat(c->in_fd, &c->st);
+    }
+    // ending in a hole, nothing was written there
+    if (c->sparse && ftruncate(c->out_fd, c->st.st_size) < 0) {
+      log_msg(LOG_WARNING, "truncate %s: %s", c->rel, strerror(errno));
+    }
+    meta_copy(c->out_fd, c->in_fd, &c->st, c->rel, META_ALL);
+    if (renameat(c->out_dir, c->temp_name, c->out_dir, c->out_base) < 0) {
+      log_msg(LOG_WARNING, "rename %s: %s", c->rel, strerror(errno));
+      ret = -1;
+    } else if (c->job->pack_size) {
+      // grew out of the pack
+      pack_forget(c->job, c->rel, 0);
+    }
+  }
+
+  if (ret < 0) {
+    unlinkat(c->out_dir, c->temp_name, 0);
+  }
+
+  if (c->in_direct >= 0) {
+    close(c->in_direct);
+    close(c->out_direct);
+  }
+  if (c->in_fd >= 0) {
+    close(c->in_fd);
+  }
+  close(c->out_fd);
+  close(c->out_dir);
+
+  return (ret);
+}
+
+
+/* replicate_copy - copy job->src/rel over job->dst/rel, along
+ *                  with its metadata
+ *
+ * returns - 0 on success, -1 on error (logged)
+ */
+
+int replicate_copy(job_st *job, const char *rel)
+{
+  copy_st c;
+  int ret;
+
+  if (job->remote) {
+    return (remote_copy(job->remote, rel, 0));
+  }
+
+  if (job->pack_size && (ret = pack_copy(job, rel)) <= 0) {
+    return (ret);
+  }
+
+  if (replicate_open(job, rel, &c) < 0) {
+    return (-1);
+  }
+
+  replicate_range(&c, 0, 0);
+  return (replicate_publish(&c));
+}
+
+
+/* replicate_mkdir - create job->dst/rel (if missing) with the owner,
+ *                   mode and extended attributes of the source
+ *                   directory
+ */
+
+int replicate_mkdir(job_st *job, const char *rel)
+{
+  const char *base;
+  struct stat st;
+  int in_fd;
+  int fd;
+  int dir;
+
+  if (job->remote) {
+    return (remote_send(job->remote, FRAME_MKDIR, rel, NULL, 1, 0));
+  }
+
+  if ((dir = dir_open(job->dst, rel, &base)) < 0 || mkdirat(dir, base, S_IRWXU) < 0) {
+    if (errno == EEXIST) {
+      return (0);
+    }
+    log_msg(LOG_WARNING, "mkdir %s/%s: %s", job->dst, rel, strerror(errno));
+    return (-1);
+  }
+
+  if ((fd = openat(dir, base, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+    return (0);
+  }
+  // (the receiver has no source, the sender's mode follows)
+  if (job->src && (dir = dir_open(job->src, rel, &base)) >= 0 &&
+      (in_fd = openat(dir, base, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) >= 0) {
+    // its times change as soon as anything is put in it
+    if (fstat(in_fd, &st) == 0) {
+      meta_copy(fd, in_fd, &st, rel, META_OWNER | META_MODE | META_XATTR);
+    }
+    close(in_fd);
+  }
+  close(fd);
+
+  return (0);
+}
+
+
+/* replicate_meta - apply a metadata only change (IN_ATTRIB) of
+ *                  job->src/rel to its copy, without copying any data
+ *
+ * returns - 0 on success, -1 on error
+ */
+
+int replicate_meta(job_st *job, const char *rel)
+{
+  const char *in_base;
+  const char *out_base;
+  struct stat st;
+  int in_dir;
+  int out_dir;
+  int ret;
+
+  if (job->pack_size && pack_meta(job, rel) == 0) {
+    return (0);
+  }
+
+  if ((out_dir = dir_dup(job->dst, rel, &out_base)) < 0) {
+    return (-1);
+  }
+
+  if (fstatat(out_dir, out_base, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+    // not replicated (yet), the copy will bring the metadata along
+    close(out_dir);
+    return (-1);
+  }
+
+  // the inode is shared with a snapshot, which must keep the old
+  // metadata, so the copy gets an inode of its own
+  if (S_ISREG(st.st_mode) && st.st_nlink > 1) {
+    close(out_dir);
+    return (replicate_copy(job, rel));
+  }
+
+  ret = -1;
+  if ((in_dir = dir_open(job->src, rel, &in_base)) >= 0) {
+    ret = meta_sync(in_dir, in_base, out_dir, out_base, rel);
+  }
+  close(out_dir);
+
+  return (ret);
+}
+
+
+int replicate_unlink(job_st *job, const char *rel)
+{
+  const char *base;
+  int dir;
+
+  if (job->remote) {
+    return (remote_send(job->remote, FRAME_UNLINK, rel, NULL, 0, 0));
+  }
+
+  // a packed file has no copy to move to the trash
+  if (job->pack_size && pack_forget(job, rel, 0) == 0) {
+    return (0);
+  }
+
+  if (trash_put(job, rel) == 0) {
+    return (0);
+  }
+
+  if ((dir = dir_open(job->dst, rel, &base)) < 0) {
+    return (errno == ENOENT ? 0 : -1);
+  }
+
+  if (unlinkat(dir, base, 0) < 0 && errno != ENOENT) {
+    log_msg(LOG_WARNING, "unlink %s/%s: %s", job->dst, rel, strerror(errno));
+    return (-1);
+  }
+
+  return (0);
+}
+
+
+/* replicate_staging_name - a name, next to rel, that a directory
+ *                          can be moved to while it is deleted
+ *
+ * returns - malloc'd path relative to the job's destination
+ */
+
+char *replicate_staging_name(const char *rel)
+{
+  static unsigned int seq = 0;
+  const char *slash = strrchr(rel, '/');
+  int dlen = slash ? (int)(slash - rel) + 1 : 0;
+  char *name;
+
+  if (asprintf(&name, "%.*s.backupd-rm.%ld.%u", dlen, rel, (long)getpid(),
+	       __atomic_fetch_add(&seq, 1, __ATOMIC_RELAXED)) < 0) {
+    return (NULL);
+  }
+  return (name);
+}
+
+
+/* replicate_remove_tree - remove job->dst/rel and everything below it.
+ *                         The directory is first renamed to staging
+ *                         (so the name can be reused at once) and
+ *                         deleted in the background, or moved to the
+ *                         trash (see trash.c)
+ *
+ * seq - IN - journal sequence number, done once the tree is gone
+ */
+
+int replicate_remove_tree(job_st *job, const char *rel, const char *staging, uint64_t seq)
+{
+  const char *base;
+  const char *staged;
+  int from;
+  int to;
+  int err = 0;
+
+  if (job->pack_size) {
+    pack_forget(job, rel, 1);
+  }
+
+  if (trash_put(job, rel) == 0) {
+    journal_done(seq);
+    return (0);
+  }
+
+  if ((from = dir_dup(job->dst, rel, &base)) < 0) {
+    err = errno;
+  } else {
+    if ((to = dir_open(job->dst, staging, &staged)) < 0 ||
+	renameat(from, base, to, staged) < 0) {
+      err = errno;
+    }
+    close(from);
+  }
+
+  if (err == ENOTDIR) {
+    journal_done(seq);
+    return (replicate_unlink(job, rel));
+  }
+
+  // the cached fds below rel now have the wrong path
+  dir_invalidate();
+
+  if (err && err != ENOENT) {
+    log_msg(LOG_WARNING, "rename %s/%s: %s", job->dst, rel, strerror(err));
+    task_remove(job->dst, rel, seq);
+    return (0);
+  }
+
+  // on ENOENT it was already staged by an earlier run that did not
+  // finish, if not this finds nothing to remove
+  task_remove(job->dst, staging, seq);
+  return (0);
+}
+
+
+/* replicate_rename - apply a rename inside the source tree to the
+ *                    destination
+ *
+ * returns - 0 on success, -1 on error. errno is ENOENT if the old copy
+ *           is not there (it was never replicated, or is filtered)
+ */
+
+int replicate_rename(job_st *job, const char *from, const char *to)
+{
+  const char *from_base;
+  const char *to_base;
+  int from_dir;
+  int to_dir;
+  int ret = 0;
+
+  if (job->pack_size && pack_rename(job, from, to) == 0) {
+    // a copy of to made before it was packed
+    if ((to_dir = dir_open(job->dst, to, &to_base)) >= 0) {
+      unlinkat(to_dir, to_base, 0);
+    }
+    return (0);
+  }
+
+  if ((from_dir = dir_dup(job->dst, from, &from_base)) < 0) {
+    return (-1);
+  }
+
+  if ((to_dir = dir_open(job->dst, to, &to_base)) < 0 ||
+      renameat(from_dir, from_base, to_dir, to_base) < 0) {
+    if (errno != ENOENT) {
+      log_msg(LOG_WARNING, "rename %s/%s: %s", job->dst, from, strerror(errno));
+    }
+    ret = -1;
+  }
+
+  close(from_dir);
+  return (ret);
+}
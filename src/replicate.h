@@ -0,0 +1,98 @@
+/*
+ * replicate.h
+ *
+ * Replication Operation Definitions
+ * 
+ *
+ * Copyright (C) 2013  Bryant Moscon - bmoscon@gmail.com
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to 
+ * deal in the Software without restriction, including without limitation the 
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, 
+ *    this list of conditions and the following disclaimer in the documentation 
+ *    and/or other materials provided with the distribution, and in the same 
+ *    place and form as other copyright, license and disclaimer information.
+ *
+ * 3. The end-user documentation included with the redistribution, if any, must 
+ *    include the following acknowledgment: "This product includes software 
+ *    developed by Bryant Moscon (http://www.bryantmoscon.org/)", in the same 
+ *    place and form as other third-party acknowledgments. Alternately, this 
+ *    acknowledgment may appear in the software itself, in the same form and 
+ *    location as other such third-party acknowledgments.
+ *
+ * 4. Except as contained in this notice, the name of the author, Bryant Moscon,
+ *    shall not be used in advertising or otherwise to promote the sale, use or 
+ *    other dealings in this Software without prior written authorization from 
+ *    the author.
+ *
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL 
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN 
+ * THE SOFTWARE.
+ *
+ */
+
+#ifndef __REPLICATE__
+#define __REPLICATE__
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "job.h"
+
+
+// page cache policy of copies (CACHE in [BACKUPD])
+#define CACHE_NORMAL   0
+#define CACHE_DONTNEED 1    // write back and drop what was copied as we go
+#define CACHE_DIRECT   2    // O_DIRECT, through aligned buffers
+
+// smaller files are always copied through the page cache
+#define CACHE_MIN_SIZE (1024 * 1024)
+
+
+/* a copy in progress, see replicate_open */
+typedef struct copy_st {
+  job_st *job;
+  int in_fd;
+  int out_fd;
+  struct stat st;          // of the source, when it was opened
+  int failed;              // set by any range that fails
+  const char *rel;         // for messages
+  int out_dir;             // destination directory, our own fd
+  const char *out_base;    // name in out_dir, points into rel
+  char temp_name[32];      // in out_dir
+  int sparse;              // the source has holes, copy only its data
+  int cache;               // CACHE_* for this copy
+  int in_direct;           // O_DIRECT fds, CACHE_DIRECT only
+  int out_direct;
+} copy_st;
+
+
+void replicate_cache(int policy);
+int replicate_create(job_st *job, const char *rel, copy_st *c);
+int replicate_open(job_st *job, const char *rel, copy_st *c);
+int replicate_range(copy_st *c, off_t off, off_t len);
+int replicate_publish(copy_st *c);
+int replicate_copy(job_st *job, const char *rel);
+int replicate_mkdir(job_st *job, const char *rel);
+int replicate_meta(job_st *job, const char *rel);
+int replicate_unlink(job_st *job, const char *rel);
+char *replicate_staging_name(const char *rel);
+int replicate_remove_tree(job_st *job, const char *rel, const char *staging, uint64_t seq);
+int replicate_rename(job_st *job, const char *from, const char *to);
+
+
+#endif
@@ -0,0 +1,464 @@
+/*
+ * restore.c
+ *
+ * Restore From a Destination
+ * 
+ *
+ * Copyright (C) 2013  Bryant Moscon - bmoscon@gmail.com
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to 
+ * deal in the Software without restriction, including without limitation the 
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, 
+ *    this list of conditions and the following disclaimer in the documentation 
+ *    and/or other materials provided with the distribution, and in the same 
+ *    place and form as other copyright, license and disclaimer information.
+ *
+ * 3. The end-user documentation included with the redistribution, if any, must 
+ *    include the following acknowledgment: "This product includes software 
+ *    developed by Bryant Moscon (http://www.bryantmoscon.org/)", in the same 
+ *    place and form as other third-party acknowledgments. Alternately, this 
+ *    acknowledgment may appear in the software itself, in the same form and 
+ *    location as other such third-party acknowledgments.
+ *
+ * 4. Except as contained in this notice, the name of the author, Bryant Moscon,
+ *    shall not be used in advertising or otherwise to promote the sale, use or 
+ *    other dealings in this Software without prior written authorization from 
+ *    the author.
+ *
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL 
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN 
+ * THE SOFTWARE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "restore.h"
+#include "replicate.h"
+#include "dircache.h"
+#include "snapshot.h"
+#include "pack.h"
+#include "watch.h"
+#include "log.h"
+
+
+/*
+ * "backupd restore" copies a job's destination, or one of its
+ * snapshots, or a part of either, out to a target directory with the
+ * replication copy engine: what is restored from stands in as the
+ * source of a job whose destination is the target. Files go through
+ * replicate_copy (copy_file_range, holes skipped, the CACHE policy, a
+ * temporary name renamed into place) and get their owner, mode,
+ * extended attributes and times back, directories go through
+ * replicate_mkdir. Packed files come out of the pack (pack_extract).
+ * Everything lands at the same path below the target as below the
+ * destination, so a target of the job's SOURCE puts it back in place.
+ *
+ * Like the watch walk, several threads share a stack of work: here
+ * directories still to read and files still to copy. Directories get
+ * their times last, once nothing more is put in them.
+ */
+
+
+#define RESTORE_BUF      65536
+#define RESTORE_PROGRESS 5        // seconds between progress messages
+#define RESTORE_MAX      32       // threads at most
+
+
+struct linux_dirent64 {
+  ino64_t d_ino;
+  off64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+
+
+typedef struct restore_item_st {
+  char *rel;
+  int is_dir;
+  struct restore_item_st *next;
+} restore_item_st;
+
+
+typedef struct restore_st {
+  job_st job;              // src is restored from, dst is the target
+
+  pthread_mutex_t lock;    // the fields below
+  pthread_cond_t cond;
+  restore_item_st *todo;
+  int busy;                // items queued or being worked on
+  char **dirs;             // made, in order, for their times
+  size_t ndirs;
+  size_t cap;
+  restore_stats_st stats;
+} restore_st;
+
+
+/* push - queue rel, lock held */
+static void push(restore_st *r, const char *rel, int is_dir)
+{
+  restore_item_st *item;
+
+  if (!(item = malloc(sizeof(restore_item_st))) || !(item->rel = strdup(rel))) {
+    free(item);
+    r->stats.failed++;
+    return;
+  }
+  item->is_dir = is_dir;
+  item->next = r->todo;
+  r->todo = item;
+  r->busy++;
+  pthread_cond_signal(&r->cond);
+}
+
+
+static void restore_file(restore_st *r, const char *rel)
+{
+  const char *base;
+  struct stat st;
+  int dir;
+  int ret = -1;
+
+  if ((dir = dir_open(r->job.src, rel, &base)) >= 0 &&
+      fstatat(dir, base, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISREG(st.st_mode)) {
+    ret = replicate_copy(&r->job, rel);
+  }
+
+  pthread_mutex_lock(&r->lock);
+  if (ret == 0) {
+    r->stats.files++;
+    r->stats.bytes += st.st_size;
+  } else {
+    r->stats.failed++;
+  }
+  pthread_mutex_unlock(&r->lock);
+}
+
+
+/* restore_dir - make rel in the target, and queue what is in it */
+static void restore_dir(restore_st *r, const char *rel, char *buf)
+{
+  struct stat st;
+  long len, pos;
+  char **dirs;
+  char *child;
+  char *copy;
+  int is_dir;
+  int fd;
+
+  if (replicate_mkdir(&r->job, rel) < 0 || !(copy = strdup(rel))) {
+    pthread_mutex_lock(&r->lock);
+    r->stats.failed++;
+    pthread_mutex_unlock(&r->lock);
+    return;
+  }
+
+  pthread_mutex_lock(&r->lock);
+  if (r->ndirs == r->cap &&
+      (dirs = realloc(r->dirs, (r->cap ? r->cap * 2 : 1024) * sizeof(char *)))) {
+    r->dirs = dirs;
+    r->cap = r->cap ? r->cap * 2 : 1024;
+  }
+  if (r->ndirs < r->cap) {
+    r->dirs[r->ndirs++] = copy;
+  } else {
+    free(copy);
+  }
+  r->stats.dirs++;
+  pthread_mutex_unlock(&r->lock);
+
+  if ((fd = dir_get(r->job.src, rel)) < 0 ||
+      (fd = openat(fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+    log_msg(LOG_WARNING, "%s/%s: %s", r->job.src, rel, strerror(errno));
+    return;
+  }
+
+  while ((len = syscall(SYS_getdents64, fd, buf, RESTORE_BUF)) > 0) {
+    for (pos = 0; pos < len; ) {
+      struct linux_dirent64 *ent = (struct linux_dirent64 *)(buf + pos);
+
+      pos += ent->d_reclen;
+      // ours: the trash, snapshots, pack, temporary files
+      if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0 ||
+	  strncmp(ent->d_name, ".backupd", 8) == 0) {
+	continue;
+      }
+
+      if (ent->d_type == DT_UNKNOWN) {
+	if (fstatat(fd, ent->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+	  continue;
+	}
+	is_dir = S_ISDIR(st.st_mode);
+	if (!is_dir && !S_ISREG(st.st_mode)) {
+	  continue;
+	}
+      } else if (ent->d_type == DT_DIR || ent->d_type == DT_REG) {
+	is_dir = (ent->d_type == DT_DIR);
+      } else {
+	continue;
+      }
+
+      if ((child = path_join(rel, ent->d_name))) {
+	pthread_mutex_lock(&r->lock);
+	push(r, child, is_dir);
+	pthread_mutex_unlock(&r->lock);
+	free(child);
+      }
+    }
+  }
+
+  close(fd);
+}
+
+
+/* work through the stack until everything is done */
+static void *restore_main(void *arg)
+{
+  restore_st *r = arg;
+  restore_item_st *item;
+  char *buf;
+
+  if (!(buf = malloc(RESTORE_BUF))) {
+    return (NULL);
+  }
+
+  pthread_mutex_lock(&r->lock);
+  while (1) {
+    while (!r->todo && r->busy) {
+      pthread_cond_wait(&r->cond, &r->lock);
+    }
+    if (!(item = r->todo)) {
+      break;
+    }
+    r->todo = item->next;
+    pthread_mutex_unlock(&r->lock);
+
+    if (item->is_dir) {
+      restore_dir(r, item->rel, buf);
+    } else {
+      restore_file(r, item->rel);
+    }
+    free(item->rel);
+    free(item);
+
+    pthread_mutex_lock(&r->lock);
+    if (--r->busy == 0) {
+      pthread_cond_broadcast(&r->cond);
+    }
+  }
+  pthread_mutex_unlock(&r->lock);
+
+  free(buf);
+  dir_release();
+  return (NULL);
+}
+
+
+/* wait for the threads, saying how far they got now and then */
+static void restore_wait(restore_st *r, struct timespec *start)
+{
+  struct timespec until, now;
+  double secs;
+  int ret;
+
+  pthread_mutex_lock(&r->lock);
+  while (r->busy) {
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_sec += RESTORE_PROGRESS;
+    ret = 0;
+    while (r->busy && ret != ETIMEDOUT) {
+      ret = pthread_cond_timedwait(&r->cond, &r->lock, &until);
+    }
+    if (r->busy) {
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      secs = (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+      log_msg(LOG_INFO, "restore: %lu files (%.1f MiB/s), %lu directories so far",
+	      r->stats.files, r->stats.bytes / secs / (1 << 20), r->stats.dirs);
+    }
+  }
+  pthread_mutex_unlock(&r->lock);
+}
+
+
+/* give the directories made the times of theirs, deepest first */
+static void dir_times(restore_st *r)
+{
+  struct timespec times[2];
+  const char *base;
+  struct stat st;
+  size_t i = r->ndirs;
+  int dir;
+
+  // each was made after its parent
+  while (i--) {
+    if ((dir = dir_open(r->job.src, r->dirs[i], &base)) < 0 ||
+	fstatat(dir, base, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+      continue;
+    }
+    times[0] = st.st_atim;
+    times[1] = st.st_mtim;
+    if ((dir = dir_open(r->job.dst, r->dirs[i], &base)) >= 0) {
+      utimensat(dir, base, times, AT_SYMLINK_NOFOLLOW);
+    }
+  }
+}
+
+
+/* restore_run - copy a job's destination (or a snapshot of it) back out
+ *
+ * job      - IN - whose destination
+ * snapshot - IN - name of the snapshot to restore from, NULL for the
+ *                 destination as it is now
+ * rel      - IN - only this file or directory (and what is below it),
+ *                 "" for everything
+ * target   - IN - directory to restore to, at the same paths below it
+ * threads  - IN - copying at once, 0 for one per CPU
+ * stats    - OUT - what was restored, and how long that took
+ *
+ * returns - 0 if everything was restored, -1 if not (logged)
+ */
+
+int restore_run(job_st *job, const char *snapshot, const char *rel, const char *target,
+		int threads, restore_stats_st *stats)
+{
+  char from[PATH_MAX];
+  char path[PATH_MAX];
+  struct timespec start, end;
+  pthread_t tids[RESTORE_MAX];
+  unsigned long packed = 0;
+  const char *base;
+  struct stat st;
+  restore_st r;
+  pack_st *p;
+  char *s;
+  int packed_only = 0;
+  int started, dir;
+  size_t i;
+
+  memset(stats, 0, sizeof(restore_stats_st));
+  if (job->remote) {
+    log_msg(LOG_ERR, "job %s: a remote destination is restored from its receiver", job->name);
+    return (-1);
+  }
+
+  if (snapshot) {
+    if (strchr(snapshot, '/') || snapshot[0] == '.' ||
+	snprintf(path, sizeof(path), "%s/%s", SNAPSHOT_DIR, snapshot) >= (int)sizeof(path) ||
+	job_path(job->dst, path, from, sizeof(from)) < 0) {
+      log_msg(LOG_ERR, "job %s: bad snapshot name %s", job->name, snapshot);
+      return (-1);
+    }
+  } else if (snprintf(from, sizeof(from), "%s", job->dst) >= (int)sizeof(from)) {
+    return (-1);
+  }
+
+  memset(&r, 0, sizeof(r));
+  r.job.name = job->name;
+  r.job.src = from;
+  r.job.dst = (char *)target;
+  r.job.refs = 1;
+
+  // snapshots leave packed files out, see job_load
+  p = snapshot ? NULL : pack_open(job->dst, 0);
+
+  // a packed file is only in the pack
+  if (((dir = dir_open(from, rel, &base)) < 0 ||
+       fstatat(dir, base, &st, AT_SYMLINK_NOFOLLOW) < 0) &&
+      (errno != ENOENT || !p || !(packed_only = (pack_stat(p, rel, &st) == 0)))) {
+    log_msg(LOG_ERR, "%s%s%s: %s", from, *rel ? "/" : "", rel, strerror(errno));
+    if (p) {
+      pack_close(p);
+    }
+    return (-1);
+  }
+  if (mkdir(target, S_IRWXU | S_IRWXG | S_IRWXO) < 0 && errno != EEXIST) {
+    log_msg(LOG_ERR, "%s: %s", target, strerror(errno));
+    if (p) {
+      pack_close(p);
+    }
+    return (-1);
+  }
+
+  pthread_mutex_init(&r.lock, NULL);
+  pthread_cond_init(&r.cond, NULL);
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  // the directories above rel, with their owners and modes
+  if (snprintf(path, sizeof(path), "%s", rel) < (int)sizeof(path)) {
+    for (s = path; (s = strchr(s, '/')); s++) {
+      *s = '\0';
+      replicate_mkdir(&r.job, path);
+      *s = '/';
+    }
+  }
+
+  if (S_ISDIR(st.st_mode)) {
+    push(&r, rel, 1);
+
+    threads = threads > 0 ? threads : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    threads = threads < 1 ? 1 : (threads > RESTORE_MAX ? RESTORE_MAX : threads);
+    for (started = 0; started < threads; started++) {
+      if (pthread_create(&tids[started], NULL, restore_main, &r) != 0) {
+	break;
+      }
+    }
+    if (started) {
+      restore_wait(&r, &start);
+      while (started--) {
+	pthread_join(tids[started], NULL);
+      }
+    } else {
+      restore_main(&r);
+    }
+  } else if (S_ISREG(st.st_mode) && !packed_only) {
+    restore_file(&r, rel);
+  }
+
+  if (p) {
+    if (pack_extract(p, *rel ? rel : NULL, target, &packed) < 0) {
+      r.stats.failed++;
+    }
+    r.stats.files += packed;
+    pack_close(p);
+  }
+
+  dir_times(&r);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  *stats = r.stats;
+  stats->seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+  for (i = 0; i < r.ndirs; i++) {
+    free(r.dirs[i]);
+  }
+  free(r.dirs);
+  pthread_mutex_destroy(&r.lock);
+  pthread_cond_destroy(&r.cond);
+
+  return (stats->failed ? -1 : 0);
+}
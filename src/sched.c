@@ -0,0 +1,1510 @@
+/*
+ * sched.c
+ *
+ * Replication scheduler - orders file copies by latency class and job priority
+ * 
+ *
+ * Copyright (C) 2013  Bryant Moscon - bmoscon@gmail.com
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to 
+ * deal in the Software without restriction, including without limitation the 
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, 
+ *    this list of conditions and the following disclaimer in the documentation 
+ *    and/or other materials provided with the distribution, and in the same 
+ *    place and form as other copyright, license and disclaimer information.
+ *
+ * 3. The end-user documentation included with the redistribution, if any, must 
+ *    include the following acknowledgment: "This product includes software 
+ *    developed by Bryant Moscon (http://www.bryantmoscon.org/)", in the same 
+ *    place and form as other third-party acknowledgments. Alternately, this 
+ *    acknowledgment may appear in the software itself, in the same form and 
+ *    location as other such third-party acknowledgments.
+ *
+ * 4. Except as contained in this notice, the name of the author, Bryant Moscon,
+ *    shall not be used in advertising or otherwise to promote the sale, use or 
+ *    other dealings in this Software without prior written authorization from 
+ *    the author.
+ *
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL 
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN 
+ * THE SOFTWARE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "sched.h"
+#include "dircache.h"
+#include "replicate.h"
+#include "job.h"
+#include "tail.h"
+#include "journal.h"
+#include "hash_map.h"
+#include "pathtree.h"
+#include "watch.h"
+#include "spill.h"
+#include "log.h"
+
+
+/*
+ * File copies are handed to a pool of worker threads instead of being
+ * done inline on the event thread. Each copy is put in a latency class
+ * by its size when it is submitted, and given a deadline:
+ *
+ *   submit time + class target * DEFAULT_PRIORITY / job priority
+ *
+ * Workers always take the earliest deadline, so a large copy that has
+ * waited long enough goes ahead of newer small ones (aging) and a high
+ * priority job gets shorter deadlines than a low priority one. One
+ * worker only ever takes small files, so small updates are not stuck
+ * behind bulk copies however many of those are queued.
+ *
+ * A copy that is already queued for the same file absorbs a new one.
+ * A file is never copied by two workers at once, a copy submitted
+ * while one is running waits for it and then runs again. Copies are
+ * keyed by their file's node in a path tree (see pathtree.c), and a
+ * queued copy keeps only the node, its path is rebuilt when a worker
+ * takes it. A rename moves the node, and with it every copy below.
+ *
+ * Files of at least the split size are copied in ranges, one per bulk
+ * worker, that are queued like any other copy. The last range to
+ * finish publishes the file.
+ *
+ * The queue's memory is capped (sched_limit). Beyond the cap a copy of
+ * a file that is already gone again is dropped at once, and the others
+ * go to an overflow file (spill.c) instead of the heaps, as do all
+ * copies submitted after them, so they come back in order. Workers read
+ * them back once the queue has drained to three quarters of the cap,
+ * where they are coalesced with what is queued like any new copy.
+ * Renames are remembered while anything is spilled, and applied to the
+ * copies spilled before them as they are read back.
+ *
+ * Each shard (see monitor.c) has a scheduler of its own, with its own
+ * lock, queue, workers and overflow file. All copies of a job go to the
+ * scheduler of the job's shard, so shards do not contend here.
+ */
+
+
+// what a queued copy costs besides its item and op: map entry, heap
+// slot and allocator overhead
+#define ITEM_OVERHEAD 96
+
+// a file's node and name in the path tree, its directories are shared
+#define NODE_COST 48
+
+// spilled copies are read back below this
+#define LOW_WATER(s) ((s)->mem_limit - (s)->mem_limit / 4)
+
+#define SMALL_SIZE (256 * 1024)
+#define MEDIUM_SIZE (64 * 1024 * 1024)
+
+static const uint64_t target_us[NUM_CLASSES] = {
+  10 * 1000,             // CLASS_SMALL
+  1000 * 1000,           // CLASS_MEDIUM
+  10 * 1000 * 1000       // CLASS_LARGE
+};
+
+
+struct sched_split_st;
+
+
+typedef struct sched_item_st {
+  op_st *op;               // NULL for a range of a split copy, its path
+			   // is NULL while queued
+  uint32_t node;           // of the file, held, the key in the maps
+  sched_class class;
+  off_t size;
+  uint64_t submitted;      // usec, CLOCK_MONOTONIC
+  uint64_t deadline;
+  int dead;                // cancelled while queued, dropped when popped
+  int stale;               // renamed or deleted while being copied
+  int epoch;               // counted in its sched_st epoch_pending[epoch]
+  size_t mem;              // charged to its sched_st mem
+  struct sched_item_st *again;  // submitted while this one was running
+
+  struct sched_split_st *split; // range to copy, for a split copy
+  off_t off;
+  off_t len;               // 0 for up to the end of the file
+} sched_item_st;
+
+
+/* a file being copied in ranges */
+typedef struct sched_split_st {
+  copy_st copy;
+  sched_item_st *parent;   // the copy that was split
+  int left;                // ranges not finished yet
+} sched_split_st;
+
+
+/* a rename made while copies were spilled */
+typedef struct sched_move_st {
+  uint64_t at;             // spill position: applies to copies before it
+  job_st *job;             // held
+  char *from;
+  char *to;
+  struct sched_move_st *next;
+} sched_move_st;
+
+
+/* a spilled copy, followed by its path */
+typedef struct spill_rec_st {
+  uint64_t seq;
+  job_st *job;             // held while spilled
+  uint64_t submitted;
+  uint64_t deadline;
+  off_t size;
+  uint8_t class;
+  uint8_t epoch;
+} spill_rec_st;
+
+
+typedef struct sched_heap_st {
+  sched_item_st **items;
+  size_t len;
+  size_t cap;
+} sched_heap_st;
+
+
+typedef struct sched_st {
+  pthread_mutex_t lock;
+  pthread_cond_t ready;
+  pthread_cond_t drained;  // an epoch_pending count went to 0
+
+  sched_heap_st heap[NUM_CLASSES];
+  hash_map_st *queued;     // node -> queued item
+  hash_map_st *running;    // node -> item being copied
+  pathtree_st *paths;      // of the files queued and running
+  hash_map_st *roots;      // job -> its node in paths, kept
+
+  int bulk_workers;         // workers that take medium and large copies
+  off_t split_size;        // 0 to never split
+
+  sched_stats_st stats[NUM_CLASSES];
+  unsigned int pending;    // copies submitted and not freed yet
+  int epoch;               // of new copies, 0 or 1, see sched_barrier
+  unsigned int epoch_pending[2];
+
+  size_t mem;              // of the items with an op
+  size_t mem_limit;        // 0 for no limit
+  char *spill_dir;
+  spill_st *spill;         // opened on first use
+  int spill_failed;        // could not be opened, or lost its contents
+  size_t spilled;          // copies in the spill file
+  size_t spilled_epoch[2]; // ... by epoch
+  sched_move_st *moves;    // oldest first
+  sched_move_st **moves_tail;
+  char *rec;               // SPILL_REC_MAX + 1, allocated with spill
+
+  int stopped;             // see sched_stop, copies go to the list below
+  op_st *stopped_ops;
+  op_st **stopped_tail;
+} sched_st;
+
+
+typedef struct sched_worker_st {
+  sched_st *s;
+  int small_only;
+} sched_worker_st;
+
+
+// one per shard, a job's copies all go to the one of its shard
+static sched_st *scheds = NULL;
+static int num_scheds = 0;
+
+
+static sched_st *sched_of(job_st *job)
+{
+  return (&scheds[job->shard % num_scheds]);
+}
+
+
+static uint64_t now_us(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+}
+
+
+/* items are keyed by the node of the file they copy */
+#define KEY(node) ((void *)(uintptr_t)(node))
+
+
+/* the node of job->src in the tree, added if create. Caller holds the
+ * lock. Roots are kept for as long as the scheduler, there is one per
+ * job
+ */
+
+static uint32_t job_root(sched_st *s, job_st *job, int create)
+{
+  uint32_t root = (uint32_t)(uintptr_t)hash_map_get(s->roots, job);
+
+  if (!root && create && (root = pathtree_root(s->paths)) &&
+      hash_map_put(s->roots, job, KEY(root)) != 0) {
+    pathtree_put(s->paths, root);
+    root = PATHTREE_NONE;
+  }
+  return (root);
+}
+
+
+/* item_key - give an item the node of its path, caller holds the lock
+ *
+ * returns - 0 on success, -1 if out of memory
+ */
+
+static int item_key(sched_st *s, sched_item_st *item)
+{
+  uint32_t root = job_root(s, item->op->job, 1);
+
+  if (!root || !(item->node = pathtree_get(s->paths, root, item->op->path))) {
+    return (-1);
+  }
+  return (0);
+}
+
+
+/* a waiting item keeps its node instead of its path, lock held */
+static void shelve(sched_item_st *item)
+{
+  free(item->op->path);
+  item->op->path = NULL;
+}
+
+
+/* unshelve - rebuild the path of an item that is to run, caller holds
+ *            the lock
+ *
+ * returns - 0 on success, -1 if out of memory or its node was cut off
+ *           by a rename over it
+ */
+
+static int unshelve(sched_st *s, sched_item_st *item)
+{
+  if (!item->op->path &&
+      !(item->op->path = pathtree_path(s->paths, job_root(s, item->op->job, 0), item->node,
+				       NULL))) {
+    return (-1);
+  }
+  return (0);
+}
+
+
+/* a copy is done with, caller holds the lock */
+static void uncount(sched_st *s, int epoch)
+{
+  __atomic_sub_fetch(&s->pending, 1, __ATOMIC_RELEASE);
+  if (!--s->epoch_pending[epoch]) {
+    pthread_cond_broadcast(&s->drained);
+  }
+}
+
+
+/* caller holds the lock */
+static void item_free(sched_st *s, sched_item_st *item)
+{
+  if (item) {
+    if (item->op) {
+      uncount(s, item->epoch);
+    }
+    if (item->node) {
+      pathtree_put(s->paths, item->node);
+    }
+    s->mem -= item->mem;
+    op_free(item->op);
+    free(item);
+  }
+}
+
+
+static size_t item_mem(sched_item_st *item)
+{
+  return (sizeof(sched_item_st) + sizeof(op_st) + NODE_COST + ITEM_OVERHEAD);
+}
+
+
+/* count an item in the queue's memory, caller holds the lock */
+static void charge(sched_st *s, sched_item_st *item)
+{
+  item->mem = item_mem(item);
+  s->mem += item->mem;
+}
+
+
+/* drop a copy that is not going to run, it is done as far as the
+ * journal is concerned */
+static void item_drop(sched_st *s, sched_item_st *item)
+{
+  if (item) {
+    journal_done(item->op->seq);
+    item_free(s, item);
+  }
+}
+
+
+static int heap_push(sched_heap_st *h, sched_item_st *item)
+{
+  size_t i;
+
+  if (h->len == h->cap) {
+    size_t cap = h->cap ? h->cap * 2 : 64;
+    sched_item_st **items = realloc(h->items, cap * sizeof(sched_item_st *));
+
+    if (!items) {
+      return (-1);
+    }
+    h->items = items;
+    h->cap = cap;
+  }
+
+  for (i = h->len++; i > 0; i = (i - 1) / 2) {
+    if (h->items[(i - 1) / 2]->deadline <= item->deadline) {
+      break;
+    }
+    h->items[i] = h->items[(i - 1) / 2];
+  }
+  h->items[i] = item;
+
+  return (0);
+}
+
+
+static sched_item_st *heap_pop(sched_heap_st *h)
+{
+  sched_item_st *top = h->items[0];
+  sched_item_st *last = h->items[--h->len];
+  size_t i = 0;
+  size_t child;
+
+  while ((child = 2 * i + 1) < h->len) {
+    if (child + 1 < h->len && h->items[child + 1]->deadline < h->items[child]->deadline) {
+      child++;
+    }
+    if (last->deadline <= h->items[child]->deadline) {
+      break;
+    }
+    h->items[i] = h->items[child];
+    i = child;
+  }
+  if (h->len) {
+    h->items[i] = last;
+  }
+
+  return (top);
+}
+
+
+/* take a copy out of the scheduler for sched_stop, caller holds the lock */
+static void unqueue(sched_st *s, sched_item_st *item)
+{
+  item->op->next = NULL;
+  *s->stopped_tail = item->op;
+  s->stopped_tail = &item->op->next;
+  item->op = NULL;
+  uncount(s, item->epoch);
+  pathtree_put(s->paths, item->node);
+  s->mem -= item->mem;
+  free(item);
+}
+
+
+/* queue an item that has its path and node, caller holds the lock */
+static void enqueue(sched_st *s, sched_item_st *item)
+{
+  sched_item_st *prev;
+
+  if (s->stopped) {
+    unqueue(s, item);
+    return;
+  }
+
+  if ((prev = hash_map_get(s->running, KEY(item->node)))) {
+    // copied again once the running copy is finished
+    if (!prev->again) {
+      shelve(item);
+      prev->again = item;
+    } else {
+      item_drop(s, item);
+    }
+    return;
+  }
+
+  if ((prev = hash_map_get(s->queued, KEY(item->node)))) {
+    // the queued copy will read the latest contents anyway
+    item_drop(s, item);
+    return;
+  }
+
+  if (heap_push(&s->heap[item->class], item) != 0) {
+    log_msg(LOG_ERR, "%s: out of memory, change not replicated", item->op->path);
+    item_drop(s, item);
+    return;
+  }
+  if (hash_map_put(s->queued, KEY(item->node), item) != 0) {
+    // still copied, just not coalesced with later changes
+    log_msg(LOG_WARNING, "%s: out of memory", item->op->path);
+  }
+
+  shelve(item);
+  s->stats[item->class].queued++;
+  pthread_cond_broadcast(&s->ready);
+}
+
+
+static char *rebase(const char *path, const char *from, const char *to)
+{
+  char *ret = malloc(strlen(to) + strlen(path) - strlen(from) + 1);
+
+  if (ret) {
+    strcpy(ret, to);
+    strcat(ret, path + strlen(from));
+  }
+  return (ret);
+}
+
+
+/* spill - put a copy in the overflow file instead of the queue, it is
+ *         still counted as pending. Caller holds the lock
+ *
+ * returns - 0 if it was spilled, -1 if it has to be queued after all
+ */
+
+static int spill(sched_st *s, sched_item_st *item)
+{
+  size_t len = strlen(item->op->path);
+  spill_rec_st *r;
+  char *rec;
+
+  if (sizeof(spill_rec_st) + len > SPILL_REC_MAX || s->spill_failed) {
+    return (-1);
+  }
+  if (!s->spill && (!(s->rec = malloc(SPILL_REC_MAX + 1)) ||
+		    !(s->spill = spill_open(s->spill_dir)))) {
+    // from now on the limit is only kept by coalescing
+    s->spill_failed = 1;
+    return (-1);
+  }
+  rec = s->rec;
+  r = (spill_rec_st *)rec;
+
+  r->seq = item->op->seq;
+  r->job = item->op->job;
+  r->submitted = item->submitted;
+  r->deadline = item->deadline;
+  r->size = item->size;
+  r->class = item->class;
+  r->epoch = item->epoch;
+  memcpy(rec + sizeof(spill_rec_st), item->op->path, len);
+  if (spill_append(s->spill, rec, sizeof(spill_rec_st) + len) < 0) {
+    return (-1);
+  }
+
+  if (!s->spilled) {
+    log_msg(LOG_WARNING, "copy queue over %zu bytes, spilling to %s", s->mem_limit,
+	    s->spill_dir);
+  }
+  s->spilled++;
+  s->spilled_epoch[item->epoch]++;
+
+  // the record holds the job and the path now
+  job_hold(r->job);
+  pathtree_put(s->paths, item->node);
+  op_free(item->op);
+  free(item);
+  return (0);
+}
+
+
+/* moved - path, after the renames made since pos
+ *
+ * returns - malloc'd path, NULL if out of memory
+ */
+
+static char *moved(sched_st *s, job_st *job, const char *path, uint64_t pos)
+{
+  sched_move_st *m;
+  char *ret = strdup(path);
+  char *p;
+
+  for (m = s->moves; m && ret; m = m->next) {
+    if (m->at > pos && m->job == job && path_in_tree(ret, m->from)) {
+      p = rebase(ret, m->from, m->to);
+      free(ret);
+      ret = p;
+    }
+  }
+  return (ret);
+}
+
+
+/* spill_lost - the overflow file cannot be read. Its copies are given
+ *              up on here (they are not done in the journal, so a
+ *              journal replays them on the next start). Caller holds
+ *              the lock
+ */
+
+static void spill_lost(sched_st *s)
+{
+  int e;
+
+  log_msg(LOG_ERR, "%zu spilled copies lost", s->spilled);
+  for (e = 0; e < 2; e++) {
+    while (s->spilled_epoch[e]) {
+      s->spilled_epoch[e]--;
+      uncount(s, e);
+    }
+  }
+  s->spilled = 0;
+  spill_close(s->spill);
+  s->spill = NULL;
+  s->spill_failed = 1;
+}
+
+
+/* refill - bring spilled copies back into the queue, oldest first,
+ *          while it is under three quarters of its limit. Caller holds
+ *          the lock
+ */
+
+static void refill(sched_st *s)
+{
+  char *rec = s->rec;
+  spill_rec_st r;
+  sched_item_st *item;
+  sched_move_st *m;
+  uint64_t pos;
+  ssize_t len;
+  char *path;
+  op_st *op;
+
+  while (s->spilled && (s->stopped || s->mem < LOW_WATER(s))) {
+    pos = s->spill->rpos;
+    if ((len = spill_next(s->spill, rec, SPILL_REC_MAX)) < (ssize_t)sizeof(spill_rec_st)) {
+      spill_lost(s);
+      break;
+    }
+    memcpy(&r, rec, sizeof(r));
+    rec[len] = '\0';
+    s->spilled--;
+    s->spilled_epoch[r.epoch]--;
+
+    item = NULL;
+    op = NULL;
+    path = NULL;
+    if (job_is_stopped(r.job) || !(path = moved(s, r.job, rec + sizeof(r), pos)) ||
+	!(op = op_new(OP_COPY, r.job, path, NULL, 0)) ||
+	!(item = calloc(1, sizeof(sched_item_st)))) {
+      journal_done(r.seq);
+      uncount(s, r.epoch);
+      op_free(op);
+    } else {
+      op->seq = r.seq;
+      item->op = op;
+      item->submitted = r.submitted;
+      item->deadline = r.deadline;
+      item->size = r.size;
+      item->class = r.class;
+      item->epoch = r.epoch;
+      if (item_key(s, item) < 0) {
+	item_drop(s, item);
+      } else {
+	charge(s, item);
+	enqueue(s, item);
+      }
+    }
+    free(path);
+    job_release(r.job);
+  }
+
+  if (!s->spilled) {
+    log_msg(LOG_INFO, "copy queue back under its limit");
+    while ((m = s->moves)) {
+      s->moves = m->next;
+      job_release(m->job);
+      free(m->from);
+      free(m->to);
+      free(m);
+    }
+    s->moves_tail = &s->moves;
+  }
+}
+
+
+/* pick - the queued item with the earliest deadline, among the classes
+ *        this worker takes. Caller holds the lock
+ */
+
+static sched_item_st *pick(sched_st *s, int small_only)
+{
+  sched_heap_st *best;
+  sched_item_st *item;
+  int c;
+
+  if (s->spilled && s->mem < LOW_WATER(s)) {
+    refill(s);
+  }
+
+  while (1) {
+    best = NULL;
+    for (c = 0; c < NUM_CLASSES; c++) {
+      if (c != CLASS_SMALL && small_only) {
+	break;
+      }
+      if (s->heap[c].len &&
+	  (!best || s->heap[c].items[0]->deadline < best->items[0]->deadline)) {
+	best = &s->heap[c];
+      }
+    }
+
+    if (!best) {
+      return (NULL);
+    }
+
+    item = heap_pop(best);
+    if (!item->op) {
+      // a range of a split copy
+      if (!item->dead) {
+	return (item);
+      }
+      free(item);
+      continue;
+    }
+    s->stats[item->class].queued--;
+    if (hash_map_get(s->queued, KEY(item->node)) == item) {
+      hash_map_remove(s->queued, KEY(item->node));
+    }
+    if (!item->dead && unshelve(s, item) == 0) {
+      return (item);
+    }
+    item_drop(s, item);
+  }
+}
+
+
+/* requeue - queue the copy that waited for a running one, caller
+ *           holds the lock
+ */
+
+static void requeue(sched_st *s, sched_item_st *again)
+{
+  if (!again) {
+    return;
+  }
+  if (unshelve(s, again) < 0) {
+    item_drop(s, again);
+    return;
+  }
+  again->submitted = now_us();
+  again->deadline = again->submitted;
+  enqueue(s, again);
+}
+
+
+/* unlink_stale - remove the copy a stale item left at its path. The
+ *                lock is dropped for it, the item stays running under
+ *                the node of that path meanwhile, so a copy of it
+ *                submitted in between waits for the unlink. Caller
+ *                holds the lock
+ */
+
+static void unlink_stale(sched_st *s, sched_item_st *item)
+{
+  job_st *job = item->op->job;
+  uint32_t node = pathtree_get(s->paths, job_root(s, job, 1), item->op->path);
+  sched_item_st *again;
+
+  if (!node || hash_map_put(s->running, KEY(node), item) != 0) {
+    // nothing to hold copies back with, unlink it under the lock
+    if (node) {
+      pathtree_put(s->paths, node);
+    }
+    replicate_unlink(job, item->op->path);
+    item_free(s, item);
+    return;
+  }
+  pathtree_put(s->paths, item->node);
+  item->node = node;
+  item->stale = 0;
+
+  pthread_mutex_unlock(&s->lock);
+  replicate_unlink(job, item->op->path);
+  pthread_mutex_lock(&s->lock);
+
+  hash_map_remove(s->running, KEY(node));
+  again = item->again;
+  item_free(s, item);
+  requeue(s, again);
+}
+
+
+/* a copy finished, caller holds the lock (dropped while a copy left
+ * over by a rename or delete is unlinked)
+ */
+static void finish(sched_st *s, sched_item_st *item)
+{
+  sched_stats_st *st = &s->stats[item->class];
+  uint64_t lag = now_us() - item->submitted;
+  sched_item_st *again = item->again;
+  uint32_t node;
+  int left = 0;
+
+  hash_map_remove(s->running, KEY(item->node));
+  item->again = NULL;
+
+  st->done++;
+  st->lag_total_us += lag;
+  if (lag > st->lag_max_us) {
+    st->lag_max_us = lag;
+  }
+
+  // the file went away (or moved) while it was copied, so the copy
+  // just made is left over unless a newer one is on its way. Its node
+  // may have moved, so what is at its path is looked up again
+  if (item->stale) {
+    node = pathtree_find(s->paths, job_root(s, item->op->job, 0), item->op->path);
+    left = (!node || (!hash_map_get(s->queued, KEY(node)) &&
+		      !hash_map_get(s->running, KEY(node)) && !(again && again->node == node)));
+  }
+
+  requeue(s, again);
+  if (left) {
+    unlink_stale(s, item);
+  } else {
+    item_free(s, item);
+  }
+}
+
+
+/* split - open a large file and queue its ranges, caller holds the
+ *         lock (dropped while the file is opened)
+ *
+ * returns - 0 if the ranges were queued, -1 if the file should be
+ *           copied in one go instead
+ */
+
+static int split(sched_st *s, sched_item_st *item)
+{
+  sched_item_st *ranges[s->bulk_workers];
+  sched_split_st *sp;
+  off_t size, chunk;
+  int i, n;
+
+  if (!(sp = calloc(1, sizeof(sched_split_st)))) {
+    return (-1);
+  }
+
+  pthread_mutex_unlock(&s->lock);
+  if (replicate_open(item->op->job, item->op->path, &sp->copy) < 0) {
+    pthread_mutex_lock(&s->lock);
+    free(sp);
+    return (-1);
+  }
+  pthread_mutex_lock(&s->lock);
+
+  // one range per bulk worker, in whole MiB
+  size = sp->copy.st.st_size;
+  chunk = (size / s->bulk_workers + (1 << 20)) & ~(off_t)((1 << 20) - 1);
+  n = (size + chunk - 1) / chunk;
+  if (n < 2) {
+    // shrank since it was submitted
+    sp->copy.failed = 1;
+    replicate_publish(&sp->copy);
+    free(sp);
+    return (-1);
+  }
+
+  for (i = 0; i < n; i++) {
+    if (!(ranges[i] = calloc(1, sizeof(sched_item_st)))) {
+      break;
+    }
+    ranges[i]->class = CLASS_LARGE;
+    ranges[i]->deadline = item->deadline;
+    ranges[i]->split = sp;
+    ranges[i]->off = i * chunk;
+    // the last one goes to the end of the file, wherever that is now
+    ranges[i]->len = (i == n - 1) ? 0 : chunk;
+
+    if (heap_push(&s->heap[CLASS_LARGE], ranges[i]) != 0) {
+      free(ranges[i]);
+      break;
+    }
+  }
+
+  if (i < n) {
+    // take back what was queued, they have not been picked yet as
+    // the lock was held all along
+    while (i--) {
+      ranges[i]->dead = 1;
+    }
+    sp->copy.failed = 1;
+    replicate_publish(&sp->copy);
+    free(sp);
+    return (-1);
+  }
+
+  sp->parent = item;
+  sp->left = n;
+  pthread_cond_broadcast(&s->ready);
+
+  return (0);
+}
+
+
+/* copy one range of a split file, caller holds the lock */
+static void run_range(sched_st *s, sched_item_st *range)
+{
+  sched_split_st *sp = range->split;
+  sched_item_st *parent = sp->parent;
+
+  pthread_mutex_unlock(&s->lock);
+  if (job_is_stopped(parent->op->job)) {
+    __atomic_store_n(&sp->copy.failed, 1, __ATOMIC_RELAXED);
+  } else {
+    replicate_range(&sp->copy, range->off, range->len);
+  }
+  pthread_mutex_lock(&s->lock);
+
+  free(range);
+  if (--sp->left) {
+    return;
+  }
+
+  // last one out publishes the file
+  pthread_mutex_unlock(&s->lock);
+  replicate_publish(&sp->copy);
+  journal_done(parent->op->seq);
+  pthread_mutex_lock(&s->lock);
+
+  free(sp);
+  finish(s, parent);
+}
+
+
+static void *worker_main(void *arg)
+{
+  sched_st *s = ((sched_worker_st *)arg)->s;
+  int small_only = ((sched_worker_st *)arg)->small_only;
+  sched_item_st *item;
+
+  free(arg);
+
+  pthread_mutex_lock(&s->lock);
+  while (1) {
+    if (!(item = pick(s, small_only))) {
+      pthread_cond_wait(&s->ready, &s->lock);
+      continue;
+    }
+
+    if (!item->op) {
+      run_range(s, item);
+      continue;
+    }
+
+    if (hash_map_put(s->running, KEY(item->node), item) != 0) {
+      // copy it anyway, just without keeping track of it
+      pthread_mutex_unlock(&s->lock);
+      op_apply(item->op);
+      pthread_mutex_lock(&s->lock);
+      item_free(s, item);
+      continue;
+    }
+
+    if (s->split_size && item->size >= s->split_size && s->bulk_workers > 1 &&
+	!job_is_stopped(item->op->job) && !item->op->job->remote &&
+	!tail_wanted(item->op->job, item->op->path) &&
+	split(s, item) == 0) {
+      // finished by the last of its ranges
+      continue;
+    }
+
+    pthread_mutex_unlock(&s->lock);
+    op_apply(item->op);
+    pthread_mutex_lock(&s->lock);
+
+    finish(s, item);
+  }
+
+  return (NULL);
+}
+
+
+/* sched_start - start the copy workers of each shard
+ *
+ * shards - IN - number of schedulers, each with its own queue, lock
+ *               and workers. A job's copies go to the one of its shard
+ * workers - IN - number of worker threads per shard. When there is
+ *                more than one, the first only takes small files
+ * split_size - IN - files at least this big are copied in ranges by
+ *                   several workers at once, 0 for never
+ * cpus - IN - CPUs the workers of each shard run on, an empty set
+ *             (or NULL for all of them) for anywhere
+ *
+ * returns - 0 on success, -1 on error
+ */
+
+int sched_start(int shards, int workers, off_t split_size, const cpu_set_t *cpus)
+{
+  sched_worker_st *w;
+  pthread_attr_t attr;
+  pthread_t tid;
+  sched_st *s;
+  int i, n;
+
+  if (shards < 1) {
+    shards = 1;
+  }
+  if (workers < 1) {
+    workers = 1;
+  }
+
+  if (!(scheds = calloc(shards, sizeof(sched_st)))) {
+    return (-1);
+  }
+  num_scheds = shards;
+
+  for (n = 0; n < shards; n++) {
+    s = &scheds[n];
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->ready, NULL);
+    pthread_cond_init(&s->drained, NULL);
+
+    s->queued = hash_map_init(1024, hash_map_int_hash, hash_map_int_cmp);
+    s->running = hash_map_init(64, hash_map_int_hash, hash_map_int_cmp);
+    s->roots = hash_map_init(16, hash_map_int_hash, hash_map_int_cmp);
+    s->paths = pathtree_init();
+    if (!s->queued || !s->running || !s->roots || !s->paths) {
+      return (-1);
+    }
+    s->bulk_workers = (workers > 1) ? workers - 1 : 1;
+    s->split_size = split_size;
+
+    pthread_attr_init(&attr);
+    if (cpus && CPU_COUNT(&cpus[n]) &&
+	pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), &cpus[n]) != 0) {
+      log_msg(LOG_WARNING, "shard %d: cannot pin copy workers", n);
+    }
+
+    for (i = 0; i < workers; i++) {
+      if (!(w = malloc(sizeof(sched_worker_st)))) {
+	return (-1);
+      }
+      w->s = s;
+      w->small_only = (i == 0 && workers > 1);
+
+      if (pthread_create(&tid, &attr, worker_main, w) != 0) {
+	free(w);
+	return (-1);
+      }
+      pthread_detach(tid);
+    }
+    pthread_attr_destroy(&attr);
+  }
+
+  return (0);
+}
+
+
+/* sched_submit - queue a copy. The op is owned by the scheduler from
+ *                here on, and marked done in the journal once copied
+ *                (or absorbed by another copy of the same file)
+ */
+
+void sched_submit(op_st *op)
+{
+  sched_st *s = sched_of(op->job);
+  sched_item_st *item;
+  const char *base;
+  struct stat st;
+  int dir;
+  int found = 0;
+  int priority = op->job->priority;
+
+  if (!(item = calloc(1, sizeof(sched_item_st)))) {
+    op_apply(op);
+    op_free(op);
+    return;
+  }
+
+  __atomic_add_fetch(&s->pending, 1, __ATOMIC_RELAXED);
+  item->op = op;
+  item->class = CLASS_SMALL;
+  if ((dir = dir_open(op->job->src, op->path, &base)) >= 0 && fstatat(dir, base, &st, 0) == 0) {
+    found = 1;
+    // a tailed file is classed by what it has to copy
+    item->size = tail_pending(op->job, op->path, &st);
+    if (item->size >= MEDIUM_SIZE) {
+      item->class = CLASS_LARGE;
+    } else if (item->size >= SMALL_SIZE) {
+      item->class = CLASS_MEDIUM;
+    }
+  }
+
+  if (priority < 1) {
+    priority = 1;
+  }
+  item->submitted = now_us();
+  item->deadline = item->submitted + target_us[item->class] * DEFAULT_PRIORITY / priority;
+
+  pthread_mutex_lock(&s->lock);
+  item->epoch = s->epoch;
+  s->epoch_pending[item->epoch]++;
+
+  if (item_key(s, item) < 0) {
+    // copied all the same, just not queued
+    pthread_mutex_unlock(&s->lock);
+    op_apply(op);
+    pthread_mutex_lock(&s->lock);
+    item_free(s, item);
+    pthread_mutex_unlock(&s->lock);
+    return;
+  }
+
+  // over the limit, unless it is absorbed by a copy already there
+  if (s->mem_limit && !s->stopped && (s->spilled || s->mem + item_mem(item) > s->mem_limit) &&
+      !hash_map_get(s->queued, KEY(item->node)) && !hash_map_get(s->running, KEY(item->node))) {
+    if (!found) {
+      // gone again, whatever removed it says so
+      item_drop(s, item);
+      pthread_mutex_unlock(&s->lock);
+      return;
+    }
+    if (spill(s, item) == 0) {
+      pthread_mutex_unlock(&s->lock);
+      return;
+    }
+  }
+
+  charge(s, item);
+  enqueue(s, item);
+  pthread_mutex_unlock(&s->lock);
+}
+
+
+/* sched_limit - cap the memory of the copy queue, shared evenly by
+ *               the shards
+ *
+ * limit - IN - bytes, 0 for no limit
+ * dir   - IN - where the overflow files go, once needed
+ */
+
+void sched_limit(size_t limit, const char *dir)
+{
+  sched_st *s;
+  int n;
+
+  for (n = 0; n < num_scheds; n++) {
+    s = &scheds[n];
+    pthread_mutex_lock(&s->lock);
+    s->mem_limit = limit / num_scheds;
+    if (limit && !s->mem_limit) {
+      s->mem_limit = 1;
+    }
+    free(s->spill_dir);
+    s->spill_dir = strdup(dir);
+    if (!s->spill_dir) {
+      s->spill_failed = 1;
+    }
+    pthread_mutex_unlock(&s->lock);
+  }
+}
+
+
+/* sched_queue_stats - memory of the copy queue, and what overflowed,
+ *                     of all the shards together
+ */
+
+void sched_queue_stats(sched_queue_stats_st *st)
+{
+  sched_st *s;
+  int n;
+
+  memset(st, 0, sizeof(*st));
+  for (n = 0; n < num_scheds; n++) {
+    s = &scheds[n];
+    pthread_mutex_lock(&s->lock);
+    st->mem += s->mem;
+    st->limit += s->mem_limit;
+    st->spilled += s->spilled;
+    st->spill_bytes += spill_bytes(s->spill);
+    pthread_mutex_unlock(&s->lock);
+  }
+}
+
+
+typedef struct tree_arg_st {
+  sched_st *s;
+  job_st *job;
+  uint32_t root;
+  uint32_t top;            // the file or directory renamed or deleted
+} tree_arg_st;
+
+
+static void rename_running(void *key, void *val, void *arg)
+{
+  tree_arg_st *t = (tree_arg_st *)arg;
+  sched_st *s = t->s;
+  sched_item_st *item = (sched_item_st *)val;
+  op_st *op;
+  char *path;
+
+  // the copy waiting on it, if any, has the same node and so follows
+  if (!pathtree_below(s->paths, item->node, t->top)) {
+    return;
+  }
+  item->stale = 1;
+  if (item->again) {
+    return;
+  }
+
+  // the running copy may have read the file before it moved, or
+  // failed to find it, copy it again under its new name
+  if (!(path = pathtree_path(s->paths, t->root, item->node, NULL))) {
+    return;
+  }
+  if ((op = op_new(OP_COPY, t->job, path, NULL, 0)) &&
+      (item->again = calloc(1, sizeof(sched_item_st)))) {
+    __atomic_add_fetch(&s->pending, 1, __ATOMIC_RELAXED);
+    item->again->epoch = s->epoch;
+    s->epoch_pending[s->epoch]++;
+    item->again->op = op;
+    item->again->class = item->class;
+    if (item_key(s, item->again) < 0) {
+      item_free(s, item->again);
+      item->again = NULL;
+    } else {
+      charge(s, item->again);
+      shelve(item->again);
+    }
+  } else {
+    op_free(op);
+  }
+  free(path);
+}
+
+
+/* sched_rename - a file or directory was renamed from one path to
+ *                another inside a job. Queued copies below it follow
+ *                it to the new name
+ */
+
+void sched_rename(job_st *job, const char *from, const char *to)
+{
+  sched_st *s = sched_of(job);
+  tree_arg_st arg = {s, job, 0, 0};
+  sched_move_st *m;
+
+  pthread_mutex_lock(&s->lock);
+
+  // copies spilled so far follow it when they are read back
+  if (s->spilled && (m = calloc(1, sizeof(sched_move_st)))) {
+    if ((m->from = strdup(from)) && (m->to = strdup(to))) {
+      m->at = s->spill->wpos;
+      m->job = job;
+      job_hold(job);
+      if (!s->moves_tail) {
+	s->moves_tail = &s->moves;
+      }
+      *s->moves_tail = m;
+      s->moves_tail = &m->next;
+    } else {
+      free(m->from);
+      free(m->to);
+      free(m);
+    }
+  }
+
+  // whatever was queued under the new name is cut off from the tree,
+  // and dropped when it is picked
+  if ((arg.root = job_root(s, job, 0)) && (arg.top = pathtree_find(s->paths, arg.root, from))) {
+    if (pathtree_move(s->paths, arg.top, arg.root, to) < 0) {
+      log_msg(LOG_WARNING, "%s: copies queued below it not moved: %s", from, strerror(errno));
+    } else {
+      hash_map_foreach(s->running, rename_running, &arg);
+    }
+  }
+
+  pthread_mutex_unlock(&s->lock);
+}
+
+
+static void cancel_queued(void *key, void *val, void *arg)
+{
+  tree_arg_st *t = (tree_arg_st *)arg;
+  sched_st *s = t->s;
+  sched_item_st *item = (sched_item_st *)val;
+
+  if (pathtree_below(s->paths, item->node, t->top)) {
+    hash_map_remove(s->queued, key);
+    item->dead = 1;
+  }
+}
+
+
+static void cancel_running(void *key, void *val, void *arg)
+{
+  tree_arg_st *t = (tree_arg_st *)arg;
+  sched_st *s = t->s;
+  sched_item_st *item = (sched_item_st *)val;
+
+  if (pathtree_below(s->paths, item->node, t->top)) {
+    item->stale = 1;
+    item_drop(s, item->again);
+    item->again = NULL;
+  }
+}
+
+
+/* sched_cancel - a file or directory was deleted, drop any copies of
+ *                it (or below it) that have not run yet
+ */
+
+void sched_cancel(job_st *job, const char *path)
+{
+  sched_st *s = sched_of(job);
+  tree_arg_st arg = {s, job, 0, 0};
+
+  pthread_mutex_lock(&s->lock);
+  // nothing is queued or running below a path that is not in the tree
+  if ((arg.root = job_root(s, job, 0)) && (arg.top = pathtree_find(s->paths, arg.root, path))) {
+    hash_map_foreach(s->running, cancel_running, &arg);
+    hash_map_foreach(s->queued, cancel_queued, &arg);
+  }
+  pthread_mutex_unlock(&s->lock);
+}
+
+
+/* sched_stats - add up the per class counters of the shards */
+void sched_stats(sched_stats_st stats[NUM_CLASSES])
+{
+  sched_st *s;
+  int n, c;
+
+  memset(stats, 0, NUM_CLASSES * sizeof(sched_stats_st));
+  for (n = 0; n < num_scheds; n++) {
+    s = &scheds[n];
+    pthread_mutex_lock(&s->lock);
+    for (c = 0; c < NUM_CLASSES; c++) {
+      stats[c].done += s->stats[c].done;
+      stats[c].lag_total_us += s->stats[c].lag_total_us;
+      if (s->stats[c].lag_max_us > stats[c].lag_max_us) {
+	stats[c].lag_max_us = s->stats[c].lag_max_us;
+      }
+      stats[c].queued += s->stats[c].queued;
+    }
+    pthread_mutex_unlock(&s->lock);
+  }
+}
+
+
+typedef struct job_arg_st {
+  job_st *job;
+  sched_job_stats_st *st;
+  uint64_t oldest;
+} job_arg_st;
+
+
+static void count_job(sched_item_st *item, job_arg_st *arg, size_t *count)
+{
+  if (item->op->job == arg->job) {
+    ++*count;
+    if (item->submitted < arg->oldest) {
+      arg->oldest = item->submitted;
+    }
+  }
+}
+
+
+static void count_queued(void *key, void *val, void *arg)
+{
+  count_job((sched_item_st *)val, (job_arg_st *)arg, &((job_arg_st *)arg)->st->queued);
+}
+
+
+static void count_running(void *key, void *val, void *arg)
+{
+  count_job((sched_item_st *)val, (job_arg_st *)arg, &((job_arg_st *)arg)->st->running);
+}
+
+
+/* sched_job_stats - count the copies of one job, queued and running */
+void sched_job_stats(job_st *job, sched_job_stats_st *st)
+{
+  sched_st *s = sched_of(job);
+  job_arg_st arg = {job, st, UINT64_MAX};
+  uint64_t now = now_us();
+
+  memset(st, 0, sizeof(*st));
+  pthread_mutex_lock(&s->lock);
+  hash_map_foreach(s->queued, count_queued, &arg);
+  hash_map_foreach(s->running, count_running, &arg);
+  pthread_mutex_unlock(&s->lock);
+
+  if (arg.oldest < now) {
+    st->lag_us = now - arg.oldest;
+  }
+}
+
+
+/* sched_drain - wait until every copy submitted so far is done */
+void sched_drain(void)
+{
+  int n;
+
+  for (n = 0; n < num_scheds; n++) {
+    while (__atomic_load_n(&scheds[n].pending, __ATOMIC_ACQUIRE)) {
+      usleep(1000);
+    }
+  }
+}
+
+
+/* sched_barrier - wait until every copy submitted so far is done,
+ *                 however many are submitted meanwhile. Copies are
+ *                 counted by epoch, a barrier starts a new one and
+ *                 waits for the old one to empty, in every shard.
+ *                 One barrier at a time, so the new epoch's counter
+ *                 is always free
+ */
+
+void sched_barrier(void)
+{
+  static pthread_mutex_t barrier = PTHREAD_MUTEX_INITIALIZER;
+  int old[num_scheds];
+  sched_st *s;
+  int n;
+
+  pthread_mutex_lock(&barrier);
+  // all of them first, so copies submitted meanwhile are not waited on
+  for (n = 0; n < num_scheds; n++) {
+    s = &scheds[n];
+    pthread_mutex_lock(&s->lock);
+    old[n] = s->epoch;
+    s->epoch = !old[n];
+    pthread_mutex_unlock(&s->lock);
+  }
+  for (n = 0; n < num_scheds; n++) {
+    s = &scheds[n];
+    pthread_mutex_lock(&s->lock);
+    while (s->epoch_pending[old[n]]) {
+      pthread_cond_wait(&s->drained, &s->lock);
+    }
+    pthread_mutex_unlock(&s->lock);
+  }
+  pthread_mutex_unlock(&barrier);
+}
+
+
+/* sched_stop - stop starting copies, for a handoff to another process.
+ *              The copies running are finished (and split copies'
+ *              ranges still queued, so they can), the ones queued or
+ *              spilled, or submitted from here on, are taken out.
+ *              They are not done as far as the journal is concerned
+ *
+ * returns - the copies taken out, a list of ops
+ */
+
+op_st *sched_stop(void)
+{
+  op_st *ret = NULL;
+  op_st **tail = &ret;
+  sched_item_st *item;
+  sched_heap_st *h;
+  sched_st *s;
+  size_t i, len;
+  int n, c;
+
+  for (n = 0; n < num_scheds; n++) {
+    s = &scheds[n];
+    pthread_mutex_lock(&s->lock);
+    s->stopped = 1;
+    s->stopped_ops = NULL;
+    s->stopped_tail = &s->stopped_ops;
+
+    // the ranges stay in the heaps, everything else comes out
+    for (c = 0; c < NUM_CLASSES; c++) {
+      h = &s->heap[c];
+      len = h->len;
+      h->len = 0;
+      for (i = 0; i < len; i++) {
+	item = h->items[i];
+	if (!item->op) {
+	  heap_push(h, item);
+	  continue;
+	}
+	s->stats[c].queued--;
+	if (hash_map_get(s->queued, KEY(item->node)) == item) {
+	  hash_map_remove(s->queued, KEY(item->node));
+	}
+	if (item->dead || unshelve(s, item) < 0) {
+	  item_drop(s, item);
+	} else {
+	  unqueue(s, item);
+	}
+      }
+    }
+    if (s->spilled) {
+      refill(s);
+    }
+    pthread_mutex_unlock(&s->lock);
+  }
+
+  // running copies put any copy waiting on them in the list as they finish
+  for (n = 0; n < num_scheds; n++) {
+    s = &scheds[n];
+    pthread_mutex_lock(&s->lock);
+    while (s->running->entries || s->heap[CLASS_MEDIUM].len || s->heap[CLASS_LARGE].len ||
+	   s->heap[CLASS_SMALL].len) {
+      pthread_mutex_unlock(&s->lock);
+      usleep(1000);
+      pthread_mutex_lock(&s->lock);
+    }
+    *tail = s->stopped_ops;
+    if (s->stopped_ops) {
+      tail = s->stopped_tail;
+    }
+    s->stopped_ops = NULL;
+    s->stopped_tail = &s->stopped_ops;
+    pthread_mutex_unlock(&s->lock);
+  }
+
+  return (ret);
+}
+
+
+/* sched_restart - start copies again after sched_stop, the handoff
+ *                 did not happen. The ops it returned are submitted
+ *                 again by the caller
+ */
+
+void sched_restart(void)
+{
+  int n;
+
+  for (n = 0; n < num_scheds; n++) {
+    pthread_mutex_lock(&scheds[n].lock);
+    scheds[n].stopped = 0;
+    pthread_mutex_unlock(&scheds[n].lock);
+  }
+}
@@ -0,0 +1,106 @@
+/*
+ * sched.h
+ *
+ * Replication Scheduler Definitions
+ * 
+ *
+ * Copyright (C) 2013  Bryant Moscon - bmoscon@gmail.com
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to 
+ * deal in the Software without restriction, including without limitation the 
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, 
+ *    this list of conditions and the following disclaimer in the documentation 
+ *    and/or other materials provided with the distribution, and in the same 
+ *    place and form as other copyright, license and disclaimer information.
+ *
+ * 3. The end-user documentation included with the redistribution, if any, must 
+ *    include the following acknowledgment: "This product includes software 
+ *    developed by Bryant Moscon (http://www.bryantmoscon.org/)", in the same 
+ *    place and form as other third-party acknowledgments. Alternately, this 
+ *    acknowledgment may appear in the software itself, in the same form and 
+ *    location as other such third-party acknowledgments.
+ *
+ * 4. Except as contained in this notice, the name of the author, Bryant Moscon,
+ *    shall not be used in advertising or otherwise to promote the sale, use or 
+ *    other dealings in this Software without prior written authorization from 
+ *    the author.
+ *
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL 
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN 
+ * THE SOFTWARE.
+ *
+ */
+
+#ifndef __SCHED__
+#define __SCHED__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sched.h>
+#include <sys/types.h>
+
+#include "op.h"
+
+
+// latency classes, by file size
+typedef enum sched_class {
+  CLASS_SMALL,
+  CLASS_MEDIUM,
+  CLASS_LARGE,
+  NUM_CLASSES
+} sched_class;
+
+
+typedef struct sched_stats_st {
+  uint64_t done;
+  uint64_t lag_total_us;   // submit to completion
+  uint64_t lag_max_us;
+  size_t queued;
+} sched_stats_st;
+
+
+/* one job's share of the queue */
+typedef struct sched_job_stats_st {
+  size_t queued;
+  size_t running;
+  uint64_t lag_us;         // age of its oldest copy not done yet
+} sched_job_stats_st;
+
+
+/* memory of the copy queue, see sched_limit */
+typedef struct sched_queue_stats_st {
+  size_t mem;              // bytes the queued and running copies take
+  size_t limit;            // 0 for none
+  size_t spilled;          // copies in the overflow file
+  uint64_t spill_bytes;    // ... and its size
+} sched_queue_stats_st;
+
+
+int sched_start(int shards, int workers, off_t split_size, const cpu_set_t *cpus);
+void sched_limit(size_t limit, const char *dir);
+void sched_queue_stats(sched_queue_stats_st *st);
+void sched_submit(op_st *op);
+void sched_rename(job_st *job, const char *from, const char *to);
+void sched_cancel(job_st *job, const char *path);
+void sched_stats(sched_stats_st stats[NUM_CLASSES]);
+void sched_job_stats(job_st *job, sched_job_stats_st *st);
+void sched_drain(void);
+void sched_barrier(void);
+op_st *sched_stop(void);
+void sched_restart(void);
+
+
+#endif
@@ -0,0 +1,812 @@
+/*
+ * scrub.c
+ *
+ * Background Scrub
+ * 
+ *
+ * Copyright (C) 2013  Bryant Moscon - bmoscon@gmail.com
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to 
+ * deal in the Software without restriction, including without limitation the 
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, 
+ *    this list of conditions and the following disclaimer in the documentation 
+ *    and/or other materials provided with the distribution, and in the same 
+ *    place and form as other copyright, license and disclaimer information.
+ *
+ * 3. The end-user documentation included with the redistribution, if any, must 
+ *    include the following acknowledgment: "This product includes software 
+ *    developed by Bryant Moscon (http://www.bryantmoscon.org/)", in the same 
+ *    place and form as other third-party acknowledgments. Alternately, this 
+ *    acknowledgment may appear in the software itself, in the same form and 
+ *    location as other such third-party acknowledgments.
+ *
+ * 4. Except as contained in this notice, the name of the author, Bryant Moscon,
+ *    shall not be used in advertising or otherwise to promote the sale, use or 
+ *    other dealings in this Software without prior written authorization from 
+ *    the author.
+ *
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL 
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN 
+ * THE SOFTWARE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "scrub.h"
+#include "dircache.h"
+#include "hash_map.h"
+#include "pathtree.h"
+#include "sched.h"
+#include "tail.h"
+#include "pack.h"
+#include "replicate.h"
+#include "watch.h"
+#include "op.h"
+#include "idle.h"
+#include "log.h"
+
+
+/*
+ * Events can be missed (a queue overflow, a crash before the journal
+ * was enabled) and a backup can rot or be edited by hand, so a thread
+ * at idle I/O priority walks each job, in name order, comparing every
+ * file with its copy: type, size, modification time and then contents.
+ * Anything that differs is logged and copied again.
+ *
+ * Reads are paced to stay under the rate budget (SCRUB_RATE). The
+ * source is what the production side is using, so its checksum is
+ * kept, and only read again once the file changes (inode, size,
+ * modification or change time). The copy is read every time, that is
+ * how rot is found.
+ *
+ * The walk is resumable: a state file per job holds the last file
+ * done and the cached checksums, saved every SCRUB_SAVE seconds and
+ * at the end of each pass.
+ */
+
+
+#define SCRUB_MAGIC  "BKDSCR1\n"
+#define SCRUB_SETTLE 10             // seconds a file is left alone after it changed
+#define SCRUB_SAVE   30             // seconds between state saves
+#define SCRUB_IDLE   60             // seconds between passes
+#define SCRUB_BUF    (128 * 1024)
+
+
+/* a source file's checksum, and what it looked like when summed */
+typedef struct scrub_sum_st {
+  uint32_t node;           // its path, in the job's tree
+  uint64_t ino;
+  uint64_t size;
+  uint64_t mtime;          // nanoseconds
+  uint64_t ctime;
+  uint64_t sum;
+  int seen;                // in this pass
+} scrub_sum_st;
+
+
+/* the job being scrubbed */
+typedef struct scrub_job_st {
+  job_st *job;
+  char *state;             // state file
+  pathtree_st *paths;      // of the files summed
+  uint32_t root;           // job->src in it
+  hash_map_st *sums;       // node -> scrub_sum_st
+  char *cursor;            // last file done by an earlier run
+  char *last;              // last file done by this one
+  time_t saved;
+  unsigned char buf[SCRUB_BUF];
+} scrub_job_st;
+
+
+static struct {
+  pthread_mutex_t lock;
+  job_st **jobs;           // held
+  int njobs;
+  char *dir;               // state files
+  off_t rate;              // bytes per second
+  uint64_t next;           // usec, when the next read may start
+  scrub_stats_st stats;
+} scrub = {PTHREAD_MUTEX_INITIALIZER};
+
+
+static uint64_t ns(struct timespec *ts)
+{
+  return ((uint64_t)ts->tv_sec * 1000000000 + ts->tv_nsec);
+}
+
+
+static void count(uint64_t *stat, uint64_t n)
+{
+  pthread_mutex_lock(&scrub.lock);
+  *stat += n;
+  pthread_mutex_unlock(&scrub.lock);
+}
+
+
+/* sum_file - FNV-1a of root/rel, read within the budget
+ *
+ * st - OUT - the file as it was once read
+ *
+ * returns - 0 on success, -1 on error
+ */
+
+static int sum_file(scrub_job_st *s, const char *root, const char *rel, struct stat *st,
+		    uint64_t *sum)
+{
+  uint64_t h = 0xcbf29ce484222325ULL;
+  const char *base;
+  ssize_t len, i;
+  int dir, fd;
+
+  if ((dir = dir_open(root, rel, &base)) < 0) {
+    return (-1);
+  }
+  if ((fd = openat(dir, base, O_RDONLY | O_NOATIME | O_CLOEXEC)) < 0 && errno == EPERM) {
+    fd = openat(dir, base, O_RDONLY | O_CLOEXEC);
+  }
+  if (fd < 0) {
+    return (-1);
+  }
+
+  while (1) {
+    if ((len = read(fd, s->buf, SCRUB_BUF)) <= 0) {
+      if (len < 0 && errno == EINTR) {
+	continue;
+      }
+      break;
+    }
+    idle_pace(&scrub.next, len, scrub.rate);
+    for (i = 0; i < len; i++) {
+      h = (h ^ s->buf[i]) * 0x100000001b3ULL;
+    }
+    count(&scrub.stats.bytes, len);
+  }
+
+  // nobody else needs what was read
+  posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+  if (len < 0 || fstat(fd, st) < 0) {
+    close(fd);
+    return (-1);
+  }
+  close(fd);
+
+  *sum = h;
+  return (0);
+}
+
+
+/* finding - rel differs from its copy, log it and queue a repair */
+static void finding(scrub_job_st *s, const char *rel, const char *what, int is_dir)
+{
+  op_st *op;
+
+  log_msg(LOG_WARNING, "scrub: %s/%s: %s, copying it again", s->job->dst, rel, what);
+  count(&scrub.stats.mismatches, 1);
+
+  if (!(op = op_new(is_dir ? OP_POPULATE : OP_COPY, s->job, rel, NULL, is_dir))) {
+    return;
+  }
+  count(&scrub.stats.repairs, 1);
+  if (is_dir) {
+    op_apply(op);
+    op_free(op);
+  } else {
+    sched_submit(op);
+  }
+}
+
+
+/* a new, empty cache entry for rel */
+static scrub_sum_st *add_sum(scrub_job_st *s, const char *rel)
+{
+  scrub_sum_st *e;
+
+  if (!(e = calloc(1, sizeof(scrub_sum_st))) || !(e->node = pathtree_get(s->paths, s->root, rel))) {
+    free(e);
+    return (NULL);
+  }
+  if (hash_map_put(s->sums, (void *)(uintptr_t)e->node, e) != 0) {
+    pathtree_put(s->paths, e->node);
+    free(e);
+    return (NULL);
+  }
+  return (e);
+}
+
+
+/* the source checksum of rel, from the cache if it did not change */
+static int source_sum(scrub_job_st *s, const char *rel, struct stat *st, uint64_t *sum)
+{
+  uint32_t node = pathtree_find(s->paths, s->root, rel);
+  scrub_sum_st *e = node ? hash_map_get(s->sums, (void *)(uintptr_t)node) : NULL;
+  struct stat now;
+
+  if (e && e->ino == st->st_ino && e->size == st->st_size && e->mtime == ns(&st->st_mtim) &&
+      e->ctime == ns(&st->st_ctim)) {
+    e->seen = 1;
+    count(&scrub.stats.cached, 1);
+    *sum = e->sum;
+    return (0);
+  }
+
+  if (sum_file(s, s->job->src, rel, &now, sum) < 0) {
+    return (-1);
+  }
+  if (now.st_size != st->st_size || ns(&now.st_mtim) != ns(&st->st_mtim)) {
+    // changed while it was read, an event is on its way
+    return (-1);
+  }
+
+  if (!e && !(e = add_sum(s, rel))) {
+    return (0);
+  }
+  e->ino = st->st_ino;
+  e->size = st->st_size;
+  e->mtime = ns(&st->st_mtim);
+  e->ctime = ns(&st->st_ctim);
+  e->sum = *sum;
+  e->seen = 1;
+
+  return (0);
+}
+
+
+/* check_packed - check_file, for a file in the job's pack */
+static void check_packed(scrub_job_st *s, pack_st *p, const char *rel, struct stat *st,
+			 struct stat *dst)
+{
+  uint64_t src_sum, dst_sum = 0xcbf29ce484222325ULL;
+  unsigned char *buf;
+  ssize_t len, i;
+
+  if (dst->st_size != st->st_size) {
+    finding(s, rel, "size differs", 0);
+    return;
+  }
+  if (ns(&dst->st_mtim) != ns(&st->st_mtim)) {
+    finding(s, rel, "modification time differs", 0);
+    return;
+  }
+  if (source_sum(s, rel, st, &src_sum) < 0 || !(buf = malloc(dst->st_size + 1))) {
+    return;
+  }
+
+  if ((len = pack_read(p, rel, buf, dst->st_size)) >= 0) {
+    idle_pace(&scrub.next, len, scrub.rate);
+    for (i = 0; i < len; i++) {
+      dst_sum = (dst_sum ^ buf[i]) * 0x100000001b3ULL;
+    }
+    count(&scrub.stats.bytes, len);
+    if (len != dst->st_size || src_sum != dst_sum) {
+      finding(s, rel, "contents differ", 0);
+    }
+  }
+  free(buf);
+}
+
+
+static void check_file(scrub_job_st *s, const char *rel, struct stat *st)
+{
+  uint64_t src_sum, dst_sum;
+  struct stat dst, now;
+  const char *base;
+  pack_st *p;
+  int dir;
+
+  // may still be on its way
+  if (time(NULL) - st->st_ctime < SCRUB_SETTLE) {
+    return;
+  }
+  count(&scrub.stats.files, 1);
+
+  if ((p = pack_get(s->job)) && pack_stat(p, rel, &dst) == 0) {
+    check_packed(s, p, rel, st, &dst);
+    return;
+  }
+
+  if ((dir = dir_open(s->job->dst, rel, &base)) < 0 ||
+      fstatat(dir, base, &dst, AT_SYMLINK_NOFOLLOW) < 0) {
+    if (errno == ENOENT) {
+      finding(s, rel, "missing", 0);
+    }
+    return;
+  }
+
+  if (!S_ISREG(dst.st_mode)) {
+    finding(s, rel, "not a file", 0);
+  } else if (dst.st_size != st->st_size) {
+    finding(s, rel, "size differs", 0);
+  } else if (ns(&dst.st_mtim) != ns(&st->st_mtim) && !tail_wanted(s->job, rel)) {
+    // tailed files only get their new bytes, not the times
+    finding(s, rel, "modification time differs", 0);
+  } else if (source_sum(s, rel, st, &src_sum) == 0 &&
+	     sum_file(s, s->job->dst, rel, &now, &dst_sum) == 0 && src_sum != dst_sum) {
+    finding(s, rel, "contents differ", 0);
+  }
+}
+
+
+static void state_save(scrub_job_st *s, int final);
+
+
+/* done - rel was checked, it is where the next run carries on */
+static void done(scrub_job_st *s, const char *rel)
+{
+  char *last = strdup(rel);
+
+  if (last) {
+    free(s->last);
+    s->last = last;
+  }
+
+  if (time(NULL) - s->saved >= SCRUB_SAVE) {
+    state_save(s, 0);
+  }
+}
+
+
+static int walk(scrub_job_st *s, const char *rel, const char *resume);
+
+
+/* check - one entry of the source tree
+ *
+ * returns - 0 to go on, -1 if the job went away (or was paused)
+ */
+
+static int check(scrub_job_st *s, const char *rel, const char *resume)
+{
+  const char *base;
+  struct stat st, dst;
+  int dir, is_dir;
+
+  if (job_is_stopped(s->job) || s->job->paused) {
+    return (-1);
+  }
+
+  if ((dir = dir_open(s->job->src, rel, &base)) < 0 ||
+      fstatat(dir, base, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+    return (0);
+  }
+  is_dir = S_ISDIR(st.st_mode);
+  if ((!is_dir && !S_ISREG(st.st_mode)) || !filter_match(s->job->filter, rel, is_dir)) {
+    return (0);
+  }
+
+  if (!is_dir) {
+    check_file(s, rel, &st);
+    done(s, rel);
+    return (0);
+  }
+
+  if ((dir = dir_open(s->job->dst, rel, &base)) < 0 ||
+      fstatat(dir, base, &dst, AT_SYMLINK_NOFOLLOW) < 0) {
+    if (errno == ENOENT && time(NULL) - st.st_ctime >= SCRUB_SETTLE) {
+      // copies everything below it too
+      finding(s, rel, "missing", 1);
+    }
+    return (0);
+  }
+  if (!S_ISDIR(dst.st_mode)) {
+    if (time(NULL) - st.st_ctime < SCRUB_SETTLE) {
+      return (0);
+    }
+    // out of the way (to the trash, with DELETE=trash) first
+    if (replicate_unlink(s->job, rel) < 0) {
+      log_msg(LOG_WARNING, "scrub: %s/%s: not a directory", s->job->dst, rel);
+      count(&scrub.stats.mismatches, 1);
+      return (0);
+    }
+    finding(s, rel, "not a directory", 1);
+    return (0);
+  }
+
+  return (walk(s, rel, resume));
+}
+
+
+static int by_name(const struct dirent **a, const struct dirent **b)
+{
+  return (strcmp((*a)->d_name, (*b)->d_name));
+}
+
+
+/* walk - check everything below rel, in name order. resume is what is
+ *        left of the cursor below rel (NULL for none), entries up to
+ *        it were done by an earlier run
+ *
+ * returns - 0 once done, -1 if the job went away (or was paused)
+ */
+
+static int walk(scrub_job_st *s, const char *rel, const char *resume)
+{
+  struct dirent **list;
+  const char *below;
+  size_t len = 0;
+  char *child;
+  int fd, n, i, cmp, ret = 0;
+
+  if ((fd = dir_get(s->job->src, rel)) < 0 || (n = scandirat(fd, ".", &list, NULL, by_name)) < 0) {
+    return (0);
+  }
+  if (resume) {
+    len = strcspn(resume, "/");
+  }
+
+  for (i = 0; i < n; i++) {
+    const char *name = list[i]->d_name;
+
+    below = NULL;
+    if (ret || strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+      free(list[i]);
+      continue;
+    }
+
+    if (resume) {
+      if ((cmp = strncmp(name, resume, len)) == 0 && name[len]) {
+	cmp = 1;
+      }
+      if (cmp < 0 || (cmp == 0 && !resume[len])) {
+	// done, or the cursor itself
+	if (cmp == 0) {
+	  resume = NULL;
+	}
+	free(list[i]);
+	continue;
+      }
+      if (cmp == 0) {
+	below = resume + len + 1;
+      }
+      resume = NULL;
+    }
+
+    if ((child = path_join(rel, name))) {
+      ret = check(s, child, below);
+      free(child);
+    }
+    free(list[i]);
+  }
+  free(list);
+
+  return (ret);
+}
+
+
+/*
+ * State file: SCRUB_MAGIC, the cursor (u32 length, then the path, 0
+ * for a fresh pass), then until the end of the file the checksums:
+ * u32 length, path, then ino, size, mtime, ctime and sum as u64, in
+ * host byte order.
+ */
+
+
+typedef struct save_arg_st {
+  scrub_job_st *s;
+  FILE *fp;
+  int final;               // only what this pass saw
+} save_arg_st;
+
+
+static void save_sum(void *key, void *val, void *arg)
+{
+  save_arg_st *a = (save_arg_st *)arg;
+  scrub_sum_st *e = (scrub_sum_st *)val;
+  uint32_t len;
+  char *rel;
+
+  if ((a->final && !e->seen) || !(rel = pathtree_path(a->s->paths, a->s->root, e->node, NULL))) {
+    return;
+  }
+  len = strlen(rel);
+  fwrite(&len, sizeof(len), 1, a->fp);
+  fwrite(rel, 1, len, a->fp);
+  fwrite(&e->ino, sizeof(uint64_t), 5, a->fp);
+  free(rel);
+}
+
+
+/* state_save - write the state out, with the cursor at the last file
+ *              done, or at the start if the pass is final
+ */
+
+static void state_save(scrub_job_st *s, int final)
+{
+  const char *cursor = (final || !s->last) ? "" : s->last;
+  uint32_t len = strlen(cursor);
+  save_arg_st arg = {s, NULL, final};
+  char *tmp;
+  int err;
+
+  s->saved = time(NULL);
+  if (!(tmp = malloc(strlen(s->state) + 5))) {
+    return;
+  }
+  sprintf(tmp, "%s.tmp", s->state);
+
+  if (!(arg.fp = fopen(tmp, "w"))) {
+    log_msg(LOG_WARNING, "scrub: %s: %s", tmp, strerror(errno));
+    free(tmp);
+    return;
+  }
+
+  fputs(SCRUB_MAGIC, arg.fp);
+  fwrite(&len, sizeof(len), 1, arg.fp);
+  fwrite(cursor, 1, len, arg.fp);
+  hash_map_foreach(s->sums, save_sum, &arg);
+
+  err = (fflush(arg.fp) != 0 || fsync(fileno(arg.fp)) < 0);
+  if (fclose(arg.fp) != 0 || err || rename(tmp, s->state) < 0) {
+    log_msg(LOG_WARNING, "scrub: %s: %s", s->state, strerror(errno));
+    unlink(tmp);
+  }
+  free(tmp);
+}
+
+
+static char *read_str(FILE *fp)
+{
+  uint32_t len;
+  char *str;
+
+  if (fread(&len, sizeof(len), 1, fp) != 1 || len > 65536 || !(str = malloc(len + 1))) {
+    return (NULL);
+  }
+  if (fread(str, 1, len, fp) != len) {
+    free(str);
+    return (NULL);
+  }
+  str[len] = '\0';
+  return (str);
+}
+
+
+static void state_load(scrub_job_st *s)
+{
+  char magic[sizeof(SCRUB_MAGIC) - 1];
+  scrub_sum_st *e;
+  char *rel;
+  FILE *fp;
+
+  if (!(fp = fopen(s->state, "r"))) {
+    return;
+  }
+
+  if (fread(magic, sizeof(magic), 1, fp) != 1 || memcmp(magic, SCRUB_MAGIC, sizeof(magic)) != 0 ||
+      !(s->cursor = read_str(fp))) {
+    log_msg(LOG_WARNING, "scrub: %s: not a state file, starting over", s->state);
+    fclose(fp);
+    return;
+  }
+  if (!s->cursor[0]) {
+    free(s->cursor);
+    s->cursor = NULL;
+  }
+
+  // a torn last record is dropped, it is only a cache
+  while ((rel = read_str(fp))) {
+    e = add_sum(s, rel);
+    free(rel);
+    if (!e) {
+      break;
+    }
+    if (fread(&e->ino, sizeof(uint64_t), 5, fp) != 5) {
+      hash_map_remove(s->sums, (void *)(uintptr_t)e->node);
+      pathtree_put(s->paths, e->node);
+      free(e);
+      break;
+    }
+  }
+
+  fclose(fp);
+}
+
+
+static void free_sum(void *key, void *val, void *arg)
+{
+  free(val);
+}
+
+
+/* scrub_job - one pass over a job, or the rest of one */
+static void scrub_job(job_st *job)
+{
+  scrub_job_st *s;
+  char *p;
+
+  if (!(s = calloc(1, sizeof(scrub_job_st))) ||
+      !(s->state = malloc(strlen(scrub.dir) + strlen(job->name) + 2)) ||
+      !(s->sums = hash_map_init(1024, hash_map_int_hash, hash_map_int_cmp)) ||
+      !(s->paths = pathtree_init()) || !(s->root = pathtree_root(s->paths))) {
+    if (s) {
+      if (s->sums) {
+	hash_map_free(s->sums);
+      }
+      pathtree_free(s->paths);
+      free(s->state);
+    }
+    free(s);
+    return;
+  }
+  s->job = job;
+  sprintf(s->state, "%s/%s", scrub.dir, job->name);
+  for (p = s->state + strlen(scrub.dir) + 1; *p; p++) {
+    if (*p == '/') {
+      *p = '_';
+    }
+  }
+
+  state_load(s);
+  s->saved = time(NULL);
+
+  pthread_mutex_lock(&scrub.lock);
+  snprintf(scrub.stats.job, sizeof(scrub.stats.job), "%s", job->name);
+  pthread_mutex_unlock(&scrub.lock);
+
+  if (s->cursor) {
+    log_msg(LOG_INFO, "scrub: job %s, carrying on after %s", job->name, s->cursor);
+  }
+
+  if (walk(s, "", s->cursor) == 0) {
+    state_save(s, 1);
+  } else if (!job_is_stopped(job)) {
+    // paused, carry on from here next time
+    state_save(s, 0);
+  }
+
+  hash_map_foreach(s->sums, free_sum, NULL);
+  hash_map_free(s->sums);
+  pathtree_free(s->paths);
+  free(s->cursor);
+  free(s->last);
+  free(s->state);
+  free(s);
+}
+
+
+static void *scrub_main(void *arg)
+{
+  job_st **jobs;
+  int n, i;
+
+  idle_thread();
+
+  while (1) {
+    pthread_mutex_lock(&scrub.lock);
+    n = scrub.njobs;
+    if ((jobs = malloc((n + 1) * sizeof(job_st *)))) {
+      for (i = 0; i < n; i++) {
+	jobs[i] = scrub.jobs[i];
+	job_hold(jobs[i]);
+      }
+    } else {
+      n = 0;
+    }
+    pthread_mutex_unlock(&scrub.lock);
+
+    for (i = 0; i < n; i++) {
+      if (!job_is_stopped(jobs[i]) && !jobs[i]->paused) {
+	scrub_job(jobs[i]);
+      }
+      job_release(jobs[i]);
+    }
+    free(jobs);
+
+    pthread_mutex_lock(&scrub.lock);
+    scrub.stats.passes++;
+    scrub.stats.job[0] = '\0';
+    pthread_mutex_unlock(&scrub.lock);
+
+    // directories of jobs that were removed
+    dir_release();
+    sleep(SCRUB_IDLE);
+  }
+
+  return (NULL);
+}
+
+
+/* scrub_start - start the scrub thread
+ *
+ * state_dir - IN - where the state files go, created if needed
+ * rate - IN - bytes read per second, at most
+ * jobs - IN - to scrub, until scrub_jobs says otherwise
+ *
+ * returns - 0 on success, -1 on error (logged)
+ */
+
+int scrub_start(const char *state_dir, off_t rate, job_st *jobs)
+{
+  pthread_t tid;
+
+  if (mkdir(state_dir, S_IRWXU) < 0 && errno != EEXIST) {
+    log_msg(LOG_ERR, "scrub: mkdir %s: %s", state_dir, strerror(errno));
+    return (-1);
+  }
+  if (!(scrub.dir = strdup(state_dir))) {
+    return (-1);
+  }
+  scrub.rate = (rate > 0) ? rate : DEFAULT_SCRUB_RATE;
+
+  scrub.stats.enabled = 1;
+  scrub_jobs(jobs);
+
+  if (pthread_create(&tid, NULL, scrub_main, NULL) != 0) {
+    log_msg(LOG_ERR, "scrub: %s", strerror(errno));
+    scrub_jobs(NULL);
+    scrub.stats.enabled = 0;
+    return (-1);
+  }
+  pthread_detach(tid);
+
+  return (0);
+}
+
+
+/* scrub_jobs - the jobs to scrub from now on, after a (re)load */
+void scrub_jobs(job_st *jobs)
+{
+  job_st **list = NULL;
+  job_st *job;
+  int n = 0, i;
+
+  pthread_mutex_lock(&scrub.lock);
+  if (!scrub.stats.enabled) {
+    pthread_mutex_unlock(&scrub.lock);
+    return;
+  }
+
+  // the copy of a remote job is not ours to read
+  for (job = jobs; job; job = job->next) {
+    n += !job->remote;
+  }
+  if (n && !(list = malloc(n * sizeof(job_st *)))) {
+    pthread_mutex_unlock(&scrub.lock);
+    return;
+  }
+  for (i = 0, job = jobs; job; job = job->next) {
+    if (job->remote) {
+      continue;
+    }
+    job_hold(job);
+    list[i++] = job;
+  }
+
+  for (i = 0; i < scrub.njobs; i++) {
+    job_release(scrub.jobs[i]);
+  }
+  free(scrub.jobs);
+  scrub.jobs = list;
+  scrub.njobs = n;
+  pthread_mutex_unlock(&scrub.lock);
+}
+
+
+/* scrub_stats - copy out the progress and findings */
+void scrub_stats(scrub_stats_st *st)
+{
+  pthread_mutex_lock(&scrub.lock);
+  *st = scrub.stats;
+  pthread_mutex_unlock(&scrub.lock);
+}
@@ -0,0 +1,242 @@
+/*
+ * snapshot.c
+ *
+ * Point-in-time snapshots of a job's destination, made of hard links
+ * 
+ *
+ * Copyright (C) 2013  Bryant Moscon - bmoscon@gmail.com
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to 
+ * deal in the Software without restriction, including without limitation the 
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, 
+ *    this list of conditions and the following disclaimer in the documentation 
+ *    and/or other materials provided with the distribution, and in the same 
+ *    place and form as other copyright, license and disclaimer information.
+ *
+ * 3. The end-user documentation included with the redistribution, if any, must 
+ *    include the following acknowledgment: "This product includes software 
+ *    developed by Bryant Moscon (http://www.bryantmoscon.org/)", in the same 
+ *    place and form as other third-party acknowledgments. Alternately, this 
+ *    acknowledgment may appear in the software itself, in the same form and 
+ *    location as other such third-party acknowledgments.
+ *
+ * 4. Except as contained in this notice, the name of the author, Bryant Moscon,
+ *    shall not be used in advertising or otherwise to promote the sale, use or 
+ *    other dealings in this Software without prior written authorization from 
+ *    the author.
+ *
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL 
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN 
+ * THE SOFTWARE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "snapshot.h"
+#include "task.h"
+#include "log.h"
+
+
+/*
+ * A snapshot is a tree of hard links to the files of the destination
+ * mirror as they were when it was taken, under
+ *
+ *   <DESTINATION>/.backupd/snapshots/<YYYY-MM-DD_HHMM>
+ *
+ * so taking one only creates directories and links, no file data is
+ * copied. The mirror is never written in place while a file has other
+ * links: copies go to a temporary file that is renamed over the old
+ * one, and tail copies fall back to that when st_nlink > 1. Each
+ * snapshot keeps the inodes it links to unchanged.
+ *
+ * The tree is built by a background task under a ".new-" name and
+ * renamed into place when complete. Snapshots beyond SNAPSHOT_KEEP are
+ * then renamed to ".old-" names and removed in the background.
+ */
+
+
+static void snapshot_start(job_st *job, time_t now)
+{
+  char dir[PATH_MAX];
+  char tmp[PATH_MAX];
+  char name[32];
+  char *slash;
+
+  strftime(name, sizeof(name), "%Y-%m-%d_%H%M", localtime(&now));
+
+  if (job_path(job->dst, SNAPSHOT_DIR, dir, sizeof(dir)) < 0 ||
+      snprintf(tmp, sizeof(tmp), "%s/.new-%s", dir, name) >= (int)sizeof(tmp)) {
+    return;
+  }
+
+  // .backupd, then .backupd/snapshots
+  slash = strrchr(dir, '/');
+  *slash = '\0';
+  mkdir(dir, S_IRWXU);
+  *slash = '/';
+  mkdir(dir, S_IRWXU);
+
+  if (mkdir(tmp, S_IRWXU) < 0 && errno != EEXIST) {
+    log_msg(LOG_WARNING, "job %s: snapshot %s: %s", job->name, tmp, strerror(errno));
+    return;
+  }
+
+  __atomic_store_n(&job->snap_running, 1, __ATOMIC_RELEASE);
+  if (task_snapshot(job, tmp) < 0) {
+    __atomic_store_n(&job->snap_running, 0, __ATOMIC_RELEASE);
+  }
+}
+
+
+/* snapshot_tick - take the snapshots that are due. Called from the
+ *                 monitor loop at least once a second
+ */
+
+void snapshot_tick(job_st *jobs)
+{
+  time_t now = time(NULL);
+  job_st *job;
+
+  for (job = jobs; job; job = job->next) {
+    if (!job->snap_every || job_is_stopped(job)) {
+      continue;
+    }
+
+    if (!job->snap_next) {
+      // on the hour (or day), starting with the next one
+      job->snap_next = (now / job->snap_every + 1) * job->snap_every;
+      continue;
+    }
+
+    if (now < job->snap_next || __atomic_load_n(&job->snap_running, __ATOMIC_ACQUIRE)) {
+      continue;
+    }
+
+    job->snap_next = (now / job->snap_every + 1) * job->snap_every;
+    snapshot_start(job, now);
+  }
+}
+
+
+static int name_cmp(const void *a, const void *b)
+{
+  return (strcmp(*(char * const *)a, *(char * const *)b));
+}
+
+
+/* remove dir/name in the background, out of the way first */
+static void discard(const char *dir, const char *name)
+{
+  char from[PATH_MAX];
+  char to[PATH_MAX];
+
+  if (snprintf(from, sizeof(from), "%s/%s", dir, name) >= (int)sizeof(from) ||
+      snprintf(to, sizeof(to), "%s/.old-%s", dir,
+	       name[0] == '.' ? strchr(name + 1, '-') + 1 : name) >= (int)sizeof(to)) {
+    return;
+  }
+
+  if (strcmp(from, to) != 0 && rename(from, to) < 0) {
+    log_msg(LOG_WARNING, "rename %s: %s", from, strerror(errno));
+    return;
+  }
+  task_remove(dir, strrchr(to, '/') + 1, 0);
+}
+
+
+/* prune - drop the oldest snapshots beyond job->snap_keep, and any
+ *         left half made or half removed by an earlier run
+ */
+
+static void prune(job_st *job, const char *dir)
+{
+  char **names = NULL;
+  size_t num = 0, cap = 0, i;
+  struct dirent *ent;
+  DIR *d;
+
+  if (!(d = opendir(dir))) {
+    return;
+  }
+
+  while ((ent = readdir(d))) {
+    if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) {
+      continue;
+    }
+
+    if (ent->d_name[0] == '.') {
+      if (strncmp(ent->d_name, ".new-", 5) == 0 || strncmp(ent->d_name, ".old-", 5) == 0) {
+	discard(dir, ent->d_name);
+      }
+      continue;
+    }
+
+    if (num == cap) {
+      char **grown = realloc(names, (cap = cap ? cap * 2 : 32) * sizeof(char *));
+
+      if (!grown) {
+	break;
+      }
+      names = grown;
+    }
+    if ((names[num] = strdup(ent->d_name))) {
+      ++num;
+    }
+  }
+  closedir(d);
+
+  // names sort by age
+  qsort(names, num, sizeof(char *), name_cmp);
+  for (i = 0; i < num; i++) {
+    if (i + job->snap_keep < num) {
+      discard(dir, names[i]);
+    }
+    free(names[i]);
+  }
+  free(names);
+}
+
+
+/* snapshot_finish - the snapshot task is done building tmp, publish
+ *                   it. Called on the task thread
+ */
+
+void snapshot_finish(job_st *job, const char *tmp)
+{
+  char name[PATH_MAX];
+  char dir[PATH_MAX];
+  const char *base = strrchr(tmp, '/');
+  const char *stamp = base + strlen("/.new-");
+
+  snprintf(dir, sizeof(dir), "%.*s", (int)(base - tmp), tmp);
+  if (snprintf(name, sizeof(name), "%s/%s", dir, stamp) < (int)sizeof(name)) {
+    if (rename(tmp, name) == 0) {
+      log_msg(LOG_INFO, "job %s: snapshot %s", job->name, stamp);
+    } else {
+      log_msg(LOG_WARNING, "job %s: snapshot %s: %s", job->name, name, strerror(errno));
+    }
+  }
+
+  prune(job, dir);
+  __atomic_store_n(&job->snap_running, 0, __ATOMIC_RELEASE);
+}
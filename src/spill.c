@@ -0,0 +1,246 @@
+/*
+ * spill.c
+ *
+ * Overflow File
+ * 
+ *
+ * Copyright (C) 2013  Bryant Moscon - bmoscon@gmail.com
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to 
+ * deal in the Software without restriction, including without limitation the 
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, 
+ *    this list of conditions and the following disclaimer in the documentation 
+ *    and/or other materials provided with the distribution, and in the same 
+ *    place and form as other copyright, license and disclaimer information.
+ *
+ * 3. The end-user documentation included with the redistribution, if any, must 
+ *    include the following acknowledgment: "This product includes software 
+ *    developed by Bryant Moscon (http://www.bryantmoscon.org/)", in the same 
+ *    place and form as other third-party acknowledgments. Alternately, this 
+ *    acknowledgment may appear in the software itself, in the same form and 
+ *    location as other such third-party acknowledgments.
+ *
+ * 4. Except as contained in this notice, the name of the author, Bryant Moscon,
+ *    shall not be used in advertising or otherwise to promote the sale, use or 
+ *    other dealings in this Software without prior written authorization from 
+ *    the author.
+ *
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL 
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN 
+ * THE SOFTWARE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include "spill.h"
+#include "log.h"
+
+
+/*
+ * Records are a u16 length and the record. They are gathered in a
+ * buffer and appended to the file a buffer at a time, and read back
+ * the same way. Once every record has been read the file is truncated,
+ * so it only ever holds one backlog.
+ *
+ * The file is unlinked from the start: what it holds only means
+ * anything to this process, and is gone with it.
+ */
+
+
+/* spill_open - create an overflow file in dir
+ *
+ * returns - NULL on error (logged)
+ */
+
+spill_st *spill_open(const char *dir)
+{
+  char *name = NULL;
+  spill_st *s;
+
+  if (!(s = calloc(1, sizeof(spill_st))) || !(s->path = strdup(dir)) ||
+      !(s->wbuf = malloc(SPILL_BUF)) || !(s->rbuf = malloc(SPILL_BUF))) {
+    log_msg(LOG_ERR, "%d - malloc failed", __LINE__);
+    goto fail;
+  }
+
+  if ((s->fd = open(dir, O_RDWR | O_TMPFILE | O_CLOEXEC, S_IRUSR | S_IWUSR)) < 0) {
+    // not every filesystem has O_TMPFILE
+    if (asprintf(&name, "%s/.backupd-spill.XXXXXX", dir) < 0) {
+      name = NULL;
+      goto fail;
+    }
+    if ((s->fd = mkostemp(name, O_CLOEXEC)) < 0) {
+      log_msg(LOG_ERR, "spill file in %s: %s", dir, strerror(errno));
+      goto fail;
+    }
+    unlink(name);
+    free(name);
+  }
+
+  return (s);
+
+ fail:
+  free(name);
+  if (s) {
+    free(s->path);
+    free(s->wbuf);
+    free(s->rbuf);
+    free(s);
+  }
+  return (NULL);
+}
+
+
+void spill_close(spill_st *s)
+{
+  if (!s) {
+    return;
+  }
+  close(s->fd);
+  free(s->path);
+  free(s->wbuf);
+  free(s->rbuf);
+  free(s);
+}
+
+
+/* write out the append buffer */
+static int flush(spill_st *s)
+{
+  off_t off = s->wpos - s->wlen - s->base;
+  size_t done = 0;
+  ssize_t ret;
+
+  while (done < s->wlen) {
+    if ((ret = pwrite(s->fd, s->wbuf + done, s->wlen - done, off + done)) < 0) {
+      if (errno == EINTR) {
+	continue;
+      }
+      log_msg(LOG_ERR, "spill file in %s: %s", s->path, strerror(errno));
+      return (-1);
+    }
+    done += ret;
+  }
+
+  s->wlen = 0;
+  return (0);
+}
+
+
+/* spill_append - add a record at the end
+ *
+ * returns - 0 on success, -1 on error (logged; the record was not
+ *           added)
+ */
+
+int spill_append(spill_st *s, const void *rec, size_t len)
+{
+  if (len > SPILL_REC_MAX) {
+    errno = EMSGSIZE;
+    return (-1);
+  }
+
+  if (s->wlen + 2 + len > SPILL_BUF && flush(s) < 0) {
+    return (-1);
+  }
+
+  s->wbuf[s->wlen] = len >> 8;
+  s->wbuf[s->wlen + 1] = len & 0xff;
+  memcpy(s->wbuf + s->wlen + 2, rec, len);
+  s->wlen += 2 + len;
+  s->wpos += 2 + len;
+  s->records++;
+
+  return (0);
+}
+
+
+/* spill_next - take the oldest record
+ *
+ * rec - OUT - the record, cap bytes at most (SPILL_REC_MAX always
+ *             fits)
+ *
+ * returns - its length, 0 if there are none, -1 on error (logged)
+ */
+
+ssize_t spill_next(spill_st *s, void *rec, size_t cap)
+{
+  size_t len;
+  ssize_t ret;
+  off_t off;
+
+  if (!s->records) {
+    return (0);
+  }
+
+  // less than a whole record buffered: read on, which may first need
+  // what is still in the append buffer to be in the file
+  while (s->rlen - s->roff < 2 ||
+	 s->rlen - s->roff < 2 + (((size_t)(unsigned char)s->rbuf[s->roff] << 8) |
+				  (unsigned char)s->rbuf[s->roff + 1])) {
+    memmove(s->rbuf, s->rbuf + s->roff, s->rlen - s->roff);
+    s->rlen -= s->roff;
+    s->roff = 0;
+
+    if (s->wlen && flush(s) < 0) {
+      return (-1);
+    }
+    off = s->rpos + s->rlen - s->base;
+    if ((ret = pread(s->fd, s->rbuf + s->rlen, SPILL_BUF - s->rlen, off)) <= 0) {
+      if (ret < 0 && errno == EINTR) {
+	continue;
+      }
+      log_msg(LOG_ERR, "spill file in %s: %s", s->path, ret < 0 ? strerror(errno) :
+	      "truncated");
+      return (-1);
+    }
+    s->rlen += ret;
+  }
+
+  len = ((size_t)(unsigned char)s->rbuf[s->roff] << 8) | (unsigned char)s->rbuf[s->roff + 1];
+  if (len > cap) {
+    errno = EMSGSIZE;
+    return (-1);
+  }
+  memcpy(rec, s->rbuf + s->roff + 2, len);
+  s->roff += 2 + len;
+  s->rpos += 2 + len;
+
+  // all read: start the file over
+  if (!--s->records) {
+    s->roff = s->rlen = 0;
+    s->base = s->wpos;
+    if (ftruncate(s->fd, 0) < 0) {
+      log_msg(LOG_WARNING, "spill file in %s: %s", s->path, strerror(errno));
+    }
+  }
+
+  return (len);
+}
+
+
+/* spill_bytes - how much is waiting to be read */
+uint64_t spill_bytes(spill_st *s)
+{
+  return (s ? s->wpos - s->rpos : 0);
+}
@@ -0,0 +1,87 @@
+/*
+ * spill.h
+ *
+ * Overflow File Definitions
+ * 
+ *
+ * Copyright (C) 2013  Bryant Moscon - bmoscon@gmail.com
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to 
+ * deal in the Software without restriction, including without limitation the 
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, 
+ *    this list of conditions and the following disclaimer in the documentation 
+ *    and/or other materials provided with the distribution, and in the same 
+ *    place and form as other copyright, license and disclaimer information.
+ *
+ * 3. The end-user documentation included with the redistribution, if any, must 
+ *    include the following acknowledgment: "This product includes software 
+ *    developed by Bryant Moscon (http://www.bryantmoscon.org/)", in the same 
+ *    place and form as other third-party acknowledgments. Alternately, this 
+ *    acknowledgment may appear in the software itself, in the same form and 
+ *    location as other such third-party acknowledgments.
+ *
+ * 4. Except as contained in this notice, the name of the author, Bryant Moscon,
+ *    shall not be used in advertising or otherwise to promote the sale, use or 
+ *    other dealings in this Software without prior written authorization from 
+ *    the author.
+ *
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL 
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN 
+ * THE SOFTWARE.
+ *
+ */
+
+#ifndef __SPILL__
+#define __SPILL__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+
+#define SPILL_BUF (64 * 1024)          // written and read this much at a time
+#define SPILL_REC_MAX (SPILL_BUF - 2)  // largest record
+
+
+/*
+ * A first in, first out queue of records in an unlinked temporary
+ * file. Positions count every byte ever appended, so a caller can tell
+ * whether a record went in before or after something else happened.
+ */
+typedef struct spill_st {
+  int fd;
+  char *path;              // the directory, for messages
+  uint64_t wpos;           // position of the next record appended
+  uint64_t rpos;           // ... and of the next one read
+  uint64_t base;           // position of file offset 0
+  size_t records;          // appended and not read yet
+
+  char *wbuf;              // appended, not written to the file yet
+  size_t wlen;
+  char *rbuf;              // read from the file, not taken yet
+  size_t rlen;
+  size_t roff;
+} spill_st;
+
+
+spill_st *spill_open(const char *dir);
+void spill_close(spill_st *s);
+int spill_append(spill_st *s, const void *rec, size_t len);
+ssize_t spill_next(spill_st *s, void *rec, size_t cap);
+uint64_t spill_bytes(spill_st *s);
+
+
+#endif
@@ -0,0 +1,373 @@
+/*
+ * tail.c
+ *
+ * Append-only tail replication - copies only what was added to a file
+ * 
+ *
+ * Copyright (C) 2013  Bryant Moscon - bmoscon@gmail.com
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to 
+ * deal in the Software without restriction, including without limitation the 
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, 
+ *    this list of conditions and the following disclaimer in the documentation 
+ *    and/or other materials provided with the distribution, and in the same 
+ *    place and form as other copyright, license and disclaimer information.
+ *
+ * 3. The end-user documentation included with the redistribution, if any, must 
+ *    include the following acknowledgment: "This product includes software 
+ *    developed by Bryant Moscon (http://www.bryantmoscon.org/)", in the same 
+ *    place and form as other third-party acknowledgments. Alternately, this 
+ *    acknowledgment may appear in the software itself, in the same form and 
+ *    location as other such third-party acknowledgments.
+ *
+ * 4. Except as contained in this notice, the name of the author, Bryant Moscon,
+ *    shall not be used in advertising or otherwise to promote the sale, use or 
+ *    other dealings in this Software without prior written authorization from 
+ *    the author.
+ *
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL 
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN 
+ * THE SOFTWARE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "tail.h"
+#include "replicate.h"
+#include "metadata.h"
+#include "dircache.h"
+#include "log.h"
+
+
+/*
+ * Files matching a job's TAIL rules are taken to only ever grow (logs).
+ * For each one we remember how much of it the destination has, along
+ * with the source's inode and a fingerprint of its first FP_LEN bytes.
+ * A change then only copies the bytes past that offset, straight into
+ * the destination copy.
+ *
+ * If the inode changed (rotated), the file shrank (truncated), the
+ * fingerprint does not match (rewritten) or the destination is not
+ * what we left there, the whole file is copied again instead.
+ *
+ * The table lives in memory only, the first change after a start
+ * always copies the whole file. Its paths are nodes of a path tree
+ * (see pathtree.c), which keys the map.
+ */
+
+
+#define FP_LEN 4096
+
+
+tail_table_st *tail_init(void)
+{
+  tail_table_st *t;
+
+  if (!(t = malloc(sizeof(tail_table_st)))) {
+    return (NULL);
+  }
+
+  if (!(t->map = hash_map_init(64, hash_map_int_hash, hash_map_int_cmp)) ||
+      !(t->paths = pathtree_init()) || !(t->root = pathtree_root(t->paths))) {
+    if (t->map) {
+      hash_map_free(t->map);
+    }
+    pathtree_free(t->paths);
+    free(t);
+    return (NULL);
+  }
+  pthread_mutex_init(&t->lock, NULL);
+
+  return (t);
+}
+
+
+static void free_state(void *key, void *val, void *arg)
+{
+  free(val);
+}
+
+
+/* drop ts from the table, lock held */
+static void drop(tail_table_st *t, tail_st *ts)
+{
+  hash_map_remove(t->map, (void *)(uintptr_t)ts->node);
+  pathtree_put(t->paths, ts->node);
+  free(ts);
+}
+
+
+/* the state of rel, NULL if there is none. Lock held */
+static tail_st *lookup(tail_table_st *t, const char *rel)
+{
+  uint32_t node = pathtree_find(t->paths, t->root, rel);
+
+  return (node ? hash_map_get(t->map, (void *)(uintptr_t)node) : NULL);
+}
+
+
+void tail_free(tail_table_st *t)
+{
+  if (!t) {
+    return;
+  }
+
+  hash_map_foreach(t->map, free_state, NULL);
+  hash_map_free(t->map);
+  pathtree_free(t->paths);
+  pthread_mutex_destroy(&t->lock);
+  free(t);
+}
+
+
+/* is rel replicated by tailing? */
+int tail_wanted(job_st *job, const char *rel)
+{
+  return (job->tails && filter_match(job->tail_filter, rel, 0));
+}
+
+
+/* FNV-1a over the first len bytes of fd */
+static int fingerprint(int fd, size_t len, uint64_t *fp)
+{
+  unsigned char buf[FP_LEN];
+  uint64_t hash = 14695981039346656037ULL;
+  size_t i;
+
+  if (pread(fd, buf, len, 0) != (ssize_t)len) {
+    return (-1);
+  }
+
+  for (i = 0; i < len; i++) {
+    hash ^= buf[i];
+    hash *= 1099511628211ULL;
+  }
+
+  *fp = hash;
+  return (0);
+}
+
+
+/* record what the destination now has of rel. fd is the source, or
+ * anything with the same contents, for the fingerprint. After a full
+ * copy the old fingerprint no longer holds */
+static void remember(tail_table_st *t, const char *rel, struct stat *st, off_t offset,
+		     int fd, int full)
+{
+  tail_st *ts;
+  int added = 0;
+
+  pthread_mutex_lock(&t->lock);
+  if (!(ts = lookup(t, rel))) {
+    if (!(ts = calloc(1, sizeof(tail_st))) || !(ts->node = pathtree_get(t->paths, t->root, rel))) {
+      free(ts);
+      pthread_mutex_unlock(&t->lock);
+      return;
+    }
+    added = 1;
+  }
+
+  ts->dev = st->st_dev;
+  ts->ino = st->st_ino;
+  ts->offset = offset;
+  if (full || ts->fp_len < FP_LEN) {
+    ts->fp_len = (offset < FP_LEN) ? (size_t)offset : FP_LEN;
+    if (fingerprint(fd, ts->fp_len, &ts->fp) < 0) {
+      ts->fp_len = 0;
+      ts->offset = -1;
+    }
+  }
+
+  if (added && hash_map_put(t->map, (void *)(uintptr_t)ts->node, ts) != 0) {
+    pathtree_put(t->paths, ts->node);
+    free(ts);
+  }
+  pthread_mutex_unlock(&t->lock);
+}
+
+
+/* look up rel, copying its state out */
+static int recall(tail_table_st *t, const char *rel, tail_st *out)
+{
+  tail_st *ts;
+
+  pthread_mutex_lock(&t->lock);
+  if ((ts = lookup(t, rel))) {
+    *out = *ts;
+  }
+  pthread_mutex_unlock(&t->lock);
+
+  return (ts && out->offset >= 0 ? 0 : -1);
+}
+
+
+/* tail_pending - how many bytes a copy of rel would move, given the
+ *                source's current stat
+ */
+
+off_t tail_pending(job_st *job, const char *rel, struct stat *st)
+{
+  tail_st ts;
+
+  if (tail_wanted(job, rel) && recall(job->tails, rel, &ts) == 0 &&
+      ts.ino == st->st_ino && ts.dev == st->st_dev && st->st_size >= ts.offset) {
+    return (st->st_size - ts.offset);
+  }
+  return (st->st_size);
+}
+
+
+/* copy all of rel, and remember how much that was */
+static int full_copy(job_st *job, const char *rel)
+{
+  struct stat out_st;
+  copy_st c;
+
+  if (replicate_open(job, rel, &c) < 0) {
+    tail_forget(job, rel, 0);
+    return (-1);
+  }
+
+  replicate_range(&c, 0, 0);
+  if (!c.failed && fstat(c.out_fd, &out_st) == 0) {
+    remember(job->tails, rel, &c.st, out_st.st_size, c.out_fd, 1);
+  }
+
+  if (replicate_publish(&c) < 0) {
+    tail_forget(job, rel, 0);
+    return (-1);
+  }
+  return (0);
+}
+
+
+/* tail_copy - bring job->dst/rel up to date with job->src/rel,
+ *             copying only what was appended since last time if
+ *             that is all that changed
+ *
+ * returns - 0 on success, -1 on error (logged)
+ */
+
+int tail_copy(job_st *job, const char *rel)
+{
+  struct stat out_st;
+  const char *base;
+  int dir;
+  uint64_t fp;
+  tail_st ts;
+  copy_st c;
+
+  if (recall(job->tails, rel, &ts) < 0) {
+    return (full_copy(job, rel));
+  }
+
+  c.job = job;
+  c.rel = rel;
+  c.failed = 0;
+  c.out_fd = -1;
+  // appends are small, and likely read again soon
+  c.cache = CACHE_NORMAL;
+  c.in_direct = c.out_direct = -1;
+  c.sparse = 0;
+
+  if ((dir = dir_open(job->src, rel, &base)) < 0 ||
+      (c.in_fd = openat(dir, base, O_RDONLY | O_CLOEXEC)) < 0) {
+    tail_forget(job, rel, 0);
+    return (-1);
+  }
+
+  if (fstat(c.in_fd, &c.st) < 0 || c.st.st_ino != ts.ino || c.st.st_dev != ts.dev ||
+      c.st.st_size < ts.offset ||
+      fingerprint(c.in_fd, ts.fp_len, &fp) < 0 || fp != ts.fp) {
+    goto rewritten;
+  }
+
+  // a destination with other links (a snapshot) must not be written
+  // in place, and one we did not leave like this is not to be trusted
+  if ((dir = dir_open(job->dst, rel, &base)) < 0 ||
+      (c.out_fd = openat(dir, base, O_WRONLY | O_CLOEXEC)) < 0 || fstat(c.out_fd, &out_st) < 0 ||
+      out_st.st_size != ts.offset || out_st.st_nlink > 1) {
+    goto rewritten;
+  }
+
+  if (replicate_range(&c, ts.offset, 0) < 0 || fstat(c.out_fd, &out_st) < 0 ||
+      fstat(c.in_fd, &c.st) < 0) {
+    tail_forget(job, rel, 0);
+    close(c.in_fd);
+    close(c.out_fd);
+    return (-1);
+  }
+
+  // appending moved the copy's times on
+  meta_copy(c.out_fd, -1, &c.st, rel, META_TIMES);
+
+  remember(job->tails, rel, &c.st, out_st.st_size, c.in_fd, 0);
+  close(c.in_fd);
+  close(c.out_fd);
+  return (0);
+
+ rewritten:
+  close(c.in_fd);
+  if (c.out_fd >= 0) {
+    close(c.out_fd);
+  }
+  return (full_copy(job, rel));
+}
+
+
+static void forget_if_tree(void *key, void *val, void *arg)
+{
+  tail_table_st *t = ((void **)arg)[0];
+  uint32_t top = (uint32_t)(uintptr_t)((void **)arg)[1];
+  tail_st *ts = (tail_st *)val;
+
+  if (pathtree_below(t->paths, ts->node, top)) {
+    drop(t, ts);
+  }
+}
+
+
+/* tail_forget - rel (or everything below the directory rel) is gone
+ *               or was replaced
+ */
+
+void tail_forget(job_st *job, const char *rel, int is_dir)
+{
+  tail_table_st *t = job->tails;
+  void *arg[2] = {t, NULL};
+  uint32_t top;
+  tail_st *ts;
+
+  if (!t) {
+    return;
+  }
+
+  pthread_mutex_lock(&t->lock);
+  // nothing below a path that is not in the tree
+  if (is_dir && (top = pathtree_find(t->paths, t->root, rel))) {
+    arg[1] = (void *)(uintptr_t)top;
+    hash_map_foreach(t->map, forget_if_tree, arg);
+  } else if (!is_dir && (ts = lookup(t, rel))) {
+    drop(t, ts);
+  }
+  pthread_mutex_unlock(&t->lock);
+}
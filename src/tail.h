@@ -0,0 +1,87 @@
+/*
+ * tail.h
+ *
+ * Append-only Tail Replication Definitions
+ * 
+ *
+ * Copyright (C) 2013  Bryant Moscon - bmoscon@gmail.com
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to 
+ * deal in the Software without restriction, including without limitation the 
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, 
+ *    this list of conditions and the following disclaimer in the documentation 
+ *    and/or other materials provided with the distribution, and in the same 
+ *    place and form as other copyright, license and disclaimer information.
+ *
+ * 3. The end-user documentation included with the redistribution, if any, must 
+ *    include the following acknowledgment: "This product includes software 
+ *    developed by Bryant Moscon (http://www.bryantmoscon.org/)", in the same 
+ *    place and form as other third-party acknowledgments. Alternately, this 
+ *    acknowledgment may appear in the software itself, in the same form and 
+ *    location as other such third-party acknowledgments.
+ *
+ * 4. Except as contained in this notice, the name of the author, Bryant Moscon,
+ *    shall not be used in advertising or otherwise to promote the sale, use or 
+ *    other dealings in this Software without prior written authorization from 
+ *    the author.
+ *
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL 
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN 
+ * THE SOFTWARE.
+ *
+ */
+
+#ifndef __TAIL__
+#define __TAIL__
+
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "hash_map.h"
+#include "pathtree.h"
+#include "job.h"
+
+
+/* what was last replicated of one file */
+typedef struct tail_st {
+  uint32_t node;       // its path in the table's tree, also the map key
+  dev_t dev;           // of the source file
+  ino_t ino;
+  off_t offset;        // bytes the destination has
+  size_t fp_len;       // bytes covered by fp
+  uint64_t fp;         // fingerprint of the start of the file
+} tail_st;
+
+
+typedef struct tail_table_st {
+  pthread_mutex_t lock;
+  hash_map_st *map;    // node -> tail_st
+  pathtree_st *paths;
+  uint32_t root;       // of the job's paths in the tree
+} tail_table_st;
+
+
+tail_table_st *tail_init(void);
+void tail_free(tail_table_st *t);
+int tail_wanted(job_st *job, const char *rel);
+off_t tail_pending(job_st *job, const char *rel, struct stat *st);
+int tail_copy(job_st *job, const char *rel);
+void tail_forget(job_st *job, const char *rel, int is_dir);
+
+
+#endif
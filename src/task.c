@@ -0,0 +1,517 @@
+/*
+ * task.c
+ *
+ * Background tasks - whole subtree operations that would stall the event loop
+ * 
+ *
+ * Copyright (C) 2013  Bryant Moscon - bmoscon@gmail.com
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to 
+ * deal in the Software without restriction, including without limitation the 
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, 
+ *    this list of conditions and the following disclaimer in the documentation 
+ *    and/or other materials provided with the distribution, and in the same 
+ *    place and form as other copyright, license and disclaimer information.
+ *
+ * 3. The end-user documentation included with the redistribution, if any, must 
+ *    include the following acknowledgment: "This product includes software 
+ *    developed by Bryant Moscon (http://www.bryantmoscon.org/)", in the same 
+ *    place and form as other third-party acknowledgments. Alternately, this 
+ *    acknowledgment may appear in the software itself, in the same form and 
+ *    location as other such third-party acknowledgments.
+ *
+ * 4. Except as contained in this notice, the name of the author, Bryant Moscon,
+ *    shall not be used in advertising or otherwise to promote the sale, use or 
+ *    other dealings in this Software without prior written authorization from 
+ *    the author.
+ *
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL 
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN 
+ * THE SOFTWARE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "task.h"
+#include "dircache.h"
+#include "replicate.h"
+#include "sched.h"
+#include "op.h"
+#include "watch.h"
+#include "journal.h"
+#include "snapshot.h"
+#include "log.h"
+
+
+/*
+ * Removing or copying a large subtree can take a long time, so those
+ * run on a background thread. A task is worked through in batches of
+ * TASK_BATCH entries, after which it goes to the back of the queue,
+ * so one huge tree does not hold up everything else. The walk state
+ * (a stack of open directories) lives in the task between batches.
+ */
+
+
+#define TASK_BATCH 256
+
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ready = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t drained = PTHREAD_COND_INITIALIZER;
+static task_st *head = NULL;
+static task_st *tail = NULL;
+static unsigned int pending = 0;  // tasks queued or running
+static int epoch = 0;             // of new tasks, like sched_barrier's
+static unsigned int epoch_pending[2];
+
+
+static void enqueue(task_st *task)
+{
+  pthread_mutex_lock(&lock);
+  task->next = NULL;
+  if (tail) {
+    tail->next = task;
+  } else {
+    head = task;
+  }
+  tail = task;
+  pthread_cond_signal(&ready);
+  pthread_mutex_unlock(&lock);
+}
+
+
+static task_st *dequeue(void)
+{
+  task_st *task;
+
+  pthread_mutex_lock(&lock);
+  while (!head) {
+    pthread_cond_wait(&ready, &lock);
+  }
+  task = head;
+  head = task->next;
+  if (!head) {
+    tail = NULL;
+  }
+  pthread_mutex_unlock(&lock);
+
+  return (task);
+}
+
+
+static int push(task_st *task, const char *rel)
+{
+  task_frame_st *f;
+
+  if (!(f = calloc(1, sizeof(task_frame_st))) || !(f->rel = strdup(rel))) {
+    free(f);
+    return (-1);
+  }
+
+  f->next = task->stack;
+  task->stack = f;
+  return (0);
+}
+
+
+static void pop(task_st *task)
+{
+  task_frame_st *f = task->stack;
+
+  task->stack = f->next;
+  if (f->dir) {
+    closedir(f->dir);
+  }
+  free(f->rel);
+  free(f);
+}
+
+
+static void task_free(task_st *task)
+{
+  while (task->stack) {
+    pop(task);
+  }
+  journal_done(task->seq);
+  if (task->job) {
+    job_release(task->job);
+  }
+  free(task->root);
+
+  pthread_mutex_lock(&lock);
+  if (!--epoch_pending[task->epoch]) {
+    pthread_cond_broadcast(&drained);
+  }
+  pthread_mutex_unlock(&lock);
+
+  free(task);
+  __atomic_sub_fetch(&pending, 1, __ATOMIC_RELEASE);
+}
+
+
+static task_st *task_new(task_type type, job_st *job, const char *root, uint64_t seq)
+{
+  task_st *task;
+
+  if (!(task = calloc(1, sizeof(task_st))) || !(task->root = strdup(root))) {
+    free(task);
+    return (NULL);
+  }
+
+  __atomic_add_fetch(&pending, 1, __ATOMIC_RELAXED);
+  pthread_mutex_lock(&lock);
+  task->epoch = epoch;
+  epoch_pending[epoch]++;
+  pthread_mutex_unlock(&lock);
+  task->type = type;
+  task->seq = seq;
+  if (job) {
+    job_hold(job);
+    task->job = job;
+  }
+
+  return (task);
+}
+
+
+/* the directory the top frame's rel is relative to */
+static const char *frame_root(task_st *task)
+{
+  if (task->type == TASK_REMOVE) {
+    return (task->root);
+  }
+  if (task->type == TASK_SNAPSHOT) {
+    return (task->job->dst);
+  }
+  return (task->job->src);
+}
+
+
+/* open the top frame's directory for reading */
+static DIR *frame_open(task_st *task)
+{
+  int fd = dir_get(frame_root(task), task->stack->rel);
+  DIR *dir;
+
+  if (fd < 0 || (fd = openat(fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+    return (NULL);
+  }
+  if (!(dir = fdopendir(fd))) {
+    close(fd);
+  }
+  return (dir);
+}
+
+
+/* link one entry of the destination into the snapshot */
+static void snap_entry(task_st *task, task_frame_st *f, struct dirent *ent)
+{
+  const char *base;
+  struct stat st;
+  char *child;
+  int dir;
+
+  // temporary copies, removals in progress, and the snapshots themselves
+  if (strncmp(ent->d_name, ".backupd", 8) == 0) {
+    return;
+  }
+
+  if (!(child = path_join(f->rel, ent->d_name))) {
+    return;
+  }
+
+  if ((dir = dir_open(task->root, child, &base)) < 0) {
+    free(child);
+    return;
+  }
+
+  if (ent->d_type == DT_DIR || ent->d_type == DT_UNKNOWN) {
+    if (fstatat(dirfd(f->dir), ent->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0 &&
+	S_ISDIR(st.st_mode)) {
+      if (mkdirat(dir, base, st.st_mode & 07777) == 0 || errno == EEXIST) {
+	if (fchownat(dir, base, st.st_uid, st.st_gid, AT_SYMLINK_NOFOLLOW) < 0 &&
+	    errno != EPERM) {
+	  log_msg(LOG_WARNING, "chown %s/%s: %s", task->root, child, strerror(errno));
+	}
+	push(task, child);
+      }
+      free(child);
+      return;
+    }
+  }
+
+  if (linkat(dirfd(f->dir), ent->d_name, dir, base, 0) < 0 && errno != EEXIST &&
+      errno != ENOENT) {
+    log_msg(LOG_WARNING, "link %s/%s: %s", task->root, child, strerror(errno));
+  }
+  free(child);
+}
+
+
+/* remove the top frame's (now empty) directory */
+static void frame_rmdir(task_st *task)
+{
+  const char *rel = task->stack->rel;
+  const char *base;
+  int dir;
+
+  if ((dir = dir_open(task->root, rel, &base)) >= 0 &&
+      unlinkat(dir, base, AT_REMOVEDIR) < 0 && errno != ENOENT) {
+    log_msg(LOG_WARNING, "rmdir %s/%s: %s", task->root, rel, strerror(errno));
+  }
+  dir_forget(task->root, rel);
+}
+
+
+/* populate_copy - journal a copy of a file found below a populated
+ *                 directory and hand it to the scheduler, like any
+ *                 other. Only the walk and the mkdirs are done here.
+ *                 The copy can be done before a sync writes it out,
+ *                 the populate op is not done until the walk is, so
+ *                 a crash replays the walk instead
+ */
+
+static void populate_copy(job_st *job, const char *rel)
+{
+  op_st *op;
+
+  if (!(op = op_new(OP_COPY, job, rel, NULL, 0))) {
+    replicate_copy(job, rel);
+    return;
+  }
+  journal_append(op);
+  sched_submit(op);
+}
+
+
+/* step - work through up to budget entries of the task
+ *
+ * returns - 1 once the task is complete, 0 if there is more to do
+ */
+
+static int step(task_st *task, int budget)
+{
+  struct dirent *ent;
+  task_frame_st *f;
+
+  if (task->job && job_is_stopped(task->job)) {
+    return (1);
+  }
+
+  while (budget > 0 && (f = task->stack)) {
+    if (!f->dir && !(f->dir = frame_open(task))) {
+      pop(task);
+      continue;
+    }
+
+    if (!(ent = readdir(f->dir))) {
+      if (task->type == TASK_REMOVE) {
+	frame_rmdir(task);
+      }
+      pop(task);
+      --budget;
+      continue;
+    }
+
+    if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) {
+      continue;
+    }
+    --budget;
+
+    if (task->type == TASK_SNAPSHOT) {
+      snap_entry(task, f, ent);
+    } else if (task->type == TASK_REMOVE) {
+      if (ent->d_type == DT_DIR ||
+	  (unlinkat(dirfd(f->dir), ent->d_name, 0) < 0 && errno == EISDIR)) {
+	char *child = path_join(f->rel, ent->d_name);
+
+	if (child) {
+	  push(task, child);
+	  free(child);
+	}
+      }
+    } else {
+      char *child = path_join(f->rel, ent->d_name);
+      int is_dir = (ent->d_type == DT_DIR);
+
+      if (!child) {
+	continue;
+      }
+
+      if (ent->d_type == DT_UNKNOWN) {
+	struct stat st;
+
+	is_dir = (fstatat(dirfd(f->dir), ent->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0 &&
+		  S_ISDIR(st.st_mode));
+      }
+
+      if (filter_match(task->job->filter, child, is_dir)) {
+	if (is_dir) {
+	  if (replicate_mkdir(task->job, child) == 0) {
+	    push(task, child);
+	  }
+	} else if (ent->d_type == DT_REG || ent->d_type == DT_UNKNOWN) {
+	  populate_copy(task->job, child);
+	}
+      }
+      free(child);
+    }
+  }
+
+  return (task->stack == NULL);
+}
+
+
+static void *task_main(void *arg)
+{
+  task_st *task;
+
+  while (1) {
+    task = dequeue();
+
+    if (step(task, TASK_BATCH)) {
+      if (task->type == TASK_SNAPSHOT && !job_is_stopped(task->job)) {
+	snapshot_finish(task->job, task->root);
+      }
+      task_free(task);
+    } else {
+      enqueue(task);
+    }
+  }
+
+  return (NULL);
+}
+
+
+int task_start(void)
+{
+  pthread_t tid;
+
+  if (pthread_create(&tid, NULL, task_main, NULL) != 0) {
+    return (-1);
+  }
+  pthread_detach(tid);
+
+  return (0);
+}
+
+
+/* task_remove - delete the tree at root/rel in the background */
+void task_remove(const char *root, const char *rel, uint64_t seq)
+{
+  task_st *task = task_new(TASK_REMOVE, NULL, root, seq);
+
+  if (!task || push(task, rel) != 0) {
+    log_msg(LOG_WARNING, "%s/%s: cannot queue removal", root, rel);
+    if (task) {
+      task_free(task);
+    }
+    return;
+  }
+
+  enqueue(task);
+}
+
+
+/* task_populate - copy everything below job->src/rel (which already
+ *                 exists in the destination): its directories are
+ *                 made in the background, its files are queued to the
+ *                 scheduler as they are found
+ */
+
+void task_populate(job_st *job, const char *rel, uint64_t seq)
+{
+  task_st *task = task_new(TASK_POPULATE, job, rel, seq);
+
+  if (!task || push(task, rel) != 0) {
+    log_msg(LOG_WARNING, "%s: cannot queue copy", rel);
+    if (task) {
+      task_free(task);
+    }
+    return;
+  }
+
+  enqueue(task);
+}
+
+
+/* task_snapshot - link everything in job->dst into dir (absolute,
+ *                 already created) in the background, then hand it
+ *                 to snapshot_finish
+ *
+ * returns - 0 if queued, -1 on error (logged)
+ */
+
+int task_snapshot(job_st *job, const char *dir)
+{
+  task_st *task = task_new(TASK_SNAPSHOT, job, dir, 0);
+
+  if (!task || push(task, "") != 0) {
+    log_msg(LOG_WARNING, "%s: cannot queue snapshot", dir);
+    if (task) {
+      task_free(task);
+    }
+    return (-1);
+  }
+
+  enqueue(task);
+  return (0);
+}
+
+
+/* task_drain - wait until every task queued so far is done */
+void task_drain(void)
+{
+  while (__atomic_load_n(&pending, __ATOMIC_ACQUIRE)) {
+    usleep(1000);
+  }
+}
+
+
+/* task_barrier - wait until every task queued so far is done, see
+ *                sched_barrier
+ */
+
+void task_barrier(void)
+{
+  static pthread_mutex_t barrier = PTHREAD_MUTEX_INITIALIZER;
+  int old;
+
+  pthread_mutex_lock(&barrier);
+  pthread_mutex_lock(&lock);
+  old = epoch;
+  epoch = !old;
+  while (epoch_pending[old]) {
+    pthread_cond_wait(&drained, &lock);
+  }
+  pthread_mutex_unlock(&lock);
+  pthread_mutex_unlock(&barrier);
+}
+
+
+/* task_pending - tasks queued or running */
+unsigned int task_pending(void)
+{
+  return (__atomic_load_n(&pending, __ATOMIC_RELAXED));
+}
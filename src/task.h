@@ -0,0 +1,94 @@
+/*
+ * task.h
+ *
+ * Background Task Definitions
+ * 
+ *
+ * Copyright (C) 2013  Bryant Moscon - bmoscon@gmail.com
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to 
+ * deal in the Software without restriction, including without limitation the 
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, 
+ *    this list of conditions and the following disclaimer in the documentation 
+ *    and/or other materials provided with the distribution, and in the same 
+ *    place and form as other copyright, license and disclaimer information.
+ *
+ * 3. The end-user documentation included with the redistribution, if any, must 
+ *    include the following acknowledgment: "This product includes software 
+ *    developed by Bryant Moscon (http://www.bryantmoscon.org/)", in the same 
+ *    place and form as other third-party acknowledgments. Alternately, this 
+ *    acknowledgment may appear in the software itself, in the same form and 
+ *    location as other such third-party acknowledgments.
+ *
+ * 4. Except as contained in this notice, the name of the author, Bryant Moscon,
+ *    shall not be used in advertising or otherwise to promote the sale, use or 
+ *    other dealings in this Software without prior written authorization from 
+ *    the author.
+ *
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL 
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN 
+ * THE SOFTWARE.
+ *
+ */
+
+#ifndef __TASK__
+#define __TASK__
+
+#include <stdint.h>
+#include <dirent.h>
+
+#include "job.h"
+
+
+typedef enum task_type {
+  TASK_REMOVE,      // delete a whole tree
+  TASK_POPULATE,    // copy a whole source subtree to the destination
+  TASK_SNAPSHOT     // hard link the whole destination into a snapshot
+} task_type;
+
+
+typedef struct task_frame_st {
+  char *rel;        // directory, relative to the task's root
+  DIR *dir;         // open while its entries are being worked through
+
+  struct task_frame_st *next;
+} task_frame_st;
+
+
+typedef struct task_st {
+  task_type type;
+  job_st *job;      // TASK_POPULATE and TASK_SNAPSHOT only
+  char *root;       // absolute path the frames are relative to (TASK_REMOVE),
+		    // the snapshot being built (TASK_SNAPSHOT) or job
+		    // relative (TASK_POPULATE)
+  task_frame_st *stack;
+  uint64_t seq;     // journal sequence number of the op this carries out
+  int epoch;        // see task_barrier
+
+  struct task_st *next;
+} task_st;
+
+
+int task_start(void);
+void task_remove(const char *root, const char *rel, uint64_t seq);
+void task_populate(job_st *job, const char *rel, uint64_t seq);
+int task_snapshot(job_st *job, const char *dir);
+void task_drain(void);
+void task_barrier(void);
+unsigned int task_pending(void);
+
+
+#endif
@@ -0,0 +1,552 @@
+/*
+ * trace.c
+ *
+ * Recording and replaying event traces
+ * 
+ *
+ * Copyright (C) 2013  Bryant Moscon - bmoscon@gmail.com
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to 
+ * deal in the Software without restriction, including without limitation the 
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, 
+ *    this list of conditions and the following disclaimer in the documentation 
+ *    and/or other materials provided with the distribution, and in the same 
+ *    place and form as other copyright, license and disclaimer information.
+ *
+ * 3. The end-user documentation included with the redistribution, if any, must 
+ *    include the following acknowledgment: "This product includes software 
+ *    developed by Bryant Moscon (http://www.bryantmoscon.org/)", in the same 
+ *    place and form as other third-party acknowledgments. Alternately, this 
+ *    acknowledgment may appear in the software itself, in the same form and 
+ *    location as other such third-party acknowledgments.
+ *
+ * 4. Except as contained in this notice, the name of the author, Bryant Moscon,
+ *    shall not be used in advertising or otherwise to promote the sale, use or 
+ *    other dealings in this Software without prior written authorization from 
+ *    the author.
+ *
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL 
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN 
+ * THE SOFTWARE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+
+#include "trace.h"
+#include "dircache.h"
+
+
+/*
+ * A trace is TRACE_MAGIC followed by records, each a type byte and a
+ * few LEB128 varints:
+ *
+ *   'J' index, length, name         - names job index for what follows
+ *   'E' delta, mask, cookie, job, arg, length, path
+ *                                   - an event, as handle_change saw it
+ *   'F' delta                       - the events since the last 'F'
+ *                                     were applied as one batch
+ *
+ * delta is the time in microseconds since the previous record. Paths
+ * are relative to the job's source, so a trace can be replayed into
+ * any tree (see trace_apply).
+ */
+
+
+static uint64_t now_us(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+}
+
+
+static void put_varint(FILE *fp, uint64_t val)
+{
+  while (val >= 0x80) {
+    putc((int)(val & 0x7f) | 0x80, fp);
+    val >>= 7;
+  }
+  putc((int)val, fp);
+}
+
+
+static int get_varint(FILE *fp, uint64_t *val)
+{
+  int shift = 0;
+  int c;
+
+  *val = 0;
+  do {
+    if ((c = getc(fp)) == EOF || shift > 63) {
+      return (-1);
+    }
+    *val |= (uint64_t)(c & 0x7f) << shift;
+    shift += 7;
+  } while (c & 0x80);
+
+  return (0);
+}
+
+
+static void put_str(FILE *fp, const char *str)
+{
+  size_t len = strlen(str);
+
+  put_varint(fp, len);
+  fwrite(str, 1, len, fp);
+}
+
+
+static trace_st *trace_new(const char *file, const char *mode)
+{
+  trace_st *t;
+
+  if (!(t = calloc(1, sizeof(trace_st)))) {
+    return (NULL);
+  }
+
+  if (!(t->fp = fopen(file, mode))) {
+    free(t);
+    return (NULL);
+  }
+
+  return (t);
+}
+
+
+/* trace_create - start writing a trace to file (replacing it)
+ *
+ * returns - the trace, or NULL with errno set
+ */
+
+trace_st *trace_create(const char *file)
+{
+  trace_st *t = trace_new(file, "w");
+
+  if (!t) {
+    return (NULL);
+  }
+
+  fputs(TRACE_MAGIC, t->fp);
+  t->start_us = t->last_us = now_us();
+  return (t);
+}
+
+
+/* trace_open - open a trace for trace_next
+ *
+ * returns - the trace, or NULL with errno set (EINVAL if it is not one)
+ */
+
+trace_st *trace_open(const char *file)
+{
+  char magic[sizeof(TRACE_MAGIC) - 1];
+  trace_st *t = trace_new(file, "r");
+
+  if (!t) {
+    return (NULL);
+  }
+
+  if (fread(magic, 1, sizeof(magic), t->fp) != sizeof(magic) ||
+      memcmp(magic, TRACE_MAGIC, sizeof(magic)) != 0) {
+    trace_close(t);
+    errno = EINVAL;
+    return (NULL);
+  }
+
+  return (t);
+}
+
+
+void trace_close(trace_st *t)
+{
+  int i;
+
+  if (!t) {
+    return;
+  }
+
+  trace_flush(t);
+  fclose(t->fp);
+  for (i = 0; i < t->njobs; i++) {
+    free(t->jobs[i]);
+  }
+  free(t->jobs);
+  free(t->path);
+  free(t->from);
+  free(t);
+}
+
+
+/* the index of job in the trace, added (and written out) if new */
+static int job_index(trace_st *t, const char *job)
+{
+  char **jobs;
+  int i;
+
+  for (i = 0; i < t->njobs; i++) {
+    if (strcmp(t->jobs[i], job) == 0) {
+      return (i);
+    }
+  }
+
+  if (!(jobs = realloc(t->jobs, (t->njobs + 1) * sizeof(char *)))) {
+    return (-1);
+  }
+  t->jobs = jobs;
+  if (!(t->jobs[t->njobs] = strdup(job))) {
+    return (-1);
+  }
+
+  putc('J', t->fp);
+  put_varint(t->fp, t->njobs);
+  put_str(t->fp, job);
+
+  return (t->njobs++);
+}
+
+
+static uint64_t delta(trace_st *t)
+{
+  uint64_t now = now_us();
+  uint64_t d = now - t->last_us;
+
+  t->last_us = now;
+  return (d);
+}
+
+
+/* trace_event - record an event
+ *
+ * job - IN - job name
+ * rel - IN - path relative to the job's source
+ * mask - IN - inotify mask bits
+ * cookie - IN - pairs moves
+ * arg - IN - size of the file, or its mode for IN_ATTRIB
+ *
+ * returns - 0 on success, -1 on error
+ */
+
+int trace_event(trace_st *t, const char *job, const char *rel, uint32_t mask,
+		uint32_t cookie, uint64_t arg)
+{
+  int index = job_index(t, job);
+
+  if (index < 0) {
+    return (-1);
+  }
+
+  putc('E', t->fp);
+  put_varint(t->fp, delta(t));
+  put_varint(t->fp, mask);
+  put_varint(t->fp, cookie);
+  put_varint(t->fp, index);
+  put_varint(t->fp, arg);
+  put_str(t->fp, rel);
+
+  t->pending++;
+  return (ferror(t->fp) ? -1 : 0);
+}
+
+
+/* trace_flush - mark the end of a batch, if there were any events
+ *               since the last one, and push it all out to the file
+ */
+
+int trace_flush(trace_st *t)
+{
+  if (!t->pending) {
+    return (0);
+  }
+
+  putc('F', t->fp);
+  put_varint(t->fp, delta(t));
+  t->pending = 0;
+
+  return (fflush(t->fp) == 0 ? 0 : -1);
+}
+
+
+/* trace_next - read the next event or batch mark. rec points into t
+ *              until the next call
+ *
+ * returns - 1 for a record, 0 at the end, -1 if the trace is corrupt
+ */
+
+int trace_next(trace_st *t, trace_rec_st *rec)
+{
+  uint64_t index, len, val;
+  char **jobs;
+  int type;
+
+  while ((type = getc(t->fp)) == 'J') {
+    if (get_varint(t->fp, &index) < 0 || index != (uint64_t)t->njobs ||
+	get_varint(t->fp, &len) < 0 || len > 4096 ||
+	!(jobs = realloc(t->jobs, (t->njobs + 1) * sizeof(char *)))) {
+      return (-1);
+    }
+    t->jobs = jobs;
+    if (!(t->jobs[t->njobs] = malloc(len + 1)) ||
+	fread(t->jobs[t->njobs], 1, len, t->fp) != len) {
+      free(t->jobs[t->njobs]);
+      return (-1);
+    }
+    t->jobs[t->njobs++][len] = '\0';
+  }
+
+  if (type == EOF) {
+    return (0);
+  }
+
+  memset(rec, 0, sizeof(trace_rec_st));
+  if (get_varint(t->fp, &val) < 0) {
+    return (-1);
+  }
+  t->last_us += val;
+  rec->time_us = t->last_us;
+
+  if (type == 'F') {
+    rec->type = TRACE_FLUSH;
+    return (1);
+  }
+  if (type != 'E') {
+    return (-1);
+  }
+
+  rec->type = TRACE_EVENT;
+  if (get_varint(t->fp, &val) < 0) {
+    return (-1);
+  }
+  rec->mask = val;
+  if (get_varint(t->fp, &val) < 0) {
+    return (-1);
+  }
+  rec->cookie = val;
+  if (get_varint(t->fp, &index) < 0 || index >= (uint64_t)t->njobs ||
+      get_varint(t->fp, &rec->arg) < 0 || get_varint(t->fp, &len) < 0) {
+    return (-1);
+  }
+  rec->job = t->jobs[index];
+
+  if (len + 1 > t->cap) {
+    char *path = realloc(t->path, len + 1);
+
+    if (!path) {
+      return (-1);
+    }
+    t->path = path;
+    t->cap = len + 1;
+  }
+  if (fread(t->path, 1, len, t->fp) != len) {
+    return (-1);
+  }
+  t->path[len] = '\0';
+  rec->path = t->path;
+
+  return (1);
+}
+
+
+/* remove name in dir, and everything below it */
+static void remove_all(int dir, const char *name)
+{
+  struct dirent *ent;
+  DIR *d;
+  int fd;
+
+  if (unlinkat(dir, name, 0) == 0 || (errno != EISDIR && errno != EPERM)) {
+    return;
+  }
+
+  if ((fd = openat(dir, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)) >= 0) {
+    if ((d = fdopendir(fd))) {
+      while ((ent = readdir(d))) {
+	if (strcmp(ent->d_name, ".") != 0 && strcmp(ent->d_name, "..") != 0) {
+	  remove_all(dirfd(d), ent->d_name);
+	}
+      }
+      closedir(d);
+    } else {
+      close(fd);
+    }
+  }
+  unlinkat(dir, name, AT_REMOVEDIR);
+}
+
+
+/* bring job->src/rel to size bytes: appended to, truncated, or (at
+ * the same size) its start rewritten */
+static int write_size(job_st *job, const char *rel, uint64_t size)
+{
+  static char fill[65536];
+  const char *base;
+  struct stat st;
+  uint64_t off;
+  int dir, fd;
+  int ret = 0;
+
+  if (!fill[0]) {
+    memset(fill, 'x', sizeof(fill));
+  }
+
+  if ((dir = dir_open(job->src, rel, &base)) < 0 ||
+      (fd = openat(dir, base, O_WRONLY | O_CREAT | O_CLOEXEC, 0644)) < 0) {
+    return (-1);
+  }
+
+  if (fstat(fd, &st) < 0) {
+    close(fd);
+    return (-1);
+  }
+
+  if (size < (uint64_t)st.st_size) {
+    ret = ftruncate(fd, size);
+  } else if (size == (uint64_t)st.st_size) {
+    ret = (pwrite(fd, fill, size < 4096 ? size : 4096, 0) < 0) ? -1 : 0;
+  }
+  for (off = st.st_size; ret == 0 && off < size; ) {
+    size_t len = (size - off < sizeof(fill)) ? size - off : sizeof(fill);
+    ssize_t result = pwrite(fd, fill, len, off);
+
+    if (result <= 0) {
+      ret = -1;
+      break;
+    }
+    off += result;
+  }
+
+  close(fd);
+  return (ret);
+}
+
+
+/* remove job->src/rel, whatever it is */
+static void remove_path(job_st *job, const char *rel)
+{
+  const char *base;
+  int dir;
+
+  if ((dir = dir_open(job->src, rel, &base)) >= 0) {
+    remove_all(dir, base);
+    dir_invalidate();
+  }
+}
+
+
+/* trace_apply - make the change rec describes to job->src (a scratch
+ *               copy of the traced tree), ahead of feeding it to the
+ *               monitor. Files get the traced sizes, not the contents.
+ *               Moves are made on their IN_MOVED_TO, an IN_MOVED_FROM
+ *               without one was moved out of the tree and is removed
+ *
+ * returns - 0 on success, -1 if the change could not be made
+ */
+
+int trace_apply(trace_st *t, job_st *job, trace_rec_st *rec)
+{
+  int is_dir = (rec->mask & IN_ISDIR) != 0;
+  const char *base;
+  int ret = 0;
+  int dir;
+
+  if (t->from && !((rec->mask & IN_MOVED_TO) && rec->cookie == t->from_cookie)) {
+    remove_path(t->from_job, t->from);
+    free(t->from);
+    t->from = NULL;
+  }
+
+  switch (rec->mask & ~IN_ISDIR) {
+  case IN_CREATE:
+    if (!is_dir) {
+      return (write_size(job, rec->path, rec->arg));
+    }
+    if ((dir = dir_open(job->src, rec->path, &base)) < 0 ||
+	(mkdirat(dir, base, 0755) < 0 && errno != EEXIST)) {
+      ret = -1;
+    }
+    break;
+
+  case IN_MODIFY:
+    return (write_size(job, rec->path, rec->arg));
+
+  case IN_DELETE:
+    remove_path(job, rec->path);
+    break;
+
+  case IN_ATTRIB:
+    if ((dir = dir_open(job->src, rec->path, &base)) < 0 ||
+	fchmodat(dir, base, rec->arg & 07777, 0) < 0) {
+      ret = -1;
+    }
+    break;
+
+  case IN_MOVED_FROM:
+    free(t->from);
+    if (!(t->from = strdup(rec->path))) {
+      return (-1);
+    }
+    t->from_job = job;
+    t->from_cookie = rec->cookie;
+    break;
+
+  case IN_MOVED_TO:
+    if (t->from) {
+      const char *from_base;
+      int from_dir;
+
+      if ((from_dir = dir_open(t->from_job->src, t->from, &from_base)) < 0 ||
+	  (from_dir = fcntl(from_dir, F_DUPFD_CLOEXEC, 0)) < 0) {
+	ret = -1;
+      } else {
+	if ((dir = dir_open(job->src, rec->path, &base)) < 0 ||
+	    renameat(from_dir, from_base, dir, base) < 0) {
+	  ret = -1;
+	}
+	close(from_dir);
+      }
+      free(t->from);
+      t->from = NULL;
+      if (is_dir) {
+	dir_invalidate();
+      }
+    } else if (is_dir) {
+      // moved in from outside
+      if ((dir = dir_open(job->src, rec->path, &base)) < 0 ||
+	  (mkdirat(dir, base, 0755) < 0 && errno != EEXIST)) {
+	ret = -1;
+      }
+    } else {
+      ret = write_size(job, rec->path, rec->arg);
+    }
+    break;
+
+  default:
+    break;
+  }
+
+  return (ret);
+}
@@ -0,0 +1,105 @@
+/*
+ * trace.h
+ *
+ * Event Trace Definitions
+ * 
+ *
+ * Copyright (C) 2013  Bryant Moscon - bmoscon@gmail.com
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to 
+ * deal in the Software without restriction, including without limitation the 
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, 
+ *    this list of conditions and the following disclaimer in the documentation 
+ *    and/or other materials provided with the distribution, and in the same 
+ *    place and form as other copyright, license and disclaimer information.
+ *
+ * 3. The end-user documentation included with the redistribution, if any, must 
+ *    include the following acknowledgment: "This product includes software 
+ *    developed by Bryant Moscon (http://www.bryantmoscon.org/)", in the same 
+ *    place and form as other third-party acknowledgments. Alternately, this 
+ *    acknowledgment may appear in the software itself, in the same form and 
+ *    location as other such third-party acknowledgments.
+ *
+ * 4. Except as contained in this notice, the name of the author, Bryant Moscon,
+ *    shall not be used in advertising or otherwise to promote the sale, use or 
+ *    other dealings in this Software without prior written authorization from 
+ *    the author.
+ *
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL 
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN 
+ * THE SOFTWARE.
+ *
+ */
+
+#ifndef __TRACE__
+#define __TRACE__
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "job.h"
+
+
+#define TRACE_MAGIC "BKDTRC1\n"
+
+
+typedef enum trace_type {
+  TRACE_EVENT,
+  TRACE_FLUSH       // the events so far were read and applied together
+} trace_type;
+
+
+/* one record, as read back by trace_next */
+typedef struct trace_rec_st {
+  trace_type type;
+  uint64_t time_us;  // since the trace started
+  const char *job;   // job name (TRACE_EVENT only, like the rest)
+  const char *path;  // relative to the job's source
+  uint32_t mask;     // inotify mask bits
+  uint32_t cookie;
+  uint64_t arg;      // file size, or the mode for IN_ATTRIB
+} trace_rec_st;
+
+
+/* a trace being written or read */
+typedef struct trace_st {
+  FILE *fp;
+  uint64_t start_us;  // CLOCK_MONOTONIC, writing
+  uint64_t last_us;   // time of the last record
+  char **jobs;        // names, by index
+  int njobs;
+  int pending;        // events since the last TRACE_FLUSH, writing
+  char *path;         // trace_rec_st.path, reading
+  size_t cap;
+
+  // a move being replayed, see trace_apply
+  char *from;
+  job_st *from_job;
+  uint32_t from_cookie;
+} trace_st;
+
+
+trace_st *trace_create(const char *file);
+trace_st *trace_open(const char *file);
+void trace_close(trace_st *t);
+int trace_event(trace_st *t, const char *job, const char *rel, uint32_t mask,
+		uint32_t cookie, uint64_t arg);
+int trace_flush(trace_st *t);
+int trace_next(trace_st *t, trace_rec_st *rec);
+int trace_apply(trace_st *t, job_st *job, trace_rec_st *rec);
+
+
+#endif
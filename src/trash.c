@@ -0,0 +1,408 @@
+/*
+ * trash.c
+ *
+ * Deletion Trash
+ * 
+ *
+ * Copyright (C) 2013  Bryant Moscon - bmoscon@gmail.com
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to 
+ * deal in the Software without restriction, including without limitation the 
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, 
+ *    this list of conditions and the following disclaimer in the documentation 
+ *    and/or other materials provided with the distribution, and in the same 
+ *    place and form as other copyright, license and disclaimer information.
+ *
+ * 3. The end-user documentation included with the redistribution, if any, must 
+ *    include the following acknowledgment: "This product includes software 
+ *    developed by Bryant Moscon (http://www.bryantmoscon.org/)", in the same 
+ *    place and form as other third-party acknowledgments. Alternately, this 
+ *    acknowledgment may appear in the software itself, in the same form and 
+ *    location as other such third-party acknowledgments.
+ *
+ * 4. Except as contained in this notice, the name of the author, Bryant Moscon,
+ *    shall not be used in advertising or otherwise to promote the sale, use or 
+ *    other dealings in this Software without prior written authorization from 
+ *    the author.
+ *
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL 
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN 
+ * THE SOFTWARE.
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "trash.h"
+#include "dircache.h"
+#include "idle.h"
+#include "log.h"
+
+
+/*
+ * With DELETE=trash, a deletion does not unlink the copy: it renames it
+ * (file or whole directory) into the destination's trash, under
+ *
+ *   <DESTINATION>/.backupd/trash/<YYYY-MM-DD_HHMM>/<path>
+ *
+ * which is one renameat() on the event thread however big the file or
+ * tree is. Within a minute a later deletion of the same path replaces
+ * the earlier one in the trash.
+ *
+ * A thread at idle I/O priority looks at the trash every TRASH_TICK
+ * seconds and purges the minutes that are over and older than the
+ * grace period (TRASH_KEEP), in batches paced to TRASH_RATE: each entry
+ * removed costs the space it took plus TRASH_ENTRY. Until then anything
+ * deleted by mistake can be taken back out of the trash by hand.
+ */
+
+
+#define TRASH_TICK   10             // seconds between looks at the trash
+#define TRASH_BATCH  256            // entries removed between budget checks
+#define TRASH_ENTRY  4096           // charged per entry, for the metadata I/O
+#define BUCKET_FMT   "%Y-%m-%d_%H%M"
+
+
+static struct {
+  pthread_mutex_t lock;
+  job_st **jobs;           // held
+  int njobs;
+  time_t keep;             // seconds
+  off_t rate;              // bytes per second
+  uint64_t next;           // usec, when the next batch may start
+  uint64_t batch;          // entries in the current batch
+  uint64_t cost;           // ... and what they cost
+  uint64_t bytes;
+  trash_stats_st stats;
+} trash = {PTHREAD_MUTEX_INITIALIZER};
+
+
+/* make the directories above path (relative to root) that are missing */
+static int make_parents(const char *root, const char *path)
+{
+  char abs[PATH_MAX];
+  char *p;
+
+  if (job_path(root, path, abs, sizeof(abs)) < 0) {
+    return (-1);
+  }
+
+  for (p = abs + strlen(root) + 1; (p = strchr(p, '/')); p++) {
+    *p = '\0';
+    if (mkdir(abs, S_IRWXU) < 0 && errno != EEXIST) {
+      return (-1);
+    }
+    *p = '/';
+  }
+  return (0);
+}
+
+
+/* trash_put - move job->dst/rel, a file or a whole tree, to the trash
+ *             instead of removing it
+ *
+ * returns - 0 if it was moved, -1 with errno set if it is to be
+ *           removed the usual way (trash off, not there, not possible)
+ */
+
+int trash_put(job_st *job, const char *rel)
+{
+  char path[PATH_MAX];
+  char bucket[32];
+  const char *from_base;
+  const char *to_base;
+  struct stat st;
+  struct tm tm;
+  time_t now;
+  int from, to;
+  int err = 0;
+
+  if (!__atomic_load_n(&trash.stats.enabled, __ATOMIC_ACQUIRE) || job->remote || !*rel) {
+    errno = EOPNOTSUPP;
+    return (-1);
+  }
+
+  now = time(NULL);
+  strftime(bucket, sizeof(bucket), BUCKET_FMT, localtime_r(&now, &tm));
+  if (snprintf(path, sizeof(path), "%s/%s/%s", TRASH_DIR, bucket, rel) >= (int)sizeof(path)) {
+    errno = ENAMETOOLONG;
+    return (-1);
+  }
+
+  // our own fd, the second lookup may evict the first from the cache
+  if ((from = dir_dup(job->dst, rel, &from_base)) < 0) {
+    return (-1);
+  }
+  if (fstatat(from, from_base, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+    err = errno;
+  } else {
+    if ((to = dir_open(job->dst, path, &to_base)) < 0 && errno == ENOENT &&
+	make_parents(job->dst, path) == 0) {
+      to = dir_open(job->dst, path, &to_base);
+    }
+    if (to < 0 || renameat(from, from_base, to, to_base) < 0) {
+      err = errno;
+    }
+  }
+  close(from);
+
+  if (err) {
+    // a directory deleted earlier in the same minute is in the way
+    if (err != ENOENT && err != EEXIST && err != ENOTEMPTY && err != EISDIR &&
+	err != ENOTDIR) {
+      log_msg(LOG_WARNING, "trash %s/%s: %s, removing it", job->dst, rel, strerror(err));
+    }
+    errno = err;
+    return (-1);
+  }
+
+  if (S_ISDIR(st.st_mode)) {
+    // the cached fds below rel now have the wrong path
+    dir_invalidate();
+  }
+
+  pthread_mutex_lock(&trash.lock);
+  trash.stats.moved++;
+  pthread_mutex_unlock(&trash.lock);
+  return (0);
+}
+
+
+/* end the current batch: count it, and wait for the budget to allow it */
+static void batch_end(void)
+{
+  pthread_mutex_lock(&trash.lock);
+  trash.stats.purged += trash.batch;
+  trash.stats.bytes += trash.bytes;
+  pthread_mutex_unlock(&trash.lock);
+
+  idle_pace(&trash.next, trash.cost, trash.rate);
+  trash.batch = trash.cost = trash.bytes = 0;
+}
+
+
+static void removed(struct stat *st)
+{
+  trash.batch++;
+  trash.bytes += (uint64_t)st->st_blocks * 512;
+  trash.cost += (uint64_t)st->st_blocks * 512 + TRASH_ENTRY;
+  if (trash.batch >= TRASH_BATCH) {
+    batch_end();
+  }
+}
+
+
+/* purge - remove name from dir, with everything below it */
+static void purge(int dir, const char *name)
+{
+  struct dirent *ent;
+  struct stat st;
+  DIR *d = NULL;
+  int fd;
+
+  if (fstatat(dir, name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+    return;
+  }
+
+  if (S_ISDIR(st.st_mode)) {
+    if ((fd = openat(dir, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)) >= 0 &&
+	!(d = fdopendir(fd))) {
+      close(fd);
+    }
+    while (d && (ent = readdir(d))) {
+      if (strcmp(ent->d_name, ".") != 0 && strcmp(ent->d_name, "..") != 0) {
+	purge(fd, ent->d_name);
+      }
+    }
+    if (d) {
+      closedir(d);
+    }
+  }
+
+  if (unlinkat(dir, name, S_ISDIR(st.st_mode) ? AT_REMOVEDIR : 0) < 0) {
+    if (errno != ENOENT) {
+      log_msg(LOG_WARNING, "trash: cannot remove %s: %s", name, strerror(errno));
+    }
+    return;
+  }
+  removed(&st);
+}
+
+
+/* reap - purge the minutes of a job's trash that are past the grace
+ *        period, oldest first as they come
+ */
+
+static void reap(job_st *job)
+{
+  char path[PATH_MAX];
+  struct dirent *ent;
+  struct tm tm;
+  time_t now = time(NULL);
+  time_t at;
+  char *end;
+  DIR *d;
+
+  if (job_path(job->dst, TRASH_DIR, path, sizeof(path)) < 0 || !(d = opendir(path))) {
+    return;
+  }
+
+  while ((ent = readdir(d)) && !job_is_stopped(job)) {
+    memset(&tm, 0, sizeof(tm));
+    if (!(end = strptime(ent->d_name, BUCKET_FMT, &tm)) || *end) {
+      // not ours
+      continue;
+    }
+    tm.tm_isdst = -1;
+    if ((at = mktime(&tm)) < 0 || at + 60 + trash.keep > now) {
+      continue;
+    }
+    purge(dirfd(d), ent->d_name);
+  }
+  closedir(d);
+
+  if (trash.batch) {
+    batch_end();
+  }
+}
+
+
+static void *trash_main(void *arg)
+{
+  job_st **jobs;
+  int n, i;
+
+  idle_thread();
+
+  while (1) {
+    pthread_mutex_lock(&trash.lock);
+    n = trash.njobs;
+    if ((jobs = malloc((n + 1) * sizeof(job_st *)))) {
+      for (i = 0; i < n; i++) {
+	jobs[i] = trash.jobs[i];
+	job_hold(jobs[i]);
+      }
+    } else {
+      n = 0;
+    }
+    pthread_mutex_unlock(&trash.lock);
+
+    for (i = 0; i < n; i++) {
+      if (!job_is_stopped(jobs[i])) {
+	reap(jobs[i]);
+      }
+      job_release(jobs[i]);
+    }
+    free(jobs);
+
+    sleep(TRASH_TICK);
+  }
+
+  return (NULL);
+}
+
+
+/* trash_start - move deletions to the trash from now on, and start the
+ *               thread that empties it
+ *
+ * keep - IN - seconds deletions stay in the trash, at least
+ * rate - IN - bytes removed per second, at most
+ * jobs - IN - whose trash to empty, until trash_jobs says otherwise
+ *
+ * returns - 0 on success, -1 on error (logged)
+ */
+
+int trash_start(time_t keep, off_t rate, job_st *jobs)
+{
+  pthread_t tid;
+
+  trash.keep = (keep > 0) ? keep : 0;
+  trash.rate = (rate > 0) ? rate : DEFAULT_TRASH_RATE;
+  trash.stats.keep = trash.keep;
+
+  __atomic_store_n(&trash.stats.enabled, 1, __ATOMIC_RELEASE);
+  trash_jobs(jobs);
+
+  if (pthread_create(&tid, NULL, trash_main, NULL) != 0) {
+    log_msg(LOG_ERR, "trash: %s", strerror(errno));
+    trash_jobs(NULL);
+    __atomic_store_n(&trash.stats.enabled, 0, __ATOMIC_RELEASE);
+    return (-1);
+  }
+  pthread_detach(tid);
+
+  return (0);
+}
+
+
+/* trash_jobs - the jobs whose trash is emptied from now on, after a
+ *              (re)load. The trash of a removed job is left as it is
+ */
+
+void trash_jobs(job_st *jobs)
+{
+  job_st **list = NULL;
+  job_st *job;
+  int n = 0, i;
+
+  pthread_mutex_lock(&trash.lock);
+  if (!trash.stats.enabled) {
+    pthread_mutex_unlock(&trash.lock);
+    return;
+  }
+
+  // a remote job's deletions are the receiver's to make
+  for (job = jobs; job; job = job->next) {
+    n += !job->remote;
+  }
+  if (n && !(list = malloc(n * sizeof(job_st *)))) {
+    pthread_mutex_unlock(&trash.lock);
+    return;
+  }
+  for (i = 0, job = jobs; job; job = job->next) {
+    if (job->remote) {
+      continue;
+    }
+    job_hold(job);
+    list[i++] = job;
+  }
+
+  for (i = 0; i < trash.njobs; i++) {
+    job_release(trash.jobs[i]);
+  }
+  free(trash.jobs);
+  trash.jobs = list;
+  trash.njobs = n;
+  pthread_mutex_unlock(&trash.lock);
+}
+
+
+/* trash_stats - copy out what was moved and purged */
+void trash_stats(trash_stats_st *st)
+{
+  pthread_mutex_lock(&trash.lock);
+  *st = trash.stats;
+  pthread_mutex_unlock(&trash.lock);
+}
@@ -0,0 +1,643 @@
+/*
+ * watch.c
+ *
+ * inotify watch table - maps watch descriptors back to jobs and directories
+ * 
+ *
+ * Copyright (C) 2013  Bryant Moscon - bmoscon@gmail.com
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to 
+ * deal in the Software without restriction, including without limitation the 
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, 
+ *    this list of conditions and the following disclaimer in the documentation 
+ *    and/or other materials provided with the distribution, and in the same 
+ *    place and form as other copyright, license and disclaimer information.
+ *
+ * 3. The end-user documentation included with the redistribution, if any, must 
+ *    include the following acknowledgment: "This product includes software 
+ *    developed by Bryant Moscon (http://www.bryantmoscon.org/)", in the same 
+ *    place and form as other third-party acknowledgments. Alternately, this 
+ *    acknowledgment may appear in the software itself, in the same form and 
+ *    location as other such third-party acknowledgments.
+ *
+ * 4. Except as contained in this notice, the name of the author, Bryant Moscon,
+ *    shall not be used in advertising or otherwise to promote the sale, use or 
+ *    other dealings in this Software without prior written authorization from 
+ *    the author.
+ *
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL 
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN 
+ * THE SOFTWARE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <sys/syscall.h>
+#include <pthread.h>
+
+#include "watch.h"
+#include "dircache.h"
+#include "log.h"
+
+
+watch_table_st *watch_init(int fd, uint32_t mask)
+{
+  watch_table_st *wt;
+
+  wt = malloc(sizeof(watch_table_st));
+  if (!wt) {
+    return (NULL);
+  }
+
+  wt->fd = fd;
+  wt->mask = mask;
+  wt->map = hash_map_init(1024, hash_map_int_hash, hash_map_int_cmp);
+  wt->roots = hash_map_init(16, hash_map_int_hash, hash_map_int_cmp);
+  wt->paths = pathtree_init();
+  if (!wt->map || !wt->roots || !wt->paths) {
+    if (wt->map) {
+      hash_map_free(wt->map);
+    }
+    if (wt->roots) {
+      hash_map_free(wt->roots);
+    }
+    pathtree_free(wt->paths);
+    free(wt);
+    return (NULL);
+  }
+
+  return (wt);
+}
+
+
+static void free_watch(void *key, void *val, void *arg)
+{
+  free(val);
+}
+
+
+void watch_free(watch_table_st *wt)
+{
+  if (!wt) {
+    return;
+  }
+
+  hash_map_foreach(wt->map, free_watch, NULL);
+  hash_map_free(wt->map);
+  hash_map_free(wt->roots);
+  pathtree_free(wt->paths);
+  free(wt);
+}
+
+
+watch_st *watch_get(watch_table_st *wt, int wd)
+{
+  return (hash_map_get(wt->map, (void *)(intptr_t)wd));
+}
+
+
+/* the node job->src is in the tree, added if create */
+static uint32_t job_root(watch_table_st *wt, job_st *job, int create)
+{
+  uint32_t root = (uint32_t)(uintptr_t)hash_map_get(wt->roots, job);
+
+  if (!root && create && (root = pathtree_root(wt->paths)) &&
+      hash_map_put(wt->roots, job, (void *)(uintptr_t)root) != 0) {
+    pathtree_put(wt->paths, root);
+    root = PATHTREE_NONE;
+  }
+  return (root);
+}
+
+
+/* watch_path - the path of a watched directory
+ *
+ * wt - IN - watch table
+ * w - IN - watch
+ * name - IN - an entry in it, to join to the path, or NULL
+ *
+ * returns - the path relative to w->job->src, to be freed, or NULL if
+ *           out of memory or the directory was replaced by another
+ */
+
+char *watch_path(watch_table_st *wt, watch_st *w, const char *name)
+{
+  return (pathtree_path(wt->paths, job_root(wt, w->job, 0), w->node, name));
+}
+
+
+char *path_join(const char *dir, const char *name)
+{
+  char *ret;
+  size_t dlen = strlen(dir);
+  size_t nlen = strlen(name);
+
+  if (!dlen) {
+    return (strdup(name));
+  }
+
+  ret = malloc(dlen + nlen + 2);
+  if (!ret) {
+    return (NULL);
+  }
+
+  memcpy(ret, dir, dlen);
+  ret[dlen] = '/';
+  memcpy(ret + dlen + 1, name, nlen + 1);
+
+  return (ret);
+}
+
+
+/*
+ * Watches are added by walking the tree, which for a big tree takes
+ * long enough that things change under us. Every directory is watched
+ * before it is read, so anything done in it afterwards comes in as an
+ * event and anything done before is in the listing. When asked to, a
+ * directory that changed since the walk started is checked: entries
+ * changed since then are handed to scan->found. Writes to a file in a
+ * directory that did not otherwise change are not seen this way, nor
+ * are removals.
+ *
+ * Directories are read with getdents64, and only entries whose d_type
+ * says (or, on filesystems without d_type, a stat says) they are
+ * directories are looked at further, unless their directory is being
+ * checked. Several threads share a stack of directories still to do.
+ */
+
+
+#define SCAN_BUF      65536
+#define SCAN_PROGRESS 5       // seconds between progress messages
+#define SCAN_MAX      16      // walker threads at most
+
+
+struct linux_dirent64 {
+  ino64_t d_ino;
+  off64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+
+
+typedef struct scan_dir_st {
+  char *rel;
+  int covered;              // an ancestor was reported whole
+  struct scan_dir_st *next;
+} scan_dir_st;
+
+
+typedef struct walk_st {
+  watch_table_st *wt;
+  job_st *job;
+  watch_scan_st *scan;
+
+  pthread_mutex_t lock;     // the fields below, wt->map and scan->found
+  pthread_cond_t cond;
+  scan_dir_st *todo;
+  int busy;                 // directories queued or being worked on
+  unsigned long dirs;
+} walk_st;
+
+
+/* record watch wd of job->src/rel */
+static int remember(watch_table_st *wt, job_st *job, const char *rel, int wd)
+{
+  watch_st *w = watch_get(wt, wd);
+  uint32_t root = job_root(wt, job, 1);
+  uint32_t node = root ? pathtree_get(wt->paths, root, rel) : PATHTREE_NONE;
+
+  if (w) {
+    // the directory was already watched, under another name (it was moved)
+    if (!node) {
+      return (-1);
+    }
+    pathtree_put(wt->paths, w->node);
+    w->node = node;
+    w->job = job;
+    return (0);
+  }
+
+  w = malloc(sizeof(watch_st));
+  if (!w || !node) {
+    inotify_rm_watch(wt->fd, wd);
+    pathtree_put(wt->paths, node);
+    free(w);
+    return (-1);
+  }
+
+  w->wd = wd;
+  w->job = job;
+  w->node = node;
+  if (hash_map_put(wt->map, (void *)(intptr_t)wd, w) != 0) {
+    inotify_rm_watch(wt->fd, wd);
+    pathtree_put(wt->paths, node);
+    free(w);
+    return (-1);
+  }
+
+  return (0);
+}
+
+
+static int changed_since(struct stat *st, struct timespec *since)
+{
+  return (st->st_mtim.tv_sec > since->tv_sec ||
+	  (st->st_mtim.tv_sec == since->tv_sec && st->st_mtim.tv_nsec >= since->tv_nsec) ||
+	  st->st_ctim.tv_sec > since->tv_sec ||
+	  (st->st_ctim.tv_sec == since->tv_sec && st->st_ctim.tv_nsec >= since->tv_nsec));
+}
+
+
+/* queue rel to be walked, takes it over. Called with the lock held */
+static void walk_push(walk_st *w, char *rel, int covered)
+{
+  scan_dir_st *d = malloc(sizeof(scan_dir_st));
+
+  if (!d) {
+    free(rel);
+    return;
+  }
+  d->rel = rel;
+  d->covered = covered;
+  d->next = w->todo;
+  w->todo = d;
+  ++w->busy;
+  pthread_cond_signal(&w->cond);
+}
+
+
+/* look at one entry of a directory being walked */
+static void walk_entry(walk_st *w, scan_dir_st *d, int fd, struct linux_dirent64 *ent,
+		       int check)
+{
+  int is_dir = (ent->d_type == DT_DIR);
+  int covered = d->covered;
+  struct stat st;
+  char *child;
+
+  if (ent->d_type == DT_UNKNOWN || check) {
+    if (fstatat(fd, ent->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+      return;
+    }
+    is_dir = S_ISDIR(st.st_mode);
+  }
+
+  if ((!is_dir && !check) || !(child = path_join(d->rel, ent->d_name))) {
+    return;
+  }
+
+  // excluded directories are not watched at all
+  if (!filter_match(w->job->filter, child, is_dir)) {
+    free(child);
+    return;
+  }
+
+  pthread_mutex_lock(&w->lock);
+  if (check && changed_since(&st, &w->scan->since) && (is_dir || S_ISREG(st.st_mode))) {
+    w->scan->found(w->scan->arg, w->job, child, is_dir);
+    covered = 1;
+  }
+  if (is_dir) {
+    walk_push(w, child, covered);
+    child = NULL;
+  }
+  pthread_mutex_unlock(&w->lock);
+
+  free(child);
+}
+
+
+/* watch d, then read it
+ *
+ * returns - 0 on success, -1 if it could not be watched
+ */
+
+static int walk_dir(walk_st *w, scan_dir_st *d, char *buf)
+{
+  char proc[64];
+  struct stat st;
+  long len, pos;
+  int check;
+  int wd;
+  int fd;
+
+  if ((fd = dir_get(w->job->src, d->rel)) < 0 ||
+      (fd = openat(fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+    log_msg(LOG_WARNING, "%s/%s: %s, not watched", w->job->src, d->rel, strerror(errno));
+    return (-1);
+  }
+
+  // inotify only takes a path, the directory's fd in /proc reaches
+  // any depth without walking it again
+  snprintf(proc, sizeof(proc), "/proc/self/fd/%d", fd);
+  if ((wd = inotify_add_watch(w->wt->fd, proc, w->wt->mask)) < 0) {
+    log_msg(LOG_WARNING, "inotify_add_watch %s/%s: %s", w->job->src, d->rel,
+	    strerror(errno));
+    close(fd);
+    return (-1);
+  }
+
+  pthread_mutex_lock(&w->lock);
+  remember(w->wt, w->job, d->rel, wd);
+  ++w->dirs;
+  pthread_mutex_unlock(&w->lock);
+
+  check = (w->scan && w->scan->found && !d->covered && fstat(fd, &st) == 0 &&
+	   changed_since(&st, &w->scan->since));
+
+  while ((len = syscall(SYS_getdents64, fd, buf, SCAN_BUF)) > 0) {
+    for (pos = 0; pos < len; ) {
+      struct linux_dirent64 *ent = (struct linux_dirent64 *)(buf + pos);
+
+      pos += ent->d_reclen;
+      if (strcmp(ent->d_name, ".") != 0 && strcmp(ent->d_name, "..") != 0) {
+	walk_entry(w, d, fd, ent, check);
+      }
+    }
+  }
+
+  close(fd);
+  return (0);
+}
+
+
+/* work through the stack until the whole tree is done */
+static void walk(walk_st *w)
+{
+  scan_dir_st *d;
+  char *buf;
+
+  if (!(buf = malloc(SCAN_BUF))) {
+    return;
+  }
+
+  pthread_mutex_lock(&w->lock);
+  while (1) {
+    while (!w->todo && w->busy) {
+      pthread_cond_wait(&w->cond, &w->lock);
+    }
+    if (!(d = w->todo)) {
+      break;
+    }
+    w->todo = d->next;
+    pthread_mutex_unlock(&w->lock);
+
+    walk_dir(w, d, buf);
+    free(d->rel);
+    free(d);
+
+    pthread_mutex_lock(&w->lock);
+    if (--w->busy == 0) {
+      pthread_cond_broadcast(&w->cond);
+    }
+  }
+  pthread_mutex_unlock(&w->lock);
+
+  free(buf);
+}
+
+
+static void *walker_main(void *arg)
+{
+  walk((walk_st *)arg);
+  dir_release();
+  return (NULL);
+}
+
+
+/* wait for the walkers, saying how far they got now and then */
+static void walk_wait(walk_st *w)
+{
+  struct timespec until;
+  int ret;
+
+  pthread_mutex_lock(&w->lock);
+  while (w->busy) {
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_sec += SCAN_PROGRESS;
+    ret = 0;
+    while (w->busy && ret != ETIMEDOUT) {
+      ret = pthread_cond_timedwait(&w->cond, &w->lock, &until);
+    }
+    if (w->busy) {
+      log_msg(LOG_INFO, "job %s: %lu directories watched so far", w->job->name, w->dirs);
+    }
+  }
+  pthread_mutex_unlock(&w->lock);
+}
+
+
+/* watch_add_tree - watch job->src/rel and every directory below it
+ *
+ * wt - IN - watch table
+ * job - IN - job that owns the tree
+ * rel - IN - directory relative to job->src
+ * scan - IN/OUT - how to walk it (NULL: in this thread, no checks),
+ *                 and how long that took
+ *
+ * returns - 0 on success, -1 if the top directory could not be watched.
+ *           failures further down are logged and skipped
+ */
+
+int watch_add_tree(watch_table_st *wt, job_st *job, const char *rel, watch_scan_st *scan)
+{
+  struct timespec start, end;
+  pthread_t tids[SCAN_MAX];
+  int threads = 1;
+  int started = 0;
+  scan_dir_st top;
+  walk_st w;
+  char *buf;
+  int ret;
+
+  if (!(buf = malloc(SCAN_BUF)) || !(top.rel = strdup(rel))) {
+    free(buf);
+    return (-1);
+  }
+  top.covered = 0;
+
+  memset(&w, 0, sizeof(w));
+  w.wt = wt;
+  w.job = job;
+  w.scan = scan;
+  pthread_mutex_init(&w.lock, NULL);
+  pthread_cond_init(&w.cond, NULL);
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  // the top one here, so its failure can be told apart
+  if ((ret = walk_dir(&w, &top, buf)) == 0) {
+    if (scan) {
+      threads = scan->threads > 0 ? scan->threads : (int)sysconf(_SC_NPROCESSORS_ONLN);
+      threads = threads < 1 ? 1 : (threads > SCAN_MAX ? SCAN_MAX : threads);
+    }
+
+    if (threads > 1) {
+      for (started = 0; started < threads; started++) {
+	if (pthread_create(&tids[started], NULL, walker_main, &w) != 0) {
+	  break;
+	}
+      }
+    }
+
+    if (started) {
+      walk_wait(&w);
+      while (started--) {
+	pthread_join(tids[started], NULL);
+      }
+    } else {
+      walk(&w);
+    }
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  if (scan) {
+    scan->dirs = w.dirs;
+    scan->seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  }
+
+  pthread_mutex_destroy(&w.lock);
+  pthread_cond_destroy(&w.cond);
+  free(top.rel);
+  free(buf);
+  return (ret);
+}
+
+
+/* watch_adopt - record a watch the fd already has, handed over by the
+ *               daemon this one replaces
+ *
+ * returns - 0 on success, -1 if out of memory (the watch is removed)
+ */
+
+int watch_adopt(watch_table_st *wt, job_st *job, const char *rel, int wd)
+{
+  return (remember(wt, job, rel, wd));
+}
+
+
+/* watch_forget - drop a watch the kernel already removed (IN_IGNORED) */
+void watch_forget(watch_table_st *wt, int wd)
+{
+  watch_st *w = hash_map_remove(wt->map, (void *)(intptr_t)wd);
+
+  if (w) {
+    pathtree_put(wt->paths, w->node);
+    free(w);
+  }
+}
+
+
+static void remove_if_job(void *key, void *val, void *arg)
+{
+  watch_table_st *wt = ((void **)arg)[0];
+  job_st *job = ((void **)arg)[1];
+  watch_st *w = (watch_st *)val;
+
+  if (w->job == job) {
+    inotify_rm_watch(wt->fd, w->wd);
+    watch_forget(wt, w->wd);
+  }
+}
+
+
+void watch_remove_job(watch_table_st *wt, job_st *job)
+{
+  void *arg[2] = {wt, job};
+  uint32_t root;
+
+  hash_map_foreach(wt->map, remove_if_job, arg);
+  if ((root = (uint32_t)(uintptr_t)hash_map_remove(wt->roots, job))) {
+    pathtree_put(wt->paths, root);
+  }
+}
+
+
+/* is path rel itself, or below it? */
+int path_in_tree(const char *path, const char *rel)
+{
+  size_t len = strlen(rel);
+
+  return (strncmp(path, rel, len) == 0 && (path[len] == '\0' || path[len] == '/'));
+}
+
+
+typedef struct tree_arg_st {
+  watch_table_st *wt;
+  job_st *job;
+  uint32_t top;
+} tree_arg_st;
+
+
+static void remove_if_tree(void *key, void *val, void *arg)
+{
+  tree_arg_st *t = (tree_arg_st *)arg;
+  watch_st *w = (watch_st *)val;
+
+  if (w->job == t->job && pathtree_below(t->wt->paths, w->node, t->top)) {
+    inotify_rm_watch(t->wt->fd, w->wd);
+    watch_forget(t->wt, w->wd);
+  }
+}
+
+
+/* watch_remove_tree - stop watching rel and everything below it (it
+ *                     was moved out of the job's tree)
+ */
+
+void watch_remove_tree(watch_table_st *wt, job_st *job, const char *rel)
+{
+  uint32_t root = job_root(wt, job, 0);
+  tree_arg_st arg = {wt, job, PATHTREE_NONE};
+
+  // held, so the last watch below it going does not free it meanwhile
+  if (!root || !pathtree_find(wt->paths, root, rel) ||
+      !(arg.top = pathtree_get(wt->paths, root, rel))) {
+    return;
+  }
+  hash_map_foreach(wt->map, remove_if_tree, &arg);
+  pathtree_put(wt->paths, arg.top);
+}
+
+
+/* watch_rename_tree - a watched directory was renamed from one path
+ *                     to another, the watches themselves stay valid.
+ *                     Their paths are kept as a tree, so moving the
+ *                     directory's node moves everything below it
+ */
+
+void watch_rename_tree(watch_table_st *wt, job_st *job, const char *from, const char *to)
+{
+  uint32_t root = job_root(wt, job, 0);
+  uint32_t node;
+
+  if (!root || !(node = pathtree_find(wt->paths, root, from))) {
+    return;
+  }
+  if (pathtree_move(wt->paths, node, root, to) < 0) {
+    log_msg(LOG_WARNING, "job %s: %s -> %s: %s, watches below it keep the old path",
+	    job->name, from, to, strerror(errno));
+  }
+}
@@ -0,0 +1,104 @@
+/*
+ * watch.h
+ *
+ * inotify Watch Table Definitions
+ * 
+ *
+ * Copyright (C) 2013  Bryant Moscon - bmoscon@gmail.com
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to 
+ * deal in the Software without restriction, including without limitation the 
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, 
+ *    this list of conditions and the following disclaimer in the documentation 
+ *    and/or other materials provided with the distribution, and in the same 
+ *    place and form as other copyright, license and disclaimer information.
+ *
+ * 3. The end-user documentation included with the redistribution, if any, must 
+ *    include the following acknowledgment: "This product includes software 
+ *    developed by Bryant Moscon (http://www.bryantmoscon.org/)", in the same 
+ *    place and form as other third-party acknowledgments. Alternately, this 
+ *    acknowledgment may appear in the software itself, in the same form and 
+ *    location as other such third-party acknowledgments.
+ *
+ * 4. Except as contained in this notice, the name of the author, Bryant Moscon,
+ *    shall not be used in advertising or otherwise to promote the sale, use or 
+ *    other dealings in this Software without prior written authorization from 
+ *    the author.
+ *
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL 
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN 
+ * THE SOFTWARE.
+ *
+ */
+
+#ifndef __WATCH__
+#define __WATCH__
+
+#include <stdint.h>
+#include <time.h>
+
+#include "hash_map.h"
+#include "pathtree.h"
+#include "job.h"
+
+
+typedef struct watch_st {
+  int wd;
+  job_st *job;
+  uint32_t node;   // its path in the table's tree, below the job's root
+} watch_st;
+
+
+typedef struct watch_table_st {
+  int fd;
+  uint32_t mask;
+  hash_map_st *map;  // wd -> watch_st
+  pathtree_st *paths;
+  hash_map_st *roots;  // job -> root of its paths in the tree
+} watch_table_st;
+
+
+typedef void (*watch_found_fp)(void *arg, job_st *job, const char *rel, int is_dir);
+
+
+/* how watch_add_tree walks a tree, and what it found */
+typedef struct watch_scan_st {
+  int threads;              // walkers, 0 for one per CPU
+  struct timespec since;    // check directories changed after this
+  watch_found_fp found;     // told what changed in them (NULL: no check)
+  void *arg;
+
+  unsigned long dirs;       // watched
+  double seconds;           // the walk took
+} watch_scan_st;
+
+
+watch_table_st *watch_init(int fd, uint32_t mask);
+void watch_free(watch_table_st *wt);
+watch_st *watch_get(watch_table_st *wt, int wd);
+char *watch_path(watch_table_st *wt, watch_st *w, const char *name);
+int watch_add_tree(watch_table_st *wt, job_st *job, const char *rel, watch_scan_st *scan);
+int watch_adopt(watch_table_st *wt, job_st *job, const char *rel, int wd);
+void watch_forget(watch_table_st *wt, int wd);
+void watch_remove_job(watch_table_st *wt, job_st *job);
+void watch_remove_tree(watch_table_st *wt, job_st *job, const char *rel);
+void watch_rename_tree(watch_table_st *wt, job_st *job, const char *from, const char *to);
+
+char *path_join(const char *dir, const char *name);
+int path_in_tree(const char *path, const char *rel);
+
+
+#endif
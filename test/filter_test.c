@@ -0,0 +1,106 @@
+/*
+ * filter_test.c
+ *
+ *
+ * test include/exclude filter matching
+ *
+ *
+ * Copyright (C) 2013  Bryant Moscon - bmoscon@gmail.com
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to 
+ * deal in the Software without restriction, including without limitation the 
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, 
+ *    this list of conditions and the following disclaimer in the documentation 
+ *    and/or other materials provided with the distribution, and in the same 
+ *    place and form as other copyright,
+ *    license and disclaimer information.
+ *
+ * 3. The end-user documentation included with the redistribution, if any, must 
+ *    include the following acknowledgment: "This product includes software 
+ *    developed by Bryant Moscon (http://www.bryantmoscon.org/)", in the same 
+ *    place and form as other third-party acknowledgments. Alternately, this 
+ *    acknowledgment may appear in the software itself, in the same form and 
+ *    location as other such third-party acknowledgments.
+ *
+ * 4. Except as contained in this notice, the name of the author, Bryant Moscon,
+ *    shall not be used in advertising or otherwise to promote the sale, use or 
+ *    other dealings in this Software without prior written authorization from 
+ *    the author.
+ *
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL 
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN 
+ * THE SOFTWARE.
+ *
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../src/filter.h"
+
+
+static int failures = 0;
+
+
+static void check(filter_st *f, const char *path, int is_dir, int expect)
+{
+  int got = filter_match(f, path, is_dir);
+
+  printf("%s %-32s %s\n", got == expect ? "ok  " : "FAIL", path, got ? "replicated" : "filtered");
+  if (got != expect) {
+    ++failures;
+  }
+}
+
+
+int main(int argc, char *argv[])
+{
+  filter_st *f;
+
+  f = filter_compile(NULL, "*.swp,*.tmp,.git,build/**/*.o,/cache");
+  if (!f) {
+    fprintf(stderr, "filter_compile failed\n");
+    exit(1);
+  }
+
+  check(f, "notes.txt", 0, 1);
+  check(f, "src/.notes.txt.swp", 0, 0);
+  check(f, "a/b/c/out.tmp", 0, 0);
+  check(f, ".git", 1, 0);
+  check(f, "proj/.git/objects/ab/cdef", 0, 0);
+  check(f, "proj/.gitignore", 0, 1);
+  check(f, "build/x.o", 0, 0);
+  check(f, "build/sub/dir/x.o", 0, 0);
+  check(f, "build/x.c", 0, 1);
+  check(f, "src/build/x.o", 0, 1);
+  check(f, "cache", 1, 0);
+  check(f, "src/cache", 1, 1);
+  filter_free(f);
+
+  f = filter_compile("*.c,*.h,docs", "test_*");
+  check(f, "src", 1, 1);
+  check(f, "src/main.c", 0, 1);
+  check(f, "src/main.o", 0, 0);
+  check(f, "src/test_main.c", 0, 0);
+  check(f, "docs/index.html", 0, 1);
+  filter_free(f);
+
+  check(NULL, "anything", 0, 1);
+
+  printf("\n%d failure(s)\n", failures);
+  return (failures ? 1 : 0);
+}
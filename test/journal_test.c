@@ -0,0 +1,234 @@
+/*
+ * journal_test.c
+ *
+ *
+ * test journal append, done and replay
+ *
+ *
+ * Copyright (C) 2013  Bryant Moscon - bmoscon@gmail.com
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to 
+ * deal in the Software without restriction, including without limitation the 
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, 
+ *    this list of conditions and the following disclaimer in the documentation 
+ *    and/or other materials provided with the distribution, and in the same 
+ *    place and form as other copyright,
+ *    license and disclaimer information.
+ *
+ * 3. The end-user documentation included with the redistribution, if any, must 
+ *    include the following acknowledgment: "This product includes software 
+ *    developed by Bryant Moscon (http://www.bryantmoscon.org/)", in the same 
+ *    place and form as other third-party acknowledgments. Alternately, this 
+ *    acknowledgment may appear in the software itself, in the same form and 
+ *    location as other such third-party acknowledgments.
+ *
+ * 4. Except as contained in this notice, the name of the author, Bryant Moscon,
+ *    shall not be used in advertising or otherwise to promote the sale, use or 
+ *    other dealings in this Software without prior written authorization from 
+ *    the author.
+ *
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL 
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN 
+ * THE SOFTWARE.
+ *
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <dirent.h>
+
+#include "../src/journal.h"
+#include "../src/op.h"
+
+
+static char filler[4096];
+
+
+/* append and finish enough ops to start a new segment */
+static void fill(job_st *job, const char *path)
+{
+  uint64_t seqs[1200];
+  op_st *op;
+  int i;
+
+  for (i = 0; i < 1200; ++i) {
+    op = op_new(OP_COPY, job, path, NULL, 0);
+    journal_append(op);
+    seqs[i] = op->seq;
+    op_free(op);
+  }
+  journal_sync();
+  for (i = 0; i < 1200; ++i) {
+    journal_done(seqs[i]);
+  }
+}
+
+
+/* how many segment files dir holds */
+static int segments(const char *dir)
+{
+  struct dirent *ent;
+  DIR *d;
+  int n = 0;
+
+  if (!(d = opendir(dir))) {
+    return (-1);
+  }
+  while ((ent = readdir(d))) {
+    if (strncmp(ent->d_name, "journal.", 8) == 0) {
+      ++n;
+    }
+  }
+  closedir(d);
+  return (n);
+}
+
+
+int main(int argc, char *argv[])
+{
+  char dir[] = "/tmp/journal_test.XXXXXX";
+  char dir2[] = "/tmp/journal_test.XXXXXX";
+  char dir3[] = "/tmp/journal_test.XXXXXX";
+  job_st job = {0};
+  op_st *ops[4];
+  op_st *op;
+  char *long_path;
+  int failures = 0;
+  int i;
+
+  if (!mkdtemp(dir)) {
+    perror("mkdtemp");
+    exit(1);
+  }
+
+  job.name = "test";
+  job.refs = 1;
+
+  if (journal_open(dir, &job) != NULL) {
+    printf("FAIL new journal replayed something\n");
+    ++failures;
+  }
+
+  ops[0] = op_new(OP_COPY, &job, "a/file", NULL, 0);
+  ops[1] = op_new(OP_UNLINK, &job, "b", NULL, 0);
+  ops[2] = op_new(OP_RENAME, &job, "c/old", "c/new", 1);
+  ops[3] = op_new(OP_COPY, &job, "d", NULL, 0);
+
+  for (i = 0; i < 4; ++i) {
+    journal_append(ops[i]);
+  }
+  journal_sync();
+
+  // 0 and 3 get applied, 1 and 2 are lost in a "crash"
+  journal_done(ops[0]->seq);
+  journal_done(ops[3]->seq);
+  journal_sync();
+
+  op = journal_open(dir, &job);
+
+  if (!op || op->type != OP_UNLINK || strcmp(op->path, "b") != 0) {
+    printf("FAIL first replayed op\n");
+    ++failures;
+  } else if (!(op = op->next) || op->type != OP_RENAME || !op->is_dir ||
+	     strcmp(op->path, "c/old") != 0 || strcmp(op->path2, "c/new") != 0) {
+    printf("FAIL second replayed op\n");
+    ++failures;
+  } else if (op->next) {
+    printf("FAIL finished ops were replayed\n");
+    ++failures;
+  } else {
+    printf("ok   replayed the two unfinished ops, in order\n");
+  }
+
+  // a segment with nothing live of its own can still hold the DONE of
+  // an op in an older, live one: the unlink of x below must not come
+  // back after the copy of x that followed it
+  if (!mkdtemp(dir2)) {
+    perror("mkdtemp");
+    exit(1);
+  }
+  journal_open(dir2, &job);
+  memset(filler, 'f', sizeof(filler) - 1);
+  filler[sizeof(filler) - 1] = '\0';
+
+  ops[0] = op_new(OP_UNLINK, &job, "x", NULL, 0);
+  ops[1] = op_new(OP_COPY, &job, "live", NULL, 0);
+  journal_append(ops[0]);
+  journal_append(ops[1]);
+  fill(&job, filler);          // segment 0, only "live" stays live
+
+  journal_done(ops[0]->seq);   // its DONE goes to segment 1
+  ops[2] = op_new(OP_COPY, &job, "x", NULL, 0);
+  journal_append(ops[2]);
+  fill(&job, filler);          // segment 1
+
+  journal_done(ops[2]->seq);   // segment 1 has nothing live now
+  journal_sync();
+
+  op = journal_open(dir2, &job);
+  if (!op || op->type != OP_COPY || strcmp(op->path, "live") != 0 || op->next) {
+    printf("FAIL replay after segments were checkpointed\n");
+    ++failures;
+  } else {
+    printf("ok   only the live op of an older segment replayed\n");
+  }
+
+  // an op can be done before the sync that writes it (a populated
+  // directory's copies are), which must not leave its segment live
+  if (!mkdtemp(dir3)) {
+    perror("mkdtemp");
+    exit(1);
+  }
+  journal_open(dir3, &job);
+  op = op_new(OP_COPY, &job, "quick", NULL, 0);
+  journal_append(op);
+  journal_done(op->seq);
+  op_free(op);
+  for (i = 0; i < 4; ++i) {
+    fill(&job, filler);
+  }
+  journal_sync();
+
+  if (segments(dir3) != 1 || journal_open(dir3, &job) != NULL) {
+    printf("FAIL an op done before its sync kept %d segments\n", segments(dir3));
+    ++failures;
+  } else {
+    printf("ok   an op done before its sync does not hold its segment\n");
+  }
+
+  // lengths are 16 bits in the journal, a longer path is left out
+  // rather than journaled with a length that wraps
+  if ((long_path = malloc(UINT16_MAX + 2))) {
+    memset(long_path, 'p', UINT16_MAX + 1);
+    long_path[UINT16_MAX + 1] = '\0';
+    op = op_new(OP_COPY, &job, long_path, NULL, 0);
+    journal_append(op);
+    if (op->seq != 0 || op_encode(op, NULL, 0) != 0) {
+      printf("FAIL a path over 64k was journaled\n");
+      ++failures;
+    } else {
+      printf("ok   a path over 64k is not journaled\n");
+    }
+    op_free(op);
+    free(long_path);
+  }
+
+  printf("\n%d failure(s)\n", failures);
+  return (failures ? 1 : 0);
+}
@@ -0,0 +1,237 @@
+/*
+ * pack_test.c
+ *
+ *
+ * small file pack test program
+ *
+ *
+ * Copyright (C) 2013  Bryant Moscon - bmoscon@gmail.com
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to 
+ * deal in the Software without restriction, including without limitation the 
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, 
+ *    this list of conditions and the following disclaimer in the documentation 
+ *    and/or other materials provided with the distribution, and in the same 
+ *    place and form as other copyright,
+ *    license and disclaimer information.
+ *
+ * 3. The end-user documentation included with the redistribution, if any, must 
+ *    include the following acknowledgment: "This product includes software 
+ *    developed by Bryant Moscon (http://www.bryantmoscon.org/)", in the same 
+ *    place and form as other third-party acknowledgments. Alternately, this 
+ *    acknowledgment may appear in the software itself, in the same form and 
+ *    location as other such third-party acknowledgments.
+ *
+ * 4. Except as contained in this notice, the name of the author, Bryant Moscon,
+ *    shall not be used in advertising or otherwise to promote the sale, use or 
+ *    other dealings in this Software without prior written authorization from 
+ *    the author.
+ *
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL 
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN 
+ * THE SOFTWARE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "../src/pack.h"
+#include "../src/replicate.h"
+
+
+static char src[64];
+static char dst[64];
+
+
+static void put(const char *rel, const char *data, size_t len)
+{
+  char name[128];
+  int fd;
+
+  snprintf(name, sizeof(name), "%s/%s", src, rel);
+  if ((fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0640)) < 0 ||
+      write(fd, data, len) != (ssize_t)len) {
+    perror(name);
+    exit(1);
+  }
+  close(fd);
+}
+
+
+/* is rel packed, holding exactly data? */
+static int packed(pack_st *p, const char *rel, const char *data)
+{
+  char buf[256];
+  ssize_t len = pack_read(p, rel, buf, sizeof(buf));
+
+  return (len == (ssize_t)strlen(data) && memcmp(buf, data, len) == 0);
+}
+
+
+static int in_dst(const char *rel)
+{
+  char name[128];
+  struct stat st;
+
+  snprintf(name, sizeof(name), "%s/%s", dst, rel);
+  return (stat(name, &st) == 0);
+}
+
+
+static int check(const char *what, int ok)
+{
+  printf("%s %s\n", ok ? "ok  " : "FAIL", what);
+  return (ok ? 0 : 1);
+}
+
+
+int main(int argc, char *argv[])
+{
+  char dir[] = "/tmp/pack_test.XXXXXX";
+  char name[128];
+  char *big;
+  pack_stats_st ps;
+  struct stat st, out;
+  unsigned long files;
+  job_st job = {0};
+  pack_st *p;
+  int failures = 0;
+  int i;
+
+  if (!mkdtemp(dir)) {
+    perror("mkdtemp");
+    exit(1);
+  }
+  snprintf(src, sizeof(src), "%s/src", dir);
+  snprintf(dst, sizeof(dst), "%s/dst", dir);
+  mkdir(src, 0755);
+  mkdir(dst, 0755);
+  snprintf(name, sizeof(name), "%s/d", src);
+  mkdir(name, 0755);
+
+  job.name = "test";
+  job.refs = 1;
+  job.src = src;
+  job.dst = dst;
+  job.pack_size = PACK_MAX;
+
+  put("a", "alpha", 5);
+  put("d/b", "bravo", 5);
+  put("d/c", "charlie", 7);
+  replicate_copy(&job, "a");
+  replicate_copy(&job, "d/b");
+  replicate_copy(&job, "d/c");
+  p = pack_get(&job);
+  failures += check("small files are packed", p && packed(p, "a", "alpha") &&
+		    packed(p, "d/b", "bravo") && packed(p, "d/c", "charlie") && !in_dst("a"));
+
+  put("a", "alpha, again", 12);
+  replicate_copy(&job, "a");
+  failures += check("a new copy replaces the packed one", packed(p, "a", "alpha, again"));
+
+  snprintf(name, sizeof(name), "%s/a", src);
+  chmod(name, 0600);
+  replicate_meta(&job, "a");
+  failures += check("metadata changes are packed", pack_stat(p, "a", &st) == 0 &&
+		    (st.st_mode & 07777) == 0600 && st.st_size == 12);
+
+  replicate_rename(&job, "d/b", "d/b2");
+  failures += check("a file rename moves it in the pack", !packed(p, "d/b", "bravo") &&
+		    packed(p, "d/b2", "bravo"));
+
+  replicate_mkdir(&job, "d");
+  replicate_rename(&job, "d", "e");
+  failures += check("a directory rename moves what is below it",
+		    packed(p, "e/b2", "bravo") && packed(p, "e/c", "charlie") &&
+		    !packed(p, "d/c", "charlie") && in_dst("e"));
+
+  replicate_unlink(&job, "e/c");
+  failures += check("an unlink drops it", !packed(p, "e/c", "charlie"));
+
+  pack_close(job.pack);
+  job.pack = NULL;
+  p = pack_get(&job);
+  failures += check("the index is replayed", p && packed(p, "a", "alpha, again") &&
+		    packed(p, "e/b2", "bravo") && !packed(p, "e/c", "charlie") &&
+		    pack_stat(p, "a", &st) == 0 && (st.st_mode & 07777) == 0600);
+
+  job.pack_size = 8;
+  replicate_copy(&job, "a");
+  failures += check("a file that grew is copied out of the pack",
+		    in_dst("a") && pack_stat(p, "a", &st) < 0);
+  job.pack_size = PACK_MAX;
+
+  snprintf(name, sizeof(name), "%s/out", dir);
+  failures += check("extract writes the files out",
+		    pack_extract(p, NULL, name, &files) == 0 && files == 1);
+  snprintf(name, sizeof(name), "%s/out/e/b2", dir);
+  failures += check("... with their metadata", stat(name, &out) == 0 &&
+		    pack_stat(p, "e/b2", &st) == 0 && out.st_size == 5 &&
+		    out.st_mode == st.st_mode && out.st_mtim.tv_sec == st.st_mtim.tv_sec &&
+		    out.st_mtim.tv_nsec == st.st_mtim.tv_nsec);
+  snprintf(name, sizeof(name), "%s/sub", dir);
+  failures += check("extract of a directory writes what is below it",
+		    pack_extract(p, "e", name, &files) == 0 && files == 1 &&
+		    pack_extract(p, "d", name, &files) == 0 && files == 0);
+
+  // fill the first segment, then supersede most of it
+  if (!(big = malloc(PACK_MAX))) {
+    exit(1);
+  }
+  memset(big, 'x', PACK_MAX);
+  put("big", big, PACK_MAX);
+  for (i = 0; i < 65; i++) {
+    replicate_copy(&job, "big");
+  }
+  pack_stats(&job, &ps);
+  failures += check("garbage is counted", ps.segments == 2 && ps.files == 2 &&
+		    ps.dead == 64 * (uint64_t)PACK_MAX + 12 + 7 + 5);
+
+  pack_compact(p);
+  pack_stats(&job, &ps);
+  snprintf(name, sizeof(name), "%s/%s/00000000.seg", dst, PACK_DIR);
+  failures += check("compaction moves the live files and removes the segment",
+		    ps.segments == 1 && ps.dead == 0 && ps.compacted == 5 &&
+		    access(name, F_OK) < 0 && packed(p, "e/b2", "bravo"));
+
+  pack_close(job.pack);
+  job.pack = NULL;
+  p = pack_get(&job);
+  pack_stats(&job, &ps);
+  failures += check("... which lasts", p && packed(p, "e/b2", "bravo") && ps.files == 2 &&
+		    ps.live == PACK_MAX + 5);
+  pack_forget(&job, "e", 1);
+  pack_stats(&job, &ps);
+  failures += check("forgetting a tree drops what is below it",
+		    !packed(p, "e/b2", "bravo") && pack_stat(p, "big", &st) == 0 &&
+		    ps.files == 1);
+  pack_close(job.pack);
+  free(big);
+
+  // the segments are big
+  snprintf(name, sizeof(name), "rm -rf %s", dir);
+  if (system(name) != 0) {
+    printf("cannot remove %s\n", dir);
+  }
+
+  printf("\n%d failure(s)\n", failures);
+  return (failures ? 1 : 0);
+}
@@ -0,0 +1,176 @@
+/*
+ * pathtree_test.c
+ *
+ *
+ * interned path tree test program
+ *
+ *
+ * Copyright (C) 2013  Bryant Moscon - bmoscon@gmail.com
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to 
+ * deal in the Software without restriction, including without limitation the 
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, 
+ *    this list of conditions and the following disclaimer in the documentation 
+ *    and/or other materials provided with the distribution, and in the same 
+ *    place and form as other copyright,
+ *    license and disclaimer information.
+ *
+ * 3. The end-user documentation included with the redistribution, if any, must 
+ *    include the following acknowledgment: "This product includes software 
+ *    developed by Bryant Moscon (http://www.bryantmoscon.org/)", in the same 
+ *    place and form as other third-party acknowledgments. Alternately, this 
+ *    acknowledgment may appear in the software itself, in the same form and 
+ *    location as other such third-party acknowledgments.
+ *
+ * 4. Except as contained in this notice, the name of the author, Bryant Moscon,
+ *    shall not be used in advertising or otherwise to promote the sale, use or 
+ *    other dealings in this Software without prior written authorization from 
+ *    the author.
+ *
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL 
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN 
+ * THE SOFTWARE.
+ *
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "../src/pathtree.h"
+
+
+#define MANY 200000
+
+
+static int failures = 0;
+
+
+static void check(int ok, const char *what)
+{
+  printf("%s %s\n", ok ? "ok  " : "FAIL", what);
+  if (!ok) {
+    ++failures;
+  }
+}
+
+
+/* does node's path below base read expect? */
+static int path_is(pathtree_st *t, uint32_t base, uint32_t node, const char *name,
+		   const char *expect)
+{
+  char *path = pathtree_path(t, base, node, name);
+  int ret;
+
+  if (!path) {
+    return (expect == NULL);
+  }
+  ret = (expect && strcmp(path, expect) == 0);
+  if (!ret) {
+    printf("     got %s\n", path);
+  }
+  free(path);
+  return (ret);
+}
+
+
+int main(int argc, char *argv[])
+{
+  uint32_t root, other, c, d, old, n;
+  uint32_t *nodes;
+  char path[64];
+  size_t mem;
+  int i, j, ok;
+  pathtree_st *t;
+
+  if (!(t = pathtree_init()) || !(root = pathtree_root(t)) || !(other = pathtree_root(t))) {
+    fprintf(stderr, "pathtree_init failed\n");
+    exit(1);
+  }
+
+  c = pathtree_get(t, root, "a/b/c");
+  d = pathtree_get(t, root, "a/b/d");
+  check(c && d && c != d, "paths get nodes of their own");
+  check(pathtree_get(t, root, "a//b/c/") == c, "the same path gets the same node");
+  pathtree_put(t, c);
+  check(path_is(t, root, c, NULL, "a/b/c") && path_is(t, root, d, "e.txt", "a/b/d/e.txt"),
+	"paths are rebuilt from the nodes");
+  check(path_is(t, root, root, NULL, "") && pathtree_get(t, root, "") == root,
+	"the root is the empty path");
+  pathtree_put(t, root);
+  check(pathtree_below(t, c, pathtree_find(t, root, "a")) &&
+	!pathtree_below(t, c, pathtree_find(t, root, "a/b/d")), "a node is below its parents");
+  check(!pathtree_find(t, root, "a/b/x") && !pathtree_find(t, other, "a/b/c"),
+	"paths are not found where they were not added");
+  check(path_is(t, other, c, NULL, NULL), "a path is relative to its own root only");
+
+  check(pathtree_move(t, pathtree_find(t, root, "a/b"), root, "x/y") == 0 &&
+	path_is(t, root, c, NULL, "x/y/c") && path_is(t, root, d, NULL, "x/y/d"),
+	"a move renames everything below the node");
+  check(!pathtree_find(t, root, "a"), "parents left empty by a move are freed");
+  check(pathtree_move(t, pathtree_find(t, root, "x/y"), root, "x/y/c/z") < 0 &&
+	errno == EINVAL, "a node cannot be moved below itself");
+
+  old = pathtree_get(t, root, "x/w");
+  check(pathtree_move(t, c, root, "x/w") == 0 && path_is(t, root, c, NULL, "x/w") &&
+	path_is(t, root, old, NULL, NULL), "a move over a node detaches that one");
+  pathtree_put(t, old);
+  pathtree_put(t, c);
+  pathtree_put(t, d);
+  check(!pathtree_find(t, root, "x"), "a node goes with its last reference");
+
+  // many paths, half of them dropped again
+  nodes = calloc(MANY, sizeof(uint32_t));
+  for (i = 0, ok = 1; i < MANY; i++) {
+    snprintf(path, sizeof(path), "dir%d/sub%d/file%d", i % 1000, i % 7, i);
+    ok &= ((nodes[i] = pathtree_get(t, other, path)) != 0);
+  }
+  for (i = 0; i < MANY; i += 2) {
+    pathtree_put(t, nodes[i]);
+  }
+  for (i = 0; i < MANY; i++) {
+    snprintf(path, sizeof(path), "dir%d/sub%d/file%d", i % 1000, i % 7, i);
+    n = pathtree_find(t, other, path);
+    ok &= (i % 2) ? (n == nodes[i] && path_is(t, other, n, NULL, path)) : !n;
+  }
+  check(ok, "200000 paths are found and rebuilt, and dropped ones are gone");
+  for (i = 1; i < MANY; i += 2) {
+    pathtree_put(t, nodes[i]);
+  }
+
+  // names that come and go do not make the tree grow
+  for (j = 0, mem = 0, ok = 1; j < 20; j++) {
+    for (i = 0; i < 10000; i++) {
+      snprintf(path, sizeof(path), "tmp/%d.%d", j, i);
+      ok &= ((nodes[i] = pathtree_get(t, root, path)) != 0);
+    }
+    for (i = 0; i < 10000; i++) {
+      pathtree_put(t, nodes[i]);
+    }
+    if (j == 1) {
+      mem = pathtree_memory(t);
+    }
+  }
+  check(ok && pathtree_memory(t) <= mem, "memory is reused as paths come and go");
+
+  free(nodes);
+  pathtree_free(t);
+
+  printf("\n%d failure(s)\n", failures);
+  return (failures ? 1 : 0);
+}
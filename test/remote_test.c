@@ -0,0 +1,284 @@
+/*
+ * remote_test.c
+ *
+ *
+ * remote replication test program
+ *
+ *
+ * Copyright (C) 2013  Bryant Moscon - bmoscon@gmail.com
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to 
+ * deal in the Software without restriction, including without limitation the 
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, 
+ *    this list of conditions and the following disclaimer in the documentation 
+ *    and/or other materials provided with the distribution, and in the same 
+ *    place and form as other copyright,
+ *    license and disclaimer information.
+ *
+ * 3. The end-user documentation included with the redistribution, if any, must 
+ *    include the following acknowledgment: "This product includes software 
+ *    developed by Bryant Moscon (http://www.bryantmoscon.org/)", in the same 
+ *    place and form as other third-party acknowledgments. Alternately, this 
+ *    acknowledgment may appear in the software itself, in the same form and 
+ *    location as other such third-party acknowledgments.
+ *
+ * 4. Except as contained in this notice, the name of the author, Bryant Moscon,
+ *    shall not be used in advertising or otherwise to promote the sale, use or 
+ *    other dealings in this Software without prior written authorization from 
+ *    the author.
+ *
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL 
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN 
+ * THE SOFTWARE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "../src/remote.h"
+#include "../src/receive.h"
+#include "../src/task.h"
+#include "../src/sched.h"
+#include "../src/op.h"
+
+
+static char src[64];
+static char recv_dir[64];
+static char dst[sizeof(recv_dir) + 5];      // recv_dir/test
+static int lfd;
+
+
+static void *serve(void *arg)
+{
+  receive_serve(lfd, recv_dir);
+  return (NULL);
+}
+
+
+static void put(const char *rel, size_t size, char c)
+{
+  char name[128];
+  char *buf;
+  size_t i;
+  int fd;
+
+  snprintf(name, sizeof(name), "%s/%s", src, rel);
+  if (!(buf = malloc(size + 1)) ||
+      (fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+    perror(name);
+    exit(1);
+  }
+  for (i = 0; i < size; i++) {
+    buf[i] = c + i % 7919 % 26;
+  }
+  if (write(fd, buf, size) != (ssize_t)size) {
+    perror(name);
+    exit(1);
+  }
+  close(fd);
+  free(buf);
+}
+
+
+static void apply(op_type type, job_st *job, const char *path, const char *path2, int is_dir)
+{
+  op_st *op = op_new(type, job, path, path2, is_dir);
+
+  op_apply(op);
+  op_free(op);
+}
+
+
+/* does dst/rel hold what src/rel2 does, mode included? */
+static int same(const char *rel, const char *rel2)
+{
+  char a[128], b[128];
+  char *x, *y;
+  struct stat sa, sb;
+  int fa, fb;
+  int ret = 0;
+
+  snprintf(a, sizeof(a), "%s/%s", src, rel2);
+  snprintf(b, sizeof(b), "%s/%s", dst, rel);
+  if (stat(a, &sa) < 0 || stat(b, &sb) < 0 || sa.st_size != sb.st_size ||
+      sa.st_mode != sb.st_mode) {
+    return (0);
+  }
+
+  x = malloc(sa.st_size + 1);
+  y = malloc(sb.st_size + 1);
+  if ((fa = open(a, O_RDONLY)) >= 0 && (fb = open(b, O_RDONLY)) >= 0) {
+    ret = (read(fa, x, sa.st_size) == sa.st_size && read(fb, y, sb.st_size) == sb.st_size &&
+	   memcmp(x, y, sa.st_size) == 0);
+    close(fb);
+  }
+  if (fa >= 0) {
+    close(fa);
+  }
+  free(x);
+  free(y);
+
+  return (ret);
+}
+
+
+static int gone(const char *rel)
+{
+  char name[128];
+  struct stat st;
+
+  snprintf(name, sizeof(name), "%s/%s", dst, rel);
+  return (lstat(name, &st) < 0);
+}
+
+
+static int check(const char *what, int ok)
+{
+  printf("%s %s\n", ok ? "ok  " : "FAIL", what);
+  return (ok ? 0 : 1);
+}
+
+
+int main(int argc, char *argv[])
+{
+  char dir[] = "/tmp/remote_test.XXXXXX";
+  char url[64];
+  char from[128], to[128];
+  struct sockaddr_in addr;
+  socklen_t len = sizeof(addr);
+  job_st job = {0};
+  pthread_t tid;
+  int failures = 0;
+
+  if (!mkdtemp(dir)) {
+    perror("mkdtemp");
+    exit(1);
+  }
+  snprintf(src, sizeof(src), "%s/src", dir);
+  snprintf(recv_dir, sizeof(recv_dir), "%s/recv", dir);
+  snprintf(dst, sizeof(dst), "%s/test", recv_dir);
+  mkdir(src, 0755);
+  mkdir(recv_dir, 0755);
+  signal(SIGPIPE, SIG_IGN);
+
+  // a receiver on a port of its own choosing
+  // a populated directory's files are copied by the scheduler
+  if (task_start() < 0 || sched_start(1, 1, 0, NULL) < 0 ||
+      (lfd = receive_listen("127.0.0.1:0")) < 0 ||
+      getsockname(lfd, (struct sockaddr *)&addr, &len) < 0 ||
+      pthread_create(&tid, NULL, serve, NULL) != 0) {
+    printf("FAIL receiver\n");
+    exit(1);
+  }
+  snprintf(url, sizeof(url), "tcp://127.0.0.1:%d", ntohs(addr.sin_port));
+
+  job.name = "test";
+  job.refs = 1;
+  job.src = src;
+  job.dst = url;
+  if (!remote_is_url(url) || !(job.remote = remote_new(&job))) {
+    printf("FAIL remote_new\n");
+    exit(1);
+  }
+
+  put("a.txt", 100, 'a');
+  put("big", 3 * REMOTE_CHUNK + 12345, 'b');
+  put("old.txt", 10, 'o');
+  put("gone.txt", 10, 'g');
+  snprintf(from, sizeof(from), "%s/d", src);
+  mkdir(from, 0750);
+  snprintf(from, sizeof(from), "%s/d/e", src);
+  mkdir(from, 0755);
+  put("d/e/f.txt", 5000, 'f');
+  put("d/g.txt", 0, 'g');
+
+  apply(OP_COPY, &job, "a.txt", NULL, 0);
+  apply(OP_COPY, &job, "big", NULL, 0);
+  apply(OP_COPY, &job, "old.txt", NULL, 0);
+  apply(OP_COPY, &job, "gone.txt", NULL, 0);
+  apply(OP_POPULATE, &job, "d", NULL, 1);
+  task_drain();
+  sched_drain();
+  if (remote_sync(job.remote) < 0) {
+    printf("FAIL remote_sync\n");
+    ++failures;
+  }
+
+  failures += check("small file copied", same("a.txt", "a.txt"));
+  failures += check("file of several chunks copied", same("big", "big"));
+  failures += check("directory populated", same("d/e/f.txt", "d/e/f.txt") &&
+		    same("d/g.txt", "d/g.txt"));
+
+  // rename, unlink and a mode change
+  snprintf(from, sizeof(from), "%s/old.txt", src);
+  snprintf(to, sizeof(to), "%s/new.txt", src);
+  rename(from, to);
+  apply(OP_RENAME, &job, "old.txt", "new.txt", 0);
+
+  snprintf(from, sizeof(from), "%s/gone.txt", src);
+  unlink(from);
+  apply(OP_UNLINK, &job, "gone.txt", NULL, 0);
+
+  snprintf(from, sizeof(from), "%s/a.txt", src);
+  chmod(from, 0600);
+  apply(OP_META, &job, "a.txt", NULL, 0);
+
+  // the receiver has nothing to rename, so it is copied instead
+  put("late.txt", 20, 'l');
+  apply(OP_RENAME, &job, "never.txt", "late.txt", 0);
+
+  if (remote_sync(job.remote) < 0) {
+    printf("FAIL remote_sync\n");
+    ++failures;
+  }
+
+  failures += check("rename", same("new.txt", "new.txt") && gone("old.txt"));
+  failures += check("unlink", gone("gone.txt"));
+  failures += check("mode change", same("a.txt", "a.txt"));
+  failures += check("rename of a file never copied", same("late.txt", "late.txt"));
+
+  // a dropped connection: whatever was not acknowledged is sent again
+  put("c.txt", 2 * REMOTE_CHUNK, 'c');
+  apply(OP_COPY, &job, "c.txt", NULL, 0);
+  pthread_mutex_lock(&job.remote->lock);
+  if (job.remote->fd >= 0) {
+    shutdown(job.remote->fd, SHUT_RDWR);
+  }
+  pthread_mutex_unlock(&job.remote->lock);
+  put("d/h.txt", 30, 'h');
+  apply(OP_COPY, &job, "d/h.txt", NULL, 0);
+
+  if (remote_sync(job.remote) < 0) {
+    printf("FAIL remote_sync after reconnect\n");
+    ++failures;
+  }
+  failures += check("resent after reconnect", same("c.txt", "c.txt") &&
+		    same("d/h.txt", "d/h.txt"));
+
+  remote_free(job.remote);
+
+  printf("\n%d failure(s)\n", failures);
+  return (failures ? 1 : 0);
+}
@@ -0,0 +1,257 @@
+/*
+ * restore_test.c
+ *
+ *
+ * restore test program
+ *
+ *
+ * Copyright (C) 2013  Bryant Moscon - bmoscon@gmail.com
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to 
+ * deal in the Software without restriction, including without limitation the 
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, 
+ *    this list of conditions and the following disclaimer in the documentation 
+ *    and/or other materials provided with the distribution, and in the same 
+ *    place and form as other copyright,
+ *    license and disclaimer information.
+ *
+ * 3. The end-user documentation included with the redistribution, if any, must 
+ *    include the following acknowledgment: "This product includes software 
+ *    developed by Bryant Moscon (http://www.bryantmoscon.org/)", in the same 
+ *    place and form as other third-party acknowledgments. Alternately, this 
+ *    acknowledgment may appear in the software itself, in the same form and 
+ *    location as other such third-party acknowledgments.
+ *
+ * 4. Except as contained in this notice, the name of the author, Bryant Moscon,
+ *    shall not be used in advertising or otherwise to promote the sale, use or 
+ *    other dealings in this Software without prior written authorization from 
+ *    the author.
+ *
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL 
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN 
+ * THE SOFTWARE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "../src/restore.h"
+#include "../src/snapshot.h"
+#include "../src/pack.h"
+
+
+static char dst[64];
+static char out[64];
+
+
+static void put(const char *rel, const char *data, mode_t mode)
+{
+  char name[256];
+  int fd;
+
+  snprintf(name, sizeof(name), "%s/%s", dst, rel);
+  if ((fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, mode)) < 0 ||
+      write(fd, data, strlen(data)) != (ssize_t)strlen(data)) {
+    perror(name);
+    exit(1);
+  }
+  fchmod(fd, mode);
+  close(fd);
+}
+
+
+/* does out/rel hold exactly data? */
+static int holds(const char *rel, const char *data)
+{
+  char name[256];
+  char buf[256];
+  ssize_t len;
+  int fd;
+
+  snprintf(name, sizeof(name), "%s/%s", out, rel);
+  if ((fd = open(name, O_RDONLY)) < 0) {
+    return (0);
+  }
+  len = read(fd, buf, sizeof(buf));
+  close(fd);
+
+  return (len == (ssize_t)strlen(data) && memcmp(buf, data, len) == 0);
+}
+
+
+static int exists(const char *rel)
+{
+  char name[256];
+  struct stat st;
+
+  snprintf(name, sizeof(name), "%s/%s", out, rel);
+  return (lstat(name, &st) == 0);
+}
+
+
+static int check(const char *what, int ok)
+{
+  printf("%s %s\n", ok ? "ok  " : "FAIL", what);
+  return (ok ? 0 : 1);
+}
+
+
+int main(int argc, char *argv[])
+{
+  char dir[] = "/tmp/restore_test.XXXXXX";
+  char src[64];
+  char name[256];
+  struct stat st, in;
+  struct timespec times[2] = {{0, UTIME_OMIT}, {1000000000, 0}};
+  restore_stats_st rs;
+  job_st job = {0};
+  int failures = 0;
+  int fd;
+
+  if (!mkdtemp(dir)) {
+    perror("mkdtemp");
+    exit(1);
+  }
+  snprintf(dst, sizeof(dst), "%s/dst", dir);
+  snprintf(out, sizeof(out), "%s/out", dir);
+  mkdir(dst, 0755);
+
+  snprintf(name, sizeof(name), "%s/a", dst);
+  mkdir(name, 0750);
+  snprintf(name, sizeof(name), "%s/a/b", dst);
+  mkdir(name, 0755);
+  snprintf(name, sizeof(name), "%s/.backupd", dst);
+  mkdir(name, 0700);
+  put("top", "top file", 0644);
+  put("a/one", "first", 0600);
+  put("a/b/two", "second", 0640);
+  put(".backupd/state", "not restored", 0600);
+  put("a/.backupd.1234.0", "a copy in progress", 0600);
+
+  // 8M, with one block of data in the middle
+  snprintf(name, sizeof(name), "%s/a/sparse", dst);
+  if ((fd = open(name, O_WRONLY | O_CREAT, 0644)) < 0 || ftruncate(fd, 8 << 20) < 0 ||
+      pwrite(fd, "data", 4, 4 << 20) != 4) {
+    perror(name);
+    exit(1);
+  }
+  close(fd);
+
+  snprintf(name, sizeof(name), "%s/a/b", dst);
+  utimensat(AT_FDCWD, name, times, 0);
+
+  job.name = "test";
+  job.refs = 1;
+  job.dst = dst;
+
+  failures += check("whole tree restored", restore_run(&job, NULL, "", out, 4, &rs) == 0 &&
+		    rs.files == 4 && rs.dirs == 3 && holds("top", "top file") &&
+		    holds("a/one", "first") && holds("a/b/two", "second"));
+  failures += check("the destination's own files are left out",
+		    !exists(".backupd") && !exists("a/.backupd.1234.0"));
+
+  snprintf(name, sizeof(name), "%s/a/one", out);
+  stat(name, &st);
+  failures += check("file modes kept", (st.st_mode & 07777) == 0600);
+  snprintf(name, sizeof(name), "%s/a", out);
+  stat(name, &st);
+  failures += check("directory modes kept", (st.st_mode & 07777) == 0750);
+  snprintf(name, sizeof(name), "%s/a/b", out);
+  stat(name, &st);
+  failures += check("directory times kept", st.st_mtim.tv_sec == 1000000000);
+
+  snprintf(name, sizeof(name), "%s/a/sparse", dst);
+  stat(name, &in);
+  snprintf(name, sizeof(name), "%s/a/sparse", out);
+  stat(name, &st);
+  failures += check("holes stay holes", st.st_size == 8 << 20 &&
+		    (in.st_blocks * 512 >= in.st_size || st.st_blocks * 512 < st.st_size));
+  if ((fd = open(name, O_RDONLY)) >= 0) {
+    char buf[4];
+
+    failures += check("... and the data is there", pread(fd, buf, 4, 4 << 20) == 4 &&
+		      memcmp(buf, "data", 4) == 0);
+    close(fd);
+  }
+
+  snprintf(out, sizeof(out), "%s/sub", dir);
+  failures += check("a subtree is restored at its own path",
+		    restore_run(&job, NULL, "a/b", out, 2, &rs) == 0 && rs.files == 1 &&
+		    holds("a/b/two", "second") && !exists("top") && !exists("a/one"));
+  snprintf(name, sizeof(name), "%s/a", out);
+  stat(name, &st);
+  failures += check("... below its parents, with their modes", (st.st_mode & 07777) == 0750);
+
+  snprintf(out, sizeof(out), "%s/file", dir);
+  failures += check("a single file is restored",
+		    restore_run(&job, NULL, "a/one", out, 0, &rs) == 0 && rs.files == 1 &&
+		    holds("a/one", "first"));
+
+  // a packed file is only in the destination's pack
+  snprintf(src, sizeof(src), "%s/src", dir);
+  mkdir(src, 0755);
+  snprintf(name, sizeof(name), "%s/a", src);
+  mkdir(name, 0750);
+  snprintf(name, sizeof(name), "%s/a/packed", src);
+  if ((fd = open(name, O_WRONLY | O_CREAT, 0644)) < 0 || write(fd, "small", 5) != 5) {
+    perror(name);
+    exit(1);
+  }
+  close(fd);
+  job.src = src;
+  job.pack_size = PACK_MAX;
+  if (pack_copy(&job, "a/packed") != 0) {
+    printf("cannot pack a/packed\n");
+    exit(1);
+  }
+  pack_close(job.pack);
+  job.pack = NULL;
+  job.pack_size = 0;
+
+  snprintf(out, sizeof(out), "%s/packed", dir);
+  failures += check("a packed file is restored on its own",
+		    restore_run(&job, NULL, "a/packed", out, 0, &rs) == 0 && rs.files == 1 &&
+		    holds("a/packed", "small"));
+  failures += check("a file in neither is an error",
+		    restore_run(&job, NULL, "a/none", out, 0, &rs) < 0);
+
+  // a snapshot is a tree of its own under the destination
+  snprintf(name, sizeof(name), "%s/%s", dst, SNAPSHOT_DIR);
+  mkdir(name, 0700);
+  snprintf(name, sizeof(name), "%s/%s/2026-01-01_0000", dst, SNAPSHOT_DIR);
+  mkdir(name, 0755);
+  put(".backupd/snapshots/2026-01-01_0000/top", "top, back then", 0644);
+  snprintf(out, sizeof(out), "%s/snap", dir);
+  failures += check("a snapshot is restored",
+		    restore_run(&job, "2026-01-01_0000", "", out, 0, &rs) == 0 &&
+		    rs.files == 1 && holds("top", "top, back then"));
+  failures += check("a missing snapshot is an error",
+		    restore_run(&job, "1999-01-01_0000", "", out, 0, &rs) < 0 &&
+		    restore_run(&job, "../..", "", out, 0, &rs) < 0);
+
+  snprintf(name, sizeof(name), "rm -rf %s", dir);
+  if (system(name) != 0) {
+    printf("cannot remove %s\n", dir);
+  }
+
+  printf("\n%d failure(s)\n", failures);
+  return (failures ? 1 : 0);
+}
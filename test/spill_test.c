@@ -0,0 +1,240 @@
+/*
+ * spill_test.c
+ *
+ *
+ * overflow file and copy queue limit test program
+ *
+ *
+ * Copyright (C) 2013  Bryant Moscon - bmoscon@gmail.com
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to 
+ * deal in the Software without restriction, including without limitation the 
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, 
+ *    this list of conditions and the following disclaimer in the documentation 
+ *    and/or other materials provided with the distribution, and in the same 
+ *    place and form as other copyright,
+ *    license and disclaimer information.
+ *
+ * 3. The end-user documentation included with the redistribution, if any, must 
+ *    include the following acknowledgment: "This product includes software 
+ *    developed by Bryant Moscon (http://www.bryantmoscon.org/)", in the same 
+ *    place and form as other third-party acknowledgments. Alternately, this 
+ *    acknowledgment may appear in the software itself, in the same form and 
+ *    location as other such third-party acknowledgments.
+ *
+ * 4. Except as contained in this notice, the name of the author, Bryant Moscon,
+ *    shall not be used in advertising or otherwise to promote the sale, use or 
+ *    other dealings in this Software without prior written authorization from 
+ *    the author.
+ *
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL 
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN 
+ * THE SOFTWARE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "../src/spill.h"
+#include "../src/sched.h"
+#include "../src/replicate.h"
+
+
+#define FILES 300
+
+static char src[64];
+static char dst[64];
+
+
+static int check(const char *what, int ok)
+{
+  printf("%s %s\n", ok ? "ok  " : "FAIL", what);
+  return (ok ? 0 : 1);
+}
+
+
+/* record n: its number, then n % 5000 bytes of a pattern */
+static size_t make(char *rec, unsigned int n)
+{
+  size_t len = sizeof(n) + n * 37 % 5000;
+  size_t i;
+
+  memcpy(rec, &n, sizeof(n));
+  for (i = sizeof(n); i < len; i++) {
+    rec[i] = n + i;
+  }
+  return (len);
+}
+
+
+static int fifo(const char *dir)
+{
+  static char rec[SPILL_REC_MAX], want[SPILL_REC_MAX];
+  unsigned int in = 0, out = 0;
+  int failures = 0;
+  int order = 1;
+  struct stat st;
+  spill_st *s;
+  ssize_t len;
+  int round;
+
+  if (!(s = spill_open(dir))) {
+    return (check("spill_open", 0));
+  }
+
+  // appends and reads interleaved, across buffer and file
+  for (round = 0; round < 20; round++) {
+    while (in < (round + 1) * 500) {
+      len = make(rec, in++);
+      if (spill_append(s, rec, len) < 0) {
+	order = 0;
+      }
+    }
+    while (out < in - (round % 3) * 100) {
+      len = spill_next(s, rec, sizeof(rec));
+      if (len != (ssize_t)make(want, out++) || memcmp(rec, want, len) != 0) {
+	order = 0;
+      }
+    }
+  }
+  while (out < in) {
+    len = spill_next(s, rec, sizeof(rec));
+    if (len != (ssize_t)make(want, out++) || memcmp(rec, want, len) != 0) {
+      order = 0;
+    }
+  }
+
+  failures += check("records read back in order", order);
+  failures += check("nothing left", spill_next(s, rec, sizeof(rec)) == 0 &&
+		    spill_bytes(s) == 0);
+  failures += check("file truncated once read", fstat(s->fd, &st) == 0 && st.st_size == 0);
+  failures += check("record too big refused", spill_append(s, rec, SPILL_REC_MAX + 1) < 0);
+
+  spill_close(s);
+  return (failures);
+}
+
+
+static void put(const char *rel)
+{
+  char name[128];
+  int fd;
+
+  snprintf(name, sizeof(name), "%s/%s", src, rel);
+  if ((fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0 ||
+      write(fd, rel, strlen(rel)) != (ssize_t)strlen(rel)) {
+    perror(name);
+    exit(1);
+  }
+  close(fd);
+}
+
+
+static int copied(const char *rel, const char *as)
+{
+  char name[128];
+  char buf[64];
+  ssize_t len;
+  int fd;
+
+  snprintf(name, sizeof(name), "%s/%s", dst, rel);
+  if ((fd = open(name, O_RDONLY)) < 0) {
+    return (0);
+  }
+  len = read(fd, buf, sizeof(buf));
+  close(fd);
+
+  return (len == (ssize_t)strlen(as) && memcmp(buf, as, len) == 0);
+}
+
+
+int main(int argc, char *argv[])
+{
+  char dir[] = "/tmp/spill_test.XXXXXX";
+  char rel[64], old[64];
+  char from[128], to[128];
+  sched_queue_stats_st qs;
+  job_st job = {0};
+  int failures = 0;
+  int all = 1;
+  int i;
+
+  if (!mkdtemp(dir)) {
+    perror("mkdtemp");
+    exit(1);
+  }
+  failures += fifo(dir);
+
+  snprintf(src, sizeof(src), "%s/src", dir);
+  snprintf(dst, sizeof(dst), "%s/dst", dir);
+  mkdir(src, 0755);
+  mkdir(dst, 0755);
+  snprintf(from, sizeof(from), "%s/d", src);
+  mkdir(from, 0755);
+
+  job.name = "test";
+  job.refs = 1;
+  job.src = src;
+  job.dst = dst;
+  job.priority = 5;
+
+  // room for a handful of copies, the rest overflow
+  if (sched_start(1, 1, 0, NULL) < 0) {
+    printf("FAIL sched_start\n");
+    exit(1);
+  }
+  sched_limit(2000, dir);
+
+  for (i = 0; i < FILES; i++) {
+    snprintf(rel, sizeof(rel), "d/f%d", i);
+    put(rel);
+    sched_submit(op_new(OP_COPY, &job, rel, NULL, 0));
+  }
+  // a copy of a file that is gone is dropped, not spilled
+  sched_submit(op_new(OP_COPY, &job, "d/never", NULL, 0));
+
+  sched_queue_stats(&qs);
+  failures += check("copies over the limit spilled", qs.spilled > 0 && qs.spill_bytes > 0);
+
+  // copies still spilled follow a rename, as queued ones do
+  snprintf(to, sizeof(to), "%s/e", src);
+  rename(from, to);
+  sched_rename(&job, "d", "e");
+  replicate_rename(&job, "d", "e");
+
+  sched_drain();
+
+  for (i = 0; i < FILES; i++) {
+    snprintf(rel, sizeof(rel), "e/f%d", i);
+    snprintf(old, sizeof(old), "d/f%d", i);
+    if (!copied(rel, old)) {
+      printf("     %s missing\n", rel);
+      all = 0;
+    }
+  }
+  failures += check("every copy made, under the new name", all);
+
+  sched_queue_stats(&qs);
+  failures += check("queue empty again", qs.spilled == 0 && qs.spill_bytes == 0 && qs.mem == 0);
+
+  printf("\n%d failure(s)\n", failures);
+  return (failures ? 1 : 0);
+}
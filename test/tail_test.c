@@ -0,0 +1,162 @@
+/*
+ * tail_test.c
+ *
+ *
+ * tail replication test program
+ *
+ *
+ * Copyright (C) 2013  Bryant Moscon - bmoscon@gmail.com
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to 
+ * deal in the Software without restriction, including without limitation the 
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, 
+ *    this list of conditions and the following disclaimer in the documentation 
+ *    and/or other materials provided with the distribution, and in the same 
+ *    place and form as other copyright,
+ *    license and disclaimer information.
+ *
+ * 3. The end-user documentation included with the redistribution, if any, must 
+ *    include the following acknowledgment: "This product includes software 
+ *    developed by Bryant Moscon (http://www.bryantmoscon.org/)", in the same 
+ *    place and form as other third-party acknowledgments. Alternately, this 
+ *    acknowledgment may appear in the software itself, in the same form and 
+ *    location as other such third-party acknowledgments.
+ *
+ * 4. Except as contained in this notice, the name of the author, Bryant Moscon,
+ *    shall not be used in advertising or otherwise to promote the sale, use or 
+ *    other dealings in this Software without prior written authorization from 
+ *    the author.
+ *
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL 
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN 
+ * THE SOFTWARE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "../src/tail.h"
+
+
+static char src[64];
+static char dst[64];
+
+
+static void put(const char *dir, const char *data, int flags)
+{
+  char name[128];
+  int fd;
+
+  snprintf(name, sizeof(name), "%s/a.log", dir);
+  if ((fd = open(name, O_WRONLY | O_CREAT | flags, 0644)) < 0 ||
+      write(fd, data, strlen(data)) != (ssize_t)strlen(data)) {
+    perror(name);
+    exit(1);
+  }
+  close(fd);
+}
+
+
+/* does dst/a.log hold exactly data? */
+static int holds(const char *data)
+{
+  char name[128];
+  char buf[256];
+  ssize_t len;
+  int fd;
+
+  snprintf(name, sizeof(name), "%s/a.log", dst);
+  if ((fd = open(name, O_RDONLY)) < 0) {
+    return (0);
+  }
+  len = read(fd, buf, sizeof(buf));
+  close(fd);
+
+  return (len == (ssize_t)strlen(data) && memcmp(buf, data, len) == 0);
+}
+
+
+static int check(const char *what, const char *data)
+{
+  if (!holds(data)) {
+    printf("FAIL %s\n", what);
+    return (1);
+  }
+  printf("ok   %s\n", what);
+  return (0);
+}
+
+
+int main(int argc, char *argv[])
+{
+  char dir[] = "/tmp/tail_test.XXXXXX";
+  char from[128], to[128];
+  job_st job = {0};
+  int failures = 0;
+
+  if (!mkdtemp(dir)) {
+    perror("mkdtemp");
+    exit(1);
+  }
+  snprintf(src, sizeof(src), "%s/src", dir);
+  snprintf(dst, sizeof(dst), "%s/dst", dir);
+  mkdir(src, 0755);
+  mkdir(dst, 0755);
+
+  job.name = "test";
+  job.refs = 1;
+  job.src = src;
+  job.dst = dst;
+  job.tail_filter = filter_compile("*.log", NULL);
+  job.tails = tail_init();
+
+  if (!tail_wanted(&job, "a.log") || tail_wanted(&job, "a.txt")) {
+    printf("FAIL TAIL rules\n");
+    ++failures;
+  }
+
+  put(src, "first line\n", O_TRUNC);
+  tail_copy(&job, "a.log");
+  failures += check("first copy is a full copy", "first line\n");
+
+  // mark the copy, a tail copy leaves the start alone
+  put(dst, "F", 0);
+  put(src, "second line\n", O_APPEND);
+  tail_copy(&job, "a.log");
+  failures += check("append copies only the tail", "First line\nsecond line\n");
+
+  put(src, "rewritten\n", O_TRUNC);
+  tail_copy(&job, "a.log");
+  failures += check("truncated file is copied in full", "rewritten\n");
+
+  put(src, "Rewritten, and longer than before\n", O_TRUNC);
+  tail_copy(&job, "a.log");
+  failures += check("rewritten file is copied in full", "Rewritten, and longer than before\n");
+
+  snprintf(from, sizeof(from), "%s/a.log", src);
+  snprintf(to, sizeof(to), "%s/a.log.1", src);
+  rename(from, to);
+  put(src, "a new file after rotation, longer still\n", O_TRUNC);
+  tail_copy(&job, "a.log");
+  failures += check("rotated file is copied in full", "a new file after rotation, longer still\n");
+
+  printf("\n%d failure(s)\n", failures);
+  return (failures ? 1 : 0);
+}
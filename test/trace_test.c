@@ -0,0 +1,148 @@
+/*
+ * trace_test.c
+ *
+ *
+ * Event trace tests
+ *
+ *
+ * Copyright (C) 2013  Bryant Moscon - bmoscon@gmail.com
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to 
+ * deal in the Software without restriction, including without limitation the 
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, 
+ *    this list of conditions and the following disclaimer in the documentation 
+ *    and/or other materials provided with the distribution, and in the same 
+ *    place and form as other copyright,
+ *    license and disclaimer information.
+ *
+ * 3. The end-user documentation included with the redistribution, if any, must 
+ *    include the following acknowledgment: "This product includes software 
+ *    developed by Bryant Moscon (http://www.bryantmoscon.org/)", in the same 
+ *    place and form as other third-party acknowledgments. Alternately, this 
+ *    acknowledgment may appear in the software itself, in the same form and 
+ *    location as other such third-party acknowledgments.
+ *
+ * 4. Except as contained in this notice, the name of the author, Bryant Moscon,
+ *    shall not be used in advertising or otherwise to promote the sale, use or 
+ *    other dealings in this Software without prior written authorization from 
+ *    the author.
+ *
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL 
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN 
+ * THE SOFTWARE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+
+#include "../src/trace.h"
+
+
+static int failures = 0;
+
+
+static void check(const char *what, int ok)
+{
+  printf("%s %s\n", ok ? "ok  " : "FAIL", what);
+  if (!ok) {
+    ++failures;
+  }
+}
+
+
+/* size of dir/name, -1 if it is not there */
+static long size_of(const char *dir, const char *name)
+{
+  char path[128];
+  struct stat st;
+
+  snprintf(path, sizeof(path), "%s/%s", dir, name);
+  return (lstat(path, &st) == 0 ? (long)st.st_size : -1);
+}
+
+
+int main(int argc, char *argv[])
+{
+  char dir[] = "/tmp/trace_test.XXXXXX";
+  char file[64], src[64];
+  trace_rec_st rec;
+  job_st job = {0};
+  uint64_t last = 0;
+  int ordered = 1;
+  trace_st *t;
+  int n = 0;
+
+  if (!mkdtemp(dir)) {
+    perror("mkdtemp");
+    exit(1);
+  }
+  snprintf(file, sizeof(file), "%s/trace", dir);
+  snprintf(src, sizeof(src), "%s/src", dir);
+  mkdir(src, 0755);
+
+  if (!(t = trace_create(file))) {
+    perror(file);
+    exit(1);
+  }
+  trace_event(t, "a", "f", IN_CREATE, 0, 10);
+  trace_event(t, "a", "f", IN_MODIFY, 0, 100000);
+  trace_flush(t);
+  trace_event(t, "b", "d", IN_CREATE | IN_ISDIR, 0, 0);
+  trace_event(t, "a", "f", IN_MOVED_FROM, 7, 0);
+  trace_event(t, "a", "g", IN_MOVED_TO, 7, 100000);
+  trace_event(t, "a", "g", IN_ATTRIB, 0, 0600);
+  trace_close(t);
+
+  if (!(t = trace_open(file))) {
+    perror(file);
+    exit(1);
+  }
+
+  job.name = "a";
+  job.src = src;
+  while (trace_next(t, &rec) > 0) {
+    n++;
+    ordered &= (rec.time_us >= last);
+    last = rec.time_us;
+    if (rec.type == TRACE_EVENT && strcmp(rec.job, "a") == 0) {
+      trace_apply(t, &job, &rec);
+    }
+    if (n == 2) {
+      check("event read back", rec.type == TRACE_EVENT && strcmp(rec.job, "a") == 0 &&
+	    strcmp(rec.path, "f") == 0 && rec.mask == IN_MODIFY && rec.arg == 100000);
+      check("file grown to the traced size", size_of(src, "f") == 100000);
+    } else if (n == 3) {
+      check("batch mark read back", rec.type == TRACE_FLUSH);
+    } else if (n == 4) {
+      check("second job named", strcmp(rec.job, "b") == 0 && rec.mask == (IN_CREATE | IN_ISDIR));
+    } else if (n == 6) {
+      check("move read back", rec.cookie == 7 && strcmp(rec.path, "g") == 0);
+      check("move made on IN_MOVED_TO", size_of(src, "f") < 0 && size_of(src, "g") == 100000);
+    }
+  }
+  // closing marks the end of the last batch
+  check("every record read", n == 8 && rec.type == TRACE_FLUSH);
+  check("times never go back", ordered);
+  trace_close(t);
+
+  printf("\n%d failure(s)\n", failures);
+  return (failures ? 1 : 0);
+}